@@ -0,0 +1,98 @@
+#!/bin/sh
+#
+# End to end throughput of sipgrep reading a capture file, in the modes
+# it is run in most: with and without dialog match, with statistics,
+# writing -O, and sending HEP to a local collector.
+#
+#   ./bench.sh [sipgen options]
+#
+# SIPGREP and SIPGEN name the binaries, RUNS how many times each mode is
+# run (the fastest run is kept), BENCH_DIR where the capture is written.
+#
+
+SIPGREP=${SIPGREP:-./sipgrep}
+SIPGEN=${SIPGEN:-./sipgen}
+RUNS=${RUNS:-3}
+BENCH_DIR=${BENCH_DIR:-bench.d}
+HEP_PORT=${HEP_PORT:-19061}
+
+mkdir -p "$BENCH_DIR" || exit 1
+
+# the same options give the same file, so it is made once
+PCAP="$BENCH_DIR/sipgen`echo " $*" | tr -c 'A-Za-z0-9:,\n' '_'`.pcap"
+if [ ! -f "$PCAP" ]; then
+	echo "generating $PCAP"
+	"$SIPGEN" -o "$PCAP.tmp" "$@" >"$PCAP.txt" && mv "$PCAP.tmp" "$PCAP" || exit 1
+fi
+PACKETS=`awk '{ print $1 }' "$PCAP.txt"`
+
+
+# run a command, print seconds and peak RSS in KB
+measure ()
+{
+	if [ -x /usr/bin/time ]; then
+		/usr/bin/time -f '%e %M' -o "$BENCH_DIR/time.out" "$@" >/dev/null 2>&1
+		cat "$BENCH_DIR/time.out"
+		return
+	fi
+
+	# without GNU time: the wall clock, and the high water mark seen last
+	start=`date +%s%N`
+	"$@" >/dev/null 2>&1 &
+	pid=$!
+	rss=0
+	while kill -0 $pid 2>/dev/null; do
+		hwm=`awk '/^VmHWM/ { print $2 }' /proc/$pid/status 2>/dev/null`
+		[ -n "$hwm" ] && rss=$hwm
+		sleep 0.05
+	done
+	wait $pid
+	end=`date +%s%N`
+	echo "`expr \( $end - $start \) / 1000000`" $rss | awk '{ printf "%.3f %d\n", $1 / 1000, $2 }'
+}
+
+bench ()
+{
+	name=$1
+	shift
+
+	best=
+	i=0
+	while [ $i -lt $RUNS ]; do
+		set -- `measure "$SIPGREP" -I "$PCAP" -C "$@"` "$@"
+		secs=$1
+		rss=$2
+		shift 2
+		if [ -z "$best" ] || awk "BEGIN { exit !($secs < $best) }"; then
+			best=$secs
+			best_rss=$rss
+		fi
+		i=`expr $i + 1`
+	done
+
+	awk -v name="$name" -v n="$PACKETS" -v s="$best" -v rss="$best_rss" 'BEGIN {
+		if (s <= 0) s = 0.001
+		printf "%-10s %12.0f %12.0f %10d\n", name, n / s, s * 1e9 / n, rss
+	}'
+}
+
+
+echo "$PCAP: `cat "$PCAP.txt"`, best of $RUNS runs"
+echo
+
+printf "%-10s %12s %12s %10s\n" mode packets/s ns/packet "rss KB"
+
+bench plain -m
+bench dialog
+bench stats -z 3600
+bench dump -O "$BENCH_DIR/out.pcap"
+
+# a collector of our own, to have the HEP go somewhere
+"$SIPGREP" -L udp:127.0.0.1:$HEP_PORT -m -C >/dev/null 2>&1 &
+sink=$!
+sleep 1
+bench hep -H udp:127.0.0.1:$HEP_PORT
+kill $sink 2>/dev/null
+wait $sink 2>/dev/null
+
+rm -f "$BENCH_DIR/out.pcap" "$BENCH_DIR/out.pcap.idx" "$BENCH_DIR/time.out"
@@ -0,0 +1,238 @@
+/*
+ * callidx -- Call-ID index of capture files, to read one call back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "callidx.h"
+#include "pcapmmap.h"
+#include "sipparse.h"
+
+
+#define CALLIDX_MAGIC "SGIX"
+#define CALLIDX_VERSION 1
+
+/* entries the index starts with, it doubles from there */
+#define CALLIDX_INITIAL 4096
+
+
+/*
+ * The file: the header, then the entries, in the byte order of the
+ * host that wrote it (the version tells another one apart).
+ */
+struct callidx_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t count;
+};
+
+struct callidx_entry {
+	uint64_t hash;
+	uint64_t offset;
+	uint32_t sec, usec;
+};
+
+
+struct callidx {
+	struct callidx_entry *entries;
+	size_t count, size;
+};
+
+
+static int compare_entries (const void *a, const void *b);
+
+
+struct callidx *
+callidx_new (void)
+{
+	return calloc (1, sizeof (struct callidx));
+}
+
+
+void
+callidx_free (struct callidx *ci)
+{
+	if (ci == NULL)
+		return;
+
+	free (ci->entries);
+	free (ci);
+}
+
+
+bool
+callidx_add (struct callidx *ci, const char *callid, int len, unsigned long long offset, const struct timeval *ts)
+{
+	struct callidx_entry *e;
+	uint64_t hash = fnv1a_64 (FNV1A_64_INIT, callid, len);
+	size_t i;
+
+	/* the messages of one packet are added one after another */
+	for (i = ci->count; i > 0 && ci->entries[i - 1].offset == offset; i--)
+		if (ci->entries[i - 1].hash == hash)
+			return true;
+
+	if (ci->count == ci->size) {
+		size_t size = ci->size ? 2 * ci->size : CALLIDX_INITIAL;
+		if ((e = realloc (ci->entries, size * sizeof (*e))) == NULL)
+			return false;
+		ci->entries = e;
+		ci->size = size;
+	}
+
+	e = &ci->entries[ci->count++];
+	e->hash = hash;
+	e->offset = offset;
+	e->sec = ts->tv_sec;
+	e->usec = ts->tv_usec;
+
+	return true;
+}
+
+
+int
+callidx_write (struct callidx *ci, const char *name, char *errbuf)
+{
+	struct callidx_header hdr;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *f;
+	bool ok;
+
+	snprintf (path, sizeof (path), "%s" CALLIDX_SUFFIX, name);
+	snprintf (tmp, sizeof (tmp), "%s" CALLIDX_SUFFIX ".tmp", name);
+
+	/* by hash, then offset: the packets of a call in the order they were written */
+	qsort (ci->entries, ci->count, sizeof (*ci->entries), compare_entries);
+
+	memcpy (hdr.magic, CALLIDX_MAGIC, sizeof (hdr.magic));
+	hdr.version = CALLIDX_VERSION;
+	hdr.count = ci->count;
+
+	if ((f = fopen (tmp, "w")) == NULL) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s" CALLIDX_SUFFIX ".tmp: %s", name, strerror (errno));
+		return -1;
+	}
+
+	ok = fwrite (&hdr, sizeof (hdr), 1, f) == 1;
+	if (ok && ci->count)
+		ok = fwrite (ci->entries, sizeof (*ci->entries), ci->count, f) == ci->count;
+	ok = (fclose (f) == 0) && ok;
+
+	ci->count = 0;
+
+	/* a reader never sees half an index */
+	if (!ok || rename (tmp, path) != 0) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s" CALLIDX_SUFFIX ": %s", name, strerror (errno));
+		unlink (tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int
+callidx_retrieve (const char *name, const char *callid, const struct bpf_program *filter, pcap_handler callback, u_char *user, char *errbuf)
+{
+	const struct callidx_header *hdr;
+	const struct callidx_entry *e, *end;
+	struct pcap_mmap *pm = NULL;
+	struct pcap_pkthdr h;
+	const u_char *data;
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t hash = fnv1a_64 (FNV1A_64_INIT, callid, strlen (callid));
+	size_t lo, hi, mid;
+	void *map;
+	int fd, n = 0;
+
+	snprintf (path, sizeof (path), "%s" CALLIDX_SUFFIX, name);
+
+	if ((fd = open (path, O_RDONLY)) < 0) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s" CALLIDX_SUFFIX ": %s", name, strerror (errno));
+		return -1;
+	}
+
+	if (fstat (fd, &st) < 0 || (size_t) st.st_size < sizeof (*hdr)) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s" CALLIDX_SUFFIX ": not an index", name);
+		close (fd);
+		return -1;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s" CALLIDX_SUFFIX ": %s", name, strerror (errno));
+		return -1;
+	}
+
+	hdr = map;
+	if (memcmp (hdr->magic, CALLIDX_MAGIC, sizeof (hdr->magic)) || hdr->version != CALLIDX_VERSION
+	    || (st.st_size - sizeof (*hdr)) / sizeof (*e) != hdr->count || (st.st_size - sizeof (*hdr)) % sizeof (*e)) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s" CALLIDX_SUFFIX ": not an index, or of another version", name);
+		munmap (map, st.st_size);
+		return -1;
+	}
+
+	e = (const struct callidx_entry *) (hdr + 1);
+	end = e + hdr->count;
+
+	/* the first entry of the call */
+	for (lo = 0, hi = hdr->count; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (e[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (e += lo; e < end && e->hash == hash; e++) {
+
+		if (pm == NULL && (pm = pcap_mmap_open (name, errbuf)) == NULL) {
+			n = -1;
+			break;
+		}
+
+		if (!pcap_mmap_seek (pm, e->offset) || pcap_mmap_next (pm, &h, &data) <= 0
+		    || (uint32_t) h.ts.tv_sec != e->sec || (uint32_t) h.ts.tv_usec != e->usec) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s" CALLIDX_SUFFIX ": index does not match the file", name);
+			n = -1;
+			break;
+		}
+
+		if (filter != NULL && filter->bf_insns != NULL && !pcap_offline_filter (filter, &h, data))
+			continue;
+
+		callback (user, &h, data);
+		n++;
+	}
+
+	if (pm != NULL)
+		pcap_mmap_close (pm);
+	munmap (map, st.st_size);
+
+	return n;
+}
+
+
+static int
+compare_entries (const void *a, const void *b)
+{
+	const struct callidx_entry *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef _CALLIDX_H
+#define _CALLIDX_H
+
+#include <stdbool.h>
+#include <sys/time.h>
+
+#include <pcap.h>
+
+
+/*
+ * Call-ID index of a capture file written with -O, kept next to it as
+ * <file>.idx. For every packet it holds a hash of each Call-ID the
+ * packet carries, the offset of the packet's record in the file (in the
+ * file decompressed, for a compressed one) and its timestamp, sorted by
+ * hash. The packets of one call are found with a binary search and read
+ * from where they are, instead of scanning the whole file.
+ */
+struct callidx;
+
+#define CALLIDX_SUFFIX ".idx"
+
+/*
+ * Functions to start and drop an index being collected in memory.
+ */
+struct callidx *callidx_new (void);
+void callidx_free (struct callidx *ci);
+
+/*
+ * Note a packet of the call, written at offset. A packet carrying
+ * the same Call-ID more than once is noted once.
+ */
+bool callidx_add (struct callidx *ci, const char *callid, int len, unsigned long long offset, const struct timeval *ts);
+
+/*
+ * Write the index of the capture file name to name.idx, and empty it
+ * for the next file. Returns 0, or -1 with a message in errbuf.
+ */
+int callidx_write (struct callidx *ci, const char *name, char *errbuf);
+
+/*
+ * Look the call up in the index of the capture file name, read its
+ * packets, and pass those the filter (if any) matches to the callback,
+ * in the order they were written. Returns the number of packets, or
+ * -1 with a message in errbuf if there is no usable index.
+ */
+int callidx_retrieve (const char *name, const char *callid, const struct bpf_program *filter, pcap_handler callback, u_char *user, char *errbuf);
+
+
+#endif /* _CALLIDX_H */
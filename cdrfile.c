@@ -0,0 +1,335 @@
+/*
+ * cdrfile -- CDRs of finished dialogs, in blocks of columns.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cdrfile.h"
+
+
+#define CDRFILE_HEADER_SIZE 16
+#define CDRFILE_STRINGS 4
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+
+
+struct string_column {
+	uint32_t off[CDRFILE_BATCH + 1];
+	char *buf;
+	size_t size;
+};
+
+
+static const char *cdr_path = NULL;
+static int cdr_fd = -1;
+static unsigned long long cdr_bytes = 0;
+static unsigned cdr_rotate_secs = 0, cdr_deadline = 0, cdr_counter = 0;
+static unsigned long cdr_rotate_kb = 0;
+
+/* the block being filled */
+static unsigned rows = 0, first_row_time = 0;
+static uint32_t col_init[CDRFILE_BATCH], col_ringing[CDRFILE_BATCH];
+static uint32_t col_connect[CDRFILE_BATCH], col_disconnect[CDRFILE_BATCH];
+static uint16_t col_reason[CDRFILE_BATCH];
+static uint8_t col_type[CDRFILE_BATCH], col_terminated[CDRFILE_BATCH], col_completed[CDRFILE_BATCH];
+static struct string_column col_strings[CDRFILE_STRINGS];
+
+/* where the block is put together to be written at once */
+static char *block = NULL;
+static size_t block_size = 0;
+
+
+static int open_file (char *errbuf);
+static void rotate (unsigned now);
+static void flush (void);
+static int add_string (struct string_column *c, const char *s);
+static int write_all (const void *buf, size_t len);
+static void header (char *buf);
+
+
+int
+cdrfile_open (const char *path, unsigned rotate_secs, unsigned long rotate_kb, char *errbuf)
+{
+	cdr_path = path;
+	cdr_rotate_secs = rotate_secs;
+	cdr_rotate_kb = rotate_kb;
+
+	if (open_file (errbuf))
+		return -1;
+
+	if (rotate_secs)
+		cdr_deadline = (unsigned) time (NULL) + rotate_secs;
+
+	return 0;
+}
+
+
+void
+cdrfile_write (const struct cdrfile_record *r)
+{
+	const char *strings[CDRFILE_STRINGS] = { r->callid, r->from, r->to, r->uac };
+	int i;
+
+	if (cdr_fd < 0)
+		return;
+
+	/* before, so the row goes in the new file */
+	if (cdr_rotate_kb && cdr_bytes >= cdr_rotate_kb * 1024ULL)
+		rotate ((unsigned) time (NULL));
+
+	for (i = 0; i < CDRFILE_STRINGS; i++)
+		if (add_string (&col_strings[i], strings[i]))
+			return; /* out of memory, the row is not had */
+
+	col_init[rows] = r->init;
+	col_ringing[rows] = r->ringing;
+	col_connect[rows] = r->connect;
+	col_disconnect[rows] = r->disconnect;
+	col_reason[rows] = r->reason;
+	col_type[rows] = r->type;
+	col_terminated[rows] = r->terminated;
+	col_completed[rows] = r->completed;
+
+	if (rows++ == 0)
+		first_row_time = (unsigned) time (NULL);
+
+	if (rows == CDRFILE_BATCH)
+		flush ();
+}
+
+
+void
+cdrfile_check (unsigned now)
+{
+	if (cdr_fd < 0)
+		return;
+
+	if (rows && now - first_row_time >= CDRFILE_FLUSH_SECS)
+		flush ();
+
+	if (cdr_rotate_secs && now >= cdr_deadline) {
+		cdr_deadline = now + cdr_rotate_secs;
+		rotate (now);
+	}
+}
+
+
+void
+cdrfile_close (void)
+{
+	int i;
+
+	if (cdr_fd < 0)
+		return;
+
+	flush ();
+	close (cdr_fd);
+	cdr_fd = -1;
+
+	for (i = 0; i < CDRFILE_STRINGS; i++) {
+		free (col_strings[i].buf);
+		col_strings[i].buf = NULL;
+		col_strings[i].size = 0;
+	}
+	free (block);
+	block = NULL;
+	block_size = 0;
+}
+
+
+static int
+open_file (char *errbuf)
+{
+	struct stat st;
+	char want[CDRFILE_HEADER_SIZE], got[CDRFILE_HEADER_SIZE];
+
+	if ((cdr_fd = open (cdr_path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0 || fstat (cdr_fd, &st) != 0) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: %s", cdr_path, strerror (errno));
+		goto fail;
+	}
+
+	header (want);
+
+	if (st.st_size == 0) {
+		if (write_all (want, sizeof (want))) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: %s", cdr_path, strerror (errno));
+			goto fail;
+		}
+		cdr_bytes = sizeof (want);
+		return 0;
+	}
+
+	/* appending, to a CDR file of the same byte order and version */
+	if (pread (cdr_fd, got, sizeof (got), 0) != sizeof (got) || memcmp (want, got, sizeof (got))) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: not a CDR file sipgrep can append to here", cdr_path);
+		goto fail;
+	}
+	cdr_bytes = st.st_size;
+	return 0;
+
+fail:
+	if (cdr_fd >= 0)
+		close (cdr_fd);
+	cdr_fd = -1;
+	return -1;
+}
+
+
+static void
+rotate (unsigned now)
+{
+	char name[1024], errbuf[PCAP_ERRBUF_SIZE];
+	const char *ext;
+	time_t t = now;
+	struct tm *tm;
+
+	flush ();
+
+	/* nothing in it yet, it may as well go on */
+	if (cdr_bytes <= CDRFILE_HEADER_SIZE)
+		return;
+
+	close (cdr_fd);
+	cdr_fd = -1;
+
+	if ((ext = strrchr (cdr_path, '.')) == NULL || ext == cdr_path || strchr (ext, '/'))
+		ext = cdr_path + strlen (cdr_path);
+
+	/* never over one rotated before, by an earlier run in the same second */
+	tm = localtime (&t);
+	do
+		snprintf (name, sizeof (name), "%.*s_%06d_%02u%02u%02u%02u%02u%02u%s",
+			  (int) (ext - cdr_path), cdr_path, ++cdr_counter, tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+			  tm->tm_hour, tm->tm_min, tm->tm_sec, ext);
+	while (access (name, F_OK) == 0);
+
+	if (rename (cdr_path, name) != 0)
+		fprintf (stderr, "unable to rename the file '%s' to '%s': %s\n", cdr_path, name, strerror (errno));
+
+	if (open_file (errbuf))
+		fprintf (stderr, "cdr: %s, no more CDRs written\n", errbuf);
+}
+
+
+static void
+flush (void)
+{
+	size_t len, sizes[8 + CDRFILE_STRINGS * 2];
+	const void *cols[8 + CDRFILE_STRINGS * 2];
+	unsigned ncols = 0, i;
+	uint32_t h[3];
+	char *p, *buf;
+
+	if (rows == 0 || cdr_fd < 0)
+		return;
+
+#define COLUMN(ptr, bytes) do { cols[ncols] = (ptr); sizes[ncols++] = (bytes); } while (0)
+	COLUMN (col_init, rows * sizeof (uint32_t));
+	COLUMN (col_ringing, rows * sizeof (uint32_t));
+	COLUMN (col_connect, rows * sizeof (uint32_t));
+	COLUMN (col_disconnect, rows * sizeof (uint32_t));
+	COLUMN (col_reason, rows * sizeof (uint16_t));
+	COLUMN (col_type, rows);
+	COLUMN (col_terminated, rows);
+	COLUMN (col_completed, rows);
+	for (i = 0; i < CDRFILE_STRINGS; i++) {
+		COLUMN (col_strings[i].off, (rows + 1) * sizeof (uint32_t));
+		COLUMN (col_strings[i].buf, col_strings[i].off[rows]);
+	}
+#undef COLUMN
+
+	for (len = 0, i = 0; i < ncols; i++)
+		len += ALIGN8 (sizes[i]);
+
+	if (block_size < 16 + len) {
+		if ((buf = realloc (block, 16 + len)) == NULL) {
+			fprintf (stderr, "cdr: out of memory, %u CDRs lost\n", rows);
+			goto done;
+		}
+		block = buf;
+		block_size = 16 + len;
+	}
+
+	memcpy (block, CDRFILE_BLOCK_MAGIC, 4);
+	h[0] = rows;
+	h[1] = len;
+	h[2] = 0;
+	memcpy (block + 4, h, sizeof (h));
+
+	for (p = block + 16, i = 0; i < ncols; i++) {
+		if (sizes[i])
+			memcpy (p, cols[i], sizes[i]);
+		memset (p + sizes[i], 0, ALIGN8 (sizes[i]) - sizes[i]);
+		p += ALIGN8 (sizes[i]);
+	}
+
+	/* in one go, a reader never sees half a block but where the disk filled */
+	if (write_all (block, 16 + len))
+		fprintf (stderr, "cdr: write to '%s' failed: %s, %u CDRs lost\n", cdr_path, strerror (errno), rows);
+	else
+		cdr_bytes += 16 + len;
+
+done:
+	rows = 0;
+	for (i = 0; i < CDRFILE_STRINGS; i++)
+		col_strings[i].off[0] = 0;
+}
+
+
+static int
+add_string (struct string_column *c, const char *s)
+{
+	size_t len = strlen (s), used = c->off[rows], size;
+	char *buf;
+
+	if (used + len > c->size) {
+		for (size = c->size ? c->size : 16384; size < used + len; size *= 2)
+			;
+		if ((buf = realloc (c->buf, size)) == NULL)
+			return -1;
+		c->buf = buf;
+		c->size = size;
+	}
+
+	memcpy (c->buf + used, s, len);
+	c->off[rows + 1] = used + len;
+	return 0;
+}
+
+
+static int
+write_all (const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write (cdr_fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+static void
+header (char *buf)
+{
+	uint32_t h[2] = { 0x01020304, CDRFILE_VERSION };
+
+	memcpy (buf, CDRFILE_MAGIC, 8);
+	memcpy (buf + 8, h, sizeof (h));
+}
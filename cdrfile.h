@@ -0,0 +1,84 @@
+#ifndef _CDRFILE_H
+#define _CDRFILE_H
+
+#include <stdint.h>
+#include <pcap.h>
+
+
+/*
+ * CDRs of finished dialogs, appended to a file in blocks of columns,
+ * for loading into analytics as they are rather than parsing the report
+ * text. Numbers are in the byte order of the host that wrote them; the
+ * file header tells which.
+ *
+ * File header, 16 bytes:
+ *   char magic[8]       "SGCDR\0\0\0"
+ *   uint32 byteorder    0x01020304 as written
+ *   uint32 version      1
+ *
+ * then blocks of up to CDRFILE_BATCH rows, each a 16 byte header:
+ *   char magic[4]       "CDRB"
+ *   uint32 rows         n
+ *   uint32 bytes        length of the columns that follow
+ *   uint32 reserved     0
+ *
+ * and the columns, in this order, each starting 8 byte aligned from the
+ * end of the block header:
+ *   uint32 init[n], ringing[n], connect[n], disconnect[n]
+ *                       unix times, 0 if it did not happen
+ *   uint16 reason[n]    final reply code, 900 for BYE, 0 if none
+ *   uint8  type[n]      CDRFILE_CALL or CDRFILE_REGISTRATION
+ *   uint8  terminated[n]
+ *                       how, the *_TERMINATION codes of sipparse.h,
+ *                       0 if the dialog was still going on
+ *   uint8  completed[n] 1 if the call was answered or the
+ *                       registration went through
+ *   callid, from, to, uac
+ *                       each uint32 offsets[n + 1], from 0, then the
+ *                       bytes of all n strings, offsets[n] of them
+ */
+
+#define CDRFILE_MAGIC "SGCDR\0\0\0"
+#define CDRFILE_BLOCK_MAGIC "CDRB"
+#define CDRFILE_VERSION 1
+
+#define CDRFILE_CALL 1
+#define CDRFILE_REGISTRATION 2
+
+/* rows in a block, and how long a row may wait for the block to fill */
+#define CDRFILE_BATCH 4096
+#define CDRFILE_FLUSH_SECS 10
+
+struct cdrfile_record {
+	const char *callid, *from, *to, *uac;
+	uint32_t init, ringing, connect, disconnect;
+	uint16_t reason;
+	uint8_t type, terminated, completed;
+};
+
+/*
+ * Append to path, starting it if empty. Every rotate_secs seconds, or
+ * when it has grown to rotate_kb KB, it is renamed with a counter and
+ * the time and a new one started; 0 for never. Returns 0, or -1 with a
+ * message in errbuf (PCAP_ERRBUF_SIZE).
+ */
+int cdrfile_open (const char *path, unsigned rotate_secs, unsigned long rotate_kb, char *errbuf);
+
+/*
+ * Add a CDR; the block is written once full.
+ */
+void cdrfile_write (const struct cdrfile_record *r);
+
+/*
+ * Write out a block whose first row has waited long enough, and rotate
+ * if it is time to. Called for every packet.
+ */
+void cdrfile_check (unsigned now);
+
+/*
+ * Write out what is left, and close.
+ */
+void cdrfile_close (void);
+
+
+#endif /* _CDRFILE_H */
@@ -0,0 +1,1074 @@
+/*
+ *  sipgrep - Monitoring tools
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2014-15 (http://www.sipcapture.org)
+ *
+ * Sipgrep is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Sipgrep is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+/* recvmmsg() */
+#if defined(LINUX) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "core_hep.h"
+#include "mpscring.h"
+#include "sipparse.h"
+
+int hep_version = 3;
+int usessl = 0;
+int pl_compress = 0;		/* compress payloads of at least this size, 0 is off */
+
+uint32_t hep_capture_id = HEP_DEFAULT_CAPTURE_ID;
+char *capt_password = NULL;
+
+static unsigned char hep_template[512];
+static unsigned int hep_template_len = 0;
+
+/*
+ * Collectors given to -H. Each message is routed to the collector with
+ * the highest rendezvous score for its Call-ID, so a whole dialog lands
+ * on one node and only the share of a failed collector moves elsewhere.
+ */
+hep_collector_t hep_collectors[HEP_MAX_COLLECTORS];
+int hep_collectors_count = 0;
+int hep_replicas = 0;
+uint32_t hep_dropped = 0;
+
+/*
+ * Capture only copies messages into a ring; encoding and sending happen
+ * on a dedicated thread, so a slow or refusing collector never stalls
+ * pcap_loop(). A ring size of 0 keeps sending inline.
+ */
+unsigned long hep_sender_ring_size = HEP_SENDER_RING_SIZE;
+int hep_sender_policy = MPSC_DROP_NEWEST;
+
+static struct mpsc_ring *hep_ring = NULL;
+static pthread_t hep_sender_thread;
+static int hep_sender_stopping = 0;
+
+/*
+ * HEP input (-L): a UDP socket read in batches, or a TCP listener with
+ * its accepted connections.
+ */
+uint32_t hep_received = 0, hep_decode_errors = 0;
+
+static int hep_listen_sock = -1;
+static int hep_listen_tcp = 0;
+
+struct hep_client {
+  int sock;
+  unsigned int len;
+  unsigned char *buf;
+};
+
+static struct hep_client hep_clients[HEP_MAX_CLIENTS];
+
+static void *hep_sender_loop (void *arg);
+static int hepv3_decode (unsigned char *buf, unsigned int len, hep_handler handler);
+static int hepv2_decode (unsigned char *buf, unsigned int len, hep_handler handler);
+static int hep_receive_udp (hep_handler handler, hep_idle_handler idle);
+static int hep_receive_tcp (hep_handler handler, hep_idle_handler idle);
+static uint32_t hep_mix32 (uint32_t h);
+static void hep_route_send (void *buffer, unsigned int buflen, uint32_t key);
+
+static int
+make_homer_socket (char *url, int *sock)
+{
+
+  char *ip, *tmp;
+  char port[20];
+  struct addrinfo *ai, hints[1] = { {0} };
+  int i;
+
+  ip = strchr (url, ':');
+  if (ip != NULL) {
+    ip++;
+    tmp = strchr (ip, ':');
+    if (tmp != NULL) {
+      i = (tmp - ip);
+      tmp++;
+      snprintf (port, 20, "%s", tmp);
+      ip[i] = '\0';
+    }
+    else
+      return 2;
+  }
+  else
+    return 2;
+
+  hints->ai_flags = AI_NUMERICSERV;
+  hints->ai_family = AF_UNSPEC;
+  hints->ai_socktype = SOCK_DGRAM;
+  hints->ai_protocol = IPPROTO_UDP;
+
+  if (getaddrinfo (ip, port, hints, &ai)) {
+    fprintf (stderr, "capture: getaddrinfo() error");
+    return 2;
+  }
+
+  *sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (*sock < 0) {
+    fprintf (stderr, "Sender socket creation failed: %s\n", strerror (errno));
+    freeaddrinfo (ai);
+    return 3;
+  }
+
+  if (connect (*sock, ai->ai_addr, (socklen_t) (ai->ai_addrlen)) == -1) {
+    if (errno != EINPROGRESS) {
+      fprintf (stderr, "Sender socket creation failed: %s\n", strerror (errno));
+      freeaddrinfo (ai);
+      return 4;
+    }
+  }
+
+  freeaddrinfo (ai);
+  return 0;
+}
+
+/*
+ * Everything but the per-message fields is encoded once: the generic
+ * header with all chunk headers filled in, the capture ID and the auth
+ * key. send_hepv3() copies this template and patches the values.
+ */
+int
+init_hepv3 (void)
+{
+
+  struct hep_generic *hg = (struct hep_generic *) hep_template;
+  hep_chunk_t *authkey_chunk;
+  unsigned int keylen = capt_password ? strlen (capt_password) : 0;
+
+  if (sizeof (struct hep_generic) + sizeof (hep_chunk_t) + keylen > sizeof (hep_template)) {
+    fprintf (stderr, "hep auth key too long\n");
+    return 1;
+  }
+
+  memset (hep_template, 0, sizeof (hep_template));
+
+  /* header set */
+  memcpy (hg->header.id, "\x48\x45\x50\x33", 4);
+
+  /* IP proto */
+  hg->ip_family.chunk.vendor_id = htons (0x0000);
+  hg->ip_family.chunk.type_id = htons (0x0001);
+  hg->ip_family.chunk.length = htons (sizeof (hg->ip_family));
+
+  /* Proto ID */
+  hg->ip_proto.chunk.vendor_id = htons (0x0000);
+  hg->ip_proto.chunk.type_id = htons (0x0002);
+  hg->ip_proto.chunk.length = htons (sizeof (hg->ip_proto));
+
+  /* SRC PORT */
+  hg->src_port.chunk.vendor_id = htons (0x0000);
+  hg->src_port.chunk.type_id = htons (0x0007);
+  hg->src_port.chunk.length = htons (sizeof (hg->src_port));
+
+  /* DST PORT */
+  hg->dst_port.chunk.vendor_id = htons (0x0000);
+  hg->dst_port.chunk.type_id = htons (0x0008);
+  hg->dst_port.chunk.length = htons (sizeof (hg->dst_port));
+
+  /* TIMESTAMP SEC */
+  hg->time_sec.chunk.vendor_id = htons (0x0000);
+  hg->time_sec.chunk.type_id = htons (0x0009);
+  hg->time_sec.chunk.length = htons (sizeof (hg->time_sec));
+
+  /* TIMESTAMP USEC */
+  hg->time_usec.chunk.vendor_id = htons (0x0000);
+  hg->time_usec.chunk.type_id = htons (0x000a);
+  hg->time_usec.chunk.length = htons (sizeof (hg->time_usec));
+
+  /* Protocol TYPE */
+  hg->proto_t.chunk.vendor_id = htons (0x0000);
+  hg->proto_t.chunk.type_id = htons (0x000b);
+  hg->proto_t.chunk.length = htons (sizeof (hg->proto_t));
+
+  /* Capture ID */
+  hg->capt_id.chunk.vendor_id = htons (0x0000);
+  hg->capt_id.chunk.type_id = htons (0x000c);
+  hg->capt_id.data = htonl (hep_capture_id);
+  hg->capt_id.chunk.length = htons (sizeof (hg->capt_id));
+
+  hep_template_len = sizeof (struct hep_generic);
+
+  /* Auth key */
+  if (keylen) {
+    authkey_chunk = (hep_chunk_t *) (hep_template + hep_template_len);
+    authkey_chunk->vendor_id = htons (0x0000);
+    authkey_chunk->type_id = htons (0x000e);
+    authkey_chunk->length = htons (sizeof (hep_chunk_t) + keylen);
+    hep_template_len += sizeof (hep_chunk_t);
+
+    memcpy (hep_template + hep_template_len, capt_password, keylen);
+    hep_template_len += keylen;
+  }
+
+  return 0;
+}
+
+int
+send_hepv3 (rc_info_t * rcinfo, unsigned char *data, unsigned int len)
+{
+
+  unsigned char buffer[HEP_MAX_PACKET];
+  struct hep_generic *hg = (struct hep_generic *) buffer;
+  unsigned int buflen;
+  hep_chunk_ip4_t *ip4;
+#if USE_IPv6
+  hep_chunk_ip6_t *ip6;
+#endif
+  hep_chunk_t *payload_chunk;
+
+  memcpy (buffer, hep_template, hep_template_len);
+  buflen = hep_template_len;
+
+  hg->ip_family.data = rcinfo->ip_family;
+  hg->ip_proto.data = rcinfo->ip_proto;
+  hg->src_port.data = htons (rcinfo->src_port);
+  hg->dst_port.data = htons (rcinfo->dst_port);
+  hg->time_sec.data = htonl (rcinfo->time_sec);
+  hg->time_usec.data = htonl (rcinfo->time_usec);
+  hg->proto_t.data = rcinfo->proto_type;
+
+  /* IPv4 */
+  if (rcinfo->ip_family == AF_INET) {
+    /* SRC IP */
+    ip4 = (hep_chunk_ip4_t *) (buffer + buflen);
+    ip4->chunk.vendor_id = htons (0x0000);
+    ip4->chunk.type_id = htons (0x0003);
+    ip4->chunk.length = htons (sizeof (hep_chunk_ip4_t));
+    inet_pton (AF_INET, rcinfo->src_ip, &ip4->data);
+    buflen += sizeof (hep_chunk_ip4_t);
+
+    /* DST IP */
+    ip4 = (hep_chunk_ip4_t *) (buffer + buflen);
+    ip4->chunk.vendor_id = htons (0x0000);
+    ip4->chunk.type_id = htons (0x0004);
+    ip4->chunk.length = htons (sizeof (hep_chunk_ip4_t));
+    inet_pton (AF_INET, rcinfo->dst_ip, &ip4->data);
+    buflen += sizeof (hep_chunk_ip4_t);
+  }
+#if USE_IPv6
+  /* IPv6 */
+  else if (rcinfo->ip_family == AF_INET6) {
+    /* SRC IPv6 */
+    ip6 = (hep_chunk_ip6_t *) (buffer + buflen);
+    ip6->chunk.vendor_id = htons (0x0000);
+    ip6->chunk.type_id = htons (0x0005);
+    ip6->chunk.length = htons (sizeof (hep_chunk_ip6_t));
+    inet_pton (AF_INET6, rcinfo->src_ip, &ip6->data);
+    buflen += sizeof (hep_chunk_ip6_t);
+
+    /* DST IPv6 */
+    ip6 = (hep_chunk_ip6_t *) (buffer + buflen);
+    ip6->chunk.vendor_id = htons (0x0000);
+    ip6->chunk.type_id = htons (0x0006);
+    ip6->chunk.length = htons (sizeof (hep_chunk_ip6_t));
+    inet_pton (AF_INET6, rcinfo->dst_ip, &ip6->data);
+    buflen += sizeof (hep_chunk_ip6_t);
+  }
+#endif
+
+  /* PAYLOAD CHUNK */
+  payload_chunk = (hep_chunk_t *) (buffer + buflen);
+  payload_chunk->vendor_id = htons (0x0000);
+  payload_chunk->type_id = htons (0x000f);
+  buflen += sizeof (hep_chunk_t);
+
+  /* the whole message must fit one datagram */
+  if (len > HEP_MAX_DATAGRAM - buflen)
+    len = HEP_MAX_DATAGRAM - buflen;
+
+#if USE_ZLIB
+  if (pl_compress && len >= (unsigned int) pl_compress) {
+    uLongf zlen = HEP_MAX_DATAGRAM - buflen;
+
+    /* keep it only if it saves something */
+    if (compress2 (buffer + buflen, &zlen, data, len, Z_BEST_SPEED) == Z_OK && zlen < len) {
+      payload_chunk->type_id = htons (0x0010);
+      payload_chunk->length = htons (sizeof (hep_chunk_t) + zlen);
+      buflen += zlen;
+      goto send;
+    }
+  }
+#endif
+
+  payload_chunk->length = htons (sizeof (hep_chunk_t) + len);
+
+  /* Now copying payload self */
+  memcpy (buffer + buflen, data, len);
+  buflen += len;
+
+#if USE_ZLIB
+send:
+#endif
+  /* total */
+  hg->header.length = htons (buflen);
+
+  /* send this packet out to the collector(s) owning this Call-ID */
+  hep_route_send (buffer, buflen, fnv1a_32 (FNV1A_32_INIT, rcinfo->callid, rcinfo->callid_len));
+
+  return 1;
+}
+
+int
+make_homer_collectors (char *urls)
+{
+
+  char *url, *next;
+  hep_collector_t *c;
+
+  for (url = urls; url && *url; url = next) {
+
+    if ((next = strchr (url, ',')) != NULL)
+      *next++ = '\0';
+
+    if (hep_collectors_count >= HEP_MAX_COLLECTORS) {
+      fprintf (stderr, "too many collectors, max %d\n", HEP_MAX_COLLECTORS);
+      return 1;
+    }
+
+    c = &hep_collectors[hep_collectors_count];
+    memset (c, 0, sizeof (hep_collector_t));
+    snprintf (c->url, sizeof (c->url), "%s", url);
+    c->seed = fnv1a_32 (FNV1A_32_INIT, c->url, strlen (c->url));
+
+    if (make_homer_socket (url, &c->sock))
+      return 2;
+
+    hep_collectors_count++;
+  }
+
+  if (hep_collectors_count == 0)
+    return 2;
+
+  if (hep_replicas >= hep_collectors_count)
+    hep_replicas = hep_collectors_count - 1;
+
+  return 0;
+}
+
+void
+close_homer_collectors (void)
+{
+
+  int i;
+
+  for (i = 0; i < hep_collectors_count; i++) {
+    if (hep_collectors[i].sock > 0)
+      close (hep_collectors[i].sock);
+  }
+
+  hep_collectors_count = 0;
+}
+
+void
+print_homer_collectors_stats (void)
+{
+
+  int i;
+
+  for (i = 0; i < hep_collectors_count; i++)
+    printf ("hep collector %s: %u sent, %u errors%s\n", hep_collectors[i].url, hep_collectors[i].sent,
+	    hep_collectors[i].errors, hep_collectors[i].retry_at ? " (down)" : "");
+
+  if (hep_dropped)
+    printf ("hep: %u messages dropped, no collector available\n", hep_dropped);
+}
+
+static uint32_t
+hep_mix32 (uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static void
+hep_route_send (void *buffer, unsigned int buflen, uint32_t key)
+{
+
+  int i, copies, best;
+  uint32_t score, best_score;
+  uint32_t used = 0;		/* bitmask of collectors already tried */
+  time_t now = 0;
+
+  copies = hep_replicas + 1;
+
+  while (copies > 0) {
+
+    best = -1;
+    best_score = 0;
+
+    for (i = 0; i < hep_collectors_count; i++) {
+
+      if (used & (1U << i))
+	continue;
+
+      if (hep_collectors[i].retry_at) {
+	if (!now)
+	  now = time (NULL);
+	if (now < hep_collectors[i].retry_at)
+	  continue;
+      }
+
+      score = hep_mix32 (key ^ hep_collectors[i].seed);
+      if (best < 0 || score > best_score) {
+	best = i;
+	best_score = score;
+      }
+    }
+
+    /* counters are read by other threads, for -Y and -U */
+    if (best < 0) {
+      __atomic_fetch_add (&hep_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    used |= 1U << best;
+
+    if (send (hep_collectors[best].sock, buffer, buflen, 0) == -1) {
+      /* take it out of the ring, its share moves to the others */
+      __atomic_fetch_add (&hep_collectors[best].errors, 1, __ATOMIC_RELAXED);
+      __atomic_store_n (&hep_collectors[best].retry_at, (now ? now : time (NULL)) + HEP_COLLECTOR_RETRY, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    __atomic_store_n (&hep_collectors[best].retry_at, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&hep_collectors[best].sent, 1, __ATOMIC_RELAXED);
+    copies--;
+  }
+}
+
+int
+hep_sender_start (void)
+{
+
+  if (hep_sender_ring_size == 0)
+    return 0;
+
+  if (!(hep_ring = mpsc_ring_new (hep_sender_ring_size, hep_sender_policy))) {
+    fprintf (stderr, "unable to allocate hep ring of %lu bytes\n", hep_sender_ring_size);
+    return 1;
+  }
+
+  if (pthread_create (&hep_sender_thread, NULL, hep_sender_loop, NULL) != 0) {
+    fprintf (stderr, "unable to start hep sender thread\n");
+    mpsc_ring_free (hep_ring);
+    hep_ring = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+void
+hep_sender_stop (void)
+{
+
+  if (!hep_ring)
+    return;
+
+  /* the sender drains what is queued before it leaves */
+  __atomic_store_n (&hep_sender_stopping, 1, __ATOMIC_RELEASE);
+  pthread_join (hep_sender_thread, NULL);
+}
+
+void
+print_hep_sender_stats (void)
+{
+
+  if (!hep_ring)
+    return;
+
+  printf ("hep queue: %lu queued, %lu dropped newest, %lu dropped oldest, %lu dropped too big, %lu of %lu bytes peak\n",
+	  mpsc_ring_pushed (hep_ring), mpsc_ring_dropped_newest (hep_ring), mpsc_ring_dropped_oldest (hep_ring),
+	  mpsc_ring_dropped_too_big (hep_ring), mpsc_ring_max_used (hep_ring), mpsc_ring_size (hep_ring));
+}
+
+int
+hep_dispatch (rc_info_t * rcinfo, unsigned char *data, unsigned int len)
+{
+
+  hep_queued_t q;
+
+  if (!hep_ring || __atomic_load_n (&hep_sender_stopping, __ATOMIC_ACQUIRE))
+    return send_hepv3 (rcinfo, data, len);
+
+  q.ip_family = rcinfo->ip_family;
+  q.ip_proto = rcinfo->ip_proto;
+  q.proto_type = rcinfo->proto_type;
+  q.src_port = rcinfo->src_port;
+  q.dst_port = rcinfo->dst_port;
+  q.time_sec = rcinfo->time_sec;
+  q.time_usec = rcinfo->time_usec;
+
+  /* no more than send_hepv3() puts in a packet, the sender's buffer holds that */
+  if (len > HEP_MAX_DATAGRAM - hep_template_len - sizeof (hep_chunk_t))
+    len = HEP_MAX_DATAGRAM - hep_template_len - sizeof (hep_chunk_t);
+
+  /* a Call-ID cut off, or beyond, routes as one without */
+  q.callid_off = q.callid_len = 0;
+  if (rcinfo->callid && (unsigned char *) rcinfo->callid - data + rcinfo->callid_len <= len) {
+    q.callid_off = (unsigned char *) rcinfo->callid - data;
+    q.callid_len = rcinfo->callid_len;
+  }
+  snprintf (q.src_ip, sizeof (q.src_ip), "%s", rcinfo->src_ip);
+  snprintf (q.dst_ip, sizeof (q.dst_ip), "%s", rcinfo->dst_ip);
+
+  return mpsc_ring_push (hep_ring, &q, sizeof (q), data, len) ? 1 : 0;
+}
+
+static void *
+hep_sender_loop (void *arg)
+{
+
+  unsigned char *buf;
+  unsigned int buflen = sizeof (hep_queued_t) + HEP_MAX_PACKET, len;
+  hep_queued_t *q;
+  rc_info_t rcinfo;
+
+  if (!(buf = malloc (buflen)))
+    return NULL;
+
+  q = (hep_queued_t *) buf;
+
+  for (;;) {
+
+    len = mpsc_ring_pop (hep_ring, buf, buflen);
+
+    if (len == 0) {
+      if (__atomic_load_n (&hep_sender_stopping, __ATOMIC_ACQUIRE) && mpsc_ring_used (hep_ring) == 0)
+	break;
+      usleep (HEP_SENDER_IDLE_USEC);
+      continue;
+    }
+
+    memset (&rcinfo, 0, sizeof (rc_info_t));
+    rcinfo.ip_family = q->ip_family;
+    rcinfo.ip_proto = q->ip_proto;
+    rcinfo.proto_type = q->proto_type;
+    rcinfo.src_port = q->src_port;
+    rcinfo.dst_port = q->dst_port;
+    rcinfo.time_sec = q->time_sec;
+    rcinfo.time_usec = q->time_usec;
+    rcinfo.src_ip = q->src_ip;
+    rcinfo.dst_ip = q->dst_ip;
+
+    if (q->callid_len) {
+      rcinfo.callid = (char *) buf + sizeof (hep_queued_t) + q->callid_off;
+      rcinfo.callid_len = q->callid_len;
+    }
+
+    send_hepv3 (&rcinfo, buf + sizeof (hep_queued_t), len - sizeof (hep_queued_t));
+  }
+
+  free (buf);
+  return NULL;
+}
+
+int
+make_hep_listener (char *url)
+{
+
+  char *ip, *tmp;
+  char port[20];
+  struct addrinfo *ai, hints[1] = { {0} };
+  int i, on = 1;
+
+  if (!memcmp (url, "tcp:", 4))
+    hep_listen_tcp = 1;
+  else if (memcmp (url, "udp:", 4))
+    return 2;
+
+  ip = url + 4;
+  if ((tmp = strrchr (ip, ':')) == NULL)
+    return 2;
+
+  i = (tmp - ip);
+  snprintf (port, 20, "%s", tmp + 1);
+  ip[i] = '\0';
+
+  hints->ai_flags = AI_NUMERICSERV | AI_PASSIVE;
+  hints->ai_family = AF_UNSPEC;
+  hints->ai_socktype = hep_listen_tcp ? SOCK_STREAM : SOCK_DGRAM;
+  hints->ai_protocol = hep_listen_tcp ? IPPROTO_TCP : IPPROTO_UDP;
+
+  if (getaddrinfo (*ip ? ip : NULL, port, hints, &ai)) {
+    fprintf (stderr, "hep input: getaddrinfo() error\n");
+    return 2;
+  }
+
+  hep_listen_sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (hep_listen_sock < 0) {
+    fprintf (stderr, "hep input: socket creation failed: %s\n", strerror (errno));
+    freeaddrinfo (ai);
+    return 3;
+  }
+
+  setsockopt (hep_listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+  if (bind (hep_listen_sock, ai->ai_addr, (socklen_t) (ai->ai_addrlen)) == -1 || (hep_listen_tcp && listen (hep_listen_sock, 16) == -1)) {
+    fprintf (stderr, "hep input: bind failed: %s\n", strerror (errno));
+    freeaddrinfo (ai);
+    return 4;
+  }
+
+  for (i = 0; i < HEP_MAX_CLIENTS; i++)
+    hep_clients[i].sock = -1;
+
+  freeaddrinfo (ai);
+  return 0;
+}
+
+void
+close_hep_listener (void)
+{
+
+  int i;
+
+  for (i = 0; i < HEP_MAX_CLIENTS; i++) {
+    if (hep_clients[i].sock >= 0)
+      close (hep_clients[i].sock);
+    if (hep_clients[i].buf)
+      free (hep_clients[i].buf);
+    hep_clients[i].sock = -1;
+    hep_clients[i].buf = NULL;
+  }
+
+  if (hep_listen_sock >= 0)
+    close (hep_listen_sock);
+  hep_listen_sock = -1;
+}
+
+/* like pcap_loop(): returns when the input is gone; idle may be NULL */
+int
+hep_receiver_loop (hep_handler handler, hep_idle_handler idle)
+{
+
+  if (hep_listen_sock < 0)
+    return -1;
+
+  return hep_listen_tcp ? hep_receive_tcp (handler, idle) : hep_receive_udp (handler, idle);
+}
+
+int
+hep_decode (unsigned char *buf, unsigned int len, hep_handler handler)
+{
+
+  hep_received++;
+
+  if (len >= 4 && !memcmp (buf, "HEP3", 4))
+    return hepv3_decode (buf, len, handler);
+
+  if (len >= sizeof (struct hep_hdr) && (buf[0] == 1 || buf[0] == 2))
+    return hepv2_decode (buf, len, handler);
+
+  hep_decode_errors++;
+  return -1;
+}
+
+static int
+hep_receive_udp (hep_handler handler, hep_idle_handler idle)
+{
+
+  unsigned char *bufs;
+  int n, i;
+#if HAVE_RECVMMSG
+  struct mmsghdr msgs[HEP_RECV_BATCH];
+  struct iovec iovecs[HEP_RECV_BATCH];
+#endif
+
+  if (!(bufs = malloc (HEP_RECV_BATCH * HEP_MAX_PACKET)))
+    return -1;
+
+  /* a receive with nothing to take gives up after a while, for idle */
+  if (idle) {
+    struct timeval tv = { HEP_IDLE_MS / 1000, HEP_IDLE_MS % 1000 * 1000 };
+    setsockopt (hep_listen_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  }
+
+#if HAVE_RECVMMSG
+  memset (msgs, 0, sizeof (msgs));
+  for (i = 0; i < HEP_RECV_BATCH; i++) {
+    iovecs[i].iov_base = bufs + i * HEP_MAX_PACKET;
+    iovecs[i].iov_len = HEP_MAX_PACKET;
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+#endif
+
+  for (;;) {
+
+    if (idle)
+      idle ();
+
+#if HAVE_RECVMMSG
+    /* block for the first datagram, then take whatever else is queued */
+    n = recvmmsg (hep_listen_sock, msgs, HEP_RECV_BATCH, MSG_WAITFORONE, NULL);
+#else
+    n = recv (hep_listen_sock, bufs, HEP_MAX_PACKET, 0);
+#endif
+
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+	continue;
+      fprintf (stderr, "hep input: receive failed: %s\n", strerror (errno));
+      break;
+    }
+
+#if HAVE_RECVMMSG
+    for (i = 0; i < n; i++)
+      hep_decode (bufs + i * HEP_MAX_PACKET, msgs[i].msg_len, handler);
+#else
+    hep_decode (bufs, n, handler);
+#endif
+  }
+
+  free (bufs);
+  return -1;
+}
+
+static int
+hep_receive_tcp (hep_handler handler, hep_idle_handler idle)
+{
+
+  struct pollfd fds[HEP_MAX_CLIENTS + 1];
+  struct hep_client *cl;
+  unsigned int used, mlen;
+  int i, n, nfds;
+
+  for (;;) {
+
+    if (idle)
+      idle ();
+
+    fds[0].fd = hep_listen_sock;
+    fds[0].events = POLLIN;
+    nfds = 1;
+
+    for (i = 0; i < HEP_MAX_CLIENTS; i++) {
+      fds[i + 1].fd = hep_clients[i].sock;	/* negative fds are ignored */
+      fds[i + 1].events = POLLIN;
+      fds[i + 1].revents = 0;
+      nfds++;
+    }
+
+    if (poll (fds, nfds, idle ? HEP_IDLE_MS : -1) < 0) {
+      if (errno == EINTR)
+	continue;
+      fprintf (stderr, "hep input: poll failed: %s\n", strerror (errno));
+      return -1;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int sock = accept (hep_listen_sock, NULL, NULL);
+
+      for (i = 0; sock >= 0 && i < HEP_MAX_CLIENTS; i++) {
+	if (hep_clients[i].sock < 0) {
+	  if (!hep_clients[i].buf && !(hep_clients[i].buf = malloc (HEP_MAX_PACKET)))
+	    break;
+	  hep_clients[i].sock = sock;
+	  hep_clients[i].len = 0;
+	  sock = -1;
+	}
+      }
+
+      /* no room for it */
+      if (sock >= 0)
+	close (sock);
+    }
+
+    for (i = 0; i < HEP_MAX_CLIENTS; i++) {
+
+      cl = &hep_clients[i];
+      if (cl->sock < 0 || !(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+	continue;
+
+      n = recv (cl->sock, cl->buf + cl->len, HEP_MAX_PACKET - cl->len, 0);
+      if (n <= 0) {
+	if (n < 0 && errno == EINTR)
+	  continue;
+	close (cl->sock);
+	cl->sock = -1;
+	continue;
+      }
+
+      cl->len += n;
+      used = 0;
+
+      /* only HEPv3 carries its total length, so only it can be framed on a stream */
+      while (cl->len - used >= 6) {
+
+	if (memcmp (cl->buf + used, "HEP3", 4)) {
+	  hep_decode_errors++;
+	  used = cl->len;
+	  close (cl->sock);
+	  cl->sock = -1;
+	  break;
+	}
+
+	mlen = ntohs (*(uint16_t *) (cl->buf + used + 4));
+	if (mlen < 6) {
+	  hep_decode_errors++;
+	  used = cl->len;
+	  close (cl->sock);
+	  cl->sock = -1;
+	  break;
+	}
+
+	if (cl->len - used < mlen)
+	  break;
+
+	hep_decode (cl->buf + used, mlen, handler);
+	used += mlen;
+      }
+
+      if (used) {
+	memmove (cl->buf, cl->buf + used, cl->len - used);
+	cl->len -= used;
+      }
+    }
+  }
+
+  return -1;
+}
+
+static int
+hepv3_decode (unsigned char *buf, unsigned int len, hep_handler handler)
+{
+
+  rc_info_t rcinfo;
+  char src_ip[INET6_ADDRSTRLEN], dst_ip[INET6_ADDRSTRLEN];
+  unsigned char *payload = NULL;
+  unsigned int plen = 0, offset, clen;
+  uint16_t type;
+  hep_chunk_t *chunk;
+  int compressed = 0;
+#if USE_ZLIB
+  unsigned char unpacked[HEP_MAX_PACKET];
+  uLongf ulen;
+#endif
+
+  memset (&rcinfo, 0, sizeof (rc_info_t));
+  rcinfo.src_ip = src_ip;
+  rcinfo.dst_ip = dst_ip;
+  src_ip[0] = dst_ip[0] = '\0';
+
+  /* too short for the length field */
+  if (len < sizeof (hep_ctrl_t)) {
+    hep_decode_errors++;
+    return -1;
+  }
+
+  offset = sizeof (hep_ctrl_t);
+
+  if (ntohs (((hep_ctrl_t *) buf)->length) < len)
+    len = ntohs (((hep_ctrl_t *) buf)->length);
+
+  while (offset + sizeof (hep_chunk_t) <= len) {
+
+    chunk = (hep_chunk_t *) (buf + offset);
+    type = ntohs (chunk->type_id);
+    clen = ntohs (chunk->length);
+
+    if (clen < sizeof (hep_chunk_t) || offset + clen > len) {
+      hep_decode_errors++;
+      return -1;
+    }
+
+    /* vendor chunks are of no use here */
+    if (chunk->vendor_id != 0) {
+      offset += clen;
+      continue;
+    }
+
+    switch (type) {
+    case 0x0001:
+      if (clen > sizeof (hep_chunk_t))
+	rcinfo.ip_family = buf[offset + sizeof (hep_chunk_t)];
+      break;
+    case 0x0002:
+      if (clen > sizeof (hep_chunk_t))
+	rcinfo.ip_proto = buf[offset + sizeof (hep_chunk_t)];
+      break;
+    case 0x0003:
+      if (clen == sizeof (hep_chunk_ip4_t))
+	inet_ntop (AF_INET, &((hep_chunk_ip4_t *) chunk)->data, src_ip, sizeof (src_ip));
+      break;
+    case 0x0004:
+      if (clen == sizeof (hep_chunk_ip4_t))
+	inet_ntop (AF_INET, &((hep_chunk_ip4_t *) chunk)->data, dst_ip, sizeof (dst_ip));
+      break;
+    case 0x0005:
+      if (clen == sizeof (hep_chunk_ip6_t))
+	inet_ntop (AF_INET6, &((hep_chunk_ip6_t *) chunk)->data, src_ip, sizeof (src_ip));
+      break;
+    case 0x0006:
+      if (clen == sizeof (hep_chunk_ip6_t))
+	inet_ntop (AF_INET6, &((hep_chunk_ip6_t *) chunk)->data, dst_ip, sizeof (dst_ip));
+      break;
+    case 0x0007:
+      if (clen == sizeof (hep_chunk_uint16_t))
+	rcinfo.src_port = ntohs (((hep_chunk_uint16_t *) chunk)->data);
+      break;
+    case 0x0008:
+      if (clen == sizeof (hep_chunk_uint16_t))
+	rcinfo.dst_port = ntohs (((hep_chunk_uint16_t *) chunk)->data);
+      break;
+    case 0x0009:
+      if (clen == sizeof (hep_chunk_uint32_t))
+	rcinfo.time_sec = ntohl (((hep_chunk_uint32_t *) chunk)->data);
+      break;
+    case 0x000a:
+      if (clen == sizeof (hep_chunk_uint32_t))
+	rcinfo.time_usec = ntohl (((hep_chunk_uint32_t *) chunk)->data);
+      break;
+    case 0x000b:
+      if (clen > sizeof (hep_chunk_t))
+	rcinfo.proto_type = buf[offset + sizeof (hep_chunk_t)];
+      break;
+    case 0x000f:
+    case 0x0010:
+      payload = buf + offset + sizeof (hep_chunk_t);
+      plen = clen - sizeof (hep_chunk_t);
+      compressed = (type == 0x0010);
+      break;
+    default:
+      break;
+    }
+
+    offset += clen;
+  }
+
+  if (!payload || !src_ip[0] || !dst_ip[0]) {
+    hep_decode_errors++;
+    return -1;
+  }
+
+  /* SIP only, not RTCP reports or logs */
+  if (rcinfo.proto_type != 1)
+    return 0;
+
+  if (compressed) {
+#if USE_ZLIB
+    ulen = sizeof (unpacked);
+    if (uncompress (unpacked, &ulen, payload, plen) != Z_OK) {
+      hep_decode_errors++;
+      return -1;
+    }
+    payload = unpacked;
+    plen = ulen;
+#else
+    hep_decode_errors++;
+    return -1;
+#endif
+  }
+
+  handler (&rcinfo, payload, plen);
+  return 0;
+}
+
+static int
+hepv2_decode (unsigned char *buf, unsigned int len, hep_handler handler)
+{
+
+  struct hep_hdr *hh = (struct hep_hdr *) buf;
+  struct hep_timehdr ht;
+  rc_info_t rcinfo;
+  char src_ip[INET6_ADDRSTRLEN], dst_ip[INET6_ADDRSTRLEN];
+  unsigned int offset = sizeof (struct hep_hdr), iplen;
+
+  memset (&rcinfo, 0, sizeof (rc_info_t));
+  rcinfo.src_ip = src_ip;
+  rcinfo.dst_ip = dst_ip;
+  rcinfo.ip_family = hh->hp_f;
+  rcinfo.ip_proto = hh->hp_p;
+  rcinfo.src_port = ntohs (hh->hp_sport);
+  rcinfo.dst_port = ntohs (hh->hp_dport);
+  rcinfo.proto_type = 1;
+
+  iplen = (hh->hp_f == AF_INET6) ? 32 : 8;
+  if (offset + iplen > len) {
+    hep_decode_errors++;
+    return -1;
+  }
+
+  if (hh->hp_f == AF_INET6) {
+    inet_ntop (AF_INET6, buf + offset, src_ip, sizeof (src_ip));
+    inet_ntop (AF_INET6, buf + offset + 16, dst_ip, sizeof (dst_ip));
+  }
+  else {
+    inet_ntop (AF_INET, buf + offset, src_ip, sizeof (src_ip));
+    inet_ntop (AF_INET, buf + offset + 4, dst_ip, sizeof (dst_ip));
+  }
+  offset += iplen;
+
+  /* HEPv2 adds the time header; HEPv1 has no timestamp at all */
+  if (hh->hp_v == 2) {
+    if (offset + sizeof (struct hep_timehdr) > len) {
+      hep_decode_errors++;
+      return -1;
+    }
+    memcpy (&ht, buf + offset, sizeof (struct hep_timehdr));
+    rcinfo.time_sec = ht.tv_sec;
+    rcinfo.time_usec = ht.tv_usec;
+    offset += sizeof (struct hep_timehdr);
+  }
+  else {
+    rcinfo.time_sec = time (NULL);
+  }
+
+  /* hp_l covers all headers, including any padding the sender had */
+  if (hh->hp_l >= offset)
+    offset = hh->hp_l;
+
+  if (offset >= len) {
+    hep_decode_errors++;
+    return -1;
+  }
+
+  handler (&rcinfo, buf + offset, len - offset);
+  return 0;
+}
@@ -23,13 +23,22 @@
 */
 
 
-#ifdef USE_IPV6
+#ifndef _CORE_HEP_H
+#define _CORE_HEP_H
+
+#if USE_IPv6
 #include <netinet/ip6.h>
-#endif /* USE_IPV6 */
+#endif /* USE_IPv6 */
+
+#define HEP_DEFAULT_CAPTURE_ID 101
+#define HEP_MAX_PACKET 65535
+#define HEP_MAX_DATAGRAM 65507	/* what one UDP datagram to a collector carries */
 
-int hep_version = 3;
-int usessl = 0;
-int pl_compress = 0;
+extern int hep_version;
+extern int usessl;
+extern int pl_compress;
+extern uint32_t hep_capture_id;
+extern char *capt_password;
 
 
 struct rc_info {
@@ -42,6 +51,8 @@ struct rc_info {
     uint16_t    dst_port;
     uint32_t    time_sec;
     uint32_t    time_usec;
+    const char  *callid; /* routing key for multiple collectors */
+    uint16_t    callid_len;
 } ;
 
 typedef struct rc_info rc_info_t;
@@ -149,9 +160,87 @@ struct hep_iphdr{
         struct in_addr hp_dst;      /* source and dest address */
 };
 
-#ifdef USE_IPV6
+#if USE_IPv6
 struct hep_ip6hdr {
         struct in6_addr hp6_src;        /* source address */
         struct in6_addr hp6_dst;        /* destination address */
 };
 #endif
+
+/* Collectors */
+
+#define HEP_MAX_COLLECTORS 16
+#define HEP_COLLECTOR_RETRY 30  /* seconds before a failed collector is probed again */
+
+struct hep_collector {
+    char     url[128];
+    int      sock;
+    uint32_t seed;        /* rendezvous hash weight, derived from url */
+    time_t   retry_at;    /* 0 if collector is healthy */
+    uint32_t sent;
+    uint32_t errors;
+};
+
+typedef struct hep_collector hep_collector_t;
+
+extern hep_collector_t hep_collectors[HEP_MAX_COLLECTORS];
+extern int hep_collectors_count;
+extern int hep_replicas;
+extern uint32_t hep_dropped;
+
+int make_homer_collectors (char *urls);
+void close_homer_collectors (void);
+void print_homer_collectors_stats (void);
+int init_hepv3 (void);
+int send_hepv3 (rc_info_t *rcinfo, unsigned char *data, unsigned int len);
+
+/* Sender thread */
+
+#define HEP_SENDER_RING_SIZE (4UL * 1024 * 1024)
+#define HEP_SENDER_IDLE_USEC 1000
+
+/* ring record header, followed by the payload */
+struct hep_queued {
+    uint8_t     ip_family;
+    uint8_t     ip_proto;
+    uint8_t     proto_type;
+    uint16_t    src_port;
+    uint16_t    dst_port;
+    uint32_t    time_sec;
+    uint32_t    time_usec;
+    uint16_t    callid_off;  /* Call-ID position inside the payload */
+    uint16_t    callid_len;
+    char        src_ip[INET6_ADDRSTRLEN];
+    char        dst_ip[INET6_ADDRSTRLEN];
+};
+
+typedef struct hep_queued hep_queued_t;
+
+extern unsigned long hep_sender_ring_size;
+extern int hep_sender_policy;
+
+int hep_sender_start (void);
+void hep_sender_stop (void);
+void print_hep_sender_stats (void);
+int hep_dispatch (rc_info_t *rcinfo, unsigned char *data, unsigned int len);
+
+/* Receiver */
+
+#define HEP_RECV_BATCH 32
+#define HEP_MAX_CLIENTS 64
+
+/* called for every SIP payload decoded from the HEP input */
+typedef void (*hep_handler) (rc_info_t *rcinfo, unsigned char *data, unsigned int len);
+
+/* called between reads, and every HEP_IDLE_MS at least while nothing comes in */
+typedef void (*hep_idle_handler) (void);
+#define HEP_IDLE_MS 1000
+
+extern uint32_t hep_received, hep_decode_errors;
+
+int make_hep_listener (char *url);
+int hep_receiver_loop (hep_handler handler, hep_idle_handler idle);
+void close_hep_listener (void);
+int hep_decode (unsigned char *buf, unsigned int len, hep_handler handler);
+
+#endif /* _CORE_HEP_H */
@@ -0,0 +1,122 @@
+/*
+ * dedup -- retransmitted SIP messages, by fingerprint.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+
+/* a bucket is two cache lines, the fingerprints first */
+struct bucket {
+	uint64_t fingerprint[DEDUP_WAYS];
+	uint32_t seen[DEDUP_WAYS];	/* 0 when empty */
+};
+
+struct dedup_set {
+	struct bucket *buckets;
+	unsigned window;
+	struct dedup_stats stats;
+};
+
+
+static uint64_t hash (uint64_t h, const char *s, int len);
+
+
+struct dedup_set *
+dedup_new (unsigned window)
+{
+	struct dedup_set *d;
+
+	if ((d = calloc (1, sizeof (*d))) == NULL)
+		return NULL;
+
+	if ((d->buckets = calloc (DEDUP_BUCKETS, sizeof (*d->buckets))) == NULL) {
+		free (d);
+		return NULL;
+	}
+
+	d->window = window;
+	return d;
+}
+
+
+void
+dedup_free (struct dedup_set *d)
+{
+	if (d == NULL)
+		return;
+
+	free (d->buckets);
+	free (d);
+}
+
+
+uint64_t
+dedup_fingerprint (const preparsed_sip_t *psip)
+{
+	uint64_t h = FNV1A_64_INIT;
+	char code[4];
+
+	if (psip->is_method == SIP_REPLY) {
+		code[0] = '0' + psip->reply / 100 % 10;
+		code[1] = '0' + psip->reply / 10 % 10;
+		code[2] = '0' + psip->reply % 10;
+		h = hash (h, code, 3);
+	}
+	else if (psip->method)
+		h = hash (h, psip->method, strlen (psip->method));
+
+	/* each closed by a separator, a byte moved from one to the next makes another */
+	h = hash (h, psip->callid.s, psip->callid.len);
+	h = hash (h, psip->cseq.s, psip->cseq.len);
+	h = hash (h, psip->via_branch.s, psip->via_branch.len);
+	h = hash (h, psip->to.s, psip->to.len);
+	h = hash (h, psip->body.s, psip->body.len);
+
+	return h;
+}
+
+
+int
+dedup_seen (struct dedup_set *d, uint64_t fingerprint, unsigned now)
+{
+	struct bucket *b = &d->buckets[(fingerprint >> 32 ^ fingerprint) & (DEDUP_BUCKETS - 1)];
+	int i, oldest = 0;
+
+	d->stats.checked++;
+
+	for (i = 0; i < DEDUP_WAYS; i++) {
+		if (b->fingerprint[i] == fingerprint && b->seen[i] != 0 && now < b->seen[i] + d->window) {
+			/* each copy holds it another window, as long as they keep coming */
+			b->seen[i] = now;
+			d->stats.duplicates++;
+			return 1;
+		}
+		if (b->seen[i] < b->seen[oldest])
+			oldest = i;
+	}
+
+	if (b->seen[oldest] != 0 && now < b->seen[oldest] + d->window)
+		d->stats.evicted++;
+
+	b->fingerprint[oldest] = fingerprint;
+	b->seen[oldest] = now;
+	return 0;
+}
+
+
+const struct dedup_stats *
+dedup_stats (const struct dedup_set *d)
+{
+	return &d->stats;
+}
+
+
+/* FNV-1a, then a separator */
+static uint64_t
+hash (uint64_t h, const char *s, int len)
+{
+	return fnv1a_64 (fnv1a_64 (h, s, len), "\xff", 1);
+}
@@ -0,0 +1,52 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stdint.h>
+
+#include "sipparse.h"
+
+
+/*
+ * Retransmissions, found by a fingerprint of each SIP message: the
+ * start line, Call-ID, CSeq, top Via branch, To and body. A message
+ * with the fingerprint of one seen less than the window before is a
+ * copy sent again.
+ *
+ * Fingerprints are kept in buckets of DEDUP_WAYS, so a lookup reads one
+ * bucket and nothing else; a new one takes the place of the oldest in
+ * its bucket. The set is of a fixed size, at a rate beyond what it
+ * holds for a window some copies go unnoticed, as counted in evicted.
+ * Times are the packets' own, in seconds.
+ */
+
+#define DEDUP_WINDOW 32		/* 64*T1, as long as a message is sent again */
+#define DEDUP_BUCKETS (1 << 15)
+#define DEDUP_WAYS 8
+
+/* what is done with a copy: nothing more, or the same as with others but marked */
+#define DEDUP_SKIP 1
+#define DEDUP_FLAG 2
+
+struct dedup_stats {
+	unsigned long long checked;	/* messages looked up */
+	unsigned long long duplicates;	/* found in the set */
+	unsigned long long evicted;	/* put out of the set before their window was over */
+};
+
+struct dedup_set;
+
+struct dedup_set *dedup_new (unsigned window);
+void dedup_free (struct dedup_set *d);
+
+uint64_t dedup_fingerprint (const preparsed_sip_t *psip);
+
+/*
+ * Whether the fingerprint was seen within the window before now, and
+ * in any case note it as seen now.
+ */
+int dedup_seen (struct dedup_set *d, uint64_t fingerprint, unsigned now);
+
+const struct dedup_stats *dedup_stats (const struct dedup_set *d);
+
+
+#endif /* _DEDUP_H */
@@ -0,0 +1,213 @@
+/*
+ * dialogdump -- write every dialog to a pcap file of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dialogdump.h"
+#include "uthash.h"
+#include "sipparse.h"
+
+
+/* files kept open at most, fewer if the descriptor limit is lower */
+#define DIALOGDUMP_OPEN 256
+
+/* descriptors left for everything else */
+#define DIALOGDUMP_SPARE 32
+
+/* longest Call-ID used as a file name as it is */
+#define DIALOGDUMP_NAME_MAX 128
+
+#define DIALOGDUMP_SUFFIX ".pcap"
+
+
+/*
+ * An open file. The table is kept in the order the files were last
+ * written to, so the first one is the one to close when too many are
+ * open.
+ */
+struct dialogdump_file {
+	char callid[256];
+	pcap_dumper_t *d;
+	const u_char *last_sp; /* the packet written last */
+	struct timeval last_ts;
+	UT_hash_handle hh;
+};
+
+
+static pcap_t *dialog_pd = NULL;
+static const char *dialog_dir = NULL, *dialog_done_dir = NULL;
+static struct dialogdump_file *dialog_files = NULL;
+static unsigned dialog_open = 0, dialog_max_open = DIALOGDUMP_OPEN;
+
+
+/*
+ * Make the path of the file of a dialog in dir.
+ */
+static void file_path (char *path, size_t size, const char *dir, const char *callid);
+
+static void close_file (struct dialogdump_file *f);
+
+
+int
+dialogdump_init (pcap_t *pd, const char *dir, const char *done_dir, char *errbuf)
+{
+	struct rlimit rl;
+	struct stat st;
+
+	if (stat (dir, &st) != 0 || !S_ISDIR (st.st_mode)) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: not a directory", dir);
+		return -1;
+	}
+
+	if (done_dir != NULL && (stat (done_dir, &st) != 0 || !S_ISDIR (st.st_mode))) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: not a directory", done_dir);
+		return -1;
+	}
+
+	if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < DIALOGDUMP_OPEN + DIALOGDUMP_SPARE)
+		dialog_max_open = rl.rlim_cur > 2 * DIALOGDUMP_SPARE ? rl.rlim_cur - DIALOGDUMP_SPARE : DIALOGDUMP_SPARE;
+
+	dialog_pd = pd;
+	dialog_dir = dir;
+	dialog_done_dir = done_dir;
+
+	return 0;
+}
+
+
+void
+dialogdump_packet (const char *callid, int len, const struct pcap_pkthdr *h, const u_char *sp)
+{
+	struct dialogdump_file *f;
+	char key[256], path[4096];
+
+	if (dialog_dir == NULL)
+		return;
+
+	snprintf (key, sizeof (key), "%.*s", len, callid);
+
+	HASH_FIND_STR (dialog_files, key, f);
+
+	if (f != NULL) {
+		if (f->last_sp == sp && f->last_ts.tv_sec == h->ts.tv_sec && f->last_ts.tv_usec == h->ts.tv_usec)
+			return;
+
+		/* to the end of the table, the most recently used */
+		HASH_DEL (dialog_files, f);
+		HASH_ADD_STR (dialog_files, callid, f);
+	}
+	else {
+		if (dialog_open >= dialog_max_open)
+			close_file (dialog_files);
+
+		if ((f = calloc (1, sizeof (*f))) == NULL) {
+			fprintf (stderr, "out of memory, dialog %s not written\n", key);
+			return;
+		}
+
+		/* a new file, or one closed before to make room */
+		file_path (path, sizeof (path), dialog_dir, key);
+#if HAVE_PCAP_DUMP_OPEN_APPEND
+		f->d = pcap_dump_open_append (dialog_pd, path);
+#else
+		/* without appending, opening it again would truncate what is in it */
+		if (access (path, F_OK) == 0) {
+			fprintf (stderr, "%s: libpcap cannot append, rest of dialog %s not written\n", path, key);
+			free (f);
+			return;
+		}
+		f->d = pcap_dump_open (dialog_pd, path);
+#endif
+		if (f->d == NULL) {
+			fprintf (stderr, "%s\n", pcap_geterr (dialog_pd));
+			free (f);
+			return;
+		}
+
+		snprintf (f->callid, sizeof (f->callid), "%s", key);
+		HASH_ADD_STR (dialog_files, callid, f);
+		dialog_open++;
+	}
+
+	/* left to stdio to buffer, flushed when the file is closed */
+	pcap_dump ((u_char *) f->d, h, sp);
+	f->last_sp = sp;
+	f->last_ts = h->ts;
+}
+
+
+void
+dialogdump_done (const char *callid)
+{
+	struct dialogdump_file *f;
+	char path[4096], done[4096];
+
+	if (dialog_dir == NULL)
+		return;
+
+	HASH_FIND_STR (dialog_files, callid, f);
+	if (f != NULL)
+		close_file (f);
+
+	if (dialog_done_dir == NULL)
+		return;
+
+	file_path (path, sizeof (path), dialog_dir, callid);
+	file_path (done, sizeof (done), dialog_done_dir, callid);
+
+	/* a dialog that was never written has no file */
+	if (rename (path, done) != 0 && errno != ENOENT)
+		fprintf (stderr, "unable to move the file '%s' to '%s': %s\n", path, done, strerror (errno));
+}
+
+
+void
+dialogdump_close (void)
+{
+	while (dialog_files != NULL)
+		close_file (dialog_files);
+}
+
+
+static void
+close_file (struct dialogdump_file *f)
+{
+	HASH_DEL (dialog_files, f);
+	pcap_dump_close (f->d);
+	free (f);
+	dialog_open--;
+}
+
+
+static void
+file_path (char *path, size_t size, const char *dir, const char *callid)
+{
+	const unsigned char *c;
+	size_t len = strlen (callid);
+
+	for (c = (const unsigned char *) callid; *c; c++)
+		if (!isalnum (*c) && !strchr ("@._-+=~", *c))
+			break;
+
+	if (*c == '\0' && len > 0 && len <= DIALOGDUMP_NAME_MAX && callid[0] != '.') {
+		snprintf (path, size, "%s/%s" DIALOGDUMP_SUFFIX, dir, callid);
+		return;
+	}
+
+	/* the hash the Call-ID index keeps, so one leads to the other */
+	snprintf (path, size, "%s/%016llx" DIALOGDUMP_SUFFIX, dir, (unsigned long long) fnv1a_64 (FNV1A_64_INIT, callid, len));
+}
@@ -0,0 +1,39 @@
+#ifndef _DIALOGDUMP_H
+#define _DIALOGDUMP_H
+
+#include <pcap.h>
+
+
+/*
+ * Output of every dialog to a pcap file of its own, in a directory,
+ * named by the Call-ID, or by a hash of it if the Call-ID doesn't make
+ * a safe file name. Only so many files are kept open, the ones written
+ * to least recently are closed, and opened again to append when the
+ * dialog goes on. A finished dialog's file is closed, and moved to
+ * another directory if one is given.
+ */
+
+/*
+ * Start writing into dir, with the link type and snapshot length of
+ * pd; done_dir may be NULL. Returns 0, or -1 with a message in errbuf.
+ */
+int dialogdump_init (pcap_t *pd, const char *dir, const char *done_dir, char *errbuf);
+
+/*
+ * Write a packet to the file of the dialog. A packet carrying several
+ * messages of one dialog is written once.
+ */
+void dialogdump_packet (const char *callid, int len, const struct pcap_pkthdr *h, const u_char *sp);
+
+/*
+ * The dialog has finished: close its file, and move it to done_dir.
+ */
+void dialogdump_done (const char *callid);
+
+/*
+ * Close all files, leaving them where they are.
+ */
+void dialogdump_close (void);
+
+
+#endif /* _DIALOGDUMP_H */
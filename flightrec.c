@@ -0,0 +1,187 @@
+/*
+ * flightrec -- keep recent packets, to write a dialog from before it matched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "flightrec.h"
+#include "sipparse.h"
+
+
+#define FLIGHTREC_ALIGN(x) (((x) + 7UL) & ~7UL)
+
+
+/*
+ * Every packet is this, then its bytes. Records follow each other in
+ * the arena; where the next one doesn't fit before its end, a size of 0
+ * says the ring goes on at the start.
+ */
+struct flightrec_rec {
+	uint32_t size; /* of the record, aligned */
+	uint32_t caplen, len;
+	uint32_t sec, usec;
+	uint32_t pad;
+	uint64_t hash; /* of the Call-ID, 0 once taken */
+};
+
+
+struct flightrec {
+	unsigned char *arena;
+	size_t size;
+	size_t head, tail; /* where the next record goes, where the oldest is */
+	unsigned long count;
+	unsigned seconds;
+};
+
+
+static uint64_t callid_hash (const char *callid, int len);
+
+/*
+ * Find, and drop, the oldest record.
+ */
+static struct flightrec_rec *oldest (struct flightrec *fr);
+static void drop (struct flightrec *fr);
+
+
+struct flightrec *
+flightrec_new (unsigned long size, unsigned seconds)
+{
+	struct flightrec *fr;
+
+	if ((fr = calloc (1, sizeof (*fr))) == NULL)
+		return NULL;
+
+	fr->size = FLIGHTREC_ALIGN (size);
+	fr->seconds = seconds;
+
+	if ((fr->arena = malloc (fr->size)) == NULL) {
+		free (fr);
+		return NULL;
+	}
+
+	return fr;
+}
+
+
+void
+flightrec_free (struct flightrec *fr)
+{
+	if (fr == NULL)
+		return;
+
+	free (fr->arena);
+	free (fr);
+}
+
+
+void
+flightrec_add (struct flightrec *fr, const char *callid, int len, const struct pcap_pkthdr *h, const u_char *sp)
+{
+	struct flightrec_rec *r;
+	size_t need = FLIGHTREC_ALIGN (sizeof (*r) + h->caplen);
+
+	if (need > fr->size)
+		return;
+
+	/* too old to be of use any more */
+	while (fr->count > 0 && fr->seconds && oldest (fr)->sec + fr->seconds < (uint32_t) h->ts.tv_sec)
+		drop (fr);
+
+	for (;;) {
+		if (fr->count == 0)
+			fr->head = fr->tail = 0;
+
+		if (fr->count == 0 || fr->head > fr->tail) {
+			if (need <= fr->size - fr->head)
+				break;
+			/* on at the start */
+			if (need <= fr->tail) {
+				if (fr->head < fr->size)
+					((struct flightrec_rec *) (fr->arena + fr->head))->size = 0;
+				fr->head = 0;
+				break;
+			}
+		}
+		else if (need <= fr->tail - fr->head)
+			break;
+
+		drop (fr);
+	}
+
+	r = (struct flightrec_rec *) (fr->arena + fr->head);
+	r->size = need;
+	r->caplen = h->caplen;
+	r->len = h->len;
+	r->sec = h->ts.tv_sec;
+	r->usec = h->ts.tv_usec;
+	r->hash = callid_hash (callid, len);
+	memcpy (r + 1, sp, h->caplen);
+
+	fr->head += need;
+	fr->count++;
+}
+
+
+unsigned
+flightrec_take (struct flightrec *fr, const char *callid, int len, pcap_handler callback, u_char *user)
+{
+	struct flightrec_rec *r;
+	struct pcap_pkthdr h;
+	uint64_t hash = callid_hash (callid, len);
+	unsigned long i;
+	unsigned taken = 0;
+	size_t off = fr->tail;
+
+	for (i = 0; i < fr->count; i++) {
+		r = (struct flightrec_rec *) (fr->arena + off);
+		if (off == fr->size || r->size == 0) {
+			off = 0;
+			r = (struct flightrec_rec *) fr->arena;
+		}
+
+		if (r->hash == hash) {
+			h.ts.tv_sec = r->sec;
+			h.ts.tv_usec = r->usec;
+			h.caplen = r->caplen;
+			h.len = r->len;
+			callback (user, &h, (const u_char *) (r + 1));
+			r->hash = 0;
+			taken++;
+		}
+
+		off += r->size;
+	}
+
+	return taken;
+}
+
+
+static struct flightrec_rec *
+oldest (struct flightrec *fr)
+{
+	if (fr->tail == fr->size || ((struct flightrec_rec *) (fr->arena + fr->tail))->size == 0)
+		fr->tail = 0;
+
+	return (struct flightrec_rec *) (fr->arena + fr->tail);
+}
+
+
+static void
+drop (struct flightrec *fr)
+{
+	fr->tail += oldest (fr)->size;
+	fr->count--;
+}
+
+
+/* never 0 */
+static uint64_t
+callid_hash (const char *callid, int len)
+{
+	uint64_t hash = fnv1a_64 (FNV1A_64_INIT, callid, len);
+
+	return hash ? hash : 1;
+}
@@ -0,0 +1,35 @@
+#ifndef _FLIGHTREC_H
+#define _FLIGHTREC_H
+
+#include <pcap.h>
+
+
+/*
+ * Ring of recent packets that were not written, kept by Call-ID, so
+ * that once a dialog matches, its packets from before the match can be
+ * written too. The packets are copied into one arena allocated up front;
+ * the oldest make room for new ones, and, if a time limit is given,
+ * packets older than that are dropped.
+ */
+struct flightrec;
+
+/*
+ * Functions to create and destroy a ring of size bytes, keeping packets
+ * for at most seconds (0 for as long as there is room).
+ */
+struct flightrec *flightrec_new (unsigned long size, unsigned seconds);
+void flightrec_free (struct flightrec *fr);
+
+/*
+ * Keep a packet of the call. Packets are expected in timestamp order.
+ */
+void flightrec_add (struct flightrec *fr, const char *callid, int len, const struct pcap_pkthdr *h, const u_char *sp);
+
+/*
+ * Pass the packets kept of the call to the callback, oldest first, and
+ * forget them. Returns how many there were.
+ */
+unsigned flightrec_take (struct flightrec *fr, const char *callid, int len, pcap_handler callback, u_char *user);
+
+
+#endif /* _FLIGHTREC_H */
@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -23,7 +25,29 @@
 #include "ipreasm.h"
 
 
-#define REASM_IP_HASH_SIZE 1021U
+/* initial number of buckets, doubled whenever entries outnumber them */
+#define REASM_IP_HASH_SIZE 1024U
+#define REASM_IP_HASH_MAX (1024U * 1024U)
+
+/* default limits on reassemblies in flight */
+#define REASM_IP_MAX_ENTRIES 8192U
+#define REASM_IP_MAX_BYTES (32U * 1024U * 1024U)
+
+/*
+ * Reassembly buffers come in power of two sizes from REASM_BUF_MIN up
+ * to the largest datagram. Each starts with REASM_HDR_ROOM bytes for
+ * the unfragmentable headers, payload follows at a fixed offset.
+ */
+#define REASM_HDR_ROOM 256U
+#define REASM_BUF_MIN 2048U
+#define REASM_BUF_CLASSES 7
+#define REASM_MAX_PAYLOAD 65535U
+
+/* released buffers kept for reuse, beyond this they go back to malloc */
+#define REASM_POOL_IDLE (4U * 1024U * 1024U)
+
+/* entries and fragment records are carved from chunks of this many */
+#define REASM_POOL_CHUNK 256
 
 
 enum entry_state {
@@ -66,15 +90,30 @@ union reasm_id {
 };
 
 
+/*
+ * The payload of a fragment is copied straight to its place in the
+ * reassembly buffer, the list only remembers which ranges are filled.
+ */
 struct reasm_frag_entry {
 	unsigned len;  /* payload length of this fragment */
 	unsigned offset; /* offset of this fragment into the payload of the reassembled packet */
-	unsigned data_offset; /* offset to the data pointer where payload starts */
-	unsigned char *data; /* payload starts at data + data_offset */
 	struct reasm_frag_entry *next;
 };
 
 
+/*
+ * What parse_packet() finds out about a fragment.
+ */
+struct reasm_frag_info {
+	unsigned len, offset;
+	unsigned hdr_len; /* unfragmentable part, copied from the first fragment */
+	unsigned data_offset; /* payload starts at packet + data_offset */
+	unsigned nxt_offset; /* IPv6: Next Header field to patch in the copied header */
+	uint8_t nxt;
+	bool last_frag;
+};
+
+
 /*
  * Reception of a complete packet is detected by counting the number
  * of "holes" that remain between the cached fragments. A hole is
@@ -84,40 +123,97 @@ struct reasm_frag_entry {
  */
 struct reasm_ip_entry {
 	union reasm_id id;
-	unsigned len, holes, frag_count, hash;
+	unsigned len, holes, frag_count, hash, hdr_len;
+	unsigned char *buf; /* REASM_HDR_ROOM, then the payload */
+	unsigned buf_class;
 	reasm_time_t timeout;
 	enum entry_state state;
 	enum reasm_proto protocol;
-	struct reasm_frag_entry *frags;
+	struct reasm_frag_entry frags; /* list head */
 	struct reasm_ip_entry *prev, *next;
 	struct reasm_ip_entry *time_prev, *time_next;
 };
 
 
+/*
+ * Fixed size records (entries, fragment records) are handed out from
+ * chunks and recycled through a free list; chunks are only released
+ * with the whole environment.
+ */
+struct reasm_pool {
+	size_t item_size;
+	void *free;
+	void *chunks;
+};
+
+
 /*
  * This struct contains some metadata, the main hash table, and a pointer
  * to the first entry that will time out. A linked list is kept in the
  * order in which packets will time out. Using a linked list for this
  * purpose requires that packets are input in chronological order, and
  * that a constant timeout value is used, which doesn't change even when
- * the entry's state transitions from active to invalid.
+ * the entry's state transitions from active to invalid. The same list
+ * gives the oldest entries to evict when the limits are reached.
+ *
+ * The table is keyed with a random secret, so nobody sending fragments
+ * can aim them all at one bucket.
  */
 struct reasm_ip {
-	struct reasm_ip_entry *table[REASM_IP_HASH_SIZE];
+	struct reasm_ip_entry **table;
+	unsigned table_size;
+	uint64_t key[2];
 	struct reasm_ip_entry *time_first, *time_last;
-	unsigned waiting, max_waiting, timed_out, dropped_frags;
+	unsigned waiting, max_waiting, timed_out, dropped_frags, evicted;
+	unsigned bytes, max_entries, max_bytes;
 	reasm_time_t timeout;
+	struct reasm_pool entry_pool, frag_pool;
+	void *buf_free[REASM_BUF_CLASSES];
+	unsigned buf_idle;
+	unsigned char *output; /* last reassembled packet, until the next call */
+	unsigned output_class;
 };
 
 
 /*
- * Hash functions.
+ * Hash functions. SipHash-2-4 over the identification tuple.
  */
-static unsigned reasm_ipv4_hash (const struct reasm_id_ipv4 *id);
+static unsigned reasm_siphash (const uint64_t key[2], const unsigned char *in, unsigned len);
+static unsigned reasm_ipv4_hash (const uint64_t key[2], const struct reasm_id_ipv4 *id);
 #if USE_IPv6
-static unsigned reasm_ipv6_hash (const struct reasm_id_ipv6 *id);
+static unsigned reasm_ipv6_hash (const uint64_t key[2], const struct reasm_id_ipv6 *id);
 #endif /* USE_IPv6 */
 
+/*
+ * Double the number of buckets. Entries keep their full hash, so they
+ * only need to be relinked.
+ */
+static void grow_table (struct reasm_ip *reasm);
+
+/*
+ * Evict the oldest entries, except keep, until a fragment of the given
+ * size fits within the limits. Without keep room is made for a new
+ * entry as well.
+ */
+static void enforce_limits (struct reasm_ip *reasm, unsigned bytes, struct reasm_ip_entry *keep);
+
+/*
+ * Pools of records and reassembly buffers.
+ */
+static void *pool_get (struct reasm_pool *pool);
+static void pool_put (struct reasm_pool *pool, void *item);
+static void pool_destroy (struct reasm_pool *pool);
+static unsigned buf_class_for (unsigned payload_len);
+static unsigned buf_size (unsigned buf_class);
+static unsigned char *buf_get (struct reasm_ip *reasm, unsigned buf_class);
+static void buf_put (struct reasm_ip *reasm, unsigned char *buf, unsigned buf_class);
+
+/*
+ * Make sure the payload area of an entry can hold len bytes, moving to
+ * a bigger buffer if needed.
+ */
+static bool reserve (struct reasm_ip *reasm, struct reasm_ip_entry *entry, unsigned len);
+
 /*
  * Insert a new fragment to the correct position in the list of fragments.
  * Check for fragment overlap and other error conditions. Update the
@@ -131,15 +227,23 @@ static bool add_fragment (struct reasm_ip_entry *entry, struct reasm_frag_entry
 static bool is_complete (struct reasm_ip_entry *entry);
 
 /*
- * Create the reassembled packet.
+ * Finish the reassembled packet in place: it starts hdr_len bytes
+ * before the payload.
  */
 static unsigned char *assemble (struct reasm_ip_entry *entry, unsigned *output_len);
 
+/*
+ * Give up on an entry. It stays around until it times out, so that the
+ * remaining fragments are recognized and dropped, but its buffer is
+ * released right away.
+ */
+static void invalidate_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry);
+
 /*
  * Drop and free entries.
  */
 static void drop_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry);
-static void free_entry (struct reasm_ip_entry *entry);
+static void free_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry);
 
 /*
  * Dispose of any entries which have expired before "now".
@@ -147,12 +251,12 @@ static void free_entry (struct reasm_ip_entry *entry);
 static void process_timeouts (struct reasm_ip *reasm, reasm_time_t now);
 
 /*
- * Create fragment structure from IPv6 packet. Returns NULL if the input
+ * Describe the fragment in an IPv6 packet. Returns false if the input
  * is not a fragment.
  * This function is called by parse_packet(), don't call it directly.
  */
 #if USE_IPv6
-static struct reasm_frag_entry *frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag);
+static bool frag_from_ipv6 (const unsigned char *packet, struct reasm_frag_info *frag, uint32_t *ip_id);
 #endif /* USE_IPv6 */
 
 /*
@@ -161,46 +265,73 @@ static struct reasm_frag_entry *frag_from_ipv6 (unsigned char *packet, uint32_t
 static bool reasm_id_equal (enum reasm_proto proto, const union reasm_id *left, const union reasm_id *right);
 
 /*
- * Create fragment structure from an IPv4 or IPv6 packet. Returns NULL
- * if the input is not a fragment.
+ * Describe the fragment in an IPv4 or IPv6 packet. Returns false if
+ * the input is not a fragment.
  */
-static struct reasm_frag_entry *parse_packet (unsigned char *packet, unsigned len, enum reasm_proto *protocol, union reasm_id *id, unsigned *hash, bool *last_frag);
+static bool parse_packet (const struct reasm_ip *reasm, const unsigned char *packet, unsigned len, struct reasm_frag_info *frag, enum reasm_proto *protocol, union reasm_id *id, unsigned *hash);
+
+
+#define ROTL64(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL64 (v1, 13); v1 ^= v0; v0 = ROTL64 (v0, 32); \
+		v2 += v3; v3 = ROTL64 (v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL64 (v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL64 (v1, 17); v1 ^= v2; v2 = ROTL64 (v2, 32); \
+	} while (0)
 
 
 static unsigned
-reasm_ipv4_hash (const struct reasm_id_ipv4 *id)
+reasm_siphash (const uint64_t key[2], const unsigned char *in, unsigned len)
 {
-	unsigned hash = 0;
+	uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+	uint64_t m, b = ((uint64_t) len) << 56;
+	const unsigned char *end = in + (len & ~7U);
 	int i;
 
-	for (i = 0; i < 4; i++) {
-		hash = 37U * hash + id->ip_src[i];
-		hash = 37U * hash + id->ip_dst[i];
+	for (; in != end; in += 8) {
+		memcpy (&m, in, 8);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
 	}
 
-	hash = 59U * hash + id->ip_id;
+	for (i = len & 7; i > 0; i--)
+		b |= ((uint64_t) in[i - 1]) << (8 * (i - 1));
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
 
-	hash = 47U * hash + id->ip_proto;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
 
-	return hash;
+	b = v0 ^ v1 ^ v2 ^ v3;
+	return (unsigned) (b ^ (b >> 32));
 }
 
 
-#if USE_IPv6
 static unsigned
-reasm_ipv6_hash (const struct reasm_id_ipv6 *id)
+reasm_ipv4_hash (const uint64_t key[2], const struct reasm_id_ipv4 *id)
 {
-	unsigned hash = 0;
-	int i;
-
-	for (i = 0; i < 16; i++) {
-		hash = 37U * hash + id->ip_src[i];
-		hash = 37U * hash + id->ip_dst[i];
-	}
+	return reasm_siphash (key, (const unsigned char *) id, sizeof (*id));
+}
 
-	hash = 59U * hash + id->ip_id;
 
-	return hash;
+#if USE_IPv6
+static unsigned
+reasm_ipv6_hash (const uint64_t key[2], const struct reasm_id_ipv6 *id)
+{
+	return reasm_siphash (key, (const unsigned char *) id, sizeof (*id));
 }
 #endif /* USE_IPv6 */
 
@@ -210,61 +341,79 @@ reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, unsigned len, reas
 {
 	enum reasm_proto proto;
 	union reasm_id id;
-	unsigned hash;
-	bool last_frag;
+	unsigned hash, bucket;
+	struct reasm_frag_info info;
+	struct reasm_frag_entry *frag;
+
+	/* the caller is done with the previous output by now */
+	if (reasm->output != NULL) {
+		buf_put (reasm, reasm->output, reasm->output_class);
+		reasm->output = NULL;
+	}
 
 	process_timeouts (reasm, timestamp);
 
-	struct reasm_frag_entry *frag = parse_packet (packet, len, &proto, &id, &hash, &last_frag);
-	if (frag == NULL) {
+	memset (&id, 0, sizeof (id));
+	if (!parse_packet (reasm, packet, len, &info, &proto, &id, &hash)) {
 		*output_len = len;
 		return packet; /* some packet that we don't recognize as a fragment */
 	}
 
-	hash %= REASM_IP_HASH_SIZE;
-	struct reasm_ip_entry *entry = reasm->table[hash];
-	while (entry != NULL && (proto != entry->protocol || !reasm_id_equal (proto, &id, &entry->id)))
+	bucket = hash & (reasm->table_size - 1);
+	struct reasm_ip_entry *entry = reasm->table[bucket];
+	while (entry != NULL && (entry->hash != hash || proto != entry->protocol || !reasm_id_equal (proto, &id, &entry->id)))
 		entry = entry->next;
 
 	if (entry == NULL) {
-		entry = malloc (sizeof (*entry));
-		if (entry == NULL) {
-			free (frag);
-			abort ();
+		unsigned need = info.offset + info.len;
+
+		/* the UDP header in the first fragment tells the size of it all */
+		if (info.offset == 0 && info.len >= 8 && ((proto == PROTO_IPV4 && packet[9] == IPPROTO_UDP)
+#if USE_IPv6
+		    || (proto == PROTO_IPV6 && info.nxt == IPPROTO_UDP)
+#endif /* USE_IPv6 */
+		    )) {
+			unsigned hint = (packet[info.data_offset + 4] << 8) | packet[info.data_offset + 5];
+			if (hint > need && hint <= REASM_MAX_PAYLOAD)
+				need = hint;
 		}
 
-		struct reasm_frag_entry *list_head = malloc (sizeof (*list_head));
-		if (list_head == NULL) {
-			free (frag);
-			free (entry);
-			abort ();
+		unsigned buf_class = buf_class_for (need);
+
+		enforce_limits (reasm, buf_size (buf_class), NULL);
+
+		if (reasm->waiting >= reasm->table_size)
+			grow_table (reasm);
+		bucket = hash & (reasm->table_size - 1);
+
+		entry = pool_get (&reasm->entry_pool);
+		unsigned char *buf = entry ? buf_get (reasm, buf_class) : NULL;
+		if (entry == NULL || buf == NULL) {
+			if (entry != NULL)
+				pool_put (&reasm->entry_pool, entry);
+			reasm->dropped_frags++;
+			return NULL;
 		}
 
 		*entry = (struct reasm_ip_entry) {
 			.id = id,
 			.len = 0,
 			.holes = 1,
-			.frags = list_head,
 			.hash = hash,
+			.buf = buf,
+			.buf_class = buf_class,
 			.protocol = proto,
 			.timeout = timestamp + reasm->timeout,
 			.state = STATE_ACTIVE,
 			.prev = NULL,
-			.next = reasm->table[hash],
+			.next = reasm->table[bucket],
 			.time_prev = reasm->time_last,
 			.time_next = NULL,
 		};
 
-		*list_head = (struct reasm_frag_entry) {
-			.len = 0,
-			.offset = 0,
-			.data_offset = 0,
-			.data = NULL,
-		};
-
 		if (entry->next != NULL)
 			entry->next->prev = entry;
-		reasm->table[hash] = entry;
+		reasm->table[bucket] = entry;
 
 		if (reasm->time_last != NULL)
 			reasm->time_last->time_next = entry;
@@ -272,6 +421,7 @@ reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, unsigned len, reas
 			reasm->time_first = entry;
 		reasm->time_last = entry;
 
+		reasm->bytes += buf_size (buf_class);
 		reasm->waiting++;
 		if (reasm->waiting > reasm->max_waiting)
 			reasm->max_waiting = reasm->waiting;
@@ -282,21 +432,239 @@ reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, unsigned len, reas
 		return NULL;
 	}
 
-	if (!add_fragment (entry, frag, last_frag)) {
-		entry->state = STATE_INVALID;
+	frag = pool_get (&reasm->frag_pool);
+	if (frag == NULL) {
+		reasm->dropped_frags++;
+		return NULL;
+	}
+
+	*frag = (struct reasm_frag_entry) {
+		.len = info.len,
+		.offset = info.offset,
+	};
+
+	if (!add_fragment (entry, frag, info.last_frag)) {
+		invalidate_entry (reasm, entry);
 		reasm->dropped_frags += entry->frag_count + 1;
+		pool_put (&reasm->frag_pool, frag);
+		return NULL;
+	}
+
+	/* zero sized fragments are not kept in the list */
+	if (frag->len == 0)
+		pool_put (&reasm->frag_pool, frag);
+
+	if (!reserve (reasm, entry, entry->len > info.offset + info.len ? entry->len : info.offset + info.len)) {
+		invalidate_entry (reasm, entry);
+		reasm->dropped_frags += entry->frag_count;
 		return NULL;
 	}
 
+	memcpy (entry->buf + REASM_HDR_ROOM + info.offset, packet + info.data_offset, info.len);
+
+	if (info.offset == 0) {
+		entry->hdr_len = info.hdr_len;
+		memcpy (entry->buf + REASM_HDR_ROOM - info.hdr_len, packet, info.hdr_len);
+#if USE_IPv6
+		/* the Fragment header is left out, the header before it now leads to what it led to */
+		if (proto == PROTO_IPV6)
+			entry->buf[REASM_HDR_ROOM - info.hdr_len + info.nxt_offset] = info.nxt;
+#endif /* USE_IPv6 */
+	}
+
 	if (!is_complete (entry))
 		return NULL;
 
 	unsigned char *r = assemble (entry, output_len);
+
+	/* the buffer outlives the entry until the next call */
+	reasm->output = entry->buf;
+	reasm->output_class = entry->buf_class;
+	reasm->bytes -= buf_size (entry->buf_class);
+	entry->buf = NULL;
+
 	drop_entry (reasm, entry);
 	return r;
 }
 
 
+static void
+grow_table (struct reasm_ip *reasm)
+{
+	unsigned size = reasm->table_size * 2, i;
+	struct reasm_ip_entry **table, *entry, *next;
+
+	if (size > REASM_IP_HASH_MAX)
+		return;
+
+	table = calloc (size, sizeof (*table));
+	if (table == NULL)
+		return; /* keep going with longer chains */
+
+	for (i = 0; i < reasm->table_size; i++) {
+		for (entry = reasm->table[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			unsigned bucket = entry->hash & (size - 1);
+			entry->prev = NULL;
+			entry->next = table[bucket];
+			if (entry->next != NULL)
+				entry->next->prev = entry;
+			table[bucket] = entry;
+		}
+	}
+
+	free (reasm->table);
+	reasm->table = table;
+	reasm->table_size = size;
+}
+
+
+static void
+enforce_limits (struct reasm_ip *reasm, unsigned bytes, struct reasm_ip_entry *keep)
+{
+	struct reasm_ip_entry *victim;
+
+	while ((reasm->waiting >= reasm->max_entries && keep == NULL) || reasm->bytes + bytes > reasm->max_bytes) {
+		victim = reasm->time_first;
+		if (victim == keep)
+			victim = victim->time_next;
+		if (victim == NULL)
+			break;
+
+		reasm->evicted++;
+		reasm->dropped_frags += victim->frag_count;
+		drop_entry (reasm, victim);
+	}
+}
+
+
+static void *
+pool_get (struct reasm_pool *pool)
+{
+	void *item = pool->free;
+	int i;
+
+	if (item == NULL) {
+		/* the first slot of a chunk links the chunks together */
+		unsigned char *chunk = malloc (pool->item_size * (REASM_POOL_CHUNK + 1));
+		if (chunk == NULL)
+			return NULL;
+
+		*(void **) chunk = pool->chunks;
+		pool->chunks = chunk;
+
+		for (i = REASM_POOL_CHUNK; i > 0; i--)
+			pool_put (pool, chunk + i * pool->item_size);
+
+		item = pool->free;
+	}
+
+	pool->free = *(void **) item;
+	return item;
+}
+
+
+static void
+pool_put (struct reasm_pool *pool, void *item)
+{
+	*(void **) item = pool->free;
+	pool->free = item;
+}
+
+
+static void
+pool_destroy (struct reasm_pool *pool)
+{
+	void *chunk, *next;
+
+	for (chunk = pool->chunks; chunk != NULL; chunk = next) {
+		next = *(void **) chunk;
+		free (chunk);
+	}
+
+	pool->chunks = pool->free = NULL;
+}
+
+
+static unsigned
+buf_class_for (unsigned payload_len)
+{
+	unsigned buf_class = 0;
+
+	while (buf_class + 1 < REASM_BUF_CLASSES && buf_size (buf_class) < payload_len)
+		buf_class++;
+
+	return buf_class;
+}
+
+
+static unsigned
+buf_size (unsigned buf_class)
+{
+	return REASM_BUF_MIN << buf_class;
+}
+
+
+static unsigned char *
+buf_get (struct reasm_ip *reasm, unsigned buf_class)
+{
+	unsigned char *buf = reasm->buf_free[buf_class];
+
+	if (buf != NULL) {
+		reasm->buf_free[buf_class] = *(void **) buf;
+		reasm->buf_idle -= buf_size (buf_class);
+		return buf;
+	}
+
+	return malloc (REASM_HDR_ROOM + buf_size (buf_class));
+}
+
+
+static void
+buf_put (struct reasm_ip *reasm, unsigned char *buf, unsigned buf_class)
+{
+	if (reasm->buf_idle + buf_size (buf_class) > REASM_POOL_IDLE) {
+		free (buf);
+		return;
+	}
+
+	*(void **) buf = reasm->buf_free[buf_class];
+	reasm->buf_free[buf_class] = buf;
+	reasm->buf_idle += buf_size (buf_class);
+}
+
+
+static bool
+reserve (struct reasm_ip *reasm, struct reasm_ip_entry *entry, unsigned len)
+{
+	unsigned buf_class;
+	unsigned char *buf;
+
+	if (len <= buf_size (entry->buf_class))
+		return true;
+
+	if (len > REASM_MAX_PAYLOAD)
+		return false;
+
+	/* the size was not known up front, this is the one extra copy */
+	buf_class = buf_class_for (len);
+	enforce_limits (reasm, buf_size (buf_class) - buf_size (entry->buf_class), entry);
+
+	buf = buf_get (reasm, buf_class);
+	if (buf == NULL)
+		return false;
+
+	memcpy (buf, entry->buf, REASM_HDR_ROOM + buf_size (entry->buf_class));
+	buf_put (reasm, entry->buf, entry->buf_class);
+
+	reasm->bytes += buf_size (buf_class) - buf_size (entry->buf_class);
+	entry->buf = buf;
+	entry->buf_class = buf_class;
+
+	return true;
+}
+
+
 static bool
 add_fragment (struct reasm_ip_entry *entry, struct reasm_frag_entry *frag, bool last_frag)
 {
@@ -333,7 +701,7 @@ add_fragment (struct reasm_ip_entry *entry, struct reasm_frag_entry *frag, bool
 		fit_right = true;
 	}
 
-	struct reasm_frag_entry *cur = entry->frags, *next = cur->next;
+	struct reasm_frag_entry *cur = &entry->frags, *next = cur->next;
 
 	while (cur->next != NULL && cur->next->offset <= frag->offset)
 		cur = cur->next;
@@ -393,6 +761,28 @@ reasm_ip_new (void)
 		return NULL;
 
 	memset (reasm, 0, sizeof (*reasm));
+
+	reasm->table = calloc (REASM_IP_HASH_SIZE, sizeof (*reasm->table));
+	if (reasm->table == NULL) {
+		free (reasm);
+		return NULL;
+	}
+
+	reasm->table_size = REASM_IP_HASH_SIZE;
+	reasm->max_entries = REASM_IP_MAX_ENTRIES;
+	reasm->max_bytes = REASM_IP_MAX_BYTES;
+	reasm->entry_pool.item_size = sizeof (struct reasm_ip_entry);
+	reasm->frag_pool.item_size = sizeof (struct reasm_frag_entry);
+
+	/* hash key: from the kernel if possible, else whatever varies */
+	FILE *f = fopen ("/dev/urandom", "r");
+	if (f == NULL || fread (reasm->key, sizeof (reasm->key), 1, f) != 1) {
+		reasm->key[0] = (uint64_t) time (NULL) ^ ((uint64_t) getpid () << 32);
+		reasm->key[1] = (uint64_t) (uintptr_t) reasm ^ (uint64_t) clock ();
+	}
+	if (f != NULL)
+		fclose (f);
+
 	return reasm;
 }
 
@@ -400,8 +790,25 @@ reasm_ip_new (void)
 void
 reasm_ip_free (struct reasm_ip *reasm)
 {
+	void *buf;
+	int i;
+
 	while (reasm->time_first != NULL)
 		drop_entry (reasm, reasm->time_first);
+
+	if (reasm->output != NULL)
+		free (reasm->output);
+
+	for (i = 0; i < REASM_BUF_CLASSES; i++) {
+		while ((buf = reasm->buf_free[i]) != NULL) {
+			reasm->buf_free[i] = *(void **) buf;
+			free (buf);
+		}
+	}
+
+	pool_destroy (&reasm->entry_pool);
+	pool_destroy (&reasm->frag_pool);
+	free (reasm->table);
 	free (reasm);
 }
 
@@ -416,42 +823,15 @@ is_complete (struct reasm_ip_entry *entry)
 static unsigned char *
 assemble (struct reasm_ip_entry *entry, unsigned *output_len)
 {
-	struct reasm_frag_entry *frag = entry->frags->next; /* skip list head */
-	unsigned offset0 = frag->data_offset;
-	unsigned char *p = malloc (entry->len + offset0);
-	if (p == NULL)
-		abort ();
+	unsigned char *p = entry->buf + REASM_HDR_ROOM - entry->hdr_len;
 
-	switch (entry->protocol) {
-		case PROTO_IPV4:
-			break;
-
-#if USE_IPv6
-		case PROTO_IPV6:
-			offset0 -= 8; /* size of frag header */
-			break;
-#endif /* USE_IPv6 */
-
-		default:
-			abort ();
-	}
-
-	*output_len = entry->len + offset0;
-
-	/* copy the (unfragmentable) header from the first fragment received */
-	memcpy (p, frag->data, offset0);
-
-	/* join all the payload fragments together */
-	while (frag != NULL) {
-		memcpy (p + offset0 + frag->offset, frag->data + frag->data_offset, frag->len);
-		frag = frag->next;
-	}
+	*output_len = entry->hdr_len + entry->len;
 
 	/* some cleanups, e.g. update the length field of reassembled packet */
 	switch (entry->protocol) {
 		case PROTO_IPV4: {
 			struct ip *ip_header = (struct ip *) p;
-			ip_header->ip_len = htons (offset0 + entry->len);
+			ip_header->ip_len = htons (entry->hdr_len + entry->len);
 			ip_header->ip_off = 0;
 			//  XXX recompute the checksum
 			break;
@@ -460,7 +840,7 @@ assemble (struct reasm_ip_entry *entry, unsigned *output_len)
 #if USE_IPv6
 		case PROTO_IPV6: {
 			struct ip6_hdr *ip6_header = (struct ip6_hdr *) p;
-			ip6_header->ip6_plen = htons (offset0 + entry->len - 40);
+			ip6_header->ip6_plen = htons (entry->hdr_len + entry->len - 40);
 			break;
 		}
 #endif /* USE_IPv6 */
@@ -473,13 +853,26 @@ assemble (struct reasm_ip_entry *entry, unsigned *output_len)
 }
 
 
+static void
+invalidate_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry)
+{
+	entry->state = STATE_INVALID;
+
+	if (entry->buf != NULL) {
+		reasm->bytes -= buf_size (entry->buf_class);
+		buf_put (reasm, entry->buf, entry->buf_class);
+		entry->buf = NULL;
+	}
+}
+
+
 static void
 drop_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry)
 {
 	if (entry->prev != NULL)
 		entry->prev->next = entry->next;
 	else
-		reasm->table[entry->hash] = entry->next;
+		reasm->table[entry->hash & (reasm->table_size - 1)] = entry->next;
 
 	if (entry->next != NULL)
 		entry->next->prev = entry->prev;
@@ -496,23 +889,26 @@ drop_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry)
 
 	reasm->waiting--;
 
-	free_entry (entry);
+	free_entry (reasm, entry);
 }
 
 
 static void
-free_entry (struct reasm_ip_entry *entry)
+free_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry)
 {
-	struct reasm_frag_entry *frag = entry->frags, *next;
+	struct reasm_frag_entry *frag = entry->frags.next, *next;
 	while (frag != NULL) {
 		next = frag->next;
-		if (frag->data != NULL)
-			free (frag->data);
-		free (frag);
+		pool_put (&reasm->frag_pool, frag);
 		frag = next;
 	}
 
-	free (entry);
+	if (entry->buf != NULL) {
+		reasm->bytes -= buf_size (entry->buf_class);
+		buf_put (reasm, entry->buf, entry->buf_class);
+	}
+
+	pool_put (&reasm->entry_pool, entry);
 }
 
 
@@ -544,6 +940,28 @@ reasm_ip_dropped_frags (const struct reasm_ip *reasm)
 }
 
 
+unsigned
+reasm_ip_evicted (const struct reasm_ip *reasm)
+{
+	return reasm->evicted;
+}
+
+
+unsigned
+reasm_ip_bytes (const struct reasm_ip *reasm)
+{
+	return reasm->bytes;
+}
+
+
+void
+reasm_ip_set_limits (struct reasm_ip *reasm, unsigned max_entries, unsigned max_bytes)
+{
+	reasm->max_entries = max_entries ? max_entries : 1;
+	reasm->max_bytes = max_bytes;
+}
+
+
 bool
 reasm_ip_set_timeout (struct reasm_ip *reasm, reasm_time_t timeout)
 {
@@ -565,11 +983,12 @@ process_timeouts (struct reasm_ip *reasm, reasm_time_t now)
 }
 
 
+
 #if USE_IPv6
-static struct reasm_frag_entry *
-frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag)
+static bool
+frag_from_ipv6 (const unsigned char *packet, struct reasm_frag_info *frag, uint32_t *ip_id)
 {
-	struct ip6_hdr *ip6_header = (struct ip6_hdr *) packet;
+	const struct ip6_hdr *ip6_header = (const struct ip6_hdr *) packet;
 	unsigned offset = 40; /* IPv6 header size */
 	uint8_t nxt = ip6_header->ip6_nxt;
 	unsigned total_len = 40 + ntohs (ip6_header->ip6_plen);
@@ -590,11 +1009,11 @@ frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag)
 	 */
 	while (nxt == IPPROTO_HOPOPTS || nxt == IPPROTO_ROUTING || nxt == IPPROTO_DSTOPTS) {
 		if (offset + 2 > total_len)
-			return NULL;  /* header extends past end of packet */
+			return false;  /* header extends past end of packet */
 
 		unsigned exthdr_len = 8 + 8 * packet[offset + 1];
 		if (offset + exthdr_len > total_len)
-			return NULL;  /* header extends past end of packet */
+			return false;  /* header extends past end of packet */
 
 		nxt = packet[offset];
 		last_nxt = offset;
@@ -602,39 +1021,32 @@ frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag)
 	}
 
 	if (nxt != IPPROTO_FRAGMENT)
-		return NULL;
-
-	if (offset + 8 > total_len)
-		return NULL;  /* Fragment header extends past end of packet */
+		return false;
 
-	struct reasm_frag_entry *frag = malloc (sizeof (*frag));
-	if (frag == NULL)
-		abort ();
+	if (offset + 8 > total_len || offset > REASM_HDR_ROOM)
+		return false;  /* Fragment header extends past end of packet */
 
-	struct ip6_frag *frag_header = (struct ip6_frag *) (packet + offset);
-	offset += 8;
+	const struct ip6_frag *frag_header = (const struct ip6_frag *) (packet + offset);
 
 	/*
-	 * The Fragment header will be removed on reassembly, so we have to
-	 * replace the Next Header field of the previous header (which is
-	 * currently IPPROTO_FRAGMENT), with the Next Header field of the
-	 * Fragment header.
-	 *
-	 * XXX We really shouldn't manipulate the input packet in-place.
+	 * The Fragment header will be removed on reassembly, so the Next
+	 * Header field of the previous header (which is currently
+	 * IPPROTO_FRAGMENT) gets the Next Header field of the Fragment
+	 * header. That is done on the copy, the input stays as it is.
 	 */
-	packet[last_nxt] = frag_header->ip6f_nxt;
-
-	*frag = (struct reasm_frag_entry) {
-		.len = total_len - offset,
-		.data_offset = offset,
+	*frag = (struct reasm_frag_info) {
+		.len = total_len - offset - 8,
 		.offset = ntohs (frag_header->ip6f_offlg & IP6F_OFF_MASK),
-		.data = packet,
+		.hdr_len = offset,
+		.data_offset = offset + 8,
+		.nxt_offset = last_nxt,
+		.nxt = frag_header->ip6f_nxt,
+		.last_frag = (frag_header->ip6f_offlg & IP6F_MORE_FRAG) == 0,
 	};
 
 	*ip_id = ntohl (frag_header->ip6f_ident);
-	*last_frag = (frag_header->ip6f_offlg & IP6F_MORE_FRAG) == 0;
 
-	return frag;
+	return true;
 }
 #endif /* USE_IPv6 */
 
@@ -660,50 +1072,47 @@ reasm_id_equal (enum reasm_proto proto, const union reasm_id *left, const union
 }
 
 
-static struct reasm_frag_entry *
-parse_packet (unsigned char *packet, unsigned len, enum reasm_proto *protocol, union reasm_id *id, unsigned *hash, bool *last_frag)
+static bool
+parse_packet (const struct reasm_ip *reasm, const unsigned char *packet, unsigned len, struct reasm_frag_info *frag, enum reasm_proto *protocol, union reasm_id *id, unsigned *hash)
 {
-	struct ip *ip_header = (struct ip *) packet;
-	struct reasm_frag_entry *frag = NULL;
+	const struct ip *ip_header = (const struct ip *) packet;
+	bool is_frag = false;
 
 	switch (ip_header->ip_v) {
 		case 4: {
 			*protocol = PROTO_IPV4;
 			uint16_t offset = ntohs (ip_header->ip_off);
-			if (len >= ntohs (ip_header->ip_len) && (offset & (IP_MF | IP_OFFMASK)) != 0) {
-				frag = malloc (sizeof (*frag));
-				if (frag == NULL)
-					abort ();
-
-				*frag = (struct reasm_frag_entry) {
+			if (len >= ntohs (ip_header->ip_len) && ntohs (ip_header->ip_len) >= ip_header->ip_hl * 4 && (offset & (IP_MF | IP_OFFMASK)) != 0) {
+				*frag = (struct reasm_frag_info) {
 					.len = ntohs (ip_header->ip_len) - ip_header->ip_hl * 4,
 					.offset = (offset & IP_OFFMASK) * 8,
+					.hdr_len = ip_header->ip_hl * 4,
 					.data_offset = ip_header->ip_hl * 4,
-					.data = packet,
+					.nxt = ip_header->ip_p,
+					.last_frag = (offset & IP_MF) == 0,
 				};
 
-				*last_frag = (offset & IP_MF) == 0;
-
 				memcpy (id->ipv4.ip_src, &ip_header->ip_src, 4);
 				memcpy (id->ipv4.ip_dst, &ip_header->ip_dst, 4);
 				id->ipv4.ip_id = ntohs (ip_header->ip_id);
 				id->ipv4.ip_proto = ip_header->ip_p;
 
-				*hash = reasm_ipv4_hash (&id->ipv4);
+				*hash = reasm_ipv4_hash (reasm->key, &id->ipv4);
+				is_frag = true;
 			}
 			break;
 		}
 
 #if USE_IPv6
 		case 6: {
-			struct ip6_hdr *ip6_header = (struct ip6_hdr *) packet;
+			const struct ip6_hdr *ip6_header = (const struct ip6_hdr *) packet;
 			*protocol = PROTO_IPV6;
 			if (len >= ntohs (ip6_header->ip6_plen) + 40)
-				frag = frag_from_ipv6 (packet, &id->ipv6.ip_id, last_frag);
-			if (frag != NULL) {
+				is_frag = frag_from_ipv6 (packet, frag, &id->ipv6.ip_id);
+			if (is_frag) {
 				memcpy (id->ipv6.ip_src, &ip6_header->ip6_src, 16);
 				memcpy (id->ipv6.ip_dst, &ip6_header->ip6_dst, 16);
-				*hash = reasm_ipv6_hash (&id->ipv6);
+				*hash = reasm_ipv6_hash (reasm->key, &id->ipv6);
 			}
 			break;
 		}
@@ -713,5 +1122,5 @@ parse_packet (unsigned char *packet, unsigned len, enum reasm_proto *protocol, u
 			break;
 	}
 
-	return frag;
+	return is_frag;
 }
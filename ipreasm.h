@@ -30,12 +30,10 @@ void reasm_ip_free (struct reasm_ip *reasm);
  * If more fragments are required for reassembly, or the input packet
  * is invalid for some reason, a NULL pointer is returned.
  *
- * The input must be a pointer allocated by malloc(). The output will
- * be a pointer allocated by malloc().
- *
- * Note that in the case of an IPv6 fragment, the input buffer will be
- * modified in-place. This is considered a bug and should be fixed in
- * the future.
+ * The input is left untouched and stays owned by the caller; a packet
+ * that is not a fragment is returned as is. A reassembled packet lives
+ * in a buffer of ipreasm, which stays valid until the next call to
+ * reasm_ip_next() or reasm_ip_free().
  */
 unsigned char *reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, unsigned len, reasm_time_t timestamp, unsigned *output_len);
 
@@ -45,6 +43,14 @@ unsigned char *reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, uns
  */
 bool reasm_ip_set_timeout (struct reasm_ip *reasm, reasm_time_t timeout);
 
+/*
+ * Limit the number of reassemblies in flight and the bytes their
+ * fragments take. When a limit is reached, the oldest reassemblies are
+ * evicted and their fragments counted as dropped. Bytes are counted in
+ * reassembly buffers, which are sized to the whole datagram.
+ */
+void reasm_ip_set_limits (struct reasm_ip *reasm, unsigned max_entries, unsigned max_bytes);
+
 /*
  * Query certain information about the current state.
  */
@@ -52,6 +58,8 @@ unsigned reasm_ip_waiting (const struct reasm_ip *reasm);
 unsigned reasm_ip_max_waiting (const struct reasm_ip *reasm);
 unsigned reasm_ip_timed_out (const struct reasm_ip *reasm);
 unsigned reasm_ip_dropped_frags (const struct reasm_ip *reasm);
+unsigned reasm_ip_evicted (const struct reasm_ip *reasm);
+unsigned reasm_ip_bytes (const struct reasm_ip *reasm);
 
 
 #endif /* _IPREASM_H */
@@ -0,0 +1,286 @@
+/*
+ * jsonout -- SIP messages as JSON Lines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "jsonout.h"
+
+
+/* room for everything but the strings, which are checked as they go */
+#define JSONOUT_FIXED 512
+
+
+static char *buf = NULL;
+static size_t size = 0, used = 0;
+static int with_raw = 0, failed = 0;
+
+/*
+ * What a byte takes in a string: 0 copied as is, 1 escaped, 2 the start
+ * of a UTF-8 sequence, to be checked.
+ */
+static unsigned char byte_class[256];
+
+
+static int reserve (size_t n);
+static void put (const char *s, size_t n);
+static void put_uint (unsigned long n);
+static void put_string (const char *key, const char *s, size_t n);
+static size_t utf8_length (const unsigned char *s, size_t n);
+
+
+void
+jsonout_init (int raw)
+{
+	int i;
+
+	with_raw = raw;
+
+	for (i = 0; i < 256; i++)
+		byte_class[i] = i < 0x20 || i == '"' || i == '\\' ? 1 : i >= 0x80 ? 2 : 0;
+}
+
+
+void
+jsonout_message (const struct timeval *ts, uint8_t proto, const char *src, uint16_t sport, const char *dst, uint16_t dport,
+		 const preparsed_sip_t *psip, const struct transact_info *tr, int duplicate,
+		 const unsigned char *msg, uint32_t len)
+{
+	char usec[7];
+	int i;
+	long u;
+
+	used = 0;
+	failed = 0;
+
+	if (reserve (JSONOUT_FIXED))
+		return;
+
+	put ("{\"ts\":", 6);
+	put_uint (ts->tv_sec);
+	usec[0] = '.';
+	for (u = ts->tv_usec, i = 6; i > 0; i--, u /= 10)
+		usec[i] = '0' + u % 10;
+	put (usec, 7);
+
+	switch (proto) {
+	case IPPROTO_UDP:
+		put (",\"proto\":\"udp\"", 14);
+		break;
+	case IPPROTO_TCP:
+		put (",\"proto\":\"tcp\"", 14);
+		break;
+	default:
+		put (",\"proto\":", 9);
+		put_uint (proto);
+		break;
+	}
+
+	put_string ("src", src, strlen (src));
+	put (",\"sport\":", 9);
+	put_uint (sport);
+	put_string ("dst", dst, strlen (dst));
+	put (",\"dport\":", 9);
+	put_uint (dport);
+
+	if (psip->is_method == SIP_REPLY) {
+		put (",\"status\":", 10);
+		put_uint (psip->reply);
+		put_string ("reason", psip->reason, strnlen (psip->reason, sizeof (psip->reason)));
+	}
+	else if (psip->method)
+		put_string ("method", psip->method, strlen (psip->method));
+
+	put (",\"cseq\":", 8);
+	put_uint (psip->cseq_num);
+	if (psip->cseq_method)
+		put_string ("cseq_method", psip->cseq_method, strlen (psip->cseq_method));
+
+	put_string ("callid", psip->callid.s, psip->callid.len);
+	put_string ("from", psip->from.s, psip->from.len);
+	put_string ("to", psip->to.s, psip->to.len);
+	if (psip->uac.len > 0)
+		put_string ("uac", psip->uac.s, psip->uac.len);
+
+	if (tr != NULL && tr->found) {
+		if (tr->retransmission)
+			put (",\"retransmission\":true", 22);
+		else
+			put (",\"retransmission\":false", 23);
+		if (tr->latency_us >= 0) {
+			put (",\"latency_us\":", 14);
+			put_uint (tr->latency_us);
+		}
+	}
+
+	if (duplicate > 0)
+		put (",\"duplicate\":true", 17);
+	else if (duplicate == 0)
+		put (",\"duplicate\":false", 18);
+
+	if (with_raw)
+		put_string ("raw", (const char *) msg, len);
+
+	put ("}\n", 2);
+
+	/* out of memory on the way, the message is left out */
+	if (!failed)
+		fwrite (buf, 1, used, stdout);
+}
+
+
+void
+jsonout_free (void)
+{
+	free (buf);
+	buf = NULL;
+	size = used = 0;
+}
+
+
+static int
+reserve (size_t n)
+{
+	char *b;
+	size_t s;
+
+	if (used + n <= size)
+		return 0;
+
+	for (s = size ? size : 4096; s < used + n; s *= 2)
+		;
+	if ((b = realloc (buf, s)) == NULL) {
+		failed = 1;
+		return -1;
+	}
+
+	buf = b;
+	size = s;
+	return 0;
+}
+
+
+/* there is room, reserved before */
+static void
+put (const char *s, size_t n)
+{
+	if (failed)
+		return;
+
+	memcpy (buf + used, s, n);
+	used += n;
+}
+
+
+static void
+put_uint (unsigned long n)
+{
+	char digits[24];
+	int i = sizeof (digits);
+
+	do
+		digits[--i] = '0' + n % 10;
+	while (n /= 10);
+
+	put (digits + i, sizeof (digits) - i);
+}
+
+
+static void
+put_string (const char *key, const char *s, size_t n)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *) s, *end = p + n, *run;
+	size_t k = strlen (key), seq;
+
+	/* at worst every byte takes six, \u00XX or \ufffd, and the fixed fields after */
+	if (failed || reserve (k + 6 + n * 6 + JSONOUT_FIXED))
+		return;
+
+	buf[used++] = ',';
+	buf[used++] = '"';
+	put (key, k);
+	put ("\":\"", 3);
+
+	while (p < end) {
+		/* the plain ASCII in between, at once */
+		for (run = p; p < end && byte_class[*p] == 0; p++)
+			;
+		put ((const char *) run, p - run);
+		if (p == end)
+			break;
+
+		if (byte_class[*p] == 2) {
+			if ((seq = utf8_length (p, end - p)) > 0) {
+				put ((const char *) p, seq);
+				p += seq;
+			}
+			else {
+				put ("\\ufffd", 6);
+				p++;
+			}
+			continue;
+		}
+
+		buf[used++] = '\\';
+		switch (*p) {
+		case '"':
+		case '\\':
+			buf[used++] = *p;
+			break;
+		case '\n':
+			buf[used++] = 'n';
+			break;
+		case '\r':
+			buf[used++] = 'r';
+			break;
+		case '\t':
+			buf[used++] = 't';
+			break;
+		default:
+			put ("u00", 3);
+			buf[used++] = hex[*p >> 4];
+			buf[used++] = hex[*p & 0xf];
+			break;
+		}
+		p++;
+	}
+
+	buf[used++] = '"';
+}
+
+
+/*
+ * Length of the well formed UTF-8 sequence at s, 0 if there is none.
+ */
+static size_t
+utf8_length (const unsigned char *s, size_t n)
+{
+	size_t len, i;
+
+	if (s[0] >= 0xc2 && s[0] <= 0xdf)
+		len = 2;
+	else if (s[0] >= 0xe0 && s[0] <= 0xef)
+		len = 3;
+	else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+		len = 4;
+	else
+		return 0;
+
+	if (n < len)
+		return 0;
+
+	for (i = 1; i < len; i++)
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+
+	/* overlong, surrogates, beyond U+10FFFF */
+	if ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] >= 0xa0) || (s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] >= 0x90))
+		return 0;
+
+	return len;
+}
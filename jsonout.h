@@ -0,0 +1,42 @@
+#ifndef _JSONOUT_H
+#define _JSONOUT_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "sipparse.h"
+#include "transact.h"
+
+
+/*
+ * One JSON object per SIP message, a line each (JSON Lines), to stdout:
+ *
+ *   {"ts":1400000000.123456,"proto":"udp","src":"10.0.0.1","sport":5060,
+ *    "dst":"10.0.0.2","dport":5060,"method":"INVITE","cseq":1,
+ *    "cseq_method":"INVITE","callid":"...","from":"...","to":"...",
+ *    "uac":"..."}
+ *
+ * with "status" and "reason" in place of "method" for replies, and
+ * "raw" with the whole message if asked for. With the transactions
+ * followed, "retransmission" and, for replies, "latency_us" since the
+ * request, for the messages of a known transaction, and with
+ * --dedup=flag "duplicate", whether the message is a copy of one seen
+ * before (duplicate -1 leaves it out). Strings are escaped, and bytes
+ * that are not UTF-8 are replaced, so any JSON parser takes them.
+ * Each record is put together in one buffer, kept from one message to
+ * the next, and handed to stdio at once.
+ */
+
+/*
+ * raw: whether the message itself goes in the record.
+ */
+void jsonout_init (int raw);
+
+void jsonout_message (const struct timeval *ts, uint8_t proto, const char *src, uint16_t sport, const char *dst, uint16_t dport,
+		      const preparsed_sip_t *psip, const struct transact_info *tr, int duplicate,
+		      const unsigned char *msg, uint32_t len);
+
+void jsonout_free (void);
+
+
+#endif /* _JSONOUT_H */
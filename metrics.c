@@ -0,0 +1,404 @@
+/*
+ * metrics -- OpenMetrics over HTTP.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <pcap.h>
+
+#include "metrics.h"
+
+
+/* how long the server sleeps between looking whether to stop, in ms */
+#define METRICS_POLL_MS 200
+
+/* how long a client has to send its request */
+#define METRICS_CLIENT_TIMEOUT 2
+
+#define METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+struct metrics_text {
+	char *buf;
+	size_t len, size;
+	bool failed; /* out of memory on the way */
+};
+
+
+static int listen_sock = -1;
+static char unix_path[sizeof (((struct sockaddr_un *) 0)->sun_path)];
+static pthread_t server_thread;
+static int stopping = 0;
+
+/* the snapshot being rendered, and the one scrapes get */
+static struct metrics_text *building = NULL;
+static struct metrics_text *published = NULL;
+
+
+static void *serve (void *arg);
+static void serve_client (int sock);
+static void send_all (int sock, const char *buf, size_t len);
+
+static void sample (const char *name, const char *value, va_list ap);
+static void append (const char *fmt, ...);
+static void append_escaped (const char *s);
+static void text_free (struct metrics_text *t);
+
+
+int
+metrics_start (const char *url, char *errbuf)
+{
+	struct addrinfo *ai, hints;
+	struct sockaddr_un sun;
+	char host[256], *port;
+	int on = 1;
+
+	if (!strncmp (url, "unix:", 5)) {
+		if (strlen (url + 5) == 0 || strlen (url + 5) >= sizeof (sun.sun_path)) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "metrics: bad unix socket path '%s'", url + 5);
+			return -1;
+		}
+
+		memset (&sun, 0, sizeof (sun));
+		sun.sun_family = AF_UNIX;
+		snprintf (sun.sun_path, sizeof (sun.sun_path), "%s", url + 5);
+
+		/* left behind by an earlier run */
+		unlink (sun.sun_path);
+
+		if ((listen_sock = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 || bind (listen_sock, (struct sockaddr *) &sun, sizeof (sun)) != 0) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "metrics: %s: %s", sun.sun_path, strerror (errno));
+			goto fail;
+		}
+		snprintf (unix_path, sizeof (unix_path), "%s", sun.sun_path);
+	}
+	else if (!strncmp (url, "tcp:", 4)) {
+		snprintf (host, sizeof (host), "%s", url + 4);
+		if ((port = strrchr (host, ':')) == NULL) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "metrics: no port in '%s'", url);
+			return -1;
+		}
+		*port++ = '\0';
+
+		memset (&hints, 0, sizeof (hints));
+		hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		if (getaddrinfo (*host ? host : NULL, port, &hints, &ai) != 0) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "metrics: unable to resolve '%s'", url);
+			return -1;
+		}
+
+		if ((listen_sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "metrics: %s", strerror (errno));
+			freeaddrinfo (ai);
+			goto fail;
+		}
+		setsockopt (listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+		if (bind (listen_sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "metrics: bind to '%s' failed: %s", url, strerror (errno));
+			freeaddrinfo (ai);
+			goto fail;
+		}
+		freeaddrinfo (ai);
+	}
+	else {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "metrics: '%s' is neither tcp:[address]:port nor unix:path", url);
+		return -1;
+	}
+
+	if (listen (listen_sock, 16) != 0) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "metrics: listen failed: %s", strerror (errno));
+		goto fail;
+	}
+
+	if (pthread_create (&server_thread, NULL, serve, NULL) != 0) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "metrics: unable to start the server thread");
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (listen_sock >= 0)
+		close (listen_sock);
+	listen_sock = -1;
+	return -1;
+}
+
+
+void
+metrics_stop (void)
+{
+	if (listen_sock < 0)
+		return;
+
+	__atomic_store_n (&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join (server_thread, NULL);
+
+	close (listen_sock);
+	listen_sock = -1;
+
+	if (*unix_path)
+		unlink (unix_path);
+
+	text_free (__atomic_exchange_n (&published, NULL, __ATOMIC_ACQ_REL));
+	text_free (building);
+	building = NULL;
+}
+
+
+void
+metrics_begin (void)
+{
+	text_free (building);
+
+	if ((building = calloc (1, sizeof (*building))) == NULL)
+		return;
+
+	building->size = 16384;
+	if ((building->buf = malloc (building->size)) == NULL)
+		building->failed = true;
+}
+
+
+void
+metrics_family (const char *name, const char *type, const char *help)
+{
+	append ("# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+
+void
+metrics_sample (const char *name, unsigned long long value, ...)
+{
+	char text[32];
+	va_list ap;
+
+	snprintf (text, sizeof (text), "%llu", value);
+	va_start (ap, value);
+	sample (name, text, ap);
+	va_end (ap);
+}
+
+
+void
+metrics_sample_double (const char *name, double value, ...)
+{
+	char text[32];
+	va_list ap;
+
+	snprintf (text, sizeof (text), "%.6f", value);
+	va_start (ap, value);
+	sample (name, text, ap);
+	va_end (ap);
+}
+
+
+void
+metrics_publish (void)
+{
+	struct metrics_text *t;
+
+	append ("# EOF\n");
+
+	t = building;
+	building = NULL;
+	if (t == NULL)
+		return;
+
+	if (t->failed) {
+		text_free (t);
+		return;
+	}
+
+	/* whatever was there had not been scraped, or is being sent now */
+	text_free (__atomic_exchange_n (&published, t, __ATOMIC_ACQ_REL));
+}
+
+
+static void *
+serve (void *arg)
+{
+	struct pollfd pfd;
+	int sock;
+
+	pfd.fd = listen_sock;
+	pfd.events = POLLIN;
+
+	while (!__atomic_load_n (&stopping, __ATOMIC_ACQUIRE)) {
+		if (poll (&pfd, 1, METRICS_POLL_MS) <= 0)
+			continue;
+
+		if ((sock = accept (listen_sock, NULL, NULL)) < 0)
+			continue;
+
+		serve_client (sock);
+		close (sock);
+	}
+
+	return NULL;
+}
+
+
+static void
+serve_client (int sock)
+{
+	struct metrics_text *t;
+	struct timeval tv = { METRICS_CLIENT_TIMEOUT, 0 };
+	char req[2048], hdr[256];
+	size_t got = 0;
+	ssize_t n;
+	int len;
+
+	setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+	/* the request line and headers, the rest is of no interest */
+	while (got < sizeof (req) - 1) {
+		if ((n = recv (sock, req + got, sizeof (req) - 1 - got, 0)) <= 0)
+			return;
+		got += n;
+		req[got] = '\0';
+		if (strstr (req, "\r\n\r\n") || strstr (req, "\n\n"))
+			break;
+	}
+
+	if (strncmp (req, "GET /metrics ", 13) && strncmp (req, "GET / ", 6)) {
+		len = snprintf (hdr, sizeof (hdr), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\n\r\nnot found\n");
+		send_all (sock, hdr, len);
+		return;
+	}
+
+	/* taken while it is sent, so the capture thread won't free it */
+	if ((t = __atomic_exchange_n (&published, NULL, __ATOMIC_ACQ_REL)) == NULL) {
+		len = snprintf (hdr, sizeof (hdr), "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/plain\r\nContent-Length: 10\r\n\r\nnot ready\n");
+		send_all (sock, hdr, len);
+		return;
+	}
+
+	len = snprintf (hdr, sizeof (hdr), "HTTP/1.0 200 OK\r\nContent-Type: " METRICS_CONTENT_TYPE "\r\nContent-Length: %lu\r\n\r\n",
+			(unsigned long) t->len);
+	send_all (sock, hdr, len);
+	send_all (sock, t->buf, t->len);
+
+	/* back, unless a newer one was published meanwhile */
+	{
+		struct metrics_text *none = NULL;
+
+		if (!__atomic_compare_exchange_n (&published, &none, t, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			text_free (t);
+	}
+}
+
+
+static void
+send_all (int sock, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = send (sock, buf, len, MSG_NOSIGNAL)) <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+
+static void
+sample (const char *name, const char *value, va_list ap)
+{
+	const char *label, *sep = "{";
+
+	append ("%s", name);
+
+	while ((label = va_arg (ap, const char *)) != NULL) {
+		append ("%s%s=\"", sep, label);
+		append_escaped (va_arg (ap, const char *));
+		append ("\"");
+		sep = ",";
+	}
+
+	append ("%s %s\n", *sep == ',' ? "}" : "", value);
+}
+
+
+static void
+append (const char *fmt, ...)
+{
+	struct metrics_text *t = building;
+	va_list ap;
+	int n;
+	char *buf;
+
+	if (t == NULL || t->failed)
+		return;
+
+	for (;;) {
+		va_start (ap, fmt);
+		n = vsnprintf (t->buf + t->len, t->size - t->len, fmt, ap);
+		va_end (ap);
+
+		if (n < 0) {
+			t->failed = true;
+			return;
+		}
+		if ((size_t) n < t->size - t->len)
+			break;
+
+		if ((buf = realloc (t->buf, t->size * 2)) == NULL) {
+			t->failed = true;
+			return;
+		}
+		t->buf = buf;
+		t->size *= 2;
+	}
+
+	t->len += n;
+}
+
+
+static void
+append_escaped (const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"')
+			append ("\\%c", *s);
+		else if (*s == '\n')
+			append ("\\n");
+		else
+			append ("%c", *s);
+	}
+}
+
+
+static void
+text_free (struct metrics_text *t)
+{
+	if (t == NULL)
+		return;
+
+	free (t->buf);
+	free (t);
+}
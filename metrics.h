@@ -0,0 +1,36 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+
+/*
+ * OpenMetrics over HTTP, on a TCP port or a unix socket, served by a
+ * thread of its own. The capture thread renders the text of all metrics
+ * into a new snapshot now and then, and publishes it by swapping one
+ * pointer; a scrape sends the snapshot last published, so it never waits
+ * for the capture thread, nor the capture thread for it.
+ */
+
+/*
+ * Listen on url, tcp:[address]:port or unix:path, and start serving.
+ * Returns 0, or -1 with a message in errbuf (PCAP_ERRBUF_SIZE).
+ */
+int metrics_start (const char *url, char *errbuf);
+
+/*
+ * Stop serving, and remove the unix socket.
+ */
+void metrics_stop (void);
+
+/*
+ * Render a snapshot: begin, a family header before its samples, then
+ * publish. A sample is name, value, then label name and value pairs up
+ * to a NULL; label values are escaped. Only on the capture thread.
+ */
+void metrics_begin (void);
+void metrics_family (const char *name, const char *type, const char *help);
+void metrics_sample (const char *name, unsigned long long value, ...);
+void metrics_sample_double (const char *name, double value, ...);
+void metrics_publish (void);
+
+
+#endif /* _METRICS_H */
@@ -0,0 +1,252 @@
+/*
+ * mpscring -- lock-free multi producer, single consumer byte ring.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpscring.h"
+
+
+#define MPSC_MIN_SIZE 4096UL
+#define MPSC_ALIGN(x) (((x) + 15UL) & ~15UL)
+
+
+/*
+ * Every record starts with this header. A record is complete when its
+ * commit field holds its own ring position plus one; a stale header
+ * left over from a previous lap can never match. Padding records fill
+ * the space at the end of the buffer when a record does not fit there.
+ */
+struct mpsc_rec {
+	uint64_t commit;
+	uint32_t len;  /* total length, header and alignment included */
+	uint32_t data_len; /* 0 for padding */
+};
+
+
+/*
+ * head and tail are free running byte positions. Producers reserve
+ * space by moving head; the consumer releases it by moving tail. With
+ * MPSC_DROP_OLDEST producers may move tail as well, so the consumer
+ * only trusts a record it has copied out if its own move of tail over
+ * that record succeeded.
+ */
+struct mpsc_ring {
+	unsigned char *buf;
+	unsigned long size, mask;
+	enum mpsc_policy policy;
+	uint64_t head __attribute__ ((aligned (64)));
+	uint64_t tail __attribute__ ((aligned (64)));
+	unsigned long pushed, dropped_newest, dropped_oldest, dropped_too_big, max_used;
+};
+
+
+/*
+ * Discard the committed record at position t to make room. Returns
+ * false if that record is still being written.
+ */
+static bool drop_oldest (struct mpsc_ring *ring, uint64_t t);
+
+
+struct mpsc_ring *
+mpsc_ring_new (unsigned long size, enum mpsc_policy policy)
+{
+	unsigned long real_size = MPSC_MIN_SIZE;
+
+	while (real_size < size)
+		real_size <<= 1;
+
+	struct mpsc_ring *ring = malloc (sizeof (*ring));
+	if (ring == NULL)
+		return NULL;
+
+	memset (ring, 0, sizeof (*ring));
+
+	ring->buf = malloc (real_size);
+	if (ring->buf == NULL) {
+		free (ring);
+		return NULL;
+	}
+
+	/* no header may accidentally look committed for position 0 */
+	memset (ring->buf, 0xff, real_size);
+
+	ring->size = real_size;
+	ring->mask = real_size - 1;
+	ring->policy = policy;
+	return ring;
+}
+
+
+void
+mpsc_ring_free (struct mpsc_ring *ring)
+{
+	free (ring->buf);
+	free (ring);
+}
+
+
+bool
+mpsc_ring_push (struct mpsc_ring *ring, const void *hdr, unsigned hdr_len, const void *data, unsigned data_len)
+{
+	unsigned long need = MPSC_ALIGN (sizeof (struct mpsc_rec) + hdr_len + data_len);
+	unsigned long off, pad, used;
+	uint64_t h, t, pos;
+	struct mpsc_rec *rec;
+
+	if (need > ring->size / 2) {
+		__atomic_add_fetch (&ring->dropped_newest, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	for (;;) {
+		h = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+		t = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+
+		off = h & ring->mask;
+		pad = (off + need > ring->size) ? ring->size - off : 0;
+
+		if (h + pad + need - t > ring->size) {
+			if (ring->policy == MPSC_DROP_OLDEST && drop_oldest (ring, t))
+				continue;
+
+			__atomic_add_fetch (&ring->dropped_newest, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+
+		if (__atomic_compare_exchange_n (&ring->head, &h, h + pad + need, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (pad) {
+		rec = (struct mpsc_rec *) (ring->buf + off);
+		rec->len = pad;
+		rec->data_len = 0;
+		__atomic_store_n (&rec->commit, h + 1, __ATOMIC_RELEASE);
+	}
+
+	pos = h + pad;
+	rec = (struct mpsc_rec *) (ring->buf + (pos & ring->mask));
+	rec->len = need;
+	rec->data_len = hdr_len + data_len;
+	memcpy ((unsigned char *) (rec + 1), hdr, hdr_len);
+	memcpy ((unsigned char *) (rec + 1) + hdr_len, data, data_len);
+	__atomic_store_n (&rec->commit, pos + 1, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch (&ring->pushed, 1, __ATOMIC_RELAXED);
+
+	/* gauge only, a lost update does no harm */
+	used = pos + need - t;
+	if (used > ring->max_used)
+		ring->max_used = used;
+
+	return true;
+}
+
+
+static bool
+drop_oldest (struct mpsc_ring *ring, uint64_t t)
+{
+	struct mpsc_rec *rec = (struct mpsc_rec *) (ring->buf + (t & ring->mask));
+
+	if (__atomic_load_n (&rec->commit, __ATOMIC_ACQUIRE) != t + 1)
+		return false;
+
+	uint32_t len = rec->len, data_len = rec->data_len;
+	if (len < sizeof (*rec) || len > ring->size)
+		return false;
+
+	if (__atomic_compare_exchange_n (&ring->tail, &t, t + len, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) && data_len != 0)
+		__atomic_add_fetch (&ring->dropped_oldest, 1, __ATOMIC_RELAXED);
+
+	/* if someone else moved tail first, space was freed all the same */
+	return true;
+}
+
+
+unsigned
+mpsc_ring_pop (struct mpsc_ring *ring, void *buf, unsigned buf_len)
+{
+	struct mpsc_rec *rec;
+	uint64_t t;
+	uint32_t len, data_len;
+
+	for (;;) {
+		t = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+		if (t == __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE))
+			return 0;
+
+		rec = (struct mpsc_rec *) (ring->buf + (t & ring->mask));
+		if (__atomic_load_n (&rec->commit, __ATOMIC_ACQUIRE) != t + 1)
+			return 0; /* still being written */
+
+		len = rec->len;
+		data_len = rec->data_len;
+
+		/* a producer may be overwriting it already, stay in bounds */
+		if (len < sizeof (*rec) || (t & ring->mask) + len > ring->size || data_len > len - sizeof (*rec))
+			continue;
+
+		if (data_len != 0 && data_len <= buf_len)
+			memcpy (buf, rec + 1, data_len);
+
+		if (!__atomic_compare_exchange_n (&ring->tail, &t, t + len, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue; /* dropped under us by a producer */
+
+		if (data_len != 0 && data_len <= buf_len)
+			return data_len;
+
+		if (data_len > buf_len)
+			__atomic_add_fetch (&ring->dropped_too_big, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+unsigned long
+mpsc_ring_size (const struct mpsc_ring *ring)
+{
+	return ring->size;
+}
+
+
+unsigned long
+mpsc_ring_used (const struct mpsc_ring *ring)
+{
+	return __atomic_load_n (&ring->head, __ATOMIC_RELAXED) - __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+}
+
+
+unsigned long
+mpsc_ring_max_used (const struct mpsc_ring *ring)
+{
+	return ring->max_used;
+}
+
+
+unsigned long
+mpsc_ring_pushed (const struct mpsc_ring *ring)
+{
+	return __atomic_load_n (&ring->pushed, __ATOMIC_RELAXED);
+}
+
+
+unsigned long
+mpsc_ring_dropped_newest (const struct mpsc_ring *ring)
+{
+	return __atomic_load_n (&ring->dropped_newest, __ATOMIC_RELAXED);
+}
+
+
+unsigned long
+mpsc_ring_dropped_oldest (const struct mpsc_ring *ring)
+{
+	return __atomic_load_n (&ring->dropped_oldest, __ATOMIC_RELAXED);
+}
+
+
+unsigned long
+mpsc_ring_dropped_too_big (const struct mpsc_ring *ring)
+{
+	return __atomic_load_n (&ring->dropped_too_big, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,54 @@
+#ifndef _MPSCRING_H
+#define _MPSCRING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Lock-free ring of variable sized records with many producers and a
+ * single consumer. The capacity is given in bytes. When a record does
+ * not fit, either the new record is dropped, or the oldest records are
+ * discarded to make room for it.
+ */
+enum mpsc_policy {
+	MPSC_DROP_NEWEST,
+	MPSC_DROP_OLDEST,
+};
+
+struct mpsc_ring;
+
+/*
+ * Functions to create and destroy a ring. The size is rounded up to
+ * the next power of two.
+ */
+struct mpsc_ring *mpsc_ring_new (unsigned long size, enum mpsc_policy policy);
+void mpsc_ring_free (struct mpsc_ring *ring);
+
+/*
+ * Append one record made of hdr followed by data. May be called from
+ * any number of threads. Returns false if the record was dropped.
+ */
+bool mpsc_ring_push (struct mpsc_ring *ring, const void *hdr, unsigned hdr_len, const void *data, unsigned data_len);
+
+/*
+ * Copy the oldest record into buf and remove it from the ring. Must
+ * only be called from the consumer thread. Returns the record length,
+ * or 0 if no complete record is available. Records longer than buf_len
+ * are removed and counted as dropped too big.
+ */
+unsigned mpsc_ring_pop (struct mpsc_ring *ring, void *buf, unsigned buf_len);
+
+/*
+ * Query certain information about the current state.
+ */
+unsigned long mpsc_ring_size (const struct mpsc_ring *ring);
+unsigned long mpsc_ring_used (const struct mpsc_ring *ring);
+unsigned long mpsc_ring_max_used (const struct mpsc_ring *ring);
+unsigned long mpsc_ring_pushed (const struct mpsc_ring *ring);
+unsigned long mpsc_ring_dropped_newest (const struct mpsc_ring *ring);
+unsigned long mpsc_ring_dropped_oldest (const struct mpsc_ring *ring);
+unsigned long mpsc_ring_dropped_too_big (const struct mpsc_ring *ring);
+
+
+#endif /* _MPSCRING_H */
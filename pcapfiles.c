@@ -0,0 +1,670 @@
+/*
+ * pcapfiles -- read many capture files in parallel, merged by time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "callidx.h"
+#include "pcapfiles.h"
+#include "pcapmmap.h"
+
+
+/* packets travel from a reader to the merge in chunks of this size */
+#define PCAPFILES_CHUNK (256U * 1024U)
+
+/* chunks one file may have waiting for the merge */
+#define PCAPFILES_CHUNKS 4
+
+#define PCAPFILES_ALIGN(x) (((x) + 7UL) & ~7UL)
+
+
+/*
+ * Packets one after another, each a struct pcap_pkthdr followed by the
+ * captured bytes, padded to 8 bytes.
+ */
+struct pcapfiles_chunk {
+	struct pcapfiles_chunk *next;
+	unsigned long len, size;
+	unsigned char data[];
+};
+
+
+/*
+ * An open file: mapped and read in place when possible, read through
+ * libpcap otherwise.
+ */
+struct pcapfiles_source {
+	struct pcap_mmap *pm;
+	pcap_t *pd;
+	struct pcap_pkthdr hdr;
+};
+
+
+enum file_state {
+	FILE_IDLE,
+	FILE_READER, /* a reader thread fills its chunks */
+	FILE_MERGE, /* the merge reads it itself */
+};
+
+
+/*
+ * A file, and where the merge is in it. Everything a reader touches
+ * after it has claimed the file is protected by the lock.
+ */
+struct pcapfiles_file {
+	char *name;
+	unsigned index, added;
+	struct timeval first;
+	enum file_state state;
+	struct pcapfiles_source *src; /* FILE_MERGE only */
+	struct pcapfiles_chunk *head, *tail;
+	unsigned chunks;
+	bool eof;
+	struct pcapfiles_chunk *cur;
+	unsigned long off;
+	struct pcap_pkthdr *hdr; /* next packet in timestamp order */
+	const u_char *data;
+};
+
+
+static struct pcapfiles_file *files = NULL;
+static unsigned files_count = 0, files_size = 0;
+static const struct bpf_program *files_filter = NULL;
+
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t files_more = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t files_room = PTHREAD_COND_INITIALIZER;
+static pthread_t *readers = NULL;
+static unsigned readers_count = 0, next_idle = 0;
+static bool stop = false;
+
+
+/*
+ * Append one file to the list.
+ */
+static int add_file (const char *name);
+
+/*
+ * Claim the next file nobody reads yet, NULL if there is none left.
+ */
+static struct pcapfiles_file *claim_file (void);
+
+/*
+ * Reader threads: read whole files into chunks.
+ */
+static void *reader_loop (void *arg);
+static void read_file (struct pcapfiles_file *f);
+static bool push_chunk (struct pcapfiles_file *f, struct pcapfiles_chunk *chunk);
+
+/*
+ * Open, read and close a file whichever way it can be read.
+ */
+static struct pcapfiles_source *source_open (const char *name, char *errbuf);
+static bool source_next (struct pcapfiles_source *src, struct pcap_pkthdr **h, const u_char **d);
+static int source_datalink (struct pcapfiles_source *src);
+static void source_close (struct pcapfiles_source *src);
+
+/*
+ * Move a file on to its next packet. Returns false at its end.
+ */
+static bool next_packet (struct pcapfiles_file *f);
+
+/*
+ * Order of the merge: by timestamp, then by file.
+ */
+static bool earlier (const struct timeval *a, unsigned a_index, const struct timeval *b, unsigned b_index);
+static void heap_down (struct pcapfiles_file **heap, unsigned n, unsigned i);
+static void heap_up (struct pcapfiles_file **heap, unsigned i);
+
+static int compare_first (const void *a, const void *b);
+static int compare_names (const void *a, const void *b);
+
+/*
+ * Query whether a file is the Call-ID index of another (see callidx.h),
+ * which is left out where files are picked by directory or glob.
+ */
+static bool is_index (const char *name);
+
+
+int
+pcapfiles_add (const char *path)
+{
+	struct stat st;
+	int added = 0;
+
+	if (stat (path, &st) == 0 && S_ISDIR (st.st_mode)) {
+		DIR *dir = opendir (path);
+		struct dirent *de;
+		char **names = NULL, **tmp;
+		unsigned n = 0, i;
+
+		if (dir == NULL)
+			return -1;
+
+		while ((de = readdir (dir)) != NULL) {
+			char name[4096];
+
+			if (de->d_name[0] == '.')
+				continue;
+
+			snprintf (name, sizeof (name), "%s/%s", path, de->d_name);
+			if (stat (name, &st) != 0 || !S_ISREG (st.st_mode) || is_index (name))
+				continue;
+
+			tmp = realloc (names, (n + 1) * sizeof (*names));
+			if (tmp == NULL)
+				break;
+			names = tmp;
+			names[n++] = strdup (name);
+		}
+		closedir (dir);
+
+		qsort (names, n, sizeof (*names), compare_names);
+		for (i = 0; i < n; i++) {
+			if (names[i] != NULL && add_file (names[i]) == 0)
+				added++;
+			free (names[i]);
+		}
+		free (names);
+	}
+	else if (strpbrk (path, "*?[") != NULL) {
+		glob_t g;
+		size_t i;
+
+		if (glob (path, 0, NULL, &g) != 0)
+			return -1;
+
+		for (i = 0; i < g.gl_pathc; i++)
+			if (!is_index (g.gl_pathv[i]) && add_file (g.gl_pathv[i]) == 0)
+				added++;
+		globfree (&g);
+	}
+	else if (add_file (path) == 0)
+		added++;
+
+	return added ? added : -1;
+}
+
+
+static int
+add_file (const char *name)
+{
+	if (files_count == files_size) {
+		unsigned size = files_size ? files_size * 2 : 16;
+		struct pcapfiles_file *tmp = realloc (files, size * sizeof (*files));
+		if (tmp == NULL)
+			return -1;
+		files = tmp;
+		files_size = size;
+	}
+
+	memset (&files[files_count], 0, sizeof (*files));
+	files[files_count].name = strdup (name);
+	if (files[files_count].name == NULL)
+		return -1;
+	files[files_count].added = files_count;
+	files_count++;
+
+	return 0;
+}
+
+
+int
+pcapfiles_prepare (char *errbuf)
+{
+	unsigned i, n = 0;
+	int linktype = -1;
+
+	for (i = 0; i < files_count; i++) {
+		struct pcapfiles_file *f = &files[i];
+		struct pcap_pkthdr *h;
+		const u_char *d;
+		struct pcapfiles_source *src;
+
+		if ((src = source_open (f->name, errbuf)) == NULL) {
+			fprintf (stderr, "skipping %s: %s\n", f->name, errbuf);
+			free (f->name);
+			continue;
+		}
+
+		if (linktype < 0)
+			linktype = source_datalink (src);
+
+		if (source_datalink (src) != linktype) {
+			fprintf (stderr, "skipping %s: link type %d, not %d\n", f->name, source_datalink (src), linktype);
+			free (f->name);
+		}
+		else if (!source_next (src, &h, &d)) {
+			/* nothing in it */
+			free (f->name);
+		}
+		else {
+			f->first = h->ts;
+			files[n++] = *f;
+		}
+
+		source_close (src);
+	}
+
+	files_count = n;
+	qsort (files, files_count, sizeof (*files), compare_first);
+
+	for (i = 0; i < files_count; i++)
+		files[i].index = i;
+
+	return files_count;
+}
+
+
+int
+pcapfiles_count (void)
+{
+	return files_count;
+}
+
+
+const char *
+pcapfiles_name (int i)
+{
+	return files[i].name;
+}
+
+
+int
+pcapfiles_loop (unsigned threads, const struct bpf_program *filter, pcap_handler callback, u_char *user)
+{
+	struct pcapfiles_file **heap, *f;
+	unsigned n = 0, next = 0, i;
+
+	heap = malloc ((files_count + 1) * sizeof (*heap));
+	if (heap == NULL)
+		return -1;
+
+	files_filter = filter;
+	stop = false;
+	next_idle = 0;
+
+	/* with one thread everything is read right here */
+	if (threads > files_count)
+		threads = files_count;
+	if (threads > 1) {
+		readers = calloc (threads, sizeof (*readers));
+		if (readers == NULL) {
+			free (heap);
+			return -1;
+		}
+
+		for (i = 0; i < threads; i++) {
+			if (pthread_create (&readers[i], NULL, reader_loop, NULL) != 0)
+				break;
+			readers_count++;
+		}
+	}
+
+	for (;;) {
+		/* a file joins once the merge has come up to its first packet */
+		while (next < files_count && (n == 0 || !earlier (&heap[0]->hdr->ts, heap[0]->index, &files[next].first, next))) {
+			f = &files[next++];
+
+			pthread_mutex_lock (&files_lock);
+			if (f->state == FILE_IDLE)
+				f->state = FILE_MERGE;
+			pthread_mutex_unlock (&files_lock);
+
+			if (next_packet (f)) {
+				heap[n] = f;
+				heap_up (heap, n++);
+			}
+		}
+
+		if (n == 0)
+			break;
+
+		f = heap[0];
+		callback (user, f->hdr, f->data);
+
+		if (!next_packet (f))
+			heap[0] = heap[--n];
+		heap_down (heap, n, 0);
+	}
+
+	free (heap);
+	pcapfiles_close ();
+
+	return 0;
+}
+
+
+void
+pcapfiles_close (void)
+{
+	struct pcapfiles_chunk *chunk, *next;
+	unsigned i;
+
+	pthread_mutex_lock (&files_lock);
+	stop = true;
+	pthread_cond_broadcast (&files_room);
+	pthread_mutex_unlock (&files_lock);
+
+	for (i = 0; i < readers_count; i++)
+		pthread_join (readers[i], NULL);
+	free (readers);
+	readers = NULL;
+	readers_count = 0;
+
+	for (i = 0; i < files_count; i++) {
+		for (chunk = files[i].head; chunk != NULL; chunk = next) {
+			next = chunk->next;
+			free (chunk);
+		}
+		free (files[i].cur);
+		if (files[i].src != NULL)
+			source_close (files[i].src);
+		free (files[i].name);
+	}
+
+	free (files);
+	files = NULL;
+	files_count = files_size = 0;
+}
+
+
+static struct pcapfiles_file *
+claim_file (void)
+{
+	struct pcapfiles_file *f = NULL;
+
+	pthread_mutex_lock (&files_lock);
+	while (!stop && next_idle < files_count && files[next_idle].state != FILE_IDLE)
+		next_idle++;
+	if (!stop && next_idle < files_count) {
+		f = &files[next_idle++];
+		f->state = FILE_READER;
+	}
+	pthread_mutex_unlock (&files_lock);
+
+	return f;
+}
+
+
+static void *
+reader_loop (void *arg)
+{
+	struct pcapfiles_file *f;
+
+	while ((f = claim_file ()) != NULL)
+		read_file (f);
+
+	return NULL;
+}
+
+
+static void
+read_file (struct pcapfiles_file *f)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct pcapfiles_chunk *chunk = NULL;
+	struct pcap_pkthdr *h;
+	const u_char *d;
+	unsigned long need;
+	struct pcapfiles_source *src;
+
+	src = source_open (f->name, errbuf);
+
+	while (src != NULL && source_next (src, &h, &d)) {
+
+		if (files_filter != NULL && !pcap_offline_filter (files_filter, h, d))
+			continue;
+
+		need = PCAPFILES_ALIGN (sizeof (*h) + h->caplen);
+
+		if (chunk != NULL && chunk->len + need > chunk->size) {
+			if (!push_chunk (f, chunk)) {
+				chunk = NULL;
+				break;
+			}
+			chunk = NULL;
+		}
+
+		if (chunk == NULL) {
+			unsigned long size = need > PCAPFILES_CHUNK ? need : PCAPFILES_CHUNK;
+			if ((chunk = malloc (sizeof (*chunk) + size)) == NULL)
+				break;
+			chunk->next = NULL;
+			chunk->len = 0;
+			chunk->size = size;
+		}
+
+		memcpy (chunk->data + chunk->len, h, sizeof (*h));
+		memcpy (chunk->data + chunk->len + sizeof (*h), d, h->caplen);
+		chunk->len += need;
+	}
+
+	if (chunk != NULL && !push_chunk (f, chunk))
+		chunk = NULL;
+
+	if (src != NULL)
+		source_close (src);
+	else
+		fprintf (stderr, "skipping %s: %s\n", f->name, errbuf);
+
+	pthread_mutex_lock (&files_lock);
+	f->eof = true;
+	pthread_cond_broadcast (&files_more);
+	pthread_mutex_unlock (&files_lock);
+}
+
+
+static bool
+push_chunk (struct pcapfiles_file *f, struct pcapfiles_chunk *chunk)
+{
+	pthread_mutex_lock (&files_lock);
+
+	while (f->chunks >= PCAPFILES_CHUNKS && !stop)
+		pthread_cond_wait (&files_room, &files_lock);
+
+	if (stop) {
+		pthread_mutex_unlock (&files_lock);
+		free (chunk);
+		return false;
+	}
+
+	if (f->tail != NULL)
+		f->tail->next = chunk;
+	else
+		f->head = chunk;
+	f->tail = chunk;
+	f->chunks++;
+
+	pthread_cond_broadcast (&files_more);
+	pthread_mutex_unlock (&files_lock);
+
+	return true;
+}
+
+
+static bool
+next_packet (struct pcapfiles_file *f)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	const u_char *d;
+
+	if (f->state == FILE_MERGE) {
+		if (f->src == NULL && (f->src = source_open (f->name, errbuf)) == NULL) {
+			fprintf (stderr, "skipping %s: %s\n", f->name, errbuf);
+			return false;
+		}
+
+		while (source_next (f->src, &f->hdr, &d)) {
+			if (files_filter == NULL || pcap_offline_filter (files_filter, f->hdr, d)) {
+				f->data = d;
+				return true;
+			}
+		}
+
+		source_close (f->src);
+		f->src = NULL;
+		return false;
+	}
+
+	if (f->cur == NULL || f->off >= f->cur->len) {
+		free (f->cur);
+		f->cur = NULL;
+
+		pthread_mutex_lock (&files_lock);
+		while (f->head == NULL && !f->eof)
+			pthread_cond_wait (&files_more, &files_lock);
+
+		if (f->head != NULL) {
+			f->cur = f->head;
+			f->head = f->cur->next;
+			if (f->head == NULL)
+				f->tail = NULL;
+			f->chunks--;
+			f->off = 0;
+			pthread_cond_broadcast (&files_room);
+		}
+		pthread_mutex_unlock (&files_lock);
+
+		if (f->cur == NULL)
+			return false;
+	}
+
+	f->hdr = (struct pcap_pkthdr *) (f->cur->data + f->off);
+	f->data = f->cur->data + f->off + sizeof (*f->hdr);
+	f->off += PCAPFILES_ALIGN (sizeof (*f->hdr) + f->hdr->caplen);
+
+	return true;
+}
+
+
+static struct pcapfiles_source *
+source_open (const char *name, char *errbuf)
+{
+	struct pcapfiles_source *src;
+
+	if ((src = calloc (1, sizeof (*src))) == NULL) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+		return NULL;
+	}
+
+	/* libpcap knows more formats, and can read pipes */
+	if ((src->pm = pcap_mmap_open (name, errbuf)) == NULL && (src->pd = pcap_open_offline (name, errbuf)) == NULL) {
+		free (src);
+		return NULL;
+	}
+
+	return src;
+}
+
+
+static bool
+source_next (struct pcapfiles_source *src, struct pcap_pkthdr **h, const u_char **d)
+{
+	if (src->pd != NULL)
+		return pcap_next_ex (src->pd, h, d) == 1;
+
+	*h = &src->hdr;
+	return pcap_mmap_next (src->pm, &src->hdr, d) > 0;
+}
+
+
+static int
+source_datalink (struct pcapfiles_source *src)
+{
+	return src->pd != NULL ? pcap_datalink (src->pd) : pcap_mmap_datalink (src->pm);
+}
+
+
+static void
+source_close (struct pcapfiles_source *src)
+{
+	if (src->pd != NULL)
+		pcap_close (src->pd);
+	else
+		pcap_mmap_close (src->pm);
+	free (src);
+}
+
+
+static bool
+earlier (const struct timeval *a, unsigned a_index, const struct timeval *b, unsigned b_index)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	if (a->tv_usec != b->tv_usec)
+		return a->tv_usec < b->tv_usec;
+	return a_index < b_index;
+}
+
+
+static void
+heap_down (struct pcapfiles_file **heap, unsigned n, unsigned i)
+{
+	struct pcapfiles_file *tmp;
+	unsigned c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && earlier (&heap[c + 1]->hdr->ts, heap[c + 1]->index, &heap[c]->hdr->ts, heap[c]->index))
+			c++;
+		if (!earlier (&heap[c]->hdr->ts, heap[c]->index, &heap[i]->hdr->ts, heap[i]->index))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
+	}
+}
+
+
+static void
+heap_up (struct pcapfiles_file **heap, unsigned i)
+{
+	struct pcapfiles_file *tmp;
+	unsigned p;
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (!earlier (&heap[i]->hdr->ts, heap[i]->index, &heap[p]->hdr->ts, heap[p]->index))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[p];
+		heap[p] = tmp;
+		i = p;
+	}
+}
+
+
+static int
+compare_first (const void *a, const void *b)
+{
+	const struct pcapfiles_file *fa = a, *fb = b;
+
+	if (fa->added == fb->added)
+		return 0;
+	if (earlier (&fa->first, fa->added, &fb->first, fb->added))
+		return -1;
+	return 1;
+}
+
+
+static int
+compare_names (const void *a, const void *b)
+{
+	return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+
+static bool
+is_index (const char *name)
+{
+	size_t len = strlen (name), suffix = strlen (CALLIDX_SUFFIX);
+
+	return len > suffix && !strcmp (name + len - suffix, CALLIDX_SUFFIX);
+}
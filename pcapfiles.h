@@ -0,0 +1,51 @@
+#ifndef _PCAPFILES_H
+#define _PCAPFILES_H
+
+#include <stdbool.h>
+
+#include <pcap.h>
+
+
+/*
+ * Offline input from several capture files at once. Files are read and
+ * filtered by a pool of reader threads, while the packets are handed
+ * to the callback on the calling thread, merged from all files in
+ * timestamp order. Packets with the same timestamp keep the order of
+ * the files they came from, files being ordered by their first packet.
+ * Files are mapped and read in place (see pcapmmap.h) where possible.
+ */
+
+/*
+ * Add a file, every file a glob matches, or every file in a directory.
+ * Returns the number of files added, or -1 if there was none.
+ */
+int pcapfiles_add (const char *path);
+
+/*
+ * Sort the files by their first packet. Files that can't be read, or
+ * whose link type differs from the first one, are skipped with a
+ * warning. Returns the number of files left.
+ */
+int pcapfiles_prepare (char *errbuf);
+
+/*
+ * Query the list, in the order the files are merged.
+ */
+int pcapfiles_count (void);
+const char *pcapfiles_name (int i);
+
+/*
+ * Read all files with the given number of threads, dropping packets
+ * the filter does not match, and pass the rest to the callback in
+ * timestamp order. Returns 0, or -1 if the threads can't be started.
+ */
+int pcapfiles_loop (unsigned threads, const struct bpf_program *filter, pcap_handler callback, u_char *user);
+
+/*
+ * Stop the reader threads and forget all files. May be called from
+ * inside the callback, if the loop is not going to be returned to.
+ */
+void pcapfiles_close (void);
+
+
+#endif /* _PCAPFILES_H */
@@ -0,0 +1,645 @@
+/*
+ * pcapmmap -- read pcap and pcapng files in place through mmap().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcapmmap.h"
+#include "pcapzip.h"
+
+
+/*
+ * The file is read ahead, and given back behind the reader, in steps of
+ * this size. A multiple of 2M, so the kernel can use huge pages for it.
+ */
+#define PCAP_MMAP_WINDOW (8UL * 1024UL * 1024UL)
+
+#define PCAP_MMAP_SNAPLEN 262144
+
+/* anything longer is taken for a damaged file */
+#define PCAP_MMAP_MAX_RECORD (16U * 1024U * 1024U)
+
+/* classic pcap */
+#define PCAP_MAGIC 0xa1b2c3d4U
+#define PCAP_MAGIC_NSEC 0xa1b23c4dU
+#define PCAP_HDR_LEN 24
+#define PCAP_REC_LEN 16
+
+/* pcapng blocks */
+#define PCAPNG_SHB 0x0a0d0d0aU
+#define PCAPNG_IDB 0x00000001U
+#define PCAPNG_PB 0x00000002U
+#define PCAPNG_SPB 0x00000003U
+#define PCAPNG_EPB 0x00000006U
+#define PCAPNG_BOM 0x1a2b3c4dU
+
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_TSRESOL 9
+#define PCAPNG_OPT_TSOFFSET 14
+
+/* the one link type whose LINKTYPE_ value sipgrep cares about that is not its DLT_ value */
+#define LINKTYPE_RAW 101
+
+
+/*
+ * A pcapng interface: its link type and how to read its timestamps.
+ */
+struct pcap_mmap_if {
+	int linktype;
+	uint64_t units; /* timestamp ticks per second */
+	int64_t offset; /* seconds to add */
+};
+
+
+/*
+ * The bytes are either the whole mapped file, or the buffer the
+ * decompression thread handed over last. A record that runs from one
+ * buffer into the next is gathered in the carry.
+ */
+struct pcap_mmap {
+	unsigned char *base;
+	size_t size, pos;
+	size_t last; /* where the record last handed out starts */
+	size_t advised, released;
+	unsigned long long block_off; /* where base starts, in the file decompressed */
+	struct pcap_zip *zip;
+	unsigned char *carry;
+	size_t carry_size, carry_len, carry_off;
+	bool failed;
+	bool swapped, nsec, pcapng;
+	int linktype, snaplen;
+	struct pcap_mmap_if *ifs;
+	unsigned ifs_count;
+	struct timeval ts; /* of the last packet, simple packet blocks have none */
+	bool pending; /* the first packet, read ahead by pcap_mmap_open () */
+	struct pcap_pkthdr pending_h;
+	const u_char *pending_data;
+};
+
+
+/*
+ * Look at the next len bytes, NULL if the file ends before them, and
+ * move past them.
+ */
+static const unsigned char *peek (struct pcap_mmap *pm, size_t len);
+static void skip (struct pcap_mmap *pm, size_t len);
+static bool fetch (struct pcap_mmap *pm);
+
+/*
+ * Read fields in the byte order of the file.
+ */
+static uint16_t get16 (const struct pcap_mmap *pm, const unsigned char *p);
+static uint32_t get32 (const struct pcap_mmap *pm, const unsigned char *p);
+
+/*
+ * Record an interface description block.
+ */
+static bool add_interface (struct pcap_mmap *pm, const unsigned char *block, uint32_t len);
+
+/*
+ * Walk pcapng blocks up to the next packet.
+ */
+static int next_pcapng (struct pcap_mmap *pm, struct pcap_pkthdr *h, const u_char **data);
+
+/*
+ * Keep the kernel reading ahead, and drop what lies well behind.
+ */
+static void advise (struct pcap_mmap *pm);
+
+static int dlt_from_linktype (int linktype);
+
+
+struct pcap_mmap *
+pcap_mmap_open (const char *name, char *errbuf)
+{
+	const unsigned char *p;
+	struct pcap_mmap *pm;
+	struct stat st;
+	uint32_t magic;
+	int fd;
+
+	if ((fd = open (name, O_RDONLY)) < 0) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: %s", name, strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode)) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: not a capture file that can be mapped", name);
+		close (fd);
+		return NULL;
+	}
+
+	pm = malloc (sizeof (*pm));
+	if (pm == NULL) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+		close (fd);
+		return NULL;
+	}
+
+	memset (pm, 0, sizeof (*pm));
+
+	/* compressed: read what the decompression thread hands over */
+	if ((pm->zip = pcap_zip_open (fd, errbuf)) == NULL && errbuf[0] != '\0') {
+		close (fd);
+		free (pm);
+		return NULL;
+	}
+
+	if (pm->zip == NULL) {
+		if (st.st_size < PCAP_HDR_LEN) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: not a capture file that can be mapped", name);
+			close (fd);
+			free (pm);
+			return NULL;
+		}
+
+		pm->size = st.st_size;
+
+		/* private and writable: callers may scribble on packets, the file stays as it is */
+		pm->base = mmap (NULL, pm->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close (fd);
+
+		if (pm->base == MAP_FAILED) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: %s", name, strerror (errno));
+			free (pm);
+			return NULL;
+		}
+
+#ifdef MADV_SEQUENTIAL
+		madvise (pm->base, pm->size, MADV_SEQUENTIAL);
+#endif
+	}
+
+	if ((p = peek (pm, PCAP_HDR_LEN)) == NULL) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: truncated file", name);
+		pcap_mmap_close (pm);
+		return NULL;
+	}
+
+	memcpy (&magic, p, 4);
+
+	switch (magic) {
+		case PCAP_MAGIC:
+		case PCAP_MAGIC_NSEC:
+			break;
+
+		case __builtin_bswap32 (PCAP_MAGIC):
+		case __builtin_bswap32 (PCAP_MAGIC_NSEC):
+			pm->swapped = true;
+			magic = __builtin_bswap32 (magic);
+			break;
+
+		case PCAPNG_SHB:
+			pm->pcapng = true;
+			break;
+
+		default:
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: unknown file format", name);
+			pcap_mmap_close (pm);
+			return NULL;
+	}
+
+	if (!pm->pcapng) {
+		pm->nsec = magic == PCAP_MAGIC_NSEC;
+		pm->snaplen = get32 (pm, p + 16);
+		pm->linktype = dlt_from_linktype (get32 (pm, p + 20) & 0xffff);
+		skip (pm, PCAP_HDR_LEN);
+	}
+	else {
+		int r;
+
+		/* the interfaces come before the first packet, which is kept for later */
+		pm->linktype = -1;
+		r = next_pcapng (pm, &pm->pending_h, &pm->pending_data);
+		if (r < 0 || pm->ifs_count == 0) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: damaged pcapng file", name);
+			pcap_mmap_close (pm);
+			return NULL;
+		}
+		pm->pending = r > 0;
+	}
+
+	if (pm->snaplen <= 0)
+		pm->snaplen = PCAP_MMAP_SNAPLEN;
+
+	advise (pm);
+	return pm;
+}
+
+
+void
+pcap_mmap_close (struct pcap_mmap *pm)
+{
+	if (pm->zip != NULL)
+		pcap_zip_close (pm->zip);
+	else
+		munmap (pm->base, pm->size);
+	free (pm->carry);
+	free (pm->ifs);
+	free (pm);
+}
+
+
+int
+pcap_mmap_next (struct pcap_mmap *pm, struct pcap_pkthdr *h, const u_char **data)
+{
+	const unsigned char *p;
+	uint32_t frac;
+
+	advise (pm);
+
+	if (pm->pending) {
+		pm->pending = false;
+		*h = pm->pending_h;
+		*data = pm->pending_data;
+		return 1;
+	}
+
+	if (pm->pcapng)
+		return next_pcapng (pm, h, data);
+
+	pm->last = pm->pos;
+	if ((p = peek (pm, PCAP_REC_LEN)) == NULL)
+		return pm->failed ? -1 : 0;
+
+	frac = get32 (pm, p + 4);
+	h->ts.tv_sec = get32 (pm, p);
+	h->ts.tv_usec = pm->nsec ? frac / 1000 : frac;
+	h->caplen = get32 (pm, p + 8);
+	h->len = get32 (pm, p + 12);
+	skip (pm, PCAP_REC_LEN);
+
+	if (h->caplen > PCAP_MMAP_MAX_RECORD || (p = peek (pm, h->caplen)) == NULL)
+		return -1;
+
+	skip (pm, h->caplen);
+	*data = p;
+
+	return 1;
+}
+
+
+bool
+pcap_mmap_seek (struct pcap_mmap *pm, unsigned long long offset)
+{
+	unsigned long long at;
+	size_t have;
+
+	pm->pending = false;
+
+	if (pm->zip == NULL) {
+		if (offset > pm->size)
+			return false;
+
+		/* jumping around: no more reading ahead or giving back */
+		if (pm->advised < pm->size) {
+#ifdef MADV_RANDOM
+			madvise (pm->base, pm->size, MADV_RANDOM);
+#endif
+			pm->advised = pm->released = pm->size;
+		}
+
+		pm->pos = pm->last = offset;
+		return true;
+	}
+
+	/* a compressed file only goes forward */
+	have = pm->carry_len - pm->carry_off;
+	at = pm->block_off + pm->pos - have;
+	if (offset < at)
+		return false;
+
+	if (offset - at < have) {
+		pm->carry_off += offset - at;
+		return true;
+	}
+
+	pm->carry_off = pm->carry_len = 0;
+
+	while (offset > pm->block_off + pm->size)
+		if (!fetch (pm))
+			return false;
+
+	pm->pos = offset - pm->block_off;
+	return true;
+}
+
+
+int
+pcap_mmap_datalink (const struct pcap_mmap *pm)
+{
+	return pm->linktype;
+}
+
+
+int
+pcap_mmap_snaplen (const struct pcap_mmap *pm)
+{
+	return pm->snaplen;
+}
+
+
+static int
+next_pcapng (struct pcap_mmap *pm, struct pcap_pkthdr *h, const u_char **data)
+{
+	const unsigned char *p;
+	uint32_t type, len, ifid, caplen;
+	uint64_t ts;
+	bool has_ts;
+
+	for (;;) {
+
+		pm->last = pm->pos;
+		if ((p = peek (pm, 12)) == NULL)
+			return pm->failed ? -1 : 0;
+
+		memcpy (&type, p, 4);
+
+		/* a new section may come in the other byte order */
+		if (type == PCAPNG_SHB) {
+			uint32_t bom;
+			memcpy (&bom, p + 8, 4);
+			if (bom != PCAPNG_BOM && bom != __builtin_bswap32 (PCAPNG_BOM))
+				return -1;
+			pm->swapped = bom != PCAPNG_BOM;
+			pm->ifs_count = 0;
+		}
+		else
+			type = get32 (pm, p);
+
+		len = get32 (pm, p + 4);
+		if (len < 12 || (len & 3) != 0 || len > PCAP_MMAP_MAX_RECORD || (p = peek (pm, len)) == NULL)
+			return -1;
+
+		skip (pm, len);
+
+		switch (type) {
+			case PCAPNG_IDB:
+				if (!add_interface (pm, p, len))
+					return -1;
+				continue;
+
+			case PCAPNG_EPB:
+				if (len < 32)
+					return -1;
+				ifid = get32 (pm, p + 8);
+				ts = ((uint64_t) get32 (pm, p + 12) << 32) | get32 (pm, p + 16);
+				caplen = get32 (pm, p + 20);
+				h->len = get32 (pm, p + 24);
+				*data = p + 28;
+				has_ts = true;
+				break;
+
+			case PCAPNG_PB:
+				if (len < 32)
+					return -1;
+				ifid = get16 (pm, p + 8);
+				ts = ((uint64_t) get32 (pm, p + 12) << 32) | get32 (pm, p + 16);
+				caplen = get32 (pm, p + 20);
+				h->len = get32 (pm, p + 24);
+				*data = p + 28;
+				has_ts = true;
+				break;
+
+			case PCAPNG_SPB:
+				if (len < 16)
+					return -1;
+				ifid = 0;
+				ts = 0;
+				h->len = get32 (pm, p + 8);
+				caplen = h->len < len - 16 ? h->len : len - 16;
+				*data = p + 12;
+				has_ts = false;
+				break;
+
+			default:
+				continue;
+		}
+
+		if (caplen > len - (*data - p) - 4)
+			return -1;
+
+		/* only packets of the first interface's link type make sense to the caller */
+		if (ifid >= pm->ifs_count || pm->ifs[ifid].linktype != pm->linktype)
+			continue;
+
+		if (has_ts) {
+			const struct pcap_mmap_if *i = &pm->ifs[ifid];
+			uint64_t frac = ts % i->units;
+
+			pm->ts.tv_sec = ts / i->units + i->offset;
+			if (i->units <= 1000000000000ULL)
+				pm->ts.tv_usec = frac * 1000000 / i->units;
+			else
+				pm->ts.tv_usec = (double) frac * 1000000 / i->units;
+		}
+
+		h->ts = pm->ts;
+		h->caplen = caplen;
+
+		return 1;
+	}
+}
+
+
+static bool
+add_interface (struct pcap_mmap *pm, const unsigned char *block, uint32_t len)
+{
+	struct pcap_mmap_if *ifs, *i;
+	uint32_t off = 16;
+	uint16_t code, olen;
+	int v;
+
+	if (len < 20)
+		return false;
+
+	ifs = realloc (pm->ifs, (pm->ifs_count + 1) * sizeof (*ifs));
+	if (ifs == NULL)
+		return false;
+	pm->ifs = ifs;
+
+	i = &pm->ifs[pm->ifs_count++];
+	i->linktype = dlt_from_linktype (get16 (pm, block + 8));
+	i->units = 1000000;
+	i->offset = 0;
+
+	if (pm->linktype < 0) {
+		pm->linktype = i->linktype;
+		pm->snaplen = get32 (pm, block + 12);
+	}
+
+	/* options, up to the trailing block length */
+	while (off + 4 <= len - 4) {
+		code = get16 (pm, block + off);
+		olen = get16 (pm, block + off + 2);
+		off += 4;
+
+		if (code == PCAPNG_OPT_END || off + olen > len - 4)
+			break;
+
+		if (code == PCAPNG_OPT_TSRESOL && olen >= 1) {
+			v = block[off];
+			if (v & 0x80)
+				i->units = (v & 0x7f) < 64 ? 1ULL << (v & 0x7f) : 1000000;
+			else if (v <= 19)
+				for (i->units = 1; v > 0; v--)
+					i->units *= 10;
+		}
+		else if (code == PCAPNG_OPT_TSOFFSET && olen >= 8) {
+			uint64_t o;
+			memcpy (&o, block + off, 8);
+			i->offset = (int64_t) (pm->swapped ? __builtin_bswap64 (o) : o);
+		}
+
+		off += (olen + 3) & ~3U;
+	}
+
+	return true;
+}
+
+
+static const unsigned char *
+peek (struct pcap_mmap *pm, size_t len)
+{
+	size_t have, n;
+
+	while ((have = pm->carry_len - pm->carry_off) < len) {
+
+		if (have == 0 && pm->size - pm->pos >= len)
+			return pm->base + pm->pos;
+
+		if (pm->pos == pm->size) {
+			if (!fetch (pm))
+				return NULL;
+			continue;
+		}
+
+		/* a mapping has nothing after it */
+		if (pm->zip == NULL)
+			return NULL;
+
+		if (pm->carry_off > 0) {
+			memmove (pm->carry, pm->carry + pm->carry_off, have);
+			pm->carry_len = have;
+			pm->carry_off = 0;
+		}
+
+		if (pm->carry_size < len) {
+			unsigned char *carry = realloc (pm->carry, len);
+			if (carry == NULL) {
+				pm->failed = true;
+				return NULL;
+			}
+			pm->carry = carry;
+			pm->carry_size = len;
+		}
+
+		n = len - have < pm->size - pm->pos ? len - have : pm->size - pm->pos;
+		memcpy (pm->carry + pm->carry_len, pm->base + pm->pos, n);
+		pm->carry_len += n;
+		pm->pos += n;
+	}
+
+	return pm->carry + pm->carry_off;
+}
+
+
+static void
+skip (struct pcap_mmap *pm, size_t len)
+{
+	/* whatever peek () returned came from the carry if there is one */
+	if (pm->carry_len > pm->carry_off) {
+		pm->carry_off += len;
+		if (pm->carry_off == pm->carry_len)
+			pm->carry_off = pm->carry_len = 0;
+	}
+	else
+		pm->pos += len;
+}
+
+
+static bool
+fetch (struct pcap_mmap *pm)
+{
+	unsigned char *data;
+	long len;
+
+	if (pm->zip == NULL)
+		return false;
+
+	if ((len = pcap_zip_next (pm->zip, &data)) <= 0) {
+		pm->failed = len < 0;
+		return false;
+	}
+
+	pm->block_off += pm->size;
+	pm->base = data;
+	pm->size = len;
+	pm->pos = 0;
+
+	return true;
+}
+
+
+static void
+advise (struct pcap_mmap *pm)
+{
+	if (pm->zip != NULL)
+		return;
+
+#ifdef MADV_WILLNEED
+	if (pm->advised < pm->size && pm->pos + PCAP_MMAP_WINDOW > pm->advised) {
+		size_t len = pm->size - pm->advised < 2 * PCAP_MMAP_WINDOW ? pm->size - pm->advised : 2 * PCAP_MMAP_WINDOW;
+		madvise (pm->base + pm->advised, len, MADV_WILLNEED);
+		pm->advised += len;
+	}
+#endif
+
+#ifdef MADV_DONTNEED
+	/* never anything the packet last handed out may still be using */
+	while (pm->released + 2 * PCAP_MMAP_WINDOW <= pm->last) {
+		madvise (pm->base + pm->released, PCAP_MMAP_WINDOW, MADV_DONTNEED);
+		pm->released += PCAP_MMAP_WINDOW;
+	}
+#endif
+}
+
+
+static uint16_t
+get16 (const struct pcap_mmap *pm, const unsigned char *p)
+{
+	uint16_t v;
+
+	memcpy (&v, p, 2);
+	return pm->swapped ? __builtin_bswap16 (v) : v;
+}
+
+
+static uint32_t
+get32 (const struct pcap_mmap *pm, const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy (&v, p, 4);
+	return pm->swapped ? __builtin_bswap32 (v) : v;
+}
+
+
+static int
+dlt_from_linktype (int linktype)
+{
+#ifdef DLT_RAW
+	if (linktype == LINKTYPE_RAW)
+		return DLT_RAW;
+#endif
+
+	return linktype;
+}
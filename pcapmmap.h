@@ -0,0 +1,54 @@
+#ifndef _PCAPMMAP_H
+#define _PCAPMMAP_H
+
+#include <stdbool.h>
+
+#include <pcap.h>
+
+
+/*
+ * Reader for capture files that maps the whole file and walks the
+ * records in place, instead of copying them through stdio. Classic
+ * pcap with microsecond or nanosecond timestamps, in either byte order,
+ * and pcapng are understood. Anything else, or anything that can't be
+ * mapped (a pipe, say), is left to libpcap. Compressed files (see
+ * pcapzip.h) are read the same way, from the buffers they are
+ * decompressed into.
+ */
+struct pcap_mmap;
+
+/*
+ * Functions to open and close a file. Opening fails, with a message in
+ * errbuf, if the file is not one the reader handles.
+ */
+struct pcap_mmap *pcap_mmap_open (const char *name, char *errbuf);
+void pcap_mmap_close (struct pcap_mmap *pm);
+
+/*
+ * Fetch the next packet. The header is filled in, with microsecond
+ * timestamps, and data points into the mapping or buffer; the bytes
+ * may be written to, the file is not changed. They stay valid until the next
+ * call. Returns 1, 0 at the end of the file, or -1 if the rest of the
+ * file is damaged.
+ */
+int pcap_mmap_next (struct pcap_mmap *pm, struct pcap_pkthdr *h, const u_char **data);
+
+/*
+ * Go to the record at offset, in bytes from the start of the file (of
+ * the file decompressed, for a compressed one). A mapped file is read
+ * in any order from then on; a compressed one can only go forward, and
+ * is decompressed up to the offset. Fails if the offset is behind or
+ * past the end.
+ */
+bool pcap_mmap_seek (struct pcap_mmap *pm, unsigned long long offset);
+
+/*
+ * Query the link type (a DLT_ value) and the snapshot length. In
+ * pcapng these come from the first interface; packets of interfaces
+ * with another link type are skipped.
+ */
+int pcap_mmap_datalink (const struct pcap_mmap *pm);
+int pcap_mmap_snaplen (const struct pcap_mmap *pm);
+
+
+#endif /* _PCAPMMAP_H */
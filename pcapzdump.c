@@ -0,0 +1,489 @@
+/*
+ * pcapzdump -- compressed pcap output, written on a thread of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if USE_ZSTD
+#include <zstd.h>
+#endif
+#if USE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "pcapzdump.h"
+#include "mpscring.h"
+
+
+/* bytes of packets waiting for the thread */
+#define ZDUMP_RING (8UL * 1024UL * 1024UL)
+
+/* longer packets are cut, a record must fit in half the ring */
+#define ZDUMP_MAX_PACKET (1024U * 1024U)
+
+/* lz4 is fed this much at a time */
+#define ZDUMP_LZ4_CHUNK (64U * 1024U)
+
+#define ZDUMP_IDLE_USEC 1000
+
+/* when the queue runs dry, files are flushed at most this often; more
+   often would make for small blocks and poor compression */
+#define ZDUMP_FLUSH_SEC 1
+
+
+enum zdump_format {
+	ZDUMP_ZSTD,
+	ZDUMP_LZ4,
+};
+
+
+enum zdump_op {
+	ZDUMP_DATA,
+	ZDUMP_CLOSE,
+};
+
+
+/*
+ * A file. Once opened, everything but the pointer belongs to the
+ * thread.
+ */
+struct pcap_zdump {
+	char *name;
+	int fd;
+	enum zdump_format format;
+	unsigned char *out;
+	size_t out_size;
+	bool begun, dirty, failed;
+	struct pcap_zdump *next_dirty;
+	unsigned long long queued; /* bytes, before compression; the caller's */
+#if USE_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+#if USE_LZ4
+	LZ4F_cctx *lz4;
+#endif
+};
+
+
+/*
+ * What goes through the ring: this, then the bytes.
+ */
+struct zdump_queued {
+	struct pcap_zdump *z;
+	enum zdump_op op;
+	unsigned rec_len;
+	uint32_t rec[4]; /* pcap record header, rec_len bytes of it */
+};
+
+
+static struct mpsc_ring *zdump_ring = NULL;
+static pthread_t zdump_thread;
+static int zdump_stopping = 0;
+
+/* files with data not yet flushed to disk, the thread's own */
+static struct pcap_zdump *zdump_dirty = NULL;
+
+
+/*
+ * Queue bytes for a file, waiting for room.
+ */
+static void queue (struct pcap_zdump *z, enum zdump_op op, const uint32_t *rec, unsigned rec_len, const void *data, unsigned len);
+
+/*
+ * The thread: compress what is queued, and flush when there's nothing.
+ */
+static void *zdump_loop (void *arg);
+
+/*
+ * Compress bytes into a file, or end a frame (end) or block (!end).
+ */
+static void compress_data (struct pcap_zdump *z, const void *data, size_t len);
+static void compress_flush (struct pcap_zdump *z, bool end);
+static void write_out (struct pcap_zdump *z, size_t len);
+
+static void free_zdump (struct pcap_zdump *z);
+
+
+bool
+pcap_zdump_wanted (const char *name)
+{
+	size_t len = strlen (name);
+
+	return (len > 4 && !strcmp (name + len - 4, ".zst")) || (len > 4 && !strcmp (name + len - 4, ".lz4"));
+}
+
+
+struct pcap_zdump *
+pcap_zdump_open (pcap_t *pd, const char *name, char *errbuf)
+{
+	struct pcap_zdump *z;
+	pcap_dumper_t *hdr_dump;
+	char *hdr = NULL;
+	size_t hdr_len = 0;
+	FILE *f;
+
+	z = calloc (1, sizeof (*z));
+	if (z == NULL || (z->name = strdup (name)) == NULL) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+		free (z);
+		return NULL;
+	}
+
+	z->format = strcmp (name + strlen (name) - 4, ".zst") ? ZDUMP_LZ4 : ZDUMP_ZSTD;
+
+	switch (z->format) {
+		case ZDUMP_ZSTD:
+#if USE_ZSTD
+			if ((z->zstd = ZSTD_createCCtx ()) == NULL)
+				break;
+			z->out_size = ZSTD_CStreamOutSize ();
+			z->out = malloc (z->out_size);
+			break;
+#else
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: zstd support is not built in", name);
+			free_zdump (z);
+			return NULL;
+#endif
+
+		case ZDUMP_LZ4:
+#if USE_LZ4
+			if (LZ4F_isError (LZ4F_createCompressionContext (&z->lz4, LZ4F_VERSION)))
+				break;
+			z->out_size = LZ4F_compressBound (ZDUMP_LZ4_CHUNK, NULL);
+			if (z->out_size < LZ4F_HEADER_SIZE_MAX)
+				z->out_size = LZ4F_HEADER_SIZE_MAX;
+			z->out = malloc (z->out_size);
+			break;
+#else
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: lz4 support is not built in", name);
+			free_zdump (z);
+			return NULL;
+#endif
+	}
+
+	if (z->out == NULL) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+		free_zdump (z);
+		return NULL;
+	}
+
+	/* let libpcap write the file header, it knows the link types */
+	if ((f = open_memstream (&hdr, &hdr_len)) == NULL || (hdr_dump = pcap_dump_fopen (pd, f)) == NULL) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: unable to create file header", name);
+		if (f != NULL)
+			fclose (f);
+		free (hdr);
+		free_zdump (z);
+		return NULL;
+	}
+	pcap_dump_close (hdr_dump);
+
+	if ((z->fd = open (name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "%s: %s", name, strerror (errno));
+		free (hdr);
+		free_zdump (z);
+		return NULL;
+	}
+
+	if (zdump_ring == NULL) {
+		if ((zdump_ring = mpsc_ring_new (ZDUMP_RING, MPSC_DROP_NEWEST)) == NULL) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "unable to allocate output queue");
+			goto failed;
+		}
+
+		__atomic_store_n (&zdump_stopping, 0, __ATOMIC_RELEASE);
+		if (pthread_create (&zdump_thread, NULL, zdump_loop, NULL) != 0) {
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "unable to start output thread");
+			mpsc_ring_free (zdump_ring);
+			zdump_ring = NULL;
+			goto failed;
+		}
+	}
+
+	queue (z, ZDUMP_DATA, NULL, 0, hdr, hdr_len);
+	z->queued = hdr_len;
+	free (hdr);
+
+	return z;
+
+failed:
+	close (z->fd);
+	free (hdr);
+	free_zdump (z);
+	return NULL;
+}
+
+
+void
+pcap_zdump (u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
+{
+	uint32_t rec[4];
+
+	rec[0] = h->ts.tv_sec;
+	rec[1] = h->ts.tv_usec;
+	rec[2] = h->caplen < ZDUMP_MAX_PACKET ? h->caplen : ZDUMP_MAX_PACKET;
+	rec[3] = h->len;
+
+	queue ((struct pcap_zdump *) user, ZDUMP_DATA, rec, sizeof (rec), sp, rec[2]);
+	((struct pcap_zdump *) user)->queued += sizeof (rec) + rec[2];
+}
+
+
+unsigned long long
+pcap_zdump_tell (const struct pcap_zdump *z)
+{
+	return z->queued;
+}
+
+
+void
+pcap_zdump_close (struct pcap_zdump *z)
+{
+	queue (z, ZDUMP_CLOSE, NULL, 0, NULL, 0);
+}
+
+
+void
+pcap_zdump_finish (void)
+{
+	if (zdump_ring == NULL)
+		return;
+
+	/* the thread drains what is queued before it leaves */
+	__atomic_store_n (&zdump_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join (zdump_thread, NULL);
+
+	mpsc_ring_free (zdump_ring);
+	zdump_ring = NULL;
+}
+
+
+static void
+queue (struct pcap_zdump *z, enum zdump_op op, const uint32_t *rec, unsigned rec_len, const void *data, unsigned len)
+{
+	struct zdump_queued q;
+
+	q.z = z;
+	q.op = op;
+	q.rec_len = rec_len;
+	if (rec_len)
+		memcpy (q.rec, rec, rec_len);
+
+	while (!mpsc_ring_push (zdump_ring, &q, sizeof (q), data, len))
+		usleep (ZDUMP_IDLE_USEC / 10);
+}
+
+
+static void *
+zdump_loop (void *arg)
+{
+	unsigned char *buf;
+	unsigned buflen = ZDUMP_RING / 2, len;
+	struct zdump_queued *q;
+	struct pcap_zdump *z;
+	time_t flushed = 0;
+	bool stopping;
+
+	if (!(buf = malloc (buflen)))
+		return NULL;
+
+	q = (struct zdump_queued *) buf;
+
+	for (;;) {
+
+		len = mpsc_ring_pop (zdump_ring, buf, buflen);
+
+		if (len == 0) {
+			stopping = __atomic_load_n (&zdump_stopping, __ATOMIC_ACQUIRE) && mpsc_ring_used (zdump_ring) == 0;
+
+			/* idle: get what was compressed so far onto the disk */
+			if (zdump_dirty != NULL && (stopping || time (NULL) - flushed >= ZDUMP_FLUSH_SEC)) {
+				while ((z = zdump_dirty) != NULL) {
+					zdump_dirty = z->next_dirty;
+					z->dirty = false;
+					compress_flush (z, false);
+				}
+				flushed = time (NULL);
+			}
+
+			if (stopping)
+				break;
+			usleep (ZDUMP_IDLE_USEC);
+			continue;
+		}
+
+		z = q->z;
+
+		if (q->op == ZDUMP_CLOSE) {
+			struct pcap_zdump **p;
+
+			for (p = &zdump_dirty; *p != NULL; p = &(*p)->next_dirty)
+				if (*p == z) {
+					*p = z->next_dirty;
+					break;
+				}
+
+			compress_flush (z, true);
+			if (close (z->fd) != 0 && !z->failed)
+				fprintf (stderr, "error writing %s: %s\n", z->name, strerror (errno));
+			free_zdump (z);
+			continue;
+		}
+
+		if (q->rec_len)
+			compress_data (z, q->rec, q->rec_len);
+		compress_data (z, buf + sizeof (*q), len - sizeof (*q));
+
+		if (!z->dirty) {
+			z->dirty = true;
+			z->next_dirty = zdump_dirty;
+			zdump_dirty = z;
+		}
+	}
+
+	free (buf);
+	return NULL;
+}
+
+
+static void
+compress_data (struct pcap_zdump *z, const void *data, size_t len)
+{
+	switch (z->format) {
+		case ZDUMP_ZSTD:
+#if USE_ZSTD
+		{
+			ZSTD_inBuffer in = { data, len, 0 };
+
+			while (in.pos < in.size) {
+				ZSTD_outBuffer out = { z->out, z->out_size, 0 };
+				if (ZSTD_isError (ZSTD_compressStream2 (z->zstd, &out, &in, ZSTD_e_continue))) {
+					z->failed = true;
+					return;
+				}
+				write_out (z, out.pos);
+			}
+		}
+#endif
+			break;
+
+		case ZDUMP_LZ4:
+#if USE_LZ4
+		{
+			const unsigned char *p = data;
+			size_t n, r;
+
+			/* the frame header goes out with the first bytes */
+			if (!z->begun) {
+				r = LZ4F_compressBegin (z->lz4, z->out, z->out_size, NULL);
+				if (LZ4F_isError (r)) {
+					z->failed = true;
+					return;
+				}
+				write_out (z, r);
+				z->begun = true;
+			}
+
+			while (len > 0) {
+				n = len < ZDUMP_LZ4_CHUNK ? len : ZDUMP_LZ4_CHUNK;
+				r = LZ4F_compressUpdate (z->lz4, z->out, z->out_size, p, n, NULL);
+				if (LZ4F_isError (r)) {
+					z->failed = true;
+					return;
+				}
+				write_out (z, r);
+				p += n;
+				len -= n;
+			}
+		}
+#endif
+			break;
+	}
+}
+
+
+static void
+compress_flush (struct pcap_zdump *z, bool end)
+{
+	switch (z->format) {
+		case ZDUMP_ZSTD:
+#if USE_ZSTD
+		{
+			ZSTD_inBuffer in = { NULL, 0, 0 };
+			size_t left;
+
+			do {
+				ZSTD_outBuffer out = { z->out, z->out_size, 0 };
+				left = ZSTD_compressStream2 (z->zstd, &out, &in, end ? ZSTD_e_end : ZSTD_e_flush);
+				if (ZSTD_isError (left)) {
+					z->failed = true;
+					return;
+				}
+				write_out (z, out.pos);
+			} while (left != 0);
+		}
+#endif
+			break;
+
+		case ZDUMP_LZ4:
+#if USE_LZ4
+		{
+			size_t r = end ? LZ4F_compressEnd (z->lz4, z->out, z->out_size, NULL) : LZ4F_flush (z->lz4, z->out, z->out_size, NULL);
+			if (LZ4F_isError (r)) {
+				z->failed = true;
+				return;
+			}
+			write_out (z, r);
+		}
+#endif
+			break;
+	}
+}
+
+
+static void
+write_out (struct pcap_zdump *z, size_t len)
+{
+	unsigned char *p = z->out;
+	ssize_t n;
+
+	while (len > 0 && !z->failed) {
+		if ((n = write (z->fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "error writing %s: %s\n", z->name, strerror (errno));
+			z->failed = true;
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+
+static void
+free_zdump (struct pcap_zdump *z)
+{
+#if USE_ZSTD
+	ZSTD_freeCCtx (z->zstd);
+#endif
+#if USE_LZ4
+	if (z->lz4 != NULL)
+		LZ4F_freeCompressionContext (z->lz4);
+#endif
+	free (z->out);
+	free (z->name);
+	free (z);
+}
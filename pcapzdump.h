@@ -0,0 +1,53 @@
+#ifndef _PCAPZDUMP_H
+#define _PCAPZDUMP_H
+
+#include <stdbool.h>
+
+#include <pcap.h>
+
+
+/*
+ * Compressed pcap output, zstd or lz4, chosen by the name of the file
+ * (.zst or .lz4). Packets are queued, and compressed and written by a
+ * thread of its own. Every file is one compressed frame, ended when the
+ * file is closed, so a rotated file can be read on its own.
+ */
+struct pcap_zdump;
+
+/*
+ * Query whether a name asks for compressed output.
+ */
+bool pcap_zdump_wanted (const char *name);
+
+/*
+ * Create a file, with the link type and snapshot length of pd. Fails
+ * with a message in errbuf, also if support for the format wasn't
+ * built in.
+ */
+struct pcap_zdump *pcap_zdump_open (pcap_t *pd, const char *name, char *errbuf);
+
+/*
+ * Queue one packet; a pcap_handler, user being the file. Waits while
+ * the queue is full, packets are never dropped.
+ */
+void pcap_zdump (u_char *user, const struct pcap_pkthdr *h, const u_char *sp);
+
+/*
+ * Query where the next packet goes, counted in bytes of the file as it
+ * is once decompressed.
+ */
+unsigned long long pcap_zdump_tell (const struct pcap_zdump *z);
+
+/*
+ * Close a file. The frame is ended and the file closed by the thread,
+ * after the packets queued before.
+ */
+void pcap_zdump_close (struct pcap_zdump *z);
+
+/*
+ * Wait until everything queued is written, and stop the thread.
+ */
+void pcap_zdump_finish (void);
+
+
+#endif /* _PCAPZDUMP_H */
@@ -0,0 +1,412 @@
+/*
+ * pcapzip -- decompress capture files on a thread of their own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if USE_GZIP
+#include <zlib.h>
+#endif
+#if USE_ZSTD
+#include <zstd.h>
+#endif
+#if USE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "pcapzip.h"
+
+
+/* decompressed bytes in each of the two buffers */
+#define PCAP_ZIP_BUF (1024U * 1024U)
+
+/* compressed bytes read at a time */
+#define PCAP_ZIP_IN (128U * 1024U)
+
+
+enum zip_format {
+	ZIP_GZIP,
+	ZIP_ZSTD,
+	ZIP_LZ4,
+};
+
+
+struct pcap_zip {
+	int fd;
+	enum zip_format format;
+	pthread_t thread;
+
+	/* shared with the thread, under the lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *buf[2];
+	size_t len[2];
+	bool full[2];
+	unsigned take; /* buffer the reader takes next */
+	bool held; /* the reader has the other one */
+	bool eof, failed, stop;
+
+	/* the thread's own */
+	unsigned char *in;
+	size_t in_len, in_pos;
+	bool in_eof, error;
+#if USE_GZIP
+	z_stream gz;
+#endif
+#if USE_ZSTD
+	ZSTD_DStream *zstd;
+#endif
+#if USE_LZ4
+	LZ4F_dctx *lz4;
+#endif
+};
+
+
+/*
+ * Set up and tear down the decompressor for the format. Setting up
+ * fails with a message if support for it wasn't built in.
+ */
+static bool start_format (struct pcap_zip *z, char *errbuf);
+static void end_format (struct pcap_zip *z);
+
+/*
+ * Decompress from in to out, updating both lengths to what was used.
+ */
+static bool decompress (struct pcap_zip *z, const unsigned char *in, size_t *in_len, unsigned char *out, size_t *out_len);
+
+/*
+ * The thread: fill buffers until the file ends.
+ */
+static void *zip_loop (void *arg);
+static size_t fill (struct pcap_zip *z, unsigned char *out, size_t size);
+static bool refill (struct pcap_zip *z);
+
+
+struct pcap_zip *
+pcap_zip_open (int fd, char *errbuf)
+{
+	struct pcap_zip *z;
+	unsigned char magic[4];
+	enum zip_format format;
+
+	errbuf[0] = '\0';
+
+	if (pread (fd, magic, sizeof (magic), 0) != sizeof (magic))
+		return NULL;
+
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+		format = ZIP_GZIP;
+	else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		format = ZIP_ZSTD;
+	else if (magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18)
+		format = ZIP_LZ4;
+	else
+		return NULL;
+
+	z = calloc (1, sizeof (*z));
+	if (z == NULL) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+		return NULL;
+	}
+
+	z->fd = fd;
+	z->format = format;
+
+	if (!start_format (z, errbuf)) {
+		free (z);
+		return NULL;
+	}
+
+	z->in = malloc (PCAP_ZIP_IN);
+	z->buf[0] = malloc (PCAP_ZIP_BUF);
+	z->buf[1] = malloc (PCAP_ZIP_BUF);
+	if (z->in == NULL || z->buf[0] == NULL || z->buf[1] == NULL) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+		goto failed;
+	}
+
+	pthread_mutex_init (&z->lock, NULL);
+	pthread_cond_init (&z->cond, NULL);
+
+	if (pthread_create (&z->thread, NULL, zip_loop, z) != 0) {
+		snprintf (errbuf, PCAP_ERRBUF_SIZE, "unable to start decompression thread");
+		pthread_cond_destroy (&z->cond);
+		pthread_mutex_destroy (&z->lock);
+		goto failed;
+	}
+
+	return z;
+
+failed:
+	end_format (z);
+	free (z->in);
+	free (z->buf[0]);
+	free (z->buf[1]);
+	free (z);
+	return NULL;
+}
+
+
+void
+pcap_zip_close (struct pcap_zip *z)
+{
+	pthread_mutex_lock (&z->lock);
+	z->stop = true;
+	pthread_cond_broadcast (&z->cond);
+	pthread_mutex_unlock (&z->lock);
+
+	pthread_join (z->thread, NULL);
+
+	pthread_cond_destroy (&z->cond);
+	pthread_mutex_destroy (&z->lock);
+	end_format (z);
+	close (z->fd);
+	free (z->in);
+	free (z->buf[0]);
+	free (z->buf[1]);
+	free (z);
+}
+
+
+long
+pcap_zip_next (struct pcap_zip *z, unsigned char **data)
+{
+	long len = 0;
+
+	pthread_mutex_lock (&z->lock);
+
+	if (z->held) {
+		z->full[z->take ^ 1] = false;
+		z->held = false;
+		pthread_cond_broadcast (&z->cond);
+	}
+
+	while (!z->full[z->take] && !z->eof)
+		pthread_cond_wait (&z->cond, &z->lock);
+
+	if (z->full[z->take]) {
+		*data = z->buf[z->take];
+		len = z->len[z->take];
+		z->held = true;
+		z->take ^= 1;
+	}
+	else if (z->failed)
+		len = -1;
+
+	pthread_mutex_unlock (&z->lock);
+
+	return len;
+}
+
+
+static void *
+zip_loop (void *arg)
+{
+	struct pcap_zip *z = arg;
+	unsigned i = 0;
+	size_t len;
+	bool stop;
+
+	for (;;) {
+		pthread_mutex_lock (&z->lock);
+		while (z->full[i] && !z->stop)
+			pthread_cond_wait (&z->cond, &z->lock);
+		stop = z->stop;
+		pthread_mutex_unlock (&z->lock);
+
+		if (stop)
+			break;
+
+		len = fill (z, z->buf[i], PCAP_ZIP_BUF);
+
+		pthread_mutex_lock (&z->lock);
+		if (len > 0) {
+			z->len[i] = len;
+			z->full[i] = true;
+		}
+		if (len < PCAP_ZIP_BUF) {
+			z->eof = true;
+			z->failed = z->error;
+		}
+		pthread_cond_broadcast (&z->cond);
+		pthread_mutex_unlock (&z->lock);
+
+		if (len < PCAP_ZIP_BUF)
+			break;
+
+		i ^= 1;
+	}
+
+	return NULL;
+}
+
+
+static size_t
+fill (struct pcap_zip *z, unsigned char *out, size_t size)
+{
+	size_t done = 0, in_len, out_len;
+
+	while (done < size && !z->error && refill (z)) {
+		in_len = z->in_len - z->in_pos;
+		out_len = size - done;
+
+		if (!decompress (z, z->in + z->in_pos, &in_len, out + done, &out_len) || (in_len == 0 && out_len == 0)) {
+			z->error = true;
+			break;
+		}
+
+		z->in_pos += in_len;
+		done += out_len;
+	}
+
+	return done;
+}
+
+
+static bool
+refill (struct pcap_zip *z)
+{
+	ssize_t n;
+
+	if (z->in_pos < z->in_len)
+		return true;
+	if (z->in_eof)
+		return false;
+
+	n = read (z->fd, z->in, PCAP_ZIP_IN);
+	if (n <= 0) {
+		z->in_eof = true;
+		z->error = n < 0;
+		return false;
+	}
+
+	z->in_len = n;
+	z->in_pos = 0;
+
+	return true;
+}
+
+
+static bool
+start_format (struct pcap_zip *z, char *errbuf)
+{
+	switch (z->format) {
+		case ZIP_GZIP:
+#if USE_GZIP
+			/* gzip header, not zlib */
+			if (inflateInit2 (&z->gz, 16 + MAX_WBITS) == Z_OK)
+				return true;
+#endif
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "gzip compressed, and gzip support is not built in");
+			return false;
+
+		case ZIP_ZSTD:
+#if USE_ZSTD
+			if ((z->zstd = ZSTD_createDStream ()) != NULL && !ZSTD_isError (ZSTD_initDStream (z->zstd)))
+				return true;
+			ZSTD_freeDStream (z->zstd);
+#endif
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "zstd compressed, and zstd support is not built in");
+			return false;
+
+		case ZIP_LZ4:
+#if USE_LZ4
+			if (!LZ4F_isError (LZ4F_createDecompressionContext (&z->lz4, LZ4F_VERSION)))
+				return true;
+#endif
+			snprintf (errbuf, PCAP_ERRBUF_SIZE, "lz4 compressed, and lz4 support is not built in");
+			return false;
+	}
+
+	return false;
+}
+
+
+static void
+end_format (struct pcap_zip *z)
+{
+	switch (z->format) {
+		case ZIP_GZIP:
+#if USE_GZIP
+			inflateEnd (&z->gz);
+#endif
+			break;
+
+		case ZIP_ZSTD:
+#if USE_ZSTD
+			ZSTD_freeDStream (z->zstd);
+#endif
+			break;
+
+		case ZIP_LZ4:
+#if USE_LZ4
+			LZ4F_freeDecompressionContext (z->lz4);
+#endif
+			break;
+	}
+}
+
+
+static bool
+decompress (struct pcap_zip *z, const unsigned char *in, size_t *in_len, unsigned char *out, size_t *out_len)
+{
+	switch (z->format) {
+		case ZIP_GZIP:
+#if USE_GZIP
+		{
+			int r;
+
+			z->gz.next_in = (unsigned char *) in;
+			z->gz.avail_in = *in_len;
+			z->gz.next_out = out;
+			z->gz.avail_out = *out_len;
+
+			r = inflate (&z->gz, Z_NO_FLUSH);
+
+			*in_len -= z->gz.avail_in;
+			*out_len -= z->gz.avail_out;
+
+			/* files written by appending hold several gzip members */
+			if (r == Z_STREAM_END)
+				return inflateReset (&z->gz) == Z_OK;
+			return r == Z_OK || r == Z_BUF_ERROR;
+		}
+#else
+			break;
+#endif
+
+		case ZIP_ZSTD:
+#if USE_ZSTD
+		{
+			ZSTD_inBuffer zin = { in, *in_len, 0 };
+			ZSTD_outBuffer zout = { out, *out_len, 0 };
+
+			if (ZSTD_isError (ZSTD_decompressStream (z->zstd, &zout, &zin)))
+				return false;
+
+			*in_len = zin.pos;
+			*out_len = zout.pos;
+			return true;
+		}
+#else
+			break;
+#endif
+
+		case ZIP_LZ4:
+#if USE_LZ4
+			return !LZ4F_isError (LZ4F_decompress (z->lz4, out, out_len, in, in_len, NULL));
+#else
+			break;
+#endif
+	}
+
+	return false;
+}
@@ -0,0 +1,33 @@
+#ifndef _PCAPZIP_H
+#define _PCAPZIP_H
+
+#include <stdbool.h>
+
+#include <pcap.h>
+
+
+/*
+ * Decompression of gzip, zstd and lz4 compressed capture files, on a
+ * thread of its own. The thread fills one buffer while the reader works
+ * through the other, so decompressing overlaps with everything the
+ * reader does with the packets.
+ */
+struct pcap_zip;
+
+/*
+ * Start decompressing an open file, which is taken over and closed
+ * with the rest. Returns NULL with an empty errbuf if the file is not
+ * compressed, and NULL with a message if it is but can't be read.
+ */
+struct pcap_zip *pcap_zip_open (int fd, char *errbuf);
+void pcap_zip_close (struct pcap_zip *z);
+
+/*
+ * Take the next decompressed buffer, giving the previous one back to
+ * the thread. Returns its length, 0 at the end of the file, or -1 if
+ * the rest could not be decompressed.
+ */
+long pcap_zip_next (struct pcap_zip *z, unsigned char **data);
+
+
+#endif /* _PCAPZIP_H */
@@ -0,0 +1,154 @@
+/*
+ * selfstats -- how sipgrep itself is doing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "core_hep.h"
+#include "selfstats.h"
+
+
+struct selfstats_counter selfstats[SELFSTATS_STAGES];
+int selfstats_timed = 0;
+
+static const char *stage_names[SELFSTATS_STAGES] = {
+	"captured", "reassembled", "parsed", "matched", "output", "hep"
+};
+
+static volatile sig_atomic_t requested = 0;
+static unsigned interval = 0;
+
+/* as of the last print */
+static struct selfstats_counter last[SELFSTATS_STAGES];
+static uint64_t last_ns, last_ticks, start_ns;
+
+
+static uint64_t now_ns (void);
+
+
+void
+selfstats_init (unsigned seconds, int timed)
+{
+	interval = seconds;
+	selfstats_timed = timed;
+
+	start_ns = last_ns = now_ns ();
+	last_ticks = selfstats_now ();
+}
+
+
+void
+selfstats_request (int sig)
+{
+	requested = 1;
+}
+
+
+void
+selfstats_check (pcap_t *pd, const struct reasm_ip *reasm, const struct tcpreasm_ip *tcpreasm,
+		 const struct transact_table *transactions, const struct dedup_set *dedup)
+{
+	if (requested) {
+		requested = 0;
+		selfstats_print (pd, reasm, tcpreasm, transactions, dedup);
+		return;
+	}
+
+	if (interval && now_ns () - last_ns >= interval * 1000000000ULL)
+		selfstats_print (pd, reasm, tcpreasm, transactions, dedup);
+}
+
+
+void
+selfstats_print (pcap_t *pd, const struct reasm_ip *reasm, const struct tcpreasm_ip *tcpreasm,
+		 const struct transact_table *transactions, const struct dedup_set *dedup)
+{
+	struct pcap_stat ps;
+	uint64_t ns = now_ns (), ticks = selfstats_now ();
+	double secs = (ns - last_ns) / 1e9, ns_per_tick;
+	const struct transact_stats *st;
+	const struct dedup_stats *ds;
+	unsigned long long count, timed, sent = 0, errors = 0;
+	int i;
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	/* cycles, counted against the clock over the same time */
+	ns_per_tick = ticks > last_ticks ? (double) (ns - last_ns) / (ticks - last_ticks) : 1;
+
+	fprintf (stderr, "selfstats: %.1f s running, last %.1f s\n", (ns - start_ns) / 1e9, secs);
+	fprintf (stderr, "  %-12s %14s %12s %10s\n", "stage", "total", "per second", "ns each");
+
+	for (i = 0; i < SELFSTATS_STAGES; i++) {
+		count = selfstats[i].count - last[i].count;
+		timed = selfstats[i].timed - last[i].timed;
+		fprintf (stderr, "  %-12s %14llu %12.0f", stage_names[i], selfstats[i].count, count / secs);
+		if (timed)
+			fprintf (stderr, " %10.0f\n", (selfstats[i].ticks - last[i].ticks) * ns_per_tick / timed);
+		else
+			fprintf (stderr, " %10s\n", "-");
+	}
+
+	if (pd != NULL && pcap_stats (pd, &ps) == 0)
+		fprintf (stderr, "  pcap: %u received, %u dropped by the kernel, %u dropped by the interface\n",
+			 ps.ps_recv, ps.ps_drop, ps.ps_ifdrop);
+
+	if (reasm != NULL)
+		fprintf (stderr, "  ip reasm: %u waiting (%u max), %u bytes, %u timed out, %u dropped fragments, %u evicted\n",
+			 reasm_ip_waiting (reasm), reasm_ip_max_waiting (reasm), reasm_ip_bytes (reasm),
+			 reasm_ip_timed_out (reasm), reasm_ip_dropped_frags (reasm), reasm_ip_evicted (reasm));
+
+	if (tcpreasm != NULL)
+		fprintf (stderr, "  tcp reasm: %u waiting (%u max), %u bytes, %u timed out, %u dropped segments, %u evicted\n",
+			 tcpreasm_ip_waiting (tcpreasm), tcpreasm_ip_max_waiting (tcpreasm), tcpreasm_ip_bytes (tcpreasm),
+			 tcpreasm_ip_timed_out (tcpreasm), tcpreasm_ip_dropped_frags (tcpreasm), tcpreasm_ip_evicted (tcpreasm));
+
+	if (transactions != NULL) {
+		st = transact_stats (transactions);
+		fprintf (stderr, "  transactions: %u open, %llu started, %llu completed, %llu timed out, %llu retransmissions\n",
+			 transact_count (transactions), st->started, st->completed, st->timed_out,
+			 st->request_retrans + st->reply_retrans);
+	}
+
+	if (dedup != NULL) {
+		ds = dedup_stats (dedup);
+		fprintf (stderr, "  dedup: %llu retransmitted of %llu messages, %llu fingerprints evicted early\n",
+			 ds->duplicates, ds->checked, ds->evicted);
+	}
+
+	if (hep_collectors_count) {
+		/* written by the sender thread */
+		for (i = 0; i < hep_collectors_count; i++) {
+			sent += __atomic_load_n (&hep_collectors[i].sent, __ATOMIC_RELAXED);
+			errors += __atomic_load_n (&hep_collectors[i].errors, __ATOMIC_RELAXED);
+		}
+		fprintf (stderr, "  hep: %llu sent, %llu send errors, %u dropped\n",
+			 sent, errors, __atomic_load_n (&hep_dropped, __ATOMIC_RELAXED));
+	}
+
+	memcpy (last, selfstats, sizeof (last));
+	last_ns = ns;
+	last_ticks = ticks;
+}
+
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
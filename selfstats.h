@@ -0,0 +1,99 @@
+#ifndef _SELFSTATS_H
+#define _SELFSTATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pcap.h>
+
+#include "ipreasm.h"
+#include "tcpreasm.h"
+#include "transact.h"
+#include "dedup.h"
+
+
+/*
+ * How sipgrep itself is doing: packets through each stage, and, once
+ * enabled, the time spent in each, counted in cycles where there is a
+ * cycle counter and in nanoseconds otherwise. Printed to stderr every
+ * so many seconds, and when SIGUSR1 is received.
+ */
+enum selfstats_stage {
+	SELFSTATS_CAPTURED, /* packets handed to process(), the time of all of it */
+	SELFSTATS_REASSEMBLED, /* IP datagrams and TCP streams put together */
+	SELFSTATS_PARSED, /* SIP messages */
+	SELFSTATS_MATCHED, /* messages the expression matched, timed for all it was run on */
+	SELFSTATS_OUTPUT, /* messages printed, packets written to -O and -o */
+	SELFSTATS_HEP, /* messages handed to HEP */
+	SELFSTATS_STAGES
+};
+
+struct selfstats_counter {
+	unsigned long long count;
+	unsigned long long timed, ticks; /* times timed, and how long in all */
+};
+
+extern struct selfstats_counter selfstats[SELFSTATS_STAGES];
+extern int selfstats_timed;
+
+
+static inline uint64_t
+selfstats_now (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+#else
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Mark the start of a stage; 0 when the time is not being counted.
+ */
+static inline uint64_t
+selfstats_start (void)
+{
+	return selfstats_timed ? selfstats_now () : 0;
+}
+
+/*
+ * Count n through the stage, and the time since start.
+ */
+static inline void
+selfstats_stop (enum selfstats_stage stage, uint64_t start, unsigned n)
+{
+	selfstats[stage].count += n;
+	if (start) {
+		selfstats[stage].timed++;
+		selfstats[stage].ticks += selfstats_now () - start;
+	}
+}
+
+/*
+ * Print every interval seconds (never if 0), counting the time of the
+ * stages if timed is set.
+ */
+void selfstats_init (unsigned interval, int timed);
+
+/*
+ * Signal handler asking for the statistics to be printed.
+ */
+void selfstats_request (int sig);
+
+/*
+ * Print if it is time to, or if asked to. Called for every packet, and
+ * often enough while input is idle; the arguments may be NULL, pd only
+ * where pcap_stats() works.
+ */
+void selfstats_check (pcap_t *pd, const struct reasm_ip *reasm, const struct tcpreasm_ip *tcpreasm,
+		     const struct transact_table *transactions, const struct dedup_set *dedup);
+void selfstats_print (pcap_t *pd, const struct reasm_ip *reasm, const struct tcpreasm_ip *tcpreasm,
+		     const struct transact_table *transactions, const struct dedup_set *dedup);
+
+
+#endif /* _SELFSTATS_H */
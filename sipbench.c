@@ -0,0 +1,449 @@
+/*
+ * sipbench -- time the hot functions of sipgrep one by one.
+ *
+ * Every function is run in batches, each batch timed, and the time per
+ * call of the batches reported as percentiles, in nanoseconds and, where
+ * there is a cycle counter, in cycles. The report is JSON, to be kept and
+ * compared between versions.
+ */
+
+#if defined(LINUX) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#if defined(LINUX)
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#define cycles() __rdtsc ()
+#else
+#define HAVE_CYCLES 0
+#define cycles() 0ULL
+#endif
+
+#include <pcap.h>
+#include <pcre.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "uthash.h"
+#include "core_hep.h"
+#include "sipgrep.h"
+#include "sipparse.h"
+
+
+/* Call-IDs in the dialog table */
+#define SIPBENCH_DIALOGS 16384
+
+
+static const char invite[] =
+	"INVITE sip:bob@example.com SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP 10.1.0.7:5060;branch=z9hG4bK776asdhds\r\n"
+	"Max-Forwards: 70\r\n"
+	"From: \"Alice\" <sip:alice@example.com>;tag=1928301774\r\n"
+	"To: <sip:bob@example.com>\r\n"
+	"Call-ID: a84b4c76e66710@10.1.0.7\r\n"
+	"CSeq: 314159 INVITE\r\n"
+	"Contact: <sip:alice@10.1.0.7:5060>\r\n"
+	"User-Agent: sipbench\r\n"
+	"Content-Type: application/sdp\r\n"
+	"Content-Length: 150\r\n"
+	"\r\n"
+	"v=0\r\n"
+	"o=- 2890844526 2890844526 IN IP4 10.1.0.7\r\n"
+	"s=-\r\n"
+	"c=IN IP4 10.1.0.7\r\n"
+	"t=0 0\r\n"
+	"m=audio 49170 RTP/AVP 0 8\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"a=rtpmap:8 PCMA/8000\r\n";
+
+static const char reply[] =
+	"SIP/2.0 200 OK\r\n"
+	"Via: SIP/2.0/UDP 10.1.0.7:5060;branch=z9hG4bK776asdhds\r\n"
+	"From: \"Alice\" <sip:alice@example.com>;tag=1928301774\r\n"
+	"To: <sip:bob@example.com>;tag=a6c85cf\r\n"
+	"Call-ID: a84b4c76e66710@10.1.0.7\r\n"
+	"CSeq: 314159 INVITE\r\n"
+	"Contact: <sip:bob@10.0.0.1:5060>\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+
+struct bench {
+	const char *name;
+	void (*op) (unsigned long i);
+};
+
+
+/* the options */
+static unsigned long samples = 10000;
+static unsigned batch = 64;
+static int cpu = -1;
+static const char *match = NULL;
+
+/* what the functions work on */
+static unsigned char message[sizeof (invite)];
+static pcre *pattern;
+static struct callid_table *dialogs = NULL, *entries;
+static char (*keys)[64];
+static int sink = -1;
+static rc_info_t rcinfo;
+
+
+static void print_usage (void);
+
+static int setup (void);
+static int pin (int cpu);
+
+/*
+ * Run one function, print its entry of the report.
+ */
+static void run (const struct bench *b, bool first);
+static void print_percentiles (const char *what, double *v, unsigned long n);
+static int compare (const void *a, const void *b);
+static uint64_t now_ns (void);
+
+static void op_parse_invite (unsigned long i);
+static void op_parse_reply (unsigned long i);
+static void op_light_parse (unsigned long i);
+static void op_re_match (unsigned long i);
+static void op_dialog_find (unsigned long i);
+static void op_dialog_add_delete (unsigned long i);
+static void op_send_hepv3 (unsigned long i);
+
+
+static const struct bench benches[] = {
+	{ "parse_message/invite", op_parse_invite },
+	{ "parse_message/reply", op_parse_reply },
+	{ "light_parse_message", op_light_parse },
+	{ "re_match_func", op_re_match },
+	{ "dialog/find", op_dialog_find },
+	{ "dialog/add_delete", op_dialog_add_delete },
+	{ "send_hepv3", op_send_hepv3 },
+	{ NULL, NULL }
+};
+
+
+int
+main (int argc, char **argv)
+{
+	const struct bench *b;
+	const char *only = NULL;
+	bool first = true;
+	int c;
+
+	while ((c = getopt (argc, argv, "n:b:p:e:t:h")) != EOF) {
+		switch (c) {
+			case 'n':
+				samples = strtoul (optarg, NULL, 10);
+				break;
+			case 'b':
+				batch = strtoul (optarg, NULL, 10);
+				break;
+			case 'p':
+				cpu = atoi (optarg);
+				break;
+			case 'e':
+				match = optarg;
+				break;
+			case 't':
+				only = optarg;
+				break;
+			default:
+				print_usage ();
+				return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (samples == 0 || batch == 0) {
+		print_usage ();
+		return 1;
+	}
+
+	if (cpu >= 0 && pin (cpu) != 0)
+		return 1;
+
+	if (setup () != 0)
+		return 1;
+
+	printf ("{\n  \"version\": \"%s\",\n  \"cpu\": %d,\n  \"samples\": %lu,\n  \"batch\": %u,\n  \"benchmarks\": [",
+		VERSION, cpu, samples, batch);
+
+	for (b = benches; b->name; b++) {
+		if (only && !strstr (b->name, only))
+			continue;
+		run (b, first);
+		first = false;
+	}
+
+	printf ("\n  ]\n}\n");
+
+	close (sink);
+	return 0;
+}
+
+
+static void
+print_usage (void)
+{
+	printf ("usage: sipbench [-n samples] [-b batch] [-p cpu] [-e regex] [-t name]\n"
+		"   -n  is number of batches timed (default 10000)\n"
+		"   -b  is number of calls in a batch (default 64)\n"
+		"   -p  is run on this CPU only\n"
+		"   -e  is the expression for re_match_func (default a -f 2323232 match)\n"
+		"   -t  is run only the functions with this in their name\n");
+}
+
+
+static int
+pin (int cpu)
+{
+#if defined(LINUX)
+	cpu_set_t set;
+
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+
+	if (sched_setaffinity (0, sizeof (set), &set) != 0) {
+		perror ("sched_setaffinity");
+		return -1;
+	}
+
+	return 0;
+#else
+	fprintf (stderr, "pinning to a CPU is not supported here\n");
+	return -1;
+#endif
+}
+
+
+static int
+setup (void)
+{
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof (sin);
+	char url[64], from[64];
+	const char *err;
+	int err_offset;
+	struct callid_table *s;
+	unsigned long i;
+
+	/* the options sipgrep compiles an expression with, by default */
+	if (match == NULL) {
+		snprintf (from, sizeof (from), SIP_FROM_MATCH, "2323232");
+		match = from;
+	}
+	if ((pattern = pcre_compile (match, PCRE_UNGREEDY | PCRE_DOTALL, &err, &err_offset, 0)) == NULL) {
+		fprintf (stderr, "compile failed: %s\n", err);
+		return -1;
+	}
+
+	entries = calloc (SIPBENCH_DIALOGS, sizeof (*entries));
+	keys = calloc (SIPBENCH_DIALOGS, sizeof (*keys));
+	if (entries == NULL || keys == NULL) {
+		fprintf (stderr, "out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < SIPBENCH_DIALOGS; i++) {
+		snprintf (keys[i], sizeof (keys[i]), "%08lx-%lu@10.1.%lu.%lu", i * 2654435761UL, i, (i >> 8) & 0xff, i & 0xff);
+		s = &entries[i];
+		snprintf (s->callid, sizeof (s->callid), "%s", keys[i]);
+		HASH_ADD_STR (dialogs, callid, s);
+	}
+
+	/* a collector that never reads: the kernel drops what doesn't fit */
+	if ((sink = socket (AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror ("socket");
+		return -1;
+	}
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	if (bind (sink, (struct sockaddr *) &sin, sizeof (sin)) != 0 || getsockname (sink, (struct sockaddr *) &sin, &sinlen) != 0) {
+		perror ("bind");
+		return -1;
+	}
+
+	snprintf (url, sizeof (url), "udp:127.0.0.1:%u", ntohs (sin.sin_port));
+	if (make_homer_collectors (url) != 0 || init_hepv3 () != 0)
+		return -1;
+
+	rcinfo.ip_family = AF_INET;
+	rcinfo.ip_proto = IPPROTO_UDP;
+	rcinfo.proto_type = 1;
+	rcinfo.src_ip = "10.1.0.7";
+	rcinfo.dst_ip = "10.0.0.1";
+	rcinfo.src_port = 5060;
+	rcinfo.dst_port = 5060;
+	rcinfo.callid = "a84b4c76e66710@10.1.0.7";
+	rcinfo.callid_len = strlen (rcinfo.callid);
+
+	return 0;
+}
+
+
+static void
+run (const struct bench *b, bool first)
+{
+	double *ns, *cy;
+	uint64_t t0, c0;
+	unsigned long s, i, n = 0;
+
+	ns = malloc (samples * sizeof (*ns));
+	cy = malloc (samples * sizeof (*cy));
+	if (ns == NULL || cy == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (1);
+	}
+
+	/* warm the caches and the branch predictors */
+	for (i = 0; i < batch * 16; i++)
+		b->op (n++);
+
+	for (s = 0; s < samples; s++) {
+		t0 = now_ns ();
+		c0 = cycles ();
+		for (i = 0; i < batch; i++)
+			b->op (n++);
+		cy[s] = (double) (cycles () - c0) / batch;
+		ns[s] = (double) (now_ns () - t0) / batch;
+	}
+
+	printf ("%s\n    {\n      \"name\": \"%s\",\n      \"ops\": %lu,\n", first ? "" : ",", b->name, samples * batch);
+	print_percentiles ("ns_per_op", ns, samples);
+	printf (",\n");
+	if (HAVE_CYCLES)
+		print_percentiles ("cycles_per_op", cy, samples);
+	else
+		printf ("      \"cycles_per_op\": null");
+	printf ("\n    }");
+
+	free (ns);
+	free (cy);
+}
+
+
+static void
+print_percentiles (const char *what, double *v, unsigned long n)
+{
+	static const double p[] = { 50, 90, 99, 99.9 };
+	double sum = 0;
+	unsigned long i;
+
+	qsort (v, n, sizeof (*v), compare);
+	for (i = 0; i < n; i++)
+		sum += v[i];
+
+	printf ("      \"%s\": { \"min\": %.2f, \"mean\": %.2f", what, v[0], sum / n);
+	for (i = 0; i < sizeof (p) / sizeof (p[0]); i++)
+		printf (", \"p%g\": %.2f", p[i], v[(unsigned long) (p[i] / 100 * (n - 1))]);
+	printf (", \"max\": %.2f }", v[n - 1]);
+}
+
+
+static int
+compare (const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void
+op_parse_invite (unsigned long i)
+{
+	struct preparsed_sip psip;
+	unsigned int parsed;
+
+	/* sipgrep parses packet data it may write to */
+	memcpy (message, invite, sizeof (invite) - 1);
+	memset (&psip, 0, sizeof (psip));
+	parse_message (message, sizeof (invite) - 1, &parsed, &psip);
+}
+
+
+static void
+op_parse_reply (unsigned long i)
+{
+	struct preparsed_sip psip;
+	unsigned int parsed;
+
+	memcpy (message, reply, sizeof (reply) - 1);
+	memset (&psip, 0, sizeof (psip));
+	parse_message (message, sizeof (reply) - 1, &parsed, &psip);
+}
+
+
+static void
+op_light_parse (unsigned long i)
+{
+	unsigned int parsed;
+
+	light_parse_message ((char *) invite, sizeof (invite) - 1, &parsed);
+}
+
+
+/* what re_match_func() runs, without sipgrep's match counting */
+static void
+op_re_match (unsigned long i)
+{
+	pcre_exec (pattern, 0, invite, sizeof (invite) - 1, 0, 0, 0, 0);
+}
+
+
+static void
+op_dialog_find (unsigned long i)
+{
+	struct callid_table *s;
+
+	HASH_FIND_STR (dialogs, keys[(i * 2654435761UL) % SIPBENCH_DIALOGS], s);
+	if (s == NULL)
+		abort ();
+}
+
+
+static void
+op_dialog_add_delete (unsigned long i)
+{
+	struct callid_table *s = &entries[(i * 2654435761UL) % SIPBENCH_DIALOGS];
+
+	HASH_DEL (dialogs, s);
+	HASH_ADD_STR (dialogs, callid, s);
+}
+
+
+static void
+op_send_hepv3 (unsigned long i)
+{
+	rcinfo.time_sec = i;
+	send_hepv3 (&rcinfo, (unsigned char *) invite, sizeof (invite) - 1);
+}
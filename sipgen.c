@@ -0,0 +1,666 @@
+/*
+ * sipgen -- write reproducible SIP traffic to a pcap file, for benchmarks.
+ *
+ * Dialogs of a configurable mix (calls, registrations with a 401
+ * challenge, OPTIONS pings) are interleaved over UDP, TCP and IPv6,
+ * some INVITEs big enough to be sent in IP fragments. The same options
+ * and seed always give the same file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+
+#define SIPGEN_MTU 1500
+#define SIPGEN_ETH_LEN 14
+#define SIPGEN_IP4_LEN 20
+#define SIPGEN_IP6_LEN 40
+#define SIPGEN_UDP_LEN 8
+#define SIPGEN_TCP_LEN 20
+
+#define SIPGEN_MSG_MAX 8192
+#define SIPGEN_PKT_MAX (SIPGEN_ETH_LEN + SIPGEN_IP6_LEN + SIPGEN_TCP_LEN + SIPGEN_MSG_MAX)
+
+#define SIPGEN_SERVER_PORT 5060
+
+
+enum dialog_kind {
+	KIND_CALL,
+	KIND_REGISTER,
+	KIND_OPTIONS,
+	KINDS
+};
+
+static const char *kind_names[KINDS] = { "invite", "register", "options" };
+
+
+struct dialog {
+	enum dialog_kind kind;
+	unsigned step;
+	uint32_t id;
+	char callid[48];
+	uint32_t from_tag, to_tag, branch;
+	bool tcp, v6, big;
+	uint16_t port; /* of the client */
+	uint32_t seq[2]; /* tcp, client to server and back */
+};
+
+
+/* the options */
+static unsigned long dialogs = 100000;
+static unsigned concurrency = 1000;
+static unsigned long rate = 10000; /* packets per second, for the timestamps */
+static unsigned weights[KINDS] = { 60, 25, 15 };
+static unsigned tcp_percent = 10, v6_percent = 10, frag_percent = 5;
+static uint64_t seed = 1;
+
+/* the output */
+static FILE *out;
+static uint64_t ts_usec = 1400000000ULL * 1000000ULL;
+static unsigned long packets = 0;
+static unsigned long long bytes = 0;
+static uint16_t ip_id = 0;
+
+
+static void usage (void);
+static bool parse_mix (char *mix);
+
+static uint64_t rnd (void);
+static unsigned rnd_below (unsigned n);
+
+static void start_dialog (struct dialog *d, uint32_t id);
+
+/*
+ * Write the next message of a dialog. Returns false once there is none.
+ */
+static bool next_message (struct dialog *d);
+
+static size_t build_message (char *buf, const struct dialog *d, const char *first, unsigned cseq, const char *method, bool to_tag, const char *extra, const char *body);
+static size_t build_sdp (char *buf, size_t size, const struct dialog *d);
+
+/*
+ * Put a message on the wire, from the client or the server.
+ */
+static void send_udp (struct dialog *d, bool from_client, const unsigned char *msg, size_t len);
+static void send_tcp (struct dialog *d, bool from_client, uint8_t flags, const unsigned char *msg, size_t len);
+
+static size_t put_headers (unsigned char *pkt, const struct dialog *d, bool from_client, uint8_t proto, size_t l4_len);
+static uint16_t l4_checksum (const unsigned char *pkt, const struct dialog *d, uint8_t proto, const unsigned char *l4, size_t len);
+static uint32_t checksum_add (uint32_t sum, const unsigned char *p, size_t len);
+static uint16_t checksum_fold (uint32_t sum);
+
+static void write_packet (const unsigned char *pkt, size_t len);
+
+
+int
+main (int argc, char **argv)
+{
+	struct dialog *active;
+	unsigned long started = 0;
+	unsigned n_active = 0, i;
+	char *file = NULL;
+	int c;
+
+	while ((c = getopt (argc, argv, "o:n:c:r:m:t:6:f:s:h")) != EOF) {
+		switch (c) {
+			case 'o':
+				file = optarg;
+				break;
+			case 'n':
+				dialogs = strtoul (optarg, NULL, 10);
+				break;
+			case 'c':
+				concurrency = strtoul (optarg, NULL, 10);
+				break;
+			case 'r':
+				rate = strtoul (optarg, NULL, 10);
+				break;
+			case 'm':
+				if (!parse_mix (optarg)) {
+					usage ();
+					return 1;
+				}
+				break;
+			case 't':
+				tcp_percent = strtoul (optarg, NULL, 10);
+				break;
+			case '6':
+				v6_percent = strtoul (optarg, NULL, 10);
+				break;
+			case 'f':
+				frag_percent = strtoul (optarg, NULL, 10);
+				break;
+			case 's':
+				seed = strtoull (optarg, NULL, 10);
+				break;
+			default:
+				usage ();
+				return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (file == NULL || concurrency == 0 || rate == 0 || weights[0] + weights[1] + weights[2] == 0) {
+		usage ();
+		return 1;
+	}
+
+	/* xorshift gets stuck at 0 */
+	seed = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+	if ((active = calloc (concurrency, sizeof (*active))) == NULL) {
+		fprintf (stderr, "out of memory\n");
+		return 1;
+	}
+
+	if ((out = fopen (file, "w")) == NULL) {
+		perror (file);
+		return 1;
+	}
+	setvbuf (out, NULL, _IOFBF, 1024 * 1024);
+
+	{
+		/* classic pcap, microseconds, Ethernet */
+		uint32_t hdr[6] = { 0xa1b2c3d4, 0x00040002, 0, 0, 65535, 1 };
+		fwrite (hdr, sizeof (hdr), 1, out);
+	}
+
+	for (;;) {
+		while (n_active < concurrency && started < dialogs)
+			start_dialog (&active[n_active++], started++);
+
+		if (n_active == 0)
+			break;
+
+		i = rnd_below (n_active);
+		if (!next_message (&active[i]))
+			active[i] = active[--n_active];
+	}
+
+	if (fclose (out) != 0) {
+		perror (file);
+		return 1;
+	}
+
+	printf ("%lu packets, %lu dialogs, %llu bytes\n", packets, started, bytes);
+
+	free (active);
+	return 0;
+}
+
+
+static void
+usage (void)
+{
+	printf ("usage: sipgen -o file [-n dialogs] [-c concurrent] [-r rate] [-m mix]\n"
+		"              [-t tcp%%] [-6 ipv6%%] [-f fragmented%%] [-s seed]\n"
+		"   -o  is the pcap file to write\n"
+		"   -n  is number of dialogs (default 100000)\n"
+		"   -c  is number of dialogs going on at once (default 1000)\n"
+		"   -r  is packets per second, for the timestamps (default 10000)\n"
+		"   -m  is the mix of dialogs (default invite:60,register:25,options:15)\n"
+		"   -t  is percent of dialogs over TCP (default 10)\n"
+		"   -6  is percent of dialogs over IPv6 (default 10)\n"
+		"   -f  is percent of UDP/IPv4 INVITEs big enough to be fragmented (default 5)\n"
+		"   -s  is the seed (default 1)\n");
+}
+
+
+static bool
+parse_mix (char *mix)
+{
+	char *item, *value;
+	unsigned k;
+
+	memset (weights, 0, sizeof (weights));
+
+	for (item = strtok (mix, ","); item != NULL; item = strtok (NULL, ",")) {
+		if ((value = strchr (item, ':')) == NULL)
+			return false;
+		*value++ = '\0';
+
+		for (k = 0; k < KINDS && strcmp (item, kind_names[k]); k++);
+		if (k == KINDS)
+			return false;
+
+		weights[k] = strtoul (value, NULL, 10);
+	}
+
+	return true;
+}
+
+
+/* xorshift64* */
+static uint64_t
+rnd (void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545f4914f6cdd1dULL;
+}
+
+
+static unsigned
+rnd_below (unsigned n)
+{
+	return (rnd () >> 32) % n;
+}
+
+
+static void
+start_dialog (struct dialog *d, uint32_t id)
+{
+	unsigned w = rnd_below (weights[0] + weights[1] + weights[2]);
+
+	memset (d, 0, sizeof (*d));
+
+	d->kind = w < weights[0] ? KIND_CALL : w < weights[0] + weights[1] ? KIND_REGISTER : KIND_OPTIONS;
+	d->id = id;
+	snprintf (d->callid, sizeof (d->callid), "%016llx@sipgen", (unsigned long long) rnd ());
+	d->from_tag = rnd ();
+	d->to_tag = rnd ();
+	d->branch = rnd ();
+	d->tcp = rnd_below (100) < tcp_percent;
+	d->v6 = rnd_below (100) < v6_percent;
+	d->big = d->kind == KIND_CALL && !d->tcp && !d->v6 && rnd_below (100) < frag_percent;
+	d->port = 10000 + rnd_below (50000);
+	d->seq[0] = rnd ();
+	d->seq[1] = rnd ();
+
+	/* a connection of its own */
+	if (d->tcp) {
+		send_tcp (d, true, 0x02, NULL, 0);
+		send_tcp (d, false, 0x12, NULL, 0);
+		send_tcp (d, true, 0x10, NULL, 0);
+	}
+}
+
+
+static bool
+next_message (struct dialog *d)
+{
+	char msg[SIPGEN_MSG_MAX], body[SIPGEN_MSG_MAX / 2];
+	bool from_client = true;
+	size_t len = 0;
+
+	switch (d->kind) {
+		case KIND_CALL:
+			switch (d->step) {
+				case 0:
+					build_sdp (body, sizeof (body), d);
+					len = build_message (msg, d, "INVITE sip:%s@example.com SIP/2.0", 1, "INVITE", false, NULL, body);
+					break;
+				case 1:
+					len = build_message (msg, d, "SIP/2.0 100 Trying", 1, "INVITE", false, NULL, NULL);
+					from_client = false;
+					break;
+				case 2:
+					len = build_message (msg, d, "SIP/2.0 180 Ringing", 1, "INVITE", true, NULL, NULL);
+					from_client = false;
+					break;
+				case 3:
+					build_sdp (body, sizeof (body), d);
+					len = build_message (msg, d, "SIP/2.0 200 OK", 1, "INVITE", true, NULL, body);
+					from_client = false;
+					break;
+				case 4:
+					len = build_message (msg, d, "ACK sip:%s@example.com SIP/2.0", 1, "ACK", true, NULL, NULL);
+					break;
+				case 5:
+					len = build_message (msg, d, "BYE sip:%s@example.com SIP/2.0", 2, "BYE", true, NULL, NULL);
+					break;
+				case 6:
+					len = build_message (msg, d, "SIP/2.0 200 OK", 2, "BYE", true, NULL, NULL);
+					from_client = false;
+					break;
+			}
+			break;
+
+		case KIND_REGISTER:
+			switch (d->step) {
+				case 0:
+					len = build_message (msg, d, "REGISTER sip:example.com SIP/2.0", 1, "REGISTER", false, "Expires: 3600\r\n", NULL);
+					break;
+				case 1:
+					len = build_message (msg, d, "SIP/2.0 401 Unauthorized", 1, "REGISTER", true,
+							     "WWW-Authenticate: Digest realm=\"example.com\", nonce=\"5f3c1a2b\", algorithm=MD5\r\n", NULL);
+					from_client = false;
+					break;
+				case 2:
+					len = build_message (msg, d, "REGISTER sip:example.com SIP/2.0", 2, "REGISTER", false,
+							     "Expires: 3600\r\nAuthorization: Digest username=\"u\", realm=\"example.com\", nonce=\"5f3c1a2b\", "
+							     "uri=\"sip:example.com\", response=\"0123456789abcdef0123456789abcdef\"\r\n", NULL);
+					break;
+				case 3:
+					len = build_message (msg, d, "SIP/2.0 200 OK", 2, "REGISTER", true, "Expires: 3600\r\n", NULL);
+					from_client = false;
+					break;
+			}
+			break;
+
+		case KIND_OPTIONS:
+			switch (d->step) {
+				case 0:
+					len = build_message (msg, d, "OPTIONS sip:%s@example.com SIP/2.0", 1, "OPTIONS", false, NULL, NULL);
+					break;
+				case 1:
+					len = build_message (msg, d, "SIP/2.0 200 OK", 1, "OPTIONS", true, "Allow: INVITE, ACK, BYE, CANCEL, OPTIONS\r\n", NULL);
+					from_client = false;
+					break;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	if (len == 0) {
+		/* the client closes the connection */
+		if (d->tcp) {
+			send_tcp (d, true, 0x11, NULL, 0);
+			send_tcp (d, false, 0x11, NULL, 0);
+			send_tcp (d, true, 0x10, NULL, 0);
+		}
+		return false;
+	}
+
+	if (d->tcp)
+		send_tcp (d, from_client, 0x18, (unsigned char *) msg, len);
+	else
+		send_udp (d, from_client, (unsigned char *) msg, len);
+
+	d->step++;
+	return true;
+}
+
+
+static size_t
+build_message (char *buf, const struct dialog *d, const char *first, unsigned cseq, const char *method, bool to_tag, const char *extra, const char *body)
+{
+	char line[128], host[64], tag[32] = "";
+	int len;
+
+	snprintf (line, sizeof (line), first, "bob");
+
+	if (d->v6)
+		snprintf (host, sizeof (host), "[2001:db8:1::%x:%x]", d->id >> 16, d->id & 0xffff);
+	else
+		snprintf (host, sizeof (host), "10.1.%u.%u", (d->id >> 8) & 0xff, d->id & 0xff);
+
+	if (to_tag)
+		snprintf (tag, sizeof (tag), ";tag=%08x", d->to_tag);
+
+	len = snprintf (buf, SIPGEN_MSG_MAX,
+			"%s\r\n"
+			"Via: SIP/2.0/%s %s:%u;branch=z9hG4bK%08x.%u\r\n"
+			"Max-Forwards: 70\r\n"
+			"From: \"Alice %u\" <sip:alice%u@example.com>;tag=%08x\r\n"
+			"To: <sip:bob@example.com>%s\r\n"
+			"Call-ID: %s\r\n"
+			"CSeq: %u %s\r\n"
+			"Contact: <sip:alice%u@%s:%u>\r\n"
+			"User-Agent: sipgen\r\n"
+			"%s"
+			"%s"
+			"Content-Length: %u\r\n"
+			"\r\n"
+			"%s",
+			line, d->tcp ? "TCP" : "UDP", host, d->port, d->branch, cseq,
+			d->id, d->id, d->from_tag, tag, d->callid, cseq, method, d->id, host, d->port,
+			extra ? extra : "", body ? "Content-Type: application/sdp\r\n" : "",
+			body ? (unsigned) strlen (body) : 0, body ? body : "");
+
+	return len < SIPGEN_MSG_MAX ? (size_t) len : SIPGEN_MSG_MAX - 1;
+}
+
+
+static size_t
+build_sdp (char *buf, size_t size, const struct dialog *d)
+{
+	size_t len;
+
+	len = snprintf (buf, size,
+			"v=0\r\n"
+			"o=- %u 1 IN IP4 10.1.%u.%u\r\n"
+			"s=-\r\n"
+			"c=IN IP4 10.1.%u.%u\r\n"
+			"t=0 0\r\n"
+			"m=audio %u RTP/AVP 0 8 101\r\n"
+			"a=rtpmap:0 PCMU/8000\r\n"
+			"a=rtpmap:8 PCMA/8000\r\n"
+			"a=rtpmap:101 telephone-event/8000\r\n"
+			"a=fmtp:101 0-15\r\n",
+			d->id, (d->id >> 8) & 0xff, d->id & 0xff, (d->id >> 8) & 0xff, d->id & 0xff, 20000 + 2 * (d->id % 10000));
+
+	/* past the MTU, so the INVITE goes in fragments */
+	while (d->big && len < 3000 && len + 80 < size)
+		len += snprintf (buf + len, size - len, "a=x-pad:%064u\r\n", (unsigned) len);
+
+	return len;
+}
+
+
+static void
+send_udp (struct dialog *d, bool from_client, const unsigned char *msg, size_t len)
+{
+	unsigned char dgram[SIPGEN_UDP_LEN + SIPGEN_MSG_MAX], pkt[SIPGEN_PKT_MAX];
+	size_t hdr, off, frag, dlen = SIPGEN_UDP_LEN + len;
+	uint16_t sport = from_client ? d->port : SIPGEN_SERVER_PORT;
+	uint16_t dport = from_client ? SIPGEN_SERVER_PORT : d->port;
+	uint16_t sum;
+
+	/* the fragments of a datagram share one */
+	ip_id++;
+
+	dgram[0] = sport >> 8;
+	dgram[1] = sport;
+	dgram[2] = dport >> 8;
+	dgram[3] = dport;
+	dgram[4] = dlen >> 8;
+	dgram[5] = dlen;
+	dgram[6] = dgram[7] = 0;
+	memcpy (dgram + SIPGEN_UDP_LEN, msg, len);
+
+	/* the checksum needs the addresses: build the headers once for them */
+	put_headers (pkt, d, from_client, 17, dlen);
+	sum = l4_checksum (pkt, d, 17, dgram, dlen);
+	dgram[6] = sum >> 8;
+	dgram[7] = sum;
+
+	if (d->v6 || SIPGEN_IP4_LEN + dlen <= SIPGEN_MTU) {
+		hdr = put_headers (pkt, d, from_client, 17, dlen);
+		memcpy (pkt + hdr, dgram, dlen);
+		write_packet (pkt, hdr + dlen);
+		return;
+	}
+
+	for (off = 0; off < dlen; off += frag) {
+		frag = dlen - off;
+		if (SIPGEN_IP4_LEN + frag > SIPGEN_MTU)
+			frag = (SIPGEN_MTU - SIPGEN_IP4_LEN) & ~7U;
+
+		hdr = put_headers (pkt, d, from_client, 17, frag);
+		/* offset and more fragments */
+		pkt[SIPGEN_ETH_LEN + 6] = ((off / 8) >> 8) | (off + frag < dlen ? 0x20 : 0);
+		pkt[SIPGEN_ETH_LEN + 7] = off / 8;
+		pkt[SIPGEN_ETH_LEN + 10] = pkt[SIPGEN_ETH_LEN + 11] = 0;
+		sum = checksum_fold (checksum_add (0, pkt + SIPGEN_ETH_LEN, SIPGEN_IP4_LEN));
+		pkt[SIPGEN_ETH_LEN + 10] = sum >> 8;
+		pkt[SIPGEN_ETH_LEN + 11] = sum;
+
+		memcpy (pkt + hdr, dgram + off, frag);
+		write_packet (pkt, hdr + frag);
+	}
+}
+
+
+static void
+send_tcp (struct dialog *d, bool from_client, uint8_t flags, const unsigned char *msg, size_t len)
+{
+	unsigned char pkt[SIPGEN_PKT_MAX], *tcp;
+	uint32_t *seq = &d->seq[from_client ? 0 : 1], ack = d->seq[from_client ? 1 : 0];
+	uint16_t sport = from_client ? d->port : SIPGEN_SERVER_PORT;
+	uint16_t dport = from_client ? SIPGEN_SERVER_PORT : d->port;
+	size_t hdr, mss = 536 + rnd_below (925), seg, off = 0;
+	uint16_t sum;
+
+	/* segments of the MSS, the push on the last one */
+	do {
+		seg = len - off < mss ? len - off : mss;
+		ip_id++;
+
+		hdr = put_headers (pkt, d, from_client, 6, SIPGEN_TCP_LEN + seg);
+		tcp = pkt + hdr;
+		memset (tcp, 0, SIPGEN_TCP_LEN);
+		tcp[0] = sport >> 8;
+		tcp[1] = sport;
+		tcp[2] = dport >> 8;
+		tcp[3] = dport;
+		tcp[4] = *seq >> 24;
+		tcp[5] = *seq >> 16;
+		tcp[6] = *seq >> 8;
+		tcp[7] = *seq;
+		if (flags != 0x02) {
+			tcp[8] = ack >> 24;
+			tcp[9] = ack >> 16;
+			tcp[10] = ack >> 8;
+			tcp[11] = ack;
+		}
+		tcp[12] = (SIPGEN_TCP_LEN / 4) << 4;
+		tcp[13] = off + seg < len ? (flags & ~0x08) : flags;
+		tcp[14] = 0xff;
+		tcp[15] = 0xff;
+		memcpy (tcp + SIPGEN_TCP_LEN, msg + off, seg);
+
+		sum = l4_checksum (pkt, d, 6, tcp, SIPGEN_TCP_LEN + seg);
+		tcp[16] = sum >> 8;
+		tcp[17] = sum;
+
+		write_packet (pkt, hdr + SIPGEN_TCP_LEN + seg);
+
+		/* SYN and FIN count as one */
+		*seq += seg ? seg : (flags & 0x03) ? 1 : 0;
+		off += seg;
+	} while (off < len);
+}
+
+
+static size_t
+put_headers (unsigned char *pkt, const struct dialog *d, bool from_client, uint8_t proto, size_t l4_len)
+{
+	unsigned char *ip = pkt + SIPGEN_ETH_LEN, *src, *dst;
+	uint16_t sum;
+
+	/* Ethernet, the client and the server each with a MAC of their own */
+	memcpy (pkt, from_client ? "\x00\x00\x5e\x00\x53\x01" : "\x02\x00\x00\x00\x00\x00", 6);
+	memcpy (pkt + 6, from_client ? "\x02\x00\x00\x00\x00\x00" : "\x00\x00\x5e\x00\x53\x01", 6);
+	pkt[12] = d->v6 ? 0x86 : 0x08;
+	pkt[13] = d->v6 ? 0xdd : 0x00;
+
+	if (d->v6) {
+		memset (ip, 0, SIPGEN_IP6_LEN);
+		ip[0] = 0x60;
+		ip[4] = l4_len >> 8;
+		ip[5] = l4_len;
+		ip[6] = proto;
+		ip[7] = 64;
+		src = ip + (from_client ? 8 : 24);
+		dst = ip + (from_client ? 24 : 8);
+		/* client 2001:db8:1::id, server 2001:db8::1 */
+		memcpy (src, "\x20\x01\x0d\xb8\x00\x01\x00\x00\x00\x00\x00\x00", 12);
+		src[12] = d->id >> 24;
+		src[13] = d->id >> 16;
+		src[14] = d->id >> 8;
+		src[15] = d->id;
+		memcpy (dst, "\x20\x01\x0d\xb8\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01", 16);
+		return SIPGEN_ETH_LEN + SIPGEN_IP6_LEN;
+	}
+
+	memset (ip, 0, SIPGEN_IP4_LEN);
+	ip[0] = 0x45;
+	ip[2] = (SIPGEN_IP4_LEN + l4_len) >> 8;
+	ip[3] = SIPGEN_IP4_LEN + l4_len;
+	ip[4] = ip_id >> 8;
+	ip[5] = ip_id;
+	ip[8] = 64;
+	ip[9] = proto;
+	src = ip + (from_client ? 12 : 16);
+	dst = ip + (from_client ? 16 : 12);
+	/* client 10.1.x.y, server 10.0.0.1 */
+	src[0] = 10;
+	src[1] = 1;
+	src[2] = d->id >> 8;
+	src[3] = d->id;
+	memcpy (dst, "\x0a\x00\x00\x01", 4);
+
+	sum = checksum_fold (checksum_add (0, ip, SIPGEN_IP4_LEN));
+	ip[10] = sum >> 8;
+	ip[11] = sum;
+
+	return SIPGEN_ETH_LEN + SIPGEN_IP4_LEN;
+}
+
+
+static uint16_t
+l4_checksum (const unsigned char *pkt, const struct dialog *d, uint8_t proto, const unsigned char *l4, size_t len)
+{
+	const unsigned char *ip = pkt + SIPGEN_ETH_LEN;
+	unsigned char pseudo[4] = { 0, proto, len >> 8, len };
+	uint32_t sum;
+	uint16_t res;
+
+	/* source and destination address, then protocol and length */
+	sum = d->v6 ? checksum_add (0, ip + 8, 32) : checksum_add (0, ip + 12, 8);
+	sum = checksum_add (sum, pseudo, 4);
+	sum = checksum_add (sum, l4, len);
+
+	res = checksum_fold (sum);
+	return res ? res : 0xffff;
+}
+
+
+static uint32_t
+checksum_add (uint32_t sum, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	if (len & 1)
+		sum += p[len - 1] << 8;
+
+	return sum;
+}
+
+
+static uint16_t
+checksum_fold (uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+
+static void
+write_packet (const unsigned char *pkt, size_t len)
+{
+	uint32_t rec[4];
+
+	rec[0] = ts_usec / 1000000;
+	rec[1] = ts_usec % 1000000;
+	rec[2] = len;
+	rec[3] = len;
+
+	fwrite (rec, sizeof (rec), 1, out);
+	fwrite (pkt, len, 1, out);
+
+	ts_usec += 1000000 / rate ? 1000000 / rate : 1;
+	packets++;
+	bytes += sizeof (rec) + len;
+}
@@ -51,8 +51,11 @@
 #include <pwd.h>
 #endif
 
-#if defined(LINUX)
+#if defined(LINUX) || HAVE_GETOPT_LONG
 #include <getopt.h>
+#endif
+
+#if defined(LINUX)
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <ctype.h>
@@ -108,7 +111,20 @@
 #endif
 
 #include <pcre.h>
+#include "callidx.h"
 #include "core_hep.h"
+#include "dedup.h"
+#include "dialogdump.h"
+#include "flightrec.h"
+#include "metrics.h"
+#include "cdrfile.h"
+#include "jsonout.h"
+#include "mpscring.h"
+#include "pcapfiles.h"
+#include "pcapmmap.h"
+#include "pcapzdump.h"
+#include "selfstats.h"
+#include "transact.h"
 #include "sipgrep.h"
 #include "sipparse.h"
 
@@ -131,7 +147,9 @@ uint8_t invert_match = 0;
 uint8_t live_read = 1, want_delay = 0;
 uint8_t dont_dropprivs = 0, ignore_bad_sip = 0;
 
-char *read_file = NULL, *dump_file = NULL;
+char *read_file = NULL, *dump_file = NULL, *retrieve_callid = NULL;
+char *dialogs_dir = NULL, *dialogs_done_dir = NULL;
+unsigned int read_threads = 0;
 char *usedev = NULL;
 
 char nonprint_char = '.';
@@ -139,6 +157,7 @@ char nonprint_char = '.';
 struct callid_table *dialogs = NULL;
 struct callid_remove *dialogs_remove = NULL;
 struct statistics_table *statstable = NULL;
+struct statistics_table *statstotal = NULL;
 /*
  * GNU PCRE
  */
@@ -171,6 +190,11 @@ uint8_t radiotap_present = 0;
 
 pcap_t *pd = NULL;
 pcap_dumper_t *pd_dump = NULL;
+struct pcap_zdump *zd_dump = NULL;
+struct callidx *dump_index = NULL;
+struct flightrec *prebuffer = NULL;
+unsigned long prebuffer_size = 0;
+unsigned int prebuffer_secs = 0;
 struct bpf_program pcapfilter;
 struct in_addr net, mask;
 int file_counter = 0;
@@ -191,19 +215,46 @@ struct reasm_ip *reasm = NULL;
 int16_t stats_duration = 0;
 int8_t stats_enable = 0;
 
+/* self statistics */
+int8_t selfstats_enable = 0;
+unsigned int selfstats_interval = 0;
+
 int8_t tcpdefrag_enable = 1;
 struct tcpreasm_ip *tcpreasm = NULL;
 
 char *sip_from_filter = NULL, *sip_to_filter = NULL, *sip_contact_filter = NULL;
-char *custom_filter = NULL, *homer_capture_url = NULL;
+char *custom_filter = NULL, *homer_capture_url = NULL, *hep_listen_url = NULL;
+char *metrics_url = NULL;
+char *cdr_file = NULL, *cdr_rotate = NULL;
+uint8_t json_output = 0;
+uint8_t transact_enable = 0;
+struct transact_table *transactions = NULL;
+uint8_t dedup_mode = 0;
+struct dedup_set *dedup = NULL;
+
+#define SIPGREP_OPTIONS "axNhCXViwmpevlDTRMGJgs:n:c:q:H:E:B:u:k:Z:L:W:d:A:I:O:S:F:P:f:t:j:K:Q:z:r:o:b:Y:U:y:"
+
+#if HAVE_GETOPT_LONG
+/* the letters have run out, what comes after has a name only */
+#define OPT_JSON 256
+#define OPT_TRANSACTIONS 257
+#define OPT_DEDUP 258
+
+struct option long_options[] = {
+  {"json", optional_argument, NULL, OPT_JSON},
+  {"transactions", no_argument, NULL, OPT_TRANSACTIONS},
+  {"dedup", optional_argument, NULL, OPT_DEDUP},
+  {NULL, 0, NULL, 0}
+};
+#endif
 
 /* default dialog match */
 uint8_t dialog_match = 1;
 
 uint8_t use_color = 1, enable_dialog_remove = 1, print_report = 0, kill_friendlyscanner = 0;
 
-/* homer socket */
-int homer_sock = 0, use_homer = 0;
+/* homer collectors */
+int use_homer = 0;
 
 /* kill time */
 unsigned int stop_working_value = 0, write_deadline = 0, stop_working_type = 0, split_file_value = 0, split_file_type = 0;
@@ -224,17 +275,23 @@ int
 main (int argc, char **argv)
 {
   int32_t c;
+  struct pcap_mmap *pm;
+  int read_in_place = 0;
 
   signal (SIGINT, clean_exit);
   signal (SIGABRT, clean_exit);
+  signal (SIGUSR1, selfstats_request);
 
   /* default timestamp */
   print_time = &print_time_absolute;
   
   start_time = (unsigned) time (NULL);
 
-  while ((c = getopt (argc, argv, "axNhCXViwmpevlDTRMGJgs:n:c:q:H:d:A:I:O:S:F:P:f:t:j:K:Q:z:"))
-	 != EOF) {
+#if HAVE_GETOPT_LONG
+  while ((c = getopt_long (argc, argv, SIPGREP_OPTIONS, long_options, NULL)) != EOF) {
+#else
+  while ((c = getopt (argc, argv, SIPGREP_OPTIONS)) != EOF) {
+#endif
     switch (c) {
 
     case 'x':
@@ -246,6 +303,10 @@ main (int argc, char **argv)
     case 'S':
       limitlen = atoi (optarg);
       break;
+    case 'Y':
+      selfstats_interval = atoi (optarg);
+      selfstats_enable = 1;
+      break;
     case 'z':
       quiet = 5;
       last_stats_dump = start_time;
@@ -290,11 +351,26 @@ main (int argc, char **argv)
     case 'O':
       dump_file = optarg;
       break;
+    case 'o':
+      dialogs_dir = optarg;
+      if ((dialogs_done_dir = strchr (optarg, ',')))
+	*dialogs_done_dir++ = '\0';
+      break;
     case 'P':
       portrange = optarg;
       break;
     case 'I':
       read_file = optarg;
+      if (pcapfiles_add (optarg) < 0) {
+	fprintf (stderr, "fatal: no capture files in %s\n", optarg);
+	exit (1);
+      }
+      break;
+    case 'r':
+      retrieve_callid = optarg;
+      break;
+    case 'W':
+      read_threads = atoi (optarg);
       break;
     case 'A':
       match_after = atoi (optarg) + 1;
@@ -318,6 +394,63 @@ main (int argc, char **argv)
       homer_capture_url = optarg;
       use_homer = 1;
       break;
+    case 'L':
+      hep_listen_url = optarg;
+      break;
+    case 'U':
+      metrics_url = optarg;
+      break;
+    case 'y':
+      cdr_file = optarg;
+      if ((cdr_rotate = strchr (optarg, ',')))
+	*cdr_rotate++ = '\0';
+      break;
+#if HAVE_GETOPT_LONG
+    case OPT_JSON:
+      if (optarg && strcmp (optarg, "raw")) {
+	fprintf (stderr, "bad --json '%s', should be --json or --json=raw\n", optarg);
+	usage (-1);
+      }
+      json_output = optarg ? 2 : 1;
+      /* nothing but the records on stdout */
+      if (quiet < 2)
+	quiet = 2;
+      break;
+    case OPT_TRANSACTIONS:
+      transact_enable = 1;
+      break;
+    case OPT_DEDUP:
+      if (optarg && strcmp (optarg, "flag")) {
+	fprintf (stderr, "bad --dedup '%s', should be --dedup or --dedup=flag\n", optarg);
+	usage (-1);
+      }
+      dedup_mode = optarg ? DEDUP_FLAG : DEDUP_SKIP;
+      break;
+#endif
+    case 'E':
+      hep_replicas = atoi (optarg);
+      break;
+    case 'B':
+      if (parse_hep_queue_request (optarg) != 0) {
+	usage (-1);
+	exit (1);
+      }
+      break;
+    case 'b':
+      if (parse_prebuffer_request (optarg) != 0) {
+	usage (-1);
+	exit (1);
+      }
+      break;
+    case 'u':
+      hep_capture_id = strtoul (optarg, NULL, 10);
+      break;
+    case 'k':
+      capt_password = optarg;
+      break;
+    case 'Z':
+      pl_compress = atoi (optarg);
+      break;
     case 'n':
       max_matches = atoi (optarg);
       break;
@@ -399,25 +532,79 @@ main (int argc, char **argv)
 
   if (use_homer) {
 
-    if (!homer_capture_url || make_homer_socket (homer_capture_url)) {
+    if (!homer_capture_url || make_homer_collectors (homer_capture_url)) {
       fprintf (stderr, "bad homer url\n");
       usage (-1);
       exit (1);
     }
+
+    if (init_hepv3 () || hep_sender_start ())
+      exit (1);
   }
 
   if (argv[optind])
     match_data = argv[optind++];
 
-  if (read_file) {
+  if (retrieve_callid && !read_file) {
+    fprintf (stderr, "-r needs -I\n");
+    usage (-1);
+    exit (1);
+  }
+
+  if (hep_listen_url) {
+
+    if (read_file || usedev) {
+      fprintf (stderr, "-L can't be used with -I or -d\n");
+      usage (-1);
+      exit (1);
+    }
+
+    if (quiet < 2)
+      printf ("hep input: %s\n", hep_listen_url);
+
+    if (make_hep_listener (hep_listen_url)) {
+      fprintf (stderr, "bad hep listen url\n");
+      usage (-1);
+      exit (1);
+    }
+
+    /* messages get wrapped into Ethernet frames, see process_hep() */
+    pd = pcap_open_dead (DLT_EN10MB, snaplen);
+  }
+  else if (read_file) {
 
-    if (!(pd = pcap_open_offline (read_file, pc_err))) {
+    /* several files: put them in order of their first packet */
+    if (pcapfiles_count () > 1 && pcapfiles_prepare (pc_err) < 1) {
+      fprintf (stderr, "fatal: no readable capture files\n");
+      clean_exit (-1);
+    }
+
+    /* the first one stands in for all of them for link type, filter and -O;
+       files we read ourselves, compressed ones too, get a dead handle */
+    if ((pm = pcap_mmap_open (pcapfiles_name (0), pc_err))) {
+      pd = pcap_open_dead (pcap_mmap_datalink (pm), pcap_mmap_snaplen (pm));
+      pcap_mmap_close (pm);
+      read_in_place = 1;
+    }
+    else if (!(pd = pcap_open_offline (pcapfiles_name (0), pc_err))) {
       perror (pc_err);
       clean_exit (-1);
     }
 
+    /* a pipe can only be read once, by pd itself */
+    if (pcapfiles_count () > 1)
+      read_in_place = 1;
+
+    if (retrieve_callid && !read_in_place) {
+      fprintf (stderr, "fatal: -r needs capture files, not a pipe\n");
+      clean_exit (-1);
+    }
+
     live_read = 0;
-    printf ("input: %s\n", read_file);
+    if (!json_output && pcapfiles_count () > 1)
+      printf ("input: %d files, from %s\n", pcapfiles_count (), pcapfiles_name (0));
+    else if (!json_output)
+      printf ("input: %s\n", pcapfiles_name (0));
 
   }
   else {
@@ -522,7 +709,8 @@ main (int argc, char **argv)
   if (filter && quiet < 2)
     printf ("filter: %s\n", filter);
 
-  if (pcap_setfilter (pd, &pcapfilter)) {
+  /* a dead handle can't filter, process_hep() and pcapfiles_loop() apply it instead */
+  if (!hep_listen_url && !read_in_place && pcap_setfilter (pd, &pcapfilter)) {
     pcap_perror (pd, "pcap set");
     clean_exit (-1);
   }
@@ -622,14 +810,40 @@ main (int argc, char **argv)
     clean_exit (-1);
   }
 
-  if (dump_file) {
+  if (dump_file && open_dump ())
+    clean_exit (-1);
 
-    if (!(pd_dump = pcap_dump_open (pd, dump_file))) {
-      fprintf (stderr, "fatal: %s\n", pcap_geterr (pd));
-      clean_exit (-1);
-    }
-    else
-      printf ("output: %s\n", dump_file);
+  if (dialogs_dir && dialogdump_init (pd, dialogs_dir, dialogs_done_dir, pc_err)) {
+    fprintf (stderr, "fatal: %s\n", pc_err);
+    clean_exit (-1);
+  }
+
+  if (cdr_file && open_cdr_file ())
+    clean_exit (-1);
+
+  if (json_output)
+    jsonout_init (json_output == 2);
+
+  if (transact_enable && !(transactions = transact_new ())) {
+    fprintf (stderr, "fatal: unable to allocate the transaction table\n");
+    clean_exit (-1);
+  }
+
+  if (dedup_mode && !(dedup = dedup_new (DEDUP_WINDOW))) {
+    fprintf (stderr, "fatal: unable to allocate the retransmission set\n");
+    clean_exit (-1);
+  }
+
+  /* only of use where matched dialogs get written */
+  if (prebuffer_size && dialog_match && (dump_file || dialogs_dir) && !(prebuffer = flightrec_new (prebuffer_size, prebuffer_secs))) {
+    fprintf (stderr, "fatal: unable to allocate %lu bytes to keep packets in\n", prebuffer_size);
+    clean_exit (-1);
+  }
+
+  /* bound before privileges are dropped, a low port may be wanted */
+  if (metrics_url && metrics_start (metrics_url, pc_err)) {
+    fprintf (stderr, "fatal: %s\n", pc_err);
+    clean_exit (-1);
   }
 
   update_windowsize (0);
@@ -653,7 +867,38 @@ main (int argc, char **argv)
      tcpreasm_ip_set_timeout (tcpreasm, 30000000);
   }
 
-  while (pcap_loop (pd, 0, (pcap_handler) process, 0));
+  selfstats_init (selfstats_interval, selfstats_enable);
+  update_metrics ();
+
+  if (hep_listen_url)
+    hep_receiver_loop (process_hep, housekeeping);
+  else if (retrieve_callid) {
+    /* straight to the call's packets, through the index of each file */
+    for (c = 0; c < pcapfiles_count (); c++)
+      if (callidx_retrieve (pcapfiles_name (c), retrieve_callid, &pcapfilter, (pcap_handler) process, 0, pc_err) < 0)
+        fprintf (stderr, "skipping %s: %s\n", pcapfiles_name (c), pc_err);
+  }
+  else if (read_in_place) {
+    if (!read_threads)
+      read_threads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (pcapfiles_loop (read_threads, &pcapfilter, (pcap_handler) process, 0)) {
+      fprintf (stderr, "fatal: unable to start reader threads\n");
+      clean_exit (-1);
+    }
+  }
+  else if (read_file)
+    while (pcap_loop (pd, 0, (pcap_handler) process, 0));
+  else {
+    /* back at least every read timeout (to), whether packets came or not */
+    while ((c = pcap_dispatch (pd, -1, (pcap_handler) process, 0)) >= 0)
+      housekeeping ();
+
+    /* -2 is pcap_breakloop(), a way out like any other */
+    if (c == -1) {
+      fprintf (stderr, "fatal: %s\n", pcap_geterr (pd));
+      clean_exit (-1);
+    }
+  }
 
   clean_exit (0);
 
@@ -675,10 +920,8 @@ create_dump (unsigned int now)
 
   if (check_split_deadline (now) == 0) {
     /* do close and create a new one */
-    if (pd_dump) {
-      pcap_dump_flush (pd_dump);
-      pcap_dump_close (pd_dump);
-    }
+    if (pd_dump || zd_dump)
+      close_dump ();
     else {
       fprintf (stderr, "fatal: file not opened\n");
       clean_exit (-1);
@@ -694,6 +937,15 @@ create_dump (unsigned int now)
     len = strlen (dump_file);
 
     if ((file_ext = strrchr (dump_file, '.'))) {
+      /* keep .pcap.zst whole */
+      if (zd_dump || pcap_zdump_wanted (dump_file)) {
+	char *ext = file_ext;
+	while (ext > dump_file && ext[-1] != '.' && ext[-1] != '/')
+	  ext--;
+	if (ext - 1 > dump_file && ext[-1] == '.')
+	  file_ext = ext - 1;
+      }
+
       if (file_ext == dump_file)
 	file_ext = NULL;
       else
@@ -708,17 +960,134 @@ create_dump (unsigned int now)
       fprintf (stderr, "unable to rename the file '%s' to '%s' %d\n", dump_file, file_ts, len);
     }
 
-    if (!(pd_dump = pcap_dump_open (pd, dump_file))) {
-      fprintf (stderr, "fatal: %s\n", pcap_geterr (pd));
+    /* the index goes along */
+    if (dump_index) {
+      char idx_from[256], idx_to[sizeof (file_ts) + sizeof (CALLIDX_SUFFIX)];
+
+      snprintf (idx_from, sizeof (idx_from), "%s" CALLIDX_SUFFIX, dump_file);
+      snprintf (idx_to, sizeof (idx_to), "%s" CALLIDX_SUFFIX, file_ts);
+      if ((len = rename (idx_from, idx_to)) != 0)
+	fprintf (stderr, "unable to rename the file '%s' to '%s' %d\n", idx_from, idx_to, len);
+    }
+
+    if (open_dump ())
+      clean_exit (-1);
+  }
+}
+
+int
+open_dump (void)
+{
+
+  /* a .zst or .lz4 name asks for compressed output */
+  if (pcap_zdump_wanted (dump_file))
+    zd_dump = pcap_zdump_open (pd, dump_file, pc_err);
+  else if (!(pd_dump = pcap_dump_open (pd, dump_file)))
+    snprintf (pc_err, sizeof (pc_err), "%s", pcap_geterr (pd));
+
+  if (!pd_dump && !zd_dump) {
+    fprintf (stderr, "fatal: %s\n", pc_err);
+    return -1;
+  }
+
+  /* stdout has nowhere to keep an index */
+  if (!dump_index && strcmp (dump_file, "-") && !(dump_index = callidx_new ())) {
+    fprintf (stderr, "fatal: out of memory\n");
+    return -1;
+  }
+
+  printf ("output: %s\n", dump_file);
+  return 0;
+}
+
+void
+close_dump (void)
+{
+
+  /* a compressed file gets finished by the writer thread */
+  if (zd_dump)
+    pcap_zdump_close (zd_dump);
+
+  if (pd_dump) {
+    pcap_dump_flush (pd_dump);
+    pcap_dump_close (pd_dump);
+  }
+
+  if ((pd_dump || zd_dump) && dump_index && callidx_write (dump_index, dump_file, pc_err))
+    fprintf (stderr, "%s\n", pc_err);
+
+  zd_dump = NULL;
+  pd_dump = NULL;
+}
+
+unsigned long long
+tell_dump (void)
+{
+  return zd_dump ? pcap_zdump_tell (zd_dump) : (unsigned long long) pcap_dump_ftell (pd_dump);
+}
+
+void
+write_dump (const struct pcap_pkthdr *h, const u_char * p)
+{
+  if (zd_dump)
+    pcap_zdump ((u_char *) zd_dump, h, p);
+  else {
+    pcap_dump ((u_char *) pd_dump, h, p);
+    pcap_dump_flush (pd_dump);
+  }
+}
+
+void
+index_dump (struct pcap_pkthdr *h, unsigned char *data, uint32_t len, unsigned long long offset)
+{
+  unsigned int start, msg_len;
+  str callid;
+
+  /* every message in the packet, TCP may carry several */
+  while (len > 0) {
+    if (!(msg_len = sip_frame_message (data, len, &start))) {
+      start = 0;
+      msg_len = len;
+    }
+
+    if (extract_callid (data + start, msg_len, &callid) && !callidx_add (dump_index, callid.s, callid.len, offset, &h->ts)) {
+      fprintf (stderr, "fatal: out of memory\n");
       clean_exit (-1);
     }
-    else
-      printf ("output: %s\n", dump_file);
+
+    data += start + msg_len;
+    len -= start + msg_len;
   }
 }
 
+/*
+ * What is due every so often, the -Y statistics, SIGUSR1 and the
+ * metrics: done for every packet, and by the input loops while idle.
+ */
+void
+housekeeping (void)
+{
+  if (hep_listen_url)
+    selfstats_check (NULL, NULL, NULL, transactions, dedup);
+  else
+    selfstats_check (read_file ? NULL : pd, reasm, tcpreasm, transactions, dedup);
+  update_metrics ();
+}
+
 void
 process (u_char * d, struct pcap_pkthdr *h, u_char * p)
+{
+  uint64_t start;
+
+  housekeeping ();
+
+  start = selfstats_start ();
+  process_packet (d, h, p);
+  selfstats_stop (SELFSTATS_CAPTURED, start, 1);
+}
+
+void
+process_packet (u_char * d, struct pcap_pkthdr *h, u_char * p)
 {
   struct ip *ip4_pkt = (struct ip *) (p + link_offset);
 #if USE_IPv6
@@ -741,6 +1110,7 @@ process (u_char * d, struct pcap_pkthdr *h, u_char * p)
 
   unsigned char *data, *datatcp;
   uint32_t len = h->caplen;
+  uint64_t start;
 
 #if HAVE_DLT_IEEE802_11_RADIO
   if (radiotap_present) {
@@ -751,17 +1121,17 @@ process (u_char * d, struct pcap_pkthdr *h, u_char * p)
 #endif
 
 
-  u_char *packet = NULL;
   if (reasm != NULL) {
     unsigned new_len;
-    u_char *new_p = malloc (len - link_offset - ((ntohs ((uint16_t) * (p + 12)) == 0x8100) ? 4 : 0));
-    memcpy (new_p, ip4_pkt, len - link_offset - ((ntohs ((uint16_t) * (p + 12)) == 0x8100) ? 4 : 0));
-    packet =
-      reasm_ip_next (reasm, new_p,
-		     len - link_offset - ((ntohs ((uint16_t) * (p + 12)) == 0x8100) ? 4 : 0), (reasm_time_t) 1000000UL * h->ts.tv_sec + h->ts.tv_usec, &new_len);
+    unsigned vlan_len = (ntohs ((uint16_t) * (p + 12)) == 0x8100) ? 4 : 0;
+    uint64_t start = selfstats_start ();
+    u_char *packet = reasm_ip_next (reasm, (u_char *) ip4_pkt, len - link_offset - vlan_len,
+				    (reasm_time_t) 1000000UL * h->ts.tv_sec + h->ts.tv_usec, &new_len);
+    /* a packet that was not a fragment comes back as it is */
+    selfstats_stop (SELFSTATS_REASSEMBLED, start, packet != NULL && packet != (u_char *) ip4_pkt);
     if (packet == NULL)
       return;
-    len = new_len + link_offset + ((ntohs ((uint16_t) * (packet + 12)) == 0x8100) ? 4 : 0);
+    len = new_len + link_offset + vlan_len;
     h->len = new_len;
     h->caplen = new_len;
 
@@ -835,37 +1205,47 @@ process (u_char * d, struct pcap_pkthdr *h, u_char * p)
       data = (unsigned char *) (tcp_pkt) + tcphdr_offset;
       len -= link_offset + ip_hl + tcphdr_offset;
 
-#if USE_IPv6
-      if (ip_ver == 6)
-	len -= ntohs (ip6_pkt->ip6_plen);
-#endif
-
       if ((int32_t) len < 0)
 	len = 0;
+
+#if USE_IPv6
+      /* anything past the payload length is link layer padding */
+      if (ip_ver == 6 && len > ntohs (ip6_pkt->ip6_plen) + sizeof (struct ip6_hdr) - ip_hl - tcphdr_offset)
+	len = ntohs (ip6_pkt->ip6_plen) + sizeof (struct ip6_hdr) - ip_hl - tcphdr_offset;
+#endif
 		
-	 if(tcpreasm != NULL && tcpdefrag_enable && (len > 0) && (tcp_pkt->th_flags & TH_ACK)) {
+	 /* SYN, FIN and RST without payload still move the stream state */
+	 if(tcpreasm != NULL && tcpdefrag_enable && (len > 0 || (tcp_pkt->th_flags & (TH_SYN | TH_FIN | TH_RST)))) {
 
 			unsigned new_len;
+			const void *tcp_src = &ip4_pkt->ip_src, *tcp_dst = &ip4_pkt->ip_dst;
+#if USE_IPv6
+			if (ip_ver == 6) {
+				tcp_src = &ip6_pkt->ip6_src;
+				tcp_dst = &ip6_pkt->ip6_dst;
+			}
+#endif
 			u_char *new_p_2 = malloc(len+10);
 			memcpy(new_p_2, data, len);
 	
 			if((tcp_pkt->th_flags & TH_PUSH)) psh = 1;
 			
 			if(debug)		
-        			printf("DEFRAG TCP process: EN:[%d], LEN:[%d], ACK:[%d], PSH[%d]\n", 
-			                        tcpdefrag_enable, len, (tcp_pkt->th_flags & TH_ACK), psh);
+        			printf("DEFRAG TCP process: EN:[%d], LEN:[%d], ACK:[%d], PSH[%d], SEQ[%u]\n", 
+			                        tcpdefrag_enable, len, (tcp_pkt->th_flags & TH_ACK), psh, ntohl(tcp_pkt->th_seq));
 			
-	                datatcp = tcpreasm_ip_next_tcp(tcpreasm, new_p_2, len , (tcpreasm_time_t) 1000000UL * h->ts.tv_sec + h->ts.tv_usec, &new_len, &ip4_pkt->ip_src, &ip4_pkt->ip_dst, ntohs(tcp_pkt->th_sport), ntohs(tcp_pkt->th_dport), psh);
-
+			start = selfstats_start ();
+	                datatcp = tcpreasm_ip_next_tcp(tcpreasm, new_p_2, len , (tcpreasm_time_t) 1000000UL * h->ts.tv_sec + h->ts.tv_usec, &new_len, ip_ver, tcp_src, tcp_dst, ntohs(tcp_pkt->th_sport), ntohs(tcp_pkt->th_dport), ntohl(tcp_pkt->th_seq), tcp_pkt->th_flags);
+			selfstats_stop (SELFSTATS_REASSEMBLED, start, datatcp != NULL);
 
-        	        if (datatcp == NULL) return;
+        	        if (datatcp != NULL) {
         	                	        
 	                len = new_len;
 	            
 	                if(debug)     
 	                {
 	                    printf("========================================================\n");
-	                    printf("COMPLETE TCP DEFRAG: LEN[%d], PACKET:[%s]\n", len, datatcp);
+	                    printf("COMPLETE TCP DEFRAG: LEN[%d], PACKET:[%.*s]\n", len, len, datatcp);
 	                    printf("========================================================\n");
                         }
 
@@ -874,7 +1254,7 @@ process (u_char * d, struct pcap_pkthdr *h, u_char * p)
 	                
 	                /* clear datatcp */
         	        free(datatcp);
-                    
+                        }
 	   }
 
            else {
@@ -893,14 +1273,15 @@ process (u_char * d, struct pcap_pkthdr *h, u_char * p)
       data = (unsigned char *) (udp_pkt) + udphdr_offset;
       len -= link_offset + ip_hl + udphdr_offset;
 
-#if USE_IPv6
-      if (ip_ver == 6)
-	len -= ntohs (ip6_pkt->ip6_plen);
-#endif
-
       if ((int32_t) len < 0)
 	len = 0;
 
+#if USE_IPv6
+      /* anything past the payload length is link layer padding */
+      if (ip_ver == 6 && len > ntohs (ip6_pkt->ip6_plen) + sizeof (struct ip6_hdr) - ip_hl - udphdr_offset)
+	len = ntohs (ip6_pkt->ip6_plen) + sizeof (struct ip6_hdr) - ip_hl - udphdr_offset;
+#endif
+
       dump_packet (h, p, ip_proto, data, len, ip_src, ip_dst,
 #if HAVE_DUMB_UDPHDR
 		   ntohs (udp_pkt->source), ntohs (udp_pkt->dest), 0,
@@ -972,8 +1353,119 @@ process (u_char * d, struct pcap_pkthdr *h, u_char * p)
 
   }
 
-  if (packet != NULL)
-    free (packet);
+  if (max_matches && matches >= max_matches)
+    clean_exit (0);
+
+  if (match_after && keep_matching)
+    keep_matching--;
+}
+
+/*
+ * A message received over HEP (-L) is rebuilt into an Ethernet frame,
+ * so the BPF filter, -O and everything after dump_packet() work as they
+ * do for captured traffic. HEP already carries whole messages, so there
+ * is nothing to reassemble.
+ */
+void
+process_hep (rc_info_t * rcinfo, unsigned char *data, unsigned int len)
+{
+
+  static u_char frame[ETHHDR_SIZE + 40 + 20 + 65535];
+  struct pcap_pkthdr h;
+  struct ip *ip4_pkt = (struct ip *) (frame + ETHHDR_SIZE);
+#if USE_IPv6
+  struct ip6_hdr *ip6_pkt = (struct ip6_hdr *) (frame + ETHHDR_SIZE);
+#endif
+  unsigned char *l4;
+  uint32_t ip_ver, ip_hl, l4_hl;
+  uint8_t flags = 0;
+  uint64_t start;
+
+  if (rcinfo->ip_proto == IPPROTO_TCP) {
+    l4_hl = sizeof (struct tcphdr);
+    flags = TH_ACK | TH_PUSH;
+  }
+  else {
+    rcinfo->ip_proto = IPPROTO_UDP;
+    l4_hl = sizeof (struct udphdr);
+  }
+
+  if (len > 65535 - 40 - l4_hl)
+    len = 65535 - 40 - l4_hl;
+
+  memset (frame, 0, ETHHDR_SIZE + 40 + 20);
+
+  if (rcinfo->ip_family == AF_INET) {
+    ip_ver = 4;
+    ip_hl = sizeof (struct ip);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+    ip4_pkt->ip_v = 4;
+    ip4_pkt->ip_hl = ip_hl / 4;
+    ip4_pkt->ip_len = htons (ip_hl + l4_hl + len);
+    ip4_pkt->ip_ttl = 64;
+    ip4_pkt->ip_p = rcinfo->ip_proto;
+    if (inet_pton (AF_INET, rcinfo->src_ip, &ip4_pkt->ip_src) != 1 || inet_pton (AF_INET, rcinfo->dst_ip, &ip4_pkt->ip_dst) != 1)
+      return;
+  }
+#if USE_IPv6
+  else if (rcinfo->ip_family == AF_INET6) {
+    ip_ver = 6;
+    ip_hl = sizeof (struct ip6_hdr);
+    frame[12] = 0x86;
+    frame[13] = 0xdd;
+    ip6_pkt->ip6_vfc = 6 << 4;
+    ip6_pkt->ip6_plen = htons (l4_hl + len);
+    ip6_pkt->ip6_nxt = rcinfo->ip_proto;
+    ip6_pkt->ip6_hlim = 64;
+    if (inet_pton (AF_INET6, rcinfo->src_ip, &ip6_pkt->ip6_src) != 1 || inet_pton (AF_INET6, rcinfo->dst_ip, &ip6_pkt->ip6_dst) != 1)
+      return;
+  }
+#endif
+  else
+    return;
+
+  l4 = frame + ETHHDR_SIZE + ip_hl;
+
+  if (rcinfo->ip_proto == IPPROTO_TCP) {
+    struct tcphdr *tcp_pkt = (struct tcphdr *) l4;
+    tcp_pkt->th_sport = htons (rcinfo->src_port);
+    tcp_pkt->th_dport = htons (rcinfo->dst_port);
+    tcp_pkt->th_off = l4_hl / 4;
+    tcp_pkt->th_flags = flags;
+  }
+  else {
+    struct udphdr *udp_pkt = (struct udphdr *) l4;
+#if HAVE_DUMB_UDPHDR
+    udp_pkt->source = htons (rcinfo->src_port);
+    udp_pkt->dest = htons (rcinfo->dst_port);
+    udp_pkt->len = htons (l4_hl + len);
+#else
+    udp_pkt->uh_sport = htons (rcinfo->src_port);
+    udp_pkt->uh_dport = htons (rcinfo->dst_port);
+    udp_pkt->uh_ulen = htons (l4_hl + len);
+#endif
+  }
+
+  memcpy (l4 + l4_hl, data, len);
+
+  h.ts.tv_sec = rcinfo->time_sec;
+  h.ts.tv_usec = rcinfo->time_usec;
+  h.caplen = h.len = ETHHDR_SIZE + ip_hl + l4_hl + len;
+
+  if (!pcap_offline_filter (&pcapfilter, &h, frame))
+    return;
+
+  if (quiet < 1) {
+    printf ("#");
+    fflush (stdout);
+  }
+
+  housekeeping ();
+
+  start = selfstats_start ();
+  dump_packet (&h, frame, rcinfo->ip_proto, l4 + l4_hl, len, rcinfo->src_ip, rcinfo->dst_ip, rcinfo->src_port, rcinfo->dst_port, flags, l4_hl, 0, 0, 0, ip_ver);
+  selfstats_stop (SELFSTATS_CAPTURED, start, 1);
 
   if (max_matches && matches >= max_matches)
     clean_exit (0);
@@ -1029,6 +1521,113 @@ error:
 }
 
 
+int
+open_cdr_file (void)
+{
+
+  unsigned int secs = 0;
+  unsigned long kb = 0;
+
+  if (cdr_rotate) {
+    if (!memcmp (cdr_rotate, "duration:", 9))
+      secs = atoi (cdr_rotate + 9);
+    else if (!memcmp (cdr_rotate, "filesize:", 9))
+      kb = atol (cdr_rotate + 9);
+
+    if (!secs && !kb) {
+      fprintf (stderr, "bad CDR rotation '%s', should be 'duration:NUM' or 'filesize:NUM'\n", cdr_rotate);
+      return -1;
+    }
+  }
+
+  if (cdrfile_open (cdr_file, secs, kb, pc_err)) {
+    fprintf (stderr, "fatal: %s\n", pc_err);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int
+parse_hep_queue_request (char *request)
+{
+
+  char *end = NULL;
+  unsigned long size = strtoul (request, &end, 10);
+
+  switch (*end) {
+  case 'k':
+  case 'K':
+    size *= 1024;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    size *= 1024 * 1024;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    size *= 1024 * 1024 * 1024;
+    end++;
+    break;
+  }
+
+  if (!*end)
+    hep_sender_policy = MPSC_DROP_NEWEST;
+  else if (!strcmp (end, ":newest"))
+    hep_sender_policy = MPSC_DROP_NEWEST;
+  else if (!strcmp (end, ":oldest"))
+    hep_sender_policy = MPSC_DROP_OLDEST;
+  else {
+    printf ("bad format, should be 'SIZE[K|M|G][:newest|:oldest]'\n");
+    return -1;
+  }
+
+  hep_sender_ring_size = size;
+  return 0;
+}
+
+
+int
+parse_prebuffer_request (char *request)
+{
+
+  char *end = NULL;
+  unsigned long size = strtoul (request, &end, 10);
+
+  switch (*end) {
+  case 'k':
+  case 'K':
+    size *= 1024;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    size *= 1024 * 1024;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    size *= 1024 * 1024 * 1024;
+    end++;
+    break;
+  }
+
+  if (*end == ':')
+    prebuffer_secs = strtoul (end + 1, &end, 10);
+
+  if (*end || size == 0) {
+    printf ("bad format, should be 'SIZE[K|M|G][:SECONDS]'\n");
+    return -1;
+  }
+
+  prebuffer_size = size;
+  return 0;
+}
+
+
 int
 check_split_deadline (unsigned int now)
 {
@@ -1090,12 +1689,188 @@ int dump_statistics (unsigned int last, unsigned int now)
 
 	printf("%d;%d;%s;%s;%s;%d;%d\n", last, now, st->method, st->orig_method, st->cseq_method, st->req, st->count);
         HASH_DEL (statstable, st);
-        free (st);
+        add_statistics_total (st);
     }
     
     return 1;
 }
 
+/* the counts of a dumped entry, kept for the metrics, which never go down */
+void
+add_statistics_total (struct statistics_table *st)
+{
+
+  struct statistics_table *total = NULL;
+
+  if (!metrics_url) {
+    free (st);
+    return;
+  }
+
+  HASH_FIND_STR (statstotal, st->method, total);
+  if (total) {
+    total->count += st->count;
+    free (st);
+  }
+  else
+    HASH_ADD_STR (statstotal, method, st);
+}
+
+/*
+ * Render the metrics for the endpoint, once a second at most. Counters
+ * are the totals since start; the -z statistics of a message are in
+ * statstable until dumped, and in statstotal after.
+ */
+void
+update_metrics (void)
+{
+
+  static time_t last = 0;
+  time_t now;
+  struct statistics_table *st, *sttmp, *total;
+  struct pcap_stat ps;
+  int i;
+
+  if (!metrics_url || (now = time (NULL)) == last)
+    return;
+  last = now;
+
+  metrics_begin ();
+
+  metrics_family ("sipgrep_build", "info", "Version of sipgrep.");
+  metrics_sample ("sipgrep_build_info", 1, "version", VERSION, NULL);
+
+  metrics_family ("sipgrep_sip_messages", "counter", "SIP messages by request method or reply code, and CSeq method.");
+  HASH_ITER (hh, statstable, st, sttmp) {
+    HASH_FIND_STR (statstotal, st->method, total);
+    metrics_sample ("sipgrep_sip_messages_total", (unsigned long long) st->count + (total ? total->count : 0),
+		    "method", st->orig_method, "cseq_method", st->cseq_method, "type", st->req ? "request" : "reply", NULL);
+  }
+  HASH_ITER (hh, statstotal, total, sttmp) {
+    HASH_FIND_STR (statstable, total->method, st);
+    if (!st)
+      metrics_sample ("sipgrep_sip_messages_total", total->count,
+		      "method", total->orig_method, "cseq_method", total->cseq_method, "type", total->req ? "request" : "reply", NULL);
+  }
+
+  metrics_family ("sipgrep_dialogs", "gauge", "Dialogs being followed.");
+  metrics_sample ("sipgrep_dialogs", HASH_COUNT (dialogs), NULL);
+  metrics_family ("sipgrep_dialogs_ending", "gauge", "Dialogs that have ended, waiting to be removed.");
+  metrics_sample ("sipgrep_dialogs_ending", HASH_COUNT (dialogs_remove), NULL);
+
+  metrics_family ("sipgrep_packets", "counter", "Packets and messages through each stage of sipgrep.");
+  metrics_sample ("sipgrep_packets_total", selfstats[SELFSTATS_CAPTURED].count, "stage", "captured", NULL);
+  metrics_sample ("sipgrep_packets_total", selfstats[SELFSTATS_REASSEMBLED].count, "stage", "reassembled", NULL);
+  metrics_sample ("sipgrep_packets_total", selfstats[SELFSTATS_PARSED].count, "stage", "parsed", NULL);
+  metrics_sample ("sipgrep_packets_total", selfstats[SELFSTATS_MATCHED].count, "stage", "matched", NULL);
+  metrics_sample ("sipgrep_packets_total", selfstats[SELFSTATS_OUTPUT].count, "stage", "output", NULL);
+  metrics_sample ("sipgrep_packets_total", selfstats[SELFSTATS_HEP].count, "stage", "hep", NULL);
+
+  if (pd && !read_file && !hep_listen_url && !pcap_stats (pd, &ps)) {
+    metrics_family ("sipgrep_pcap_received_packets", "counter", "Packets received, as told by pcap_stats().");
+    metrics_sample ("sipgrep_pcap_received_packets_total", ps.ps_recv, NULL);
+    metrics_family ("sipgrep_pcap_dropped_packets", "counter", "Packets dropped, by the kernel or by the interface.");
+    metrics_sample ("sipgrep_pcap_dropped_packets_total", ps.ps_drop, "by", "kernel", NULL);
+    metrics_sample ("sipgrep_pcap_dropped_packets_total", ps.ps_ifdrop, "by", "interface", NULL);
+  }
+
+  if (reasm) {
+    metrics_family ("sipgrep_reasm_waiting", "gauge", "Packets or streams waiting to be reassembled.");
+    metrics_sample ("sipgrep_reasm_waiting", reasm_ip_waiting (reasm), "proto", "ip", NULL);
+    if (tcpreasm)
+      metrics_sample ("sipgrep_reasm_waiting", tcpreasm_ip_waiting (tcpreasm), "proto", "tcp", NULL);
+    metrics_family ("sipgrep_reasm_max_waiting", "gauge", "Most packets or streams ever waiting at once.");
+    metrics_sample ("sipgrep_reasm_max_waiting", reasm_ip_max_waiting (reasm), "proto", "ip", NULL);
+    if (tcpreasm)
+      metrics_sample ("sipgrep_reasm_max_waiting", tcpreasm_ip_max_waiting (tcpreasm), "proto", "tcp", NULL);
+    metrics_family ("sipgrep_reasm_bytes", "gauge", "Bytes held for reassembly.");
+    metrics_sample ("sipgrep_reasm_bytes", reasm_ip_bytes (reasm), "proto", "ip", NULL);
+    if (tcpreasm)
+      metrics_sample ("sipgrep_reasm_bytes", tcpreasm_ip_bytes (tcpreasm), "proto", "tcp", NULL);
+    metrics_family ("sipgrep_reasm_timed_out", "counter", "Packets or streams given up waiting for the rest.");
+    metrics_sample ("sipgrep_reasm_timed_out_total", reasm_ip_timed_out (reasm), "proto", "ip", NULL);
+    if (tcpreasm)
+      metrics_sample ("sipgrep_reasm_timed_out_total", tcpreasm_ip_timed_out (tcpreasm), "proto", "tcp", NULL);
+    metrics_family ("sipgrep_reasm_evicted", "counter", "Packets or streams dropped to stay within the limits.");
+    metrics_sample ("sipgrep_reasm_evicted_total", reasm_ip_evicted (reasm), "proto", "ip", NULL);
+    if (tcpreasm)
+      metrics_sample ("sipgrep_reasm_evicted_total", tcpreasm_ip_evicted (tcpreasm), "proto", "tcp", NULL);
+    metrics_family ("sipgrep_reasm_dropped_fragments", "counter", "Fragments or segments that could not be used.");
+    metrics_sample ("sipgrep_reasm_dropped_fragments_total", reasm_ip_dropped_frags (reasm), "proto", "ip", NULL);
+    if (tcpreasm)
+      metrics_sample ("sipgrep_reasm_dropped_fragments_total", tcpreasm_ip_dropped_frags (tcpreasm), "proto", "tcp", NULL);
+  }
+
+  if (dedup) {
+    const struct dedup_stats *ds = dedup_stats (dedup);
+    metrics_family ("sipgrep_retransmitted_messages", "counter", "SIP messages found to be copies of one seen before, by fingerprint.");
+    metrics_sample ("sipgrep_retransmitted_messages_total", ds->duplicates, NULL);
+    metrics_family ("sipgrep_dedup_evicted", "counter", "Fingerprints put out of the set before their time, the set being full.");
+    metrics_sample ("sipgrep_dedup_evicted_total", ds->evicted, NULL);
+  }
+
+  if (transactions) {
+    const struct transact_stats *ts = transact_stats (transactions);
+    metrics_family ("sipgrep_transactions", "gauge", "SIP transactions being followed.");
+    metrics_sample ("sipgrep_transactions", transact_count (transactions), NULL);
+    metrics_family ("sipgrep_transactions_ended", "counter", "SIP transactions ended, with a final reply or without.");
+    metrics_sample ("sipgrep_transactions_ended_total", ts->completed, "how", "completed", NULL);
+    metrics_sample ("sipgrep_transactions_ended_total", ts->timed_out, "how", "timed_out", NULL);
+    metrics_family ("sipgrep_transactions_started", "counter", "SIP transactions started.");
+    metrics_sample ("sipgrep_transactions_started_total", ts->started, NULL);
+    metrics_family ("sipgrep_transactions_untracked", "counter", "SIP transactions not followed, the table being full.");
+    metrics_sample ("sipgrep_transactions_untracked_total", ts->untracked, NULL);
+    metrics_family ("sipgrep_orphan_replies", "counter", "SIP replies to a request not seen.");
+    metrics_sample ("sipgrep_orphan_replies_total", ts->orphan_replies, NULL);
+    metrics_family ("sipgrep_retransmissions", "counter", "SIP requests and replies sent again.");
+    metrics_sample ("sipgrep_retransmissions_total", ts->request_retrans, "of", "request", NULL);
+    metrics_sample ("sipgrep_retransmissions_total", ts->reply_retrans, "of", "reply", NULL);
+    metrics_family ("sipgrep_transaction_latency_seconds", "histogram", "Time from a SIP request to its first reply, and to its final one.");
+    latency_metrics ("first", ts->first_reply, ts->first_reply_us);
+    latency_metrics ("final", ts->final_reply, ts->final_reply_us);
+  }
+
+  if (hep_collectors_count) {
+    /* the sender thread counts these */
+    metrics_family ("sipgrep_hep_sent_messages", "counter", "HEP messages sent, by collector.");
+    for (i = 0; i < hep_collectors_count; i++)
+      metrics_sample ("sipgrep_hep_sent_messages_total", __atomic_load_n (&hep_collectors[i].sent, __ATOMIC_RELAXED),
+		      "collector", hep_collectors[i].url, NULL);
+    metrics_family ("sipgrep_hep_send_errors", "counter", "HEP messages that could not be sent, by collector.");
+    for (i = 0; i < hep_collectors_count; i++)
+      metrics_sample ("sipgrep_hep_send_errors_total", __atomic_load_n (&hep_collectors[i].errors, __ATOMIC_RELAXED),
+		      "collector", hep_collectors[i].url, NULL);
+    metrics_family ("sipgrep_hep_dropped_messages", "counter", "HEP messages dropped, no collector being available.");
+    metrics_sample ("sipgrep_hep_dropped_messages_total", __atomic_load_n (&hep_dropped, __ATOMIC_RELAXED), NULL);
+  }
+
+  metrics_publish ();
+}
+
+/*
+ * One histogram of the transaction latencies, the buckets counting all
+ * below their bound.
+ */
+void
+latency_metrics (const char *reply, const unsigned long long *buckets, unsigned long long sum_us)
+{
+
+  unsigned long long count = 0;
+  char le[32];
+  int i;
+
+  for (i = 0; i < TRANSACT_BUCKETS; i++) {
+    count += buckets[i];
+    if (i == TRANSACT_BUCKETS - 1)
+      snprintf (le, sizeof (le), "+Inf");
+    else
+      snprintf (le, sizeof (le), "%g", transact_bucket_ms[i] / 1000.0);
+    metrics_sample ("sipgrep_transaction_latency_seconds_bucket", count, "reply", reply, "le", le, NULL);
+  }
+  metrics_sample ("sipgrep_transaction_latency_seconds_count", count, "reply", reply, NULL);
+  metrics_sample_double ("sipgrep_transaction_latency_seconds_sum", sum_us / 1e6, "reply", reply, NULL);
+}
+
 int check_exit_deadline (unsigned int now)
 {
 
@@ -1138,6 +1913,7 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
   rc_info_t *rcinfo = NULL;
   int now = (unsigned) time (NULL);
   unsigned char *d;
+  uint64_t start;
 
   if (!isalpha (data[0])) {
     return;
@@ -1166,21 +1942,36 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
     rcinfo->dst_port = dport;
     rcinfo->src_ip = ip_src;
     rcinfo->dst_ip = ip_dst;
-    rcinfo->ip_family = ip_ver = 4 ? AF_INET : AF_INET6;
+    rcinfo->ip_family = ip_ver == 4 ? AF_INET : AF_INET6;
     rcinfo->ip_proto = proto;
     rcinfo->time_sec = h->ts.tv_sec;
     rcinfo->time_usec = h->ts.tv_usec;
     rcinfo->proto_type = 1;
 
-    /* Duplicate */
-    if (!send_hepv3 (rcinfo, data, (unsigned int) len)) {
+    /* route key, only needed to pick one of several collectors */
+    if (hep_collectors_count > 1) {
+      str callid = { NULL, 0 };
+      if (extract_callid (data, len, &callid)) {
+        rcinfo->callid = callid.s;
+        rcinfo->callid_len = callid.len;
+      }
+    }
+
+    /* Duplicate, queued to the sender thread unless -B 0 */
+    start = selfstats_start ();
+    if (!hep_dispatch (rcinfo, data, (unsigned int) len) && debug) {
       printf ("Not duplicated\n");
     }
+    selfstats_stop (SELFSTATS_HEP, start, 1);
 
     if (rcinfo)
       free (rcinfo);
   }
   
+  cdrfile_check (now);
+
+  if (transactions) transact_expire (transactions, h->ts.tv_sec);
+
   if (stats_enable && check_exit_statistics(now) == 0) {
       clean_exit (0);
       return;          
@@ -1205,9 +1996,11 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
         struct callid_table *s = NULL;
         struct statistics_table *st = NULL;
         struct callid_remove *rm = NULL;
+        struct transact_info tinfo = { 0, 0, -1 };
+        int duplicate = 0;
 	uint32_t bytes_parsed = 0;
 
-        if (dialog_match || stats_enable || kill_friendlyscanner) 
+        if (dialog_match || stats_enable || metrics_url || json_output || transactions || dedup || kill_friendlyscanner) 
         {
 
           /* SIP parse */
@@ -1217,21 +2010,43 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
       
             memset (&psip, 0, sizeof (struct preparsed_sip));
             bytes_parsed = 0;
+            start = selfstats_start ();
             int message_parsed = parse_message ( d, remaining_bytes, &bytes_parsed, &psip);
+            selfstats_stop (SELFSTATS_PARSED, start, message_parsed != 0);
             total_bytes_parsed += bytes_parsed;
             remaining_bytes = len - total_bytes_parsed;                  
       
             if (message_parsed == 0) 
             {
         	// incomplete packet encountered, will deal with it whenever next packet comes in.
-        	printf("NOT PARSED!\n");
+        	if (!json_output) printf("NOT PARSED!\n");
         	total_bytes_parsed = len;
         	continue;
             }            
             
+            /* a copy sent again, with --dedup nothing more is done with it */
+            if (dedup && dedup_seen (dedup, dedup_fingerprint (&psip), h->ts.tv_sec))
+            {
+                  duplicate = 1;
+                  if (dedup_mode == DEDUP_SKIP)
+                  {
+                      d += bytes_parsed;
+                      continue;
+                  }
+            }
+
+            /* by the CSeq method, which requests and replies have alike */
+            if (transactions && psip.via_branch.len > 0 && psip.cseq_method)
+            {
+                  if (psip.is_method == SIP_REPLY)
+                      transact_reply (transactions, psip.via_branch.s, psip.via_branch.len, psip.cseq_method, psip.reply,
+                                      psip.to.s, psip.to.len, &h->ts, &tinfo);
+                  else
+                      transact_request (transactions, psip.via_branch.s, psip.via_branch.len, psip.cseq_method, &h->ts, &tinfo);
+            }
 
             
-            if(stats_enable) 
+            if(stats_enable || metrics_url) 
             {
                     
                   if(psip.is_method == SIP_REPLY) 
@@ -1279,11 +2094,20 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
         	send_kill_to_friendly_scanner (ip_src, sport);
             }
 
-            if (!dialog_match) continue;
+            if (!dialog_match)
+            {
+                /* with -z, only the statistics are printed */
+                if (stats_enable)
+                {
+                    d += bytes_parsed;
+                    continue;
+                }
+                goto output;
+            }
 
             if(psip.callid.len == 0) 
             {
-                    printf("BAD M:[%s]\n", d);        
+                    if (!json_output) printf("BAD M:[%s]\n", d);
                     continue;
             }
       
@@ -1435,8 +2259,11 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
             if (!s) 
             {
                 // Sip Message not found, add it to hash table
+                start = selfstats_start ();
                 local_match = match_func (d, len);
-                if (local_match == 1 && !invert_match || local_match != invert_match) 
+                int matched = (local_match == 1 && !invert_match) || local_match != invert_match;
+                selfstats_stop (SELFSTATS_MATCHED, start, matched);
+                if (matched) 
                 {
                     if (dialog_match) 
                     {
@@ -1545,19 +2372,29 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
                                       s->termination_reason = 0;
                                 }
 
-                                if (s) HASH_ADD_STR (dialogs, callid, s);
+                                if (s) 
+                                {
+                                    HASH_ADD_STR (dialogs, callid, s);
+                                    /* what the dialog had before it matched goes first */
+                                    if (prebuffer) flightrec_take (prebuffer, callid, strlen (callid), dump_prebuffered, (u_char *) callid);
+                                }
                        }
                     }
                 }
                 else 
                 {
+                    /* kept in case the dialog matches later */
+                    if (prebuffer) flightrec_add (prebuffer, callid, strlen (callid), h, p);
                     return;
                 }
             }
         }
         else {
             /* check if we have more than one SIP message here */
-            if(light_parse_message ( d, remaining_bytes, &bytes_parsed) == 1)
+            start = selfstats_start ();
+            int message_parsed = light_parse_message ( d, remaining_bytes, &bytes_parsed);
+            selfstats_stop (SELFSTATS_PARSED, start, message_parsed == 1);
+            if(message_parsed == 1)
 	    {
 		total_bytes_parsed += bytes_parsed;
 		remaining_bytes = len - total_bytes_parsed;
@@ -1568,6 +2405,7 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
 	    }
         }
 
+output:
         if (!live_read && want_delay) dump_delay (h);
 
         {
@@ -1596,11 +2434,12 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
                   if (quiet < 2) printf ("\n%c", ident);
         }
 
-        if (quiet < 3) 
+        if (quiet < 3 && !json_output) 
         {
               if (show_proto) printf ("(%u)", proto);
               printf (" ");
               if (print_time) print_time (h);
+              if (duplicate) printf ("(dup) ");
               if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && (sport || dport) && (hdr_offset || frag_offset == 0))
                       printf ("%s:%u -> %s:%u\n", ip_src, sport, ip_dst, dport);
               else printf ("%s -> %s\n", ip_src, ip_dst);
@@ -1622,22 +2461,57 @@ dump_packet (struct pcap_pkthdr *h, u_char * p, uint8_t proto, unsigned char *da
               else printf ("\n");
          }
 
-         if (quiet < 3) dump_func (d, bytes_parsed);	// dumps the packet held by data buffer
+         start = selfstats_start ();
+
+         /* the whole packet, to the file of the message's dialog */
+         if (dialogs_dir)
+         {
+              str cid;
+              if (extract_callid (d, bytes_parsed, &cid)) dialogdump_packet (cid.s, cid.len, h, p);
+         }
+
+         if (json_output) jsonout_message (&h->ts, proto, ip_src, sport, ip_dst, dport, &psip, transactions ? &tinfo : NULL,
+                                         dedup_mode == DEDUP_FLAG ? duplicate : -1, d, bytes_parsed);
+         else if (quiet < 3) dump_func (d, bytes_parsed);	// dumps the packet held by data buffer
+
+         selfstats_stop (SELFSTATS_OUTPUT, start, dialogs_dir || json_output || quiet < 3);
 
 	 /* and now skip parsed data*/
          d+=bytes_parsed;
   	 bytes_parsed = 0;
     }
 
-    if (pd_dump) 
+    if (pd_dump || zd_dump)
     {
     	/* check rotation */
+        start = selfstats_start ();
         create_dump (now);
-        pcap_dump ((u_char *) pd_dump, h, p);
-        pcap_dump_flush (pd_dump);
+        if (dump_index)
+          index_dump (h, data, len, tell_dump ());
+        write_dump (h, p);
+        selfstats_stop (SELFSTATS_OUTPUT, start, 1);
     }
 }
 
+void
+dump_prebuffered (u_char * user, const struct pcap_pkthdr *h, const u_char * p)
+{
+  const char *callid = (const char *) user;
+
+  if (dialogs_dir)
+    dialogdump_packet (callid, strlen (callid), h, p);
+
+  if (!pd_dump && !zd_dump)
+    return;
+
+  create_dump ((unsigned) time (NULL));
+  if (dump_index && !callidx_add (dump_index, callid, strlen (callid), tell_dump (), &h->ts)) {
+    fprintf (stderr, "fatal: out of memory\n");
+    clean_exit (-1);
+  }
+  write_dump (h, p);
+}
+
 int8_t
 re_match_func (unsigned char *data, uint32_t len)
 {
@@ -2039,10 +2913,12 @@ void
 usage (int8_t e)
 {
   printf ("usage: sipgrep <-"
-	  "ahNViwgGJpevxlDTRMmqCJjxK> <-IO pcap_dump> <-n num> <-d dev> <-A num>\n"
+	  "ahNViwgGJpevxlDTRMmqCJjxK> <-IO pcap_dump> <-o dir[,done_dir]> <-b prebuffer> <-W threads> <-r call-id> <-n num> <-d dev> <-A num>\n"
 	  "             <-s snaplen> <-S limitlen> <-c contact user> <-j user agent>\n"
-	  "		 <-f from user>  <-t to user> <-H capture url> <-q autostop cond.>\n"
-	  "		 <-Q split cond.> <-P portrange> <-F file> <-z duration>\n"
+	  "		 <-f from user>  <-t to user> <-H capture url> <-E replicas> <-B hep queue>\n"
+	  "		 <-u capture id> <-k auth key> <-Z compress size> <-L hep listen url>\n"
+	  "		 <-q autostop cond.> <-Q split cond.> <-P portrange> <-F file> <-z duration> <-Y seconds> <-U metrics url>\n"
+	  "		 <-y CDR file[,rotation]> <--json[=raw]> <--transactions> <--dedup[=flag]>\n"
 	  "		 <match expression> <bpf filter>\n"
 	  "   -h  is help/usage\n"
 	  "   -V  is version information\n"
@@ -2058,8 +2934,17 @@ usage (int8_t e)
 	  "   -T  is print delta timestamp every time a packet is matched\n"
 	  "   -m  is don't do dialog match\n"
 	  "   -M  is don't do multi-line match (do single-line match instead)\n"
-	  "   -I  is read packet stream from pcap format file pcap_dump\n"
-	  "   -O  is dump matched packets in pcap format to pcap_dump\n"
+	  "   -I  is read packet stream from pcap format file pcap_dump; repeat it, or give\n"
+	  "       a glob or a directory, to read many files merged by timestamp; files\n"
+	  "       may be gzip, zstd or lz4 compressed\n"
+	  "   -W  is number of threads reading files for -I (default: one per CPU)\n"
+	  "   -O  is dump matched packets in pcap format to pcap_dump; a name ending\n"
+	  "       in .zst or .lz4 writes it compressed; a Call-ID index is kept in pcap_dump.idx\n"
+	  "   -r  is read only the packets of call-id from -I files, through their index\n"
+	  "   -o  is dump every dialog to a pcap file of its own in dir, moved to\n"
+	  "       done_dir (if given) when the dialog ends\n"
+	  "   -b  is keep SIZE[K|M|G][:SECONDS] of recent packets, and write a dialog's\n"
+	  "       packets from before it matched to -O/-o once it does\n"
 	  "   -n  is look at only num packets\n"
 	  "   -A  is dump num packets after a match\n"
 	  "   -s  is set the bpf caplen\n"
@@ -2070,6 +2955,15 @@ usage (int8_t e)
 	  "   -t  is search user in To: header\n"
 	  "   -F  is read the bpf filter from the specified file\n"
 	  "   -H  is homer sipcapture URL (i.e. udp:10.0.0.1:9061)\n"
+	  "       or comma separated list, balanced by Call-ID (i.e. udp:10.0.0.1:9061,udp:10.0.0.2:9061)\n"
+	  "   -E  is send num extra copies of each HEP message to the next collectors\n"
+	  "   -B  is HEP sender queue size in bytes, 0 sends inline (default 4M):\n"
+	  "    	SIZE[K|M|G]:newest - drop new messages when full (default)\n"
+	  "    	SIZE[K|M|G]:oldest - drop queued messages when full\n"
+	  "   -u  is HEP capture node ID (default 101)\n"
+	  "   -k  is HEP capture auth key\n"
+	  "   -Z  is compress HEP payloads of at least num bytes (zlib)\n"
+	  "   -L  is read SIP from HEPv1/v2/v3 instead of an interface (i.e. udp:0.0.0.0:9060)\n"
 	  "   -N  is show sub protocol number\n"
 	  "   -g  is disabled clean up dialogs during trace\n"
 	  "   -G  is print dialog report during clean up\n"
@@ -2084,7 +2978,19 @@ usage (int8_t e)
 	  "    	filesize:NUM - switch to next file after NUM KB\n"
 	  "   -a  is disable packet re-assemblation\n"
 	  "   -P  is use specified portrange instead of default 5060-5061\n"
-	  "   -d  is use specified device instead of the pcap default\n" "   -z  is make statistics count maximum <duration> seconds\n" "");
+	  "   -d  is use specified device instead of the pcap default\n" "   -z  is make statistics count maximum <duration> seconds\n"
+	  "   -Y  is print packets and time per stage, drops and reassembly to stderr\n"
+	  "       every <seconds> (0 for only at exit), and on SIGUSR1\n"
+	  "   -U  is serve OpenMetrics over HTTP on tcp:[address]:port or unix:path\n"
+	  "   -y  is append CDRs of finished dialogs to a binary columnar file, rotated on\n"
+	  "    	duration:NUM - switch to next file after NUM secs\n"
+	  "    	filesize:NUM - switch to next file after NUM KB\n"
+	  "   --json is print each SIP message as a line of JSON instead, =raw to add\n"
+	  "       the message itself\n"
+	  "   --transactions is follow SIP transactions by Via branch and method: reply\n"
+	  "       latencies and retransmissions, in -U, -Y and --json\n"
+	  "   --dedup is skip SIP messages retransmitted within 32 seconds, =flag to only\n"
+	  "       mark them (dup) in the output\n" "");
 
   exit (e);
 }
@@ -2123,18 +3029,67 @@ clean_exit (int32_t sig)
   if (quiet < 1 && sig >= 0 && !read_file && pd && !pcap_stats (pd, &s))
     printf ("%u received, %u dropped\n", s.ps_recv, s.ps_drop);
 
+  if (selfstats_enable && sig >= 0)
+    selfstats_print (read_file ? NULL : pd, reasm, tcpreasm, transactions, dedup);
+
+  if (hep_listen_url) {
+    if (quiet < 1 && sig >= 0)
+      printf ("%u hep received, %u undecodable\n", hep_received, hep_decode_errors);
+    close_hep_listener ();
+  }
+
+  pcapfiles_close ();
+  metrics_stop ();
+
   if (pd)
     pcap_close (pd);
-  if (pd_dump)
-    pcap_dump_close (pd_dump);
+  close_dump ();
+  pcap_zdump_finish ();
+  callidx_free (dump_index);
+  flightrec_free (prebuffer);
+  dialogdump_close ();
 
   if (reasm != NULL)
     reasm_ip_free (reasm);
 
-  if (tcpreasm != NULL) 
-     tcpreasm_ip_free(tcpreasm);
+  if (tcpreasm != NULL) {
+    if (quiet < 2 && sig >= 0)
+      printf ("%u tcp streams waiting (%u max), %u bytes buffered, %u evicted, %u timed out\n",
+	      tcpreasm_ip_waiting (tcpreasm), tcpreasm_ip_max_waiting (tcpreasm), tcpreasm_ip_bytes (tcpreasm),
+	      tcpreasm_ip_evicted (tcpreasm), tcpreasm_ip_timed_out (tcpreasm));
+    tcpreasm_ip_free (tcpreasm);
+  }
+
+  if (transactions != NULL) {
+    const struct transact_stats *ts = transact_stats (transactions);
+    if (quiet < 2 && sig >= 0)
+      printf ("%llu transactions, %llu completed, %llu timed out, %u open, %llu request and %llu reply retransmissions\n",
+	      ts->started, ts->completed, ts->timed_out, transact_count (transactions), ts->request_retrans, ts->reply_retrans);
+    transact_free (transactions);
+    transactions = NULL;
+  }
+
+  if (dedup != NULL) {
+    const struct dedup_stats *ds = dedup_stats (dedup);
+    if (quiet < 2 && sig >= 0)
+      printf ("%llu retransmitted messages %s, of %llu, %llu fingerprints evicted early\n",
+	      ds->duplicates, dedup_mode == DEDUP_SKIP ? "skipped" : "flagged", ds->checked, ds->evicted);
+    dedup_free (dedup);
+    dedup = NULL;
+  }
+
+  if (use_homer) {
+    hep_sender_stop ();
+    if (quiet < 1 && sig >= 0) {
+      print_hep_sender_stats ();
+      print_homer_collectors_stats ();
+    }
+    close_homer_collectors ();
+  }
 
   clear_all_dialogs_element ();
+  cdrfile_close ();
+  jsonout_free ();
 
   exit (sig);
 }
@@ -2165,6 +3120,8 @@ delete_dialogs_element (char *callid)
   if (s) {
     if (print_report)
       print_dialogs_stats (s);
+    write_dialog_cdr (s);
+    dialogdump_done (s->callid);
     HASH_DEL (dialogs, s);
     if (s)
       free (s);
@@ -2181,6 +3138,7 @@ clear_all_dialogs_element ()
   HASH_ITER (hh, dialogs, s, tmp) {
     if (print_report)
       print_dialogs_stats (s);
+    write_dialog_cdr (s);
     HASH_DEL (dialogs, s);
     free (s);
   }
@@ -2287,6 +3245,43 @@ print_dialogs_stats (struct callid_table *s)
 }
 
 
+void
+write_dialog_cdr (struct callid_table *s)
+{
+
+  struct cdrfile_record r;
+
+  if (!cdr_file)
+    return;
+
+  switch (s->transaction) {
+  case INVITE_TRANSACTION:
+    r.type = CDRFILE_CALL;
+    r.completed = s->cdr_connect > 0;
+    break;
+  case REGISTER_TRANSACTION:
+    r.type = CDRFILE_REGISTRATION;
+    r.completed = s->registered;
+    break;
+  default:
+    return;
+  }
+
+  r.callid = s->callid;
+  r.from = s->from;
+  r.to = s->to;
+  r.uac = s->uac;
+  r.init = s->cdr_init;
+  r.ringing = s->cdr_ringing;
+  r.connect = s->cdr_connect;
+  r.disconnect = s->cdr_disconnect;
+  r.reason = s->termination_reason;
+  r.terminated = s->terminated;
+
+  cdrfile_write (&r);
+}
+
+
 void
 check_dialogs_delete ()
 {
@@ -2341,249 +3336,6 @@ send_kill_to_friendly_scanner (const char *ip, uint16_t port)
 }
 
 
-int
-make_homer_socket (char *url)
-{
-
-  char *ip, *tmp;
-  char port[20];
-  struct addrinfo *ai, hints[1] = { {0} };
-  int i;
-
-  ip = strchr (url, ':');
-  if (ip != NULL) {
-    ip++;
-    tmp = strchr (ip, ':');
-    if (tmp != NULL) {
-      i = (tmp - ip);
-      tmp++;
-      snprintf (port, 20, "%s", tmp);
-      ip[i] = '\0';
-    }
-    else
-      return 2;
-  }
-  else
-    return 2;
-
-  hints->ai_flags = AI_NUMERICSERV;
-  hints->ai_family = AF_UNSPEC;
-  hints->ai_socktype = SOCK_DGRAM;
-  hints->ai_protocol = IPPROTO_UDP;
-
-  if (getaddrinfo (ip, port, hints, &ai)) {
-    fprintf (stderr, "capture: getaddrinfo() error");
-    return 2;
-  }
-
-  homer_sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-  if (homer_sock < 0) {
-    fprintf (stderr, "Sender socket creation failed: %s\n", strerror (errno));
-    return 3;
-  }
-
-  if (connect (homer_sock, ai->ai_addr, (socklen_t) (ai->ai_addrlen)) == -1) {
-    if (errno != EINPROGRESS) {
-      fprintf (stderr, "Sender socket creation failed: %s\n", strerror (errno));
-      return 4;
-    }
-  }
-  return 0;
-}
-
-int
-send_hepv3 (rc_info_t * rcinfo, unsigned char *data, unsigned int len)
-{
-
-  struct hep_generic *hg = NULL;
-  void *buffer;
-  unsigned int buflen = 0, iplen = 0, tlen = 0;
-  hep_chunk_ip4_t src_ip4, dst_ip4;
-#ifdef USE_IPV6
-  hep_chunk_ip6_t src_ip6, dst_ip6;
-#endif
-  hep_chunk_t payload_chunk;
-  hep_chunk_t authkey_chunk;
-  //static int errors = 0;
-  char *capt_password = NULL;
-
-  hg = malloc (sizeof (struct hep_generic));
-  memset (hg, 0, sizeof (struct hep_generic));
-
-  /* header set */
-  memcpy (hg->header.id, "\x48\x45\x50\x33", 4);
-
-  /* IP proto */
-  hg->ip_family.chunk.vendor_id = htons (0x0000);
-  hg->ip_family.chunk.type_id = htons (0x0001);
-  hg->ip_family.data = rcinfo->ip_family;
-  hg->ip_family.chunk.length = htons (sizeof (hg->ip_family));
-
-  /* Proto ID */
-  hg->ip_proto.chunk.vendor_id = htons (0x0000);
-  hg->ip_proto.chunk.type_id = htons (0x0002);
-  hg->ip_proto.data = rcinfo->ip_proto;
-  hg->ip_proto.chunk.length = htons (sizeof (hg->ip_proto));
-
-
-  /* IPv4 */
-  if (rcinfo->ip_family == AF_INET) {
-    /* SRC IP */
-    src_ip4.chunk.vendor_id = htons (0x0000);
-    src_ip4.chunk.type_id = htons (0x0003);
-    inet_pton (AF_INET, rcinfo->src_ip, &src_ip4.data);
-    src_ip4.chunk.length = htons (sizeof (src_ip4));
-
-    /* DST IP */
-    dst_ip4.chunk.vendor_id = htons (0x0000);
-    dst_ip4.chunk.type_id = htons (0x0004);
-    inet_pton (AF_INET, rcinfo->dst_ip, &dst_ip4.data);
-    dst_ip4.chunk.length = htons (sizeof (dst_ip4));
-
-    iplen = sizeof (dst_ip4) + sizeof (src_ip4);
-  }
-#ifdef USE_IPV6
-  /* IPv6 */
-  else if (rcinfo->ip_family == AF_INET6) {
-    /* SRC IPv6 */
-    src_ip6.chunk.vendor_id = htons (0x0000);
-    src_ip6.chunk.type_id = htons (0x0005);
-    inet_pton (AF_INET6, rcinfo->src_ip, &src_ip6.data);
-    src_ip6.chunk.length = htonl (sizeof (src_ip6));
-
-    /* DST IPv6 */
-    dst_ip6.chunk.vendor_id = htons (0x0000);
-    dst_ip6.chunk.type_id = htons (0x0006);
-    inet_pton (AF_INET6, rcinfo->dst_ip, &dst_ip6.data);
-    dst_ip6.chunk.length = htonl (sizeof (dst_ip6));
-
-    iplen = sizeof (dst_ip6) + sizeof (src_ip6);
-  }
-#endif
-
-  /* SRC PORT */
-  hg->src_port.chunk.vendor_id = htons (0x0000);
-  hg->src_port.chunk.type_id = htons (0x0007);
-  hg->src_port.data = htons (rcinfo->src_port);
-  hg->src_port.chunk.length = htons (sizeof (hg->src_port));
-
-  /* DST PORT */
-  hg->dst_port.chunk.vendor_id = htons (0x0000);
-  hg->dst_port.chunk.type_id = htons (0x0008);
-  hg->dst_port.data = htons (rcinfo->dst_port);
-  hg->dst_port.chunk.length = htons (sizeof (hg->dst_port));
-
-
-  /* TIMESTAMP SEC */
-  hg->time_sec.chunk.vendor_id = htons (0x0000);
-  hg->time_sec.chunk.type_id = htons (0x0009);
-  hg->time_sec.data = htonl (rcinfo->time_sec);
-  hg->time_sec.chunk.length = htons (sizeof (hg->time_sec));
-
-
-  /* TIMESTAMP USEC */
-  hg->time_usec.chunk.vendor_id = htons (0x0000);
-  hg->time_usec.chunk.type_id = htons (0x000a);
-  hg->time_usec.data = htonl (rcinfo->time_usec);
-  hg->time_usec.chunk.length = htons (sizeof (hg->time_usec));
-
-  /* Protocol TYPE */
-  hg->proto_t.chunk.vendor_id = htons (0x0000);
-  hg->proto_t.chunk.type_id = htons (0x000b);
-  hg->proto_t.data = rcinfo->proto_type;
-  hg->proto_t.chunk.length = htons (sizeof (hg->proto_t));
-
-  /* Capture ID */
-  hg->capt_id.chunk.vendor_id = htons (0x0000);
-  hg->capt_id.chunk.type_id = htons (0x000c);
-  hg->capt_id.data = htons (101);
-  hg->capt_id.chunk.length = htons (sizeof (hg->capt_id));
-
-  /* Payload */
-  payload_chunk.vendor_id = htons (0x0000);
-  payload_chunk.type_id = htons (0x000f);
-  payload_chunk.length = htons (sizeof (payload_chunk) + len);
-
-  tlen = sizeof (struct hep_generic) + len + iplen + sizeof (hep_chunk_t);
-
-  /* auth key */
-  if (capt_password != NULL) {
-
-    tlen += sizeof (hep_chunk_t);
-    /* Auth key */
-    authkey_chunk.vendor_id = htons (0x0000);
-    authkey_chunk.type_id = htons (0x000e);
-    authkey_chunk.length = htons (sizeof (authkey_chunk) + strlen (capt_password));
-    tlen += strlen (capt_password);
-  }
-
-  /* total */
-  hg->header.length = htons (tlen);
-
-  buffer = (void *) malloc (tlen);
-  if (buffer == 0) {
-    fprintf (stderr, "ERROR: out of memory\n");
-    free (hg);
-    return 1;
-  }
-
-  memcpy ((void *) buffer, hg, sizeof (struct hep_generic));
-  buflen = sizeof (struct hep_generic);
-
-  /* IPv4 */
-  if (rcinfo->ip_family == AF_INET) {
-    /* SRC IP */
-    memcpy ((void *) buffer + buflen, &src_ip4, sizeof (struct hep_chunk_ip4));
-    buflen += sizeof (struct hep_chunk_ip4);
-
-    memcpy ((void *) buffer + buflen, &dst_ip4, sizeof (struct hep_chunk_ip4));
-    buflen += sizeof (struct hep_chunk_ip4);
-  }
-#ifdef USE_IPV6
-  /* IPv6 */
-  else if (rcinfo->ip_family == AF_INET6) {
-    /* SRC IPv6 */
-    memcpy ((void *) buffer + buflen, &src_ip4, sizeof (struct hep_chunk_ip6));
-    buflen += sizeof (struct hep_chunk_ip6);
-
-    memcpy ((void *) buffer + buflen, &dst_ip6, sizeof (struct hep_chunk_ip6));
-    buflen += sizeof (struct hep_chunk_ip6);
-  }
-#endif
-
-  /* AUTH KEY CHUNK */
-  if (capt_password != NULL) {
-
-    memcpy ((void *) buffer + buflen, &authkey_chunk, sizeof (struct hep_chunk));
-    buflen += sizeof (struct hep_chunk);
-
-    /* Now copying payload self */
-    memcpy ((void *) buffer + buflen, capt_password, strlen (capt_password));
-    buflen += strlen (capt_password);
-  }
-
-  /* PAYLOAD CHUNK */
-  memcpy ((void *) buffer + buflen, &payload_chunk, sizeof (struct hep_chunk));
-  buflen += sizeof (struct hep_chunk);
-
-  /* Now copying payload self */
-  memcpy ((void *) buffer + buflen, data, len);
-  buflen += len;
-
-  /* send this packet out of our socket */
-  if (send (homer_sock, buffer, buflen, 0) == -1) {
-    printf ("send error\n");
-  }
-
-  /* FREE */
-  if (buffer)
-    free (buffer);
-  if (hg)
-    free (hg);
-
-  return 1;
-}
-
 void
 mass_friendlyscanner_kill (char *data)
 {
@@ -113,6 +113,8 @@ typedef enum {
  */
 
 void process(u_char *, struct pcap_pkthdr *, u_char *);
+void process_packet(u_char *, struct pcap_pkthdr *, u_char *);
+void process_hep(rc_info_t *, unsigned char *, unsigned int);
 
 void version(void);
 void usage(int8_t);
@@ -141,9 +143,12 @@ char *get_filter_from_argv  (char **);
 char *get_filter_from_portrange(char *);
 
 void create_dump(unsigned int now);
-
-/* Call ID extract */
-int extract_callid(char *msg, int len);
+int open_dump(void);
+void close_dump(void);
+unsigned long long tell_dump(void);
+void write_dump(const struct pcap_pkthdr *, const u_char *);
+void index_dump(struct pcap_pkthdr *, unsigned char *, uint32_t, unsigned long long);
+void dump_prebuffered(u_char *, const struct pcap_pkthdr *, const u_char *);
 
 
 uint8_t strishex(char *);
@@ -153,6 +158,9 @@ void drop_privs(void);
 
 int parse_stop_request(char *request);
 int parse_split_request(char *request);
+int parse_hep_queue_request(char *request);
+int parse_prebuffer_request(char *request);
+int open_cdr_file(void);
 int check_split_deadline(unsigned int now);
 int check_exit_deadline(unsigned int now);
 void mass_friendlyscanner_kill(char *data);
@@ -209,11 +217,14 @@ void delete_dialogs_remove_element (char *callid);
 void delete_dialogs_element (char *callid);
 void check_dialogs_delete ();
 void print_dialogs_stats(struct callid_table *s);
+void write_dialog_cdr(struct callid_table *s);
 void clear_all_dialogs_element();
 void send_kill_to_friendly_scanner(const char *ip, uint16_t port);
-int make_homer_socket(char *url);
-int send_hepv3 (rc_info_t *rcinfo, unsigned char *data, unsigned int len);
 int dump_statistics (unsigned int last, unsigned int now);
+void add_statistics_total (struct statistics_table *st);
+void update_metrics (void);
+void housekeeping (void);
+void latency_metrics (const char *reply, const unsigned long long *buckets, unsigned long long sum_us);
 
 
 #define SIP_CRASH "SIP/2.0 200 OK\r\nVia: SIP/2.0/UDP 8.7.6.5:5061;branch=z9hG4bK-573841574;rport\r\n\r\nContent-length: 0\r\n" \
@@ -21,6 +21,7 @@
 */
 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "sipparse.h"
@@ -182,6 +183,7 @@ parse_message (unsigned char *message, unsigned int blen, unsigned int *bytes_pa
    */
   int contentLengthFound = 0;
   int contentLength = 0;
+  int via_found = 0;
 
   for (; *c && c - new_message < new_len; c++) {
 
@@ -275,6 +277,15 @@ parse_message (unsigned char *message, unsigned int blen, unsigned int *bytes_pa
 	  psip->cseq_num = atoi((char *) (tmp + CSEQ_LEN + 1));
 	}
 
+	ret = set_hname (&psip->cseq, (offset - last_offset - CSEQ_LEN), tmp + CSEQ_LEN);
+
+      }
+      /* the top Via, the branch the transaction is known by */
+      else if (!via_found && (((*tmp == 'V' || *tmp == 'v') && (*(tmp + 1) == 'i' || *(tmp + 1) == 'I') && *(tmp + VIA_LEN) == ':') || (*tmp == 'v' && *(tmp + 1) == ':'))) {
+
+	via_found = 1;
+	cut = *(tmp + 1) == ':' ? 2 : VIA_LEN + 1;
+	via_branch (tmp + cut, offset - last_offset - cut - 2, &psip->via_branch);
       }
       /* Call-ID: */
       else if ((*tmp == 'C' && (*(tmp + 5) == 'I' || *(tmp + 5) == 'i') && *(tmp + CALLID_LEN) == ':') || ( *tmp  == 'i' && *(tmp + 1) == ':') ) {
@@ -312,6 +323,14 @@ parse_message (unsigned char *message, unsigned int blen, unsigned int *bytes_pa
 
   int message_parsed = 1;
   *bytes_parsed = c + 2 - new_message;
+
+  /* as much of the body as is here */
+  psip->body.s = (char *) c + 2;
+  psip->body.len = (int) new_len - (int) (c + 2 - new_message);
+  if (!contentLengthFound || psip->body.len < 0)
+    psip->body.len = 0;
+  else if (psip->body.len > contentLength)
+    psip->body.len = contentLength;
   if (contentLengthFound == 0) {
     
     //Bad packet
@@ -344,45 +363,161 @@ parse_message (unsigned char *message, unsigned int blen, unsigned int *bytes_pa
 }
 
 
+/* Content-Length (or l:) of one header line, -1 if it is another header */
+static int content_length_header(const unsigned char *line, unsigned int len)
+{
+	if (len > 2 && (*line == 'l' || *line == 'L') && *(line+1) == ':')
+		return atoi((const char *) line + 2);
+
+	if (len > CONTENTLENGTH_LEN && (*line == 'C' || *line == 'c') && (*(line+8) == 'L' || *(line+8) == 'l') && *(line+CONTENTLENGTH_LEN) == ':')
+		return atoi((const char *) line + CONTENTLENGTH_LEN + 1);
+
+	return -1;
+}
+
+
+unsigned int sip_header_length(const unsigned char *message, unsigned int blen, unsigned int *content_length)
+{
+	unsigned int line = 0, i;
+	int val;
+
+	*content_length = 0;
+
+	for (i = 0; i + 1 < blen; i++) {
+
+		if (message[i] != '\r' || message[i+1] != '\n')
+			continue;
+
+		/* empty line, the body follows */
+		if (i == line)
+			return i + 2;
+
+		val = content_length_header(message + line, i - line);
+		if (val >= 0)
+			*content_length = val;
+
+		line = i + 2;
+		i++;
+	}
+
+	return 0;
+}
+
+
+/* "SIP/2.0 200 OK" or "INVITE sip:bob@host SIP/2.0" */
+static int sip_start_line(const unsigned char *line, unsigned int len)
+{
+	if (len >= 12 && !strncasecmp((const char *) line, "SIP/2.0 ", 8))
+		return 1;
+
+	return len >= 12 && *line >= 'A' && *line <= 'Z' && !strncasecmp((const char *) line + len - 8, " SIP/2.0", 8);
+}
+
+
+unsigned int sip_frame_message(const unsigned char *message, unsigned int blen, unsigned int *start)
+{
+	unsigned int pos = 0, eol, hdr, cl;
+
+	for (;;) {
+
+		/* CRLF keep-alives between messages */
+		while (pos + 1 < blen && message[pos] == '\r' && message[pos+1] == '\n')
+			pos += 2;
+
+		*start = pos;
+
+		for (eol = pos; eol + 1 < blen && (message[eol] != '\r' || message[eol+1] != '\n'); eol++);
+		if (eol + 1 >= blen)
+			return 0;
+
+		if (sip_start_line(message + pos, eol - pos))
+			break;
+
+		/* not where a message begins, skip to the next line that is */
+		pos = eol + 2;
+	}
+
+	hdr = sip_header_length(message + pos, blen - pos, &cl);
+	if (hdr == 0 || cl > blen - pos - hdr)
+		return 0;
+
+	return hdr + cl;
+}
+
+
 int light_parse_message(char *message, unsigned int blen, unsigned int* bytes_parsed)
 {
-	unsigned int new_len = blen;
-	int header_offset = 0;
-        int content_length = 0;
-        	
+	unsigned int hdr, cl;
+
 	if (blen <= 2) return 0;
 
-        int offset = 0, last_offset = 0;
-        char *c, *tmp;
+	/* headers and body as far as we have them, the rest is all one message */
+	hdr = sip_header_length((unsigned char *) message, blen, &cl);
+	*bytes_parsed = (hdr != 0 && cl <= blen - hdr) ? hdr + cl : blen;
 
-        c = message;
+	return 1;
+}
 
-        for (; *c && c-message < new_len; c++) {
 
-                        /* END of Request line and START of all other headers */
-                        if (*c == '\r' && *(c+1) == '\n') {        /* end of this line */
+/* Call-ID only, without a full parse: used to route HEP messages */
+int extract_callid(unsigned char *message, unsigned int blen, str *callid)
+{
+	unsigned char *c = message, *end = message + blen, *tmp;
+	int cut;
+
+	while (c < end) {
+
+		tmp = c;
+		cut = 0;
+
+		if ((end - tmp) > CALLID_LEN && (*tmp == 'C' || *tmp == 'c') && (*(tmp+5) == 'I' || *(tmp+5) == 'i') && *(tmp+CALLID_LEN) == ':')
+			cut = CALLID_LEN + 1;
+		else if ((end - tmp) > 2 && (*tmp == 'i' || *tmp == 'I') && *(tmp+1) == ':')
+			cut = 2;
+
+		/* next line */
+		for (; c < end && *c != '\n'; c++);
+		c++;
+
+		if (cut) {
+			tmp += cut;
+			while (tmp < end && (*tmp == ' ' || *tmp == '\t')) tmp++;
+			callid->s = (char *) tmp;
+			while (tmp < end && *tmp != '\r' && *tmp != '\n') tmp++;
+			callid->len = (char *) tmp - callid->s;
+			return callid->len > 0;
+		}
+
+		/* empty line, end of headers */
+		if (c < end && (*c == '\r' || *c == '\n'))
+			break;
+	}
+
+	return 0;
+}
 
-				last_offset = offset;
-				offset = (c+2) - message;
 
-				tmp = (message + last_offset);
-		
-				/* BODY */
-				if((offset - last_offset) == 2) {
-				        new_len = offset + content_length;
-					*bytes_parsed = new_len;
-					break;
-		                }
+int via_branch(const unsigned char *value, unsigned int len, str *branch)
+{
+	const unsigned char *c = value, *end = value + len, *v;
 
-                                if((*tmp == 'l' && *(tmp+1) == ':') || ((*tmp == 'C' || *tmp == 'c') && ( *(tmp+8) == 'L' || *(tmp+8) == 'l') && *(tmp+CONTENTLENGTH_LEN) == ':'))
-                                {
-					if(*(tmp+1) == ':') header_offset = 1;
-                            	   	else header_offset = CONTENTLENGTH_LEN;					
-  					content_length = atoi(tmp+header_offset+1);
-					continue;
-                               }
-                       }
-        }
+	branch->len = 0;
 
-        return 1;
-}
\ No newline at end of file
+	/* up to the comma before the next value, if there is one */
+	for (; c < end && *c != ','; c++) {
+
+		if (*c != ';')
+			continue;
+
+		for (c++; c < end && (*c == ' ' || *c == '\t'); c++);
+		if (end - c < 7 || strncasecmp((const char *) c, "branch=", 7))
+			continue;
+
+		for (v = c += 7; c < end && *c != ';' && *c != ',' && *c != ' ' && *c != '\t' && *c != '\r'; c++);
+		branch->s = (char *) v;
+		branch->len = c - v;
+		break;
+	}
+
+	return branch->len > 0;
+}
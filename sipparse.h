@@ -23,6 +23,9 @@
 #ifndef _SIPPARSE_H
 #define _SIPPARSE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define SIP_REQUEST 1
 #define SIP_REPLY   2
 
@@ -74,6 +77,7 @@
 #define FROM_LEN 4
 #define CALLID_LEN 7
 #define CSEQ_LEN 4
+#define VIA_LEN 3
 #define PROXY_AUTH_LEN 19
 #define WWW_AUTH_LEN 16
 #define CONTENTLENGTH_LEN 14
@@ -123,14 +127,58 @@ typedef struct preparsed_sip {
       char reason[32];
       str callid;
       str cseq;
+      str via_branch;
       str from;
       str to;
       str uac;
+      str body;
 } preparsed_sip_t;
 
 int set_hname(str *hname, int len, unsigned char *s);
 int parse_message(unsigned char *body, unsigned int blen, unsigned int* bytes_parsed, struct preparsed_sip *psip);
 int light_parse_message(char *message, unsigned int blen, unsigned int* bytes_parsed);
 
+/* Length of the headers up to and including the empty line, 0 if incomplete */
+unsigned int sip_header_length(const unsigned char *message, unsigned int blen, unsigned int *content_length);
+
+/*
+ * Length of the first complete message in a stream, framed by the empty
+ * line and Content-Length, or 0 if more data is needed. Keep-alives and
+ * anything before a start line are skipped, start tells how much.
+ */
+unsigned int sip_frame_message(const unsigned char *message, unsigned int blen, unsigned int *start);
+int extract_callid(unsigned char *message, unsigned int blen, str *callid);
+
+/*
+ * FNV-1a of len bytes, going on from hash; a new one starts from
+ * FNV1A_64_INIT or FNV1A_32_INIT. Call-ID index entries and dialog
+ * file names are both found by the 64-bit hash of the Call-ID.
+ */
+#define FNV1A_64_INIT 14695981039346656037ULL
+#define FNV1A_32_INIT 2166136261U
+
+static inline uint64_t
+fnv1a_64 (uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+		hash = (hash ^ *p++) * 1099511628211ULL;
+	return hash;
+}
+
+static inline uint32_t
+fnv1a_32 (uint32_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+		hash = (hash ^ *p++) * 16777619U;
+	return hash;
+}
+
+/* branch of the first of the values of a Via header, given what follows the name */
+int via_branch(const unsigned char *value, unsigned int len, str *branch);
+
 
 #endif /* _SIPPARSE_H */
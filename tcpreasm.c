@@ -18,65 +18,45 @@
 
 #include <netinet/ip.h>
 #include <netinet/udp.h>
+#include <netinet/tcp.h>
 #if USE_IPv6
 #include <netinet/ip6.h>
 #endif /* USE_IPv6 */
 
-extern int debug;
+extern uint8_t debug;
 
 #include "tcpreasm.h"
+#include "sipparse.h"
 
 
 #define REASM_IP_HASH_SIZE 1021U
 
+/* default bytes one direction may hold, in order and out of order together */
+#define TCPREASM_FLOW_MAX (256U * 1024U)
 
-enum entry_state {
-	STATE_ACTIVE,
-	STATE_INVALID,
-};
-
-
-enum tcpreasm_proto {
-	PROTO_IPV4,
-#if USE_IPv6
-	PROTO_IPV6,
-#endif /* USE_IPv6 */
-};
+/* default bytes all connections may hold together */
+#define TCPREASM_MAX_BYTES (64U * 1024U * 1024U)
 
 
 /*
- * This tuple uniquely identifies all fragments belonging to
- * the same IPv4 packet.
+ * This tuple uniquely identifies one direction of a TCP connection.
+ * IPv4 addresses fill the first 4 bytes and the rest stays zero, so
+ * connections of both families are compared the same way.
  */
-struct tcpreasm_id_ipv4 {
-	uint8_t ip_src[4], ip_dst[4];
-	uint16_t ip_id;
-	uint8_t ip_proto;
+struct tcpreasm_id {
+	uint8_t ip_src[16], ip_dst[16];
 	uint16_t sport;
 	uint16_t dport;
+	uint8_t ip_ver;
 };
 
 
 /*
- * Same for IPv6.
+ * A segment that arrived ahead of a hole in the stream.
  */
-struct tcpreasm_id_ipv6 {
-	uint8_t ip_src[16], ip_dst[16];
-	uint32_t ip_id;
-	uint16_t sport;
-	uint16_t dport;
-};
-
-
-union tcpreasm_id {
-	struct tcpreasm_id_ipv4 ipv4;
-	struct tcpreasm_id_ipv6 ipv6;
-};
-
-
 struct tcpreasm_frag_entry {
-	unsigned len;  /* payload length of this fragment */
-	unsigned offset; /* offset of this fragment into the payload of the reassembled packet */
+	unsigned len;  /* payload length of this segment */
+	uint32_t seq; /* sequence number of the first payload byte */
 	unsigned data_offset; /* offset to the data pointer where payload starts */
 	unsigned char *data; /* payload starts at data + data_offset */
 	struct tcpreasm_frag_entry *next;
@@ -84,18 +64,20 @@ struct tcpreasm_frag_entry {
 
 
 /*
- * Reception of a complete packet is detected by counting the number
- * of "holes" that remain between the cached fragments. A hole is
- * assumed to exist at the upper end of the packet until the final
- * fragment has been received. When the number of holes drops to 0,
- * all fragments have been received and the packet can be reassembled.
+ * One direction of a connection. Bytes up to next_seq have been seen
+ * in order; those not yet framed into complete SIP messages wait in
+ * buf. Segments beyond a hole wait in frags, sorted by sequence number,
+ * until the hole is filled.
  */
 struct tcpreasm_ip_entry {
-	union tcpreasm_id id;
-	unsigned len, holes, frag_count, hash, mss;
+	struct tcpreasm_id id;
+	unsigned hash, frag_count, frag_bytes;
+	unsigned bytes; /* stream buffer and queued segments, as last accounted */
+	uint32_t next_seq;
+	unsigned char *buf;
+	unsigned len, size;
+	bool fin;
 	tcpreasm_time_t timeout;
-	enum entry_state state;
-	enum tcpreasm_proto protocol;
 	struct tcpreasm_frag_entry *frags;
 	struct tcpreasm_ip_entry *prev, *next;
 	struct tcpreasm_ip_entry *time_prev, *time_next;
@@ -105,46 +87,67 @@ struct tcpreasm_ip_entry {
 /*
  * This struct contains some metadata, the main hash table, and a pointer
  * to the first entry that will time out. A linked list is kept in the
- * order in which packets will time out. Using a linked list for this
- * purpose requires that packets are input in chronological order, and
- * that a constant timeout value is used, which doesn't change even when
- * the entry's state transitions from active to invalid.
+ * order in which entries will time out. Every segment moves its entry
+ * to the end of the list, so this requires that packets are input in
+ * chronological order, and that a constant timeout value is used. The
+ * list starts with the connection that has been idle longest, which is
+ * the one evicted when the byte budget runs out.
  */
 struct tcpreasm_ip {
 	struct tcpreasm_ip_entry *table[REASM_IP_HASH_SIZE];
 	struct tcpreasm_ip_entry *time_first, *time_last;
-	unsigned waiting, max_waiting, timed_out, dropped_frags;
+	unsigned waiting, max_waiting, timed_out, dropped_frags, evicted;
+	unsigned bytes, max_bytes, max_flow_bytes;
 	tcpreasm_time_t timeout;
 };
 
 
 /*
- * Hash functions.
+ * Hash function, over addr_len bytes of each address and the ports.
  */
-static unsigned tcpreasm_ipv4_hash (const struct tcpreasm_id_ipv4 *id);
-#if USE_IPv6
-static unsigned tcpreasm_ipv6_hash (const struct tcpreasm_id_ipv6 *id);
-#endif /* USE_IPv6 */
+static unsigned tcpreasm_hash (const struct tcpreasm_id *id, unsigned addr_len);
+
+/*
+ * Insert an out-of-order segment into the sorted list of segments
+ * waiting beyond a hole. Exact duplicates are refused.
+ */
+static bool add_fragment_tcp (struct tcpreasm_ip_entry *entry, struct tcpreasm_frag_entry *frag);
 
 /*
- * Insert a new fragment to the correct position in the list of fragments.
- * Check for fragment overlap and other error conditions. Update the
- * "hole count".
+ * Append in-order payload to the stream buffer and advance next_seq,
+ * unless the buffer would hold more than max bytes.
  */
-static bool add_fragment_tcp (struct tcpreasm_ip_entry *entry, struct tcpreasm_frag_entry *frag, bool last_frag);
+static bool append_tcp (struct tcpreasm_ip_entry *entry, const unsigned char *data, unsigned len, unsigned max);
 
 /*
- * Is the entry complete, ready for reassembly?
+ * Move every queued segment the stream has caught up with into the
+ * stream buffer, trimming what was already seen.
  */
-static bool is_complete (struct tcpreasm_ip_entry *entry);
+static void drain_fragments_tcp (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry, unsigned max);
 
+/*
+ * Give up on a hole: whatever was buffered in front of it is lost, and
+ * the stream continues at the first queued segment.
+ */
+static void skip_hole_tcp (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry);
+
+/*
+ * Hand out the complete messages of the stream buffer, if any.
+ */
 static unsigned char *assemble_tcp (struct tcpreasm_ip_entry *entry, unsigned *output_len);
 
+/*
+ * Bring the byte count of an entry up to date, then evict the
+ * connections idle longest, except keep, until the budget holds.
+ */
+static void account_tcp (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry);
+static void enforce_limits_tcp (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *keep);
+
 /*
  * Drop and free entries.
  */
 static void drop_entry (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry);
-static void free_entry (struct tcpreasm_ip_entry *entry);
+static void free_entry (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry);
 
 /*
  * Dispose of any entries which have expired before "now".
@@ -152,34 +155,22 @@ static void free_entry (struct tcpreasm_ip_entry *entry);
 static void process_timeouts (struct tcpreasm_ip *tcpreasm, tcpreasm_time_t now);
 
 /*
- * Create fragment structure from IPv6 packet. Returns NULL if the input
- * is not a fragment.
- * This function is called by parse_packet(), don't call it directly.
- */
-#if USE_IPv6
-static struct tcpreasm_frag_entry *frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag);
-#endif /* USE_IPv6 */
-
-/*
- * Compare packet identification tuples for specified protocol.
+ * Compare connection identification tuples.
  */
-static bool tcpreasm_id_equal_tcp (enum tcpreasm_proto proto, const union tcpreasm_id *left, const union tcpreasm_id *right);
+static bool tcpreasm_id_equal_tcp (const struct tcpreasm_id *left, const struct tcpreasm_id *right);
 
 
 static unsigned
-tcpreasm_ipv4_hash (const struct tcpreasm_id_ipv4 *id)
+tcpreasm_hash (const struct tcpreasm_id *id, unsigned addr_len)
 {
 	unsigned hash = 0;
-	int i;
+	unsigned i;
 
-	for (i = 0; i < 4; i++) {
+	for (i = 0; i < addr_len; i++) {
 		hash = 37U * hash + id->ip_src[i];
 		hash = 37U * hash + id->ip_dst[i];
 	}
 
-	hash = 59U * hash + id->ip_id;
-
-	hash = 47U * hash + id->ip_proto;
 	hash = 47U * hash + id->dport;
 	hash = 47U * hash + id->sport;
 
@@ -187,272 +178,387 @@ tcpreasm_ipv4_hash (const struct tcpreasm_id_ipv4 *id)
 }
 
 
-#if USE_IPv6
-static unsigned
-tcpreasm_ipv6_hash (const struct tcpreasm_id_ipv6 *id)
+unsigned char *
+tcpreasm_ip_next_tcp (struct tcpreasm_ip *tcpreasm, unsigned char *packet, unsigned len, tcpreasm_time_t timestamp, unsigned *output_len, uint8_t ip_ver, const void *ip_src, const void *ip_dst, uint16_t sport, uint16_t dport, uint32_t seq, uint8_t flags)
 {
-	unsigned hash = 0;
-	int i;
+	struct tcpreasm_id id;
+	unsigned hash, bucket, skip, start, addr_len;
+	int32_t diff;
 
-	for (i = 0; i < 16; i++) {
-		hash = 37U * hash + id->ip_src[i];
-		hash = 37U * hash + id->ip_dst[i];
-	}
+	process_timeouts (tcpreasm, timestamp);
 
-	hash = 59U * hash + id->ip_id;
-	hash = 47U * hash + id->dport;
-	hash = 47U * hash + id->sport;
-	return hash;
-}
+	switch (ip_ver) {
+		case 4:
+			addr_len = 4;
+			break;
+#if USE_IPv6
+		case 6:
+			addr_len = 16;
+			break;
 #endif /* USE_IPv6 */
+		default:
+			free (packet);
+			return NULL;
+	}
 
+	memset (&id, 0, sizeof (id));
+	memcpy (id.ip_src, ip_src, addr_len);
+	memcpy (id.ip_dst, ip_dst, addr_len);
+	id.sport = sport;
+	id.dport = dport;
+	id.ip_ver = ip_ver;
 
-unsigned char *
-tcpreasm_ip_next_tcp (struct tcpreasm_ip *tcpreasm, unsigned char *packet, unsigned len, tcpreasm_time_t timestamp, unsigned *output_len, struct in_addr *ip_src, struct in_addr *ip_dst, uint16_t sport, uint16_t dport, uint8_t psh)
-{
-	enum tcpreasm_proto proto;
-	union tcpreasm_id id;
-	unsigned hash;
-	bool last_frag;
+	hash = tcpreasm_hash (&id, addr_len);
 
+	if (debug == 2)
+		printf ("\nTCPREASM: IPv%d, Hash:[%u] SPORT: [%d], DPORT: [%d], SEQ: [%u], FLAGS: [%x]\n", ip_ver, hash, sport, dport, seq, flags);
 
-	process_timeouts (tcpreasm, timestamp);
-		
-	struct tcpreasm_frag_entry *frag = NULL;
-	frag = malloc (sizeof (*frag));
-        if (frag == NULL)
-        	return NULL;
-
-	*frag = (struct tcpreasm_frag_entry) {
-        	.len = len,
-                .offset = 10 * 8,
-                .data_offset = len,
-                .data = packet,
-	};
-	
-	proto = PROTO_IPV4;
-	
-	memcpy (id.ipv4.ip_src, ip_src, 4);
-        memcpy (id.ipv4.ip_dst, ip_dst, 4);
-        id.ipv4.ip_id = 200;
-        id.ipv4.ip_proto = PROTO_IPV4;
-        id.ipv4.sport = sport;
-        id.ipv4.dport = dport;        
-        
-        hash = tcpreasm_ipv4_hash (&id.ipv4);
-                
-        if(debug == 2) {
-        
-        	printf("\nTCPREASM: Proto [%d], Hash:[%d] SPORT: [%d], DPORT: [%d]\n", proto, hash, sport, dport);
-        }
-        
-	hash %= REASM_IP_HASH_SIZE;
-	struct tcpreasm_ip_entry *entry = tcpreasm->table[hash];
-		
-	while (entry != NULL && (!tcpreasm_id_equal_tcp (proto, &id, &entry->id)))
+	bucket = hash % REASM_IP_HASH_SIZE;
+	struct tcpreasm_ip_entry *entry = tcpreasm->table[bucket];
+
+	while (entry != NULL && (entry->hash != hash || !tcpreasm_id_equal_tcp (&id, &entry->id)))
 		entry = entry->next;
-	
-	/* no buffer, go out */
-	if(psh == 1 && entry == NULL) {
-		free(frag);
-		if(debug == 2) printf("RETURN PACKET BACK\n");
-		*output_len = len;
-		return packet;
-	}		
+
+	/* the connection is gone, and anything still buffered with it */
+	if (flags & TH_RST) {
+		if (entry != NULL)
+			drop_entry (tcpreasm, entry);
+		free (packet);
+		return NULL;
+	}
+
+	/* a new connection on the same ports restarts the stream */
+	if ((flags & TH_SYN) && entry != NULL) {
+		drop_entry (tcpreasm, entry);
+		entry = NULL;
+	}
 
 	if (entry == NULL) {
-	
-		if(debug == 2) printf("EMPTY ENTRY\n");
-        			
-		entry = malloc (sizeof (*entry));
-		if (entry == NULL) {
-			free (frag);
+
+		if (len == 0 && !(flags & TH_SYN)) {
+			free (packet);
 			return NULL;
 		}
 
-		struct tcpreasm_frag_entry *list_head = malloc (sizeof (*list_head));
-		if (list_head == NULL) {
-			free (frag);
-			free (entry);
+		entry = malloc (sizeof (*entry));
+		if (entry == NULL) {
+			free (packet);
 			return NULL;
 		}
 
+		/* joining a connection already running: start where we are */
 		*entry = (struct tcpreasm_ip_entry) {
 			.id = id,
-			.len = 0,
-			.holes = 1,
-			.frags = list_head,
 			.hash = hash,
-			.protocol = proto,
-			.mss = len,
-			.timeout = timestamp + tcpreasm->timeout,
-			.state = STATE_ACTIVE,
+			.next_seq = (flags & TH_SYN) ? seq + 1 : seq,
 			.prev = NULL,
-			.next = tcpreasm->table[hash],
-			.time_prev = tcpreasm->time_last,
+			.next = tcpreasm->table[bucket],
+			.time_prev = NULL,
 			.time_next = NULL,
 		};
 
-		*list_head = (struct tcpreasm_frag_entry) {
-			.len = 0,
-			.offset = 0,
-			.data_offset = 0,
-			.data = NULL,
-		};
-
 		if (entry->next != NULL)
 			entry->next->prev = entry;
-		tcpreasm->table[hash] = entry;
-
-		if (tcpreasm->time_last != NULL)
-			tcpreasm->time_last->time_next = entry;
-		else
-			tcpreasm->time_first = entry;
-		tcpreasm->time_last = entry;
+		tcpreasm->table[bucket] = entry;
 
 		tcpreasm->waiting++;
 		if (tcpreasm->waiting > tcpreasm->max_waiting)
 			tcpreasm->max_waiting = tcpreasm->waiting;
 	}
+	else {
+		/* unlink from the timeout list, it goes back at the end */
+		if (entry->time_prev != NULL)
+			entry->time_prev->time_next = entry->time_next;
+		else
+			tcpreasm->time_first = entry->time_next;
 
-	if (entry->state != STATE_ACTIVE) {
-		tcpreasm->dropped_frags++;
-		return NULL;
+		if (entry->time_next != NULL)
+			entry->time_next->time_prev = entry->time_prev;
+		else
+			tcpreasm->time_last = entry->time_prev;
 	}
 
-	
-	
-	if (!add_fragment_tcp (entry, frag, last_frag)) {
-		entry->state = STATE_INVALID;
-		tcpreasm->dropped_frags += entry->frag_count + 1;
-		return NULL;
+	entry->timeout = timestamp + tcpreasm->timeout;
+	entry->time_prev = tcpreasm->time_last;
+	entry->time_next = NULL;
+	if (tcpreasm->time_last != NULL)
+		tcpreasm->time_last->time_next = entry;
+	else
+		tcpreasm->time_first = entry;
+	tcpreasm->time_last = entry;
+
+	if (flags & TH_SYN)
+		seq++;
+
+	if (flags & TH_FIN)
+		entry->fin = true;
+
+	diff = (int32_t) (seq - entry->next_seq);
+
+	/* retransmission, entirely or in part */
+	if (diff < 0) {
+		skip = (unsigned) -diff;
+		if (skip >= len) {
+			if (len != 0 && debug == 2)
+				printf ("TCPREASM: duplicate segment, SEQ: [%u], LEN: [%u]\n", seq, len);
+			free (packet);
+			packet = NULL;
+			len = 0;
+		}
+		else {
+			len -= skip;
+			seq += skip;
+			diff = 0;
+		}
+	}
+	else
+		skip = 0;
+
+	if (len != 0 && diff > 0) {
+
+		struct tcpreasm_frag_entry *frag = malloc (sizeof (*frag));
+		if (frag == NULL) {
+			free (packet);
+			return NULL;
+		}
+
+		*frag = (struct tcpreasm_frag_entry) {
+			.len = len,
+			.seq = seq,
+			.data_offset = skip,
+			.data = packet,
+		};
+
+		if (!add_fragment_tcp (entry, frag)) {
+			free (frag);
+			free (packet);
+			return NULL;
+		}
+
+		/* the hole is not going to be filled within bounds */
+		if (entry->len + entry->frag_bytes > tcpreasm->max_flow_bytes)
+			skip_hole_tcp (tcpreasm, entry);
+
+		unsigned char *r = assemble_tcp (entry, output_len);
+		account_tcp (tcpreasm, entry);
+		enforce_limits_tcp (tcpreasm, entry);
+		return r;
 	}
 
-	if(psh == 0) return NULL;
-	
-	/* workaround for ACK/PSH big messages */
-	if(entry->mss == len) return NULL;
-	
+	if (len != 0) {
+
+		/* nothing pending: hand out the segment itself when it holds whole messages */
+		if (entry->len == 0 && entry->frags == NULL && skip == 0 && sip_frame_message (packet, len, &start) == len) {
+			entry->next_seq += len;
+			*output_len = len;
+			if (entry->fin)
+				drop_entry (tcpreasm, entry);
+			return packet;
+		}
+
+		if (!append_tcp (entry, packet + skip, len, tcpreasm->max_flow_bytes)) {
+			/* a message longer than we are willing to hold */
+			tcpreasm->dropped_frags++;
+			entry->len = 0;
+			entry->next_seq = seq + len;
+		}
+
+		free (packet);
+		drain_fragments_tcp (tcpreasm, entry, tcpreasm->max_flow_bytes);
+	}
+	else
+		free (packet);	/* SYN, FIN or ACK without payload */
+
 	unsigned char *r = assemble_tcp (entry, output_len);
 
-	//printf("TCP REASSEM: [%d]\n", *output_len);
-	//printf("MESSAGE: [%s]\n", r);
-	
-	drop_entry (tcpreasm, entry);
+	/* closed and nothing left in flight: what remains is the last message */
+	if (entry->fin && entry->frags == NULL) {
+		if (r == NULL && entry->len != 0) {
+			r = entry->buf;
+			*output_len = entry->len;
+			entry->buf = NULL;
+		}
+		else if (entry->len != 0) {
+			unsigned char *p = realloc (r, *output_len + entry->len);
+			if (p != NULL) {
+				memcpy (p + *output_len, entry->buf, entry->len);
+				*output_len += entry->len;
+				r = p;
+			}
+		}
+		drop_entry (tcpreasm, entry);
+		return r;
+	}
+
+	account_tcp (tcpreasm, entry);
+	enforce_limits_tcp (tcpreasm, entry);
+
 	return r;
 }
 
 
 static bool
-add_fragment_tcp (struct tcpreasm_ip_entry *entry, struct tcpreasm_frag_entry *frag, bool last_frag)
+add_fragment_tcp (struct tcpreasm_ip_entry *entry, struct tcpreasm_frag_entry *frag)
 {
-	/*
-	 * When a fragment is inserted into the list, different cases can occur
-	 * concerning the number of holes.
-	 * - The new fragment can be inserted in the middle of a hole, such that
-	 *   it will split the hole in two. The number of holes increases by 1.
-	 * - The new fragment can be attached to one end of a hole, such that
-	 *   the rest of the hole remains at the opposite side of the fragment.
-	 *   The number of holes remains constant.
-	 * - The new fragment can fill a hole completely. The number of holes
-	 *   decreases by 1.
-	 */
+	struct tcpreasm_frag_entry **cur = &entry->frags;
 
-	struct tcpreasm_frag_entry *cur = entry->frags, *next = cur->next;
+	while (*cur != NULL && (int32_t) ((*cur)->seq - frag->seq) < 0)
+		cur = &(*cur)->next;
 
-	entry->len+=frag->len;
-
-	while (cur->next != NULL) cur = cur->next;
-	next = cur->next;
+	/* already queued, a retransmission of an out-of-order segment */
+	if (*cur != NULL && (*cur)->seq == frag->seq && (*cur)->len >= frag->len)
+		return false;
 
-	/* Fragment is to be inserted between cur and next; next may be NULL. */
+	frag->next = *cur;
+	*cur = frag;
+	entry->frag_count++;
+	entry->frag_bytes += frag->len;
 
-	if (frag->len != 0) {
-		frag->next = cur->next;
-		cur->next = frag;
-		entry->frag_count++;
-	} 
-	
 	return true;
 }
 
 
-
-struct tcpreasm_ip *
-tcpreasm_ip_new (void)
+static bool
+append_tcp (struct tcpreasm_ip_entry *entry, const unsigned char *data, unsigned len, unsigned max)
 {
-	struct tcpreasm_ip *tcpreasm = malloc (sizeof (*tcpreasm));
-	if (tcpreasm == NULL)
-		return NULL;
+	unsigned size = entry->size ? entry->size : 2048;
 
-	memset (tcpreasm, 0, sizeof (*tcpreasm));
-	return tcpreasm;
+	entry->next_seq += len;
+
+	if (entry->len + len > max)
+		return false;
+
+	while (size < entry->len + len)
+		size *= 2;
+
+	if (size != entry->size) {
+		unsigned char *buf = realloc (entry->buf, size);
+		if (buf == NULL)
+			return false;
+		entry->buf = buf;
+		entry->size = size;
+	}
+
+	memcpy (entry->buf + entry->len, data, len);
+	entry->len += len;
+
+	return true;
 }
 
 
-void
-tcpreasm_ip_free (struct tcpreasm_ip *tcpreasm)
+static void
+drain_fragments_tcp (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry, unsigned max)
 {
-	while (tcpreasm->time_first != NULL)
-		drop_entry (tcpreasm, tcpreasm->time_first);
-	free (tcpreasm);
+	struct tcpreasm_frag_entry *frag;
+	unsigned skip;
+
+	while ((frag = entry->frags) != NULL && (int32_t) (frag->seq - entry->next_seq) <= 0) {
+
+		entry->frags = frag->next;
+		entry->frag_count--;
+		entry->frag_bytes -= frag->len;
+
+		skip = entry->next_seq - frag->seq;
+		if (skip < frag->len && !append_tcp (entry, frag->data + frag->data_offset + skip, frag->len - skip, max)) {
+			tcpreasm->dropped_frags++;
+			entry->len = 0;
+		}
+
+		free (frag->data);
+		free (frag);
+	}
 }
 
 
-static bool
-is_complete (struct tcpreasm_ip_entry *entry)
+static void
+skip_hole_tcp (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry)
 {
-	return entry->holes == 0;
+	if (debug == 2)
+		printf ("TCPREASM: skipping hole, SEQ: [%u] -> [%u]\n", entry->next_seq, entry->frags->seq);
+
+	tcpreasm->dropped_frags++;
+	entry->len = 0;
+	entry->next_seq = entry->frags->seq;
+
+	/*
+	 * What was queued may itself come to the cap, with complete messages
+	 * in it; it is held already, so it goes into the buffer as a whole.
+	 */
+	drain_fragments_tcp (tcpreasm, entry, entry->frag_bytes);
 }
 
 
 static unsigned char *
 assemble_tcp (struct tcpreasm_ip_entry *entry, unsigned *output_len)
 {
-	struct tcpreasm_frag_entry *frag = entry->frags->next; /* skip list head */
-	unsigned offset0 = frag->data_offset;
-	unsigned char *p = malloc (entry->len + offset0);
-	unsigned tlen = 0;
-	
-	//printf("TOTAL LEN: %d\n", entry->len);
-	
-	if (p == NULL)
-		return NULL;
-
-	switch (entry->protocol) {
-		case PROTO_IPV4:
-			break;
-
-#if USE_IPv6
-		case PROTO_IPV6:
-			offset0 -= 8; /* size of frag header */
-			break;
-#endif /* USE_IPv6 */
-
-		default:
+	unsigned off = 0, out = 0, start, n;
+	unsigned char *p;
+
+	/* pack the complete messages to the front, dropping keep-alives and junk */
+	while (off < entry->len) {
+		n = sip_frame_message (entry->buf + off, entry->len - off, &start);
+		off += start;
+		if (n == 0)
 			break;
+		memmove (entry->buf + out, entry->buf + off, n);
+		out += n;
+		off += n;
 	}
 
-	*output_len = entry->len;
+	/* all of it, the buffer itself goes */
+	if (out != 0 && off == entry->len) {
+		p = entry->buf;
+		entry->buf = NULL;
+		entry->len = entry->size = 0;
+		*output_len = out;
+		return p;
+	}
 
-	/* join all the payload fragments together */
-	while (frag != NULL) {		
-		memcpy (p + tlen, frag->data, frag->len);
-		tlen += frag->len;			
-		frag = frag->next;
+	p = NULL;
+	if (out != 0 && (p = malloc (out)) != NULL) {
+		memcpy (p, entry->buf, out);
+		*output_len = out;
 	}
 
+	/* nothing to move, and no buffer at all for a SYN or FIN alone */
+	if (off != 0 && entry->len > off)
+		memmove (entry->buf, entry->buf + off, entry->len - off);
+	entry->len -= off;
+
 	return p;
 }
 
 
+struct tcpreasm_ip *
+tcpreasm_ip_new (void)
+{
+	struct tcpreasm_ip *tcpreasm = malloc (sizeof (*tcpreasm));
+	if (tcpreasm == NULL)
+		return NULL;
+
+	memset (tcpreasm, 0, sizeof (*tcpreasm));
+	tcpreasm->max_bytes = TCPREASM_MAX_BYTES;
+	tcpreasm->max_flow_bytes = TCPREASM_FLOW_MAX;
+	return tcpreasm;
+}
+
+
+void
+tcpreasm_ip_free (struct tcpreasm_ip *tcpreasm)
+{
+	while (tcpreasm->time_first != NULL)
+		drop_entry (tcpreasm, tcpreasm->time_first);
+	free (tcpreasm);
+}
+
+
 static void
 drop_entry (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry)
 {
 	if (entry->prev != NULL)
 		entry->prev->next = entry->next;
 	else
-		tcpreasm->table[entry->hash] = entry->next;
+		tcpreasm->table[entry->hash % REASM_IP_HASH_SIZE] = entry->next;
 
 	if (entry->next != NULL)
 		entry->next->prev = entry->prev;
@@ -469,12 +575,12 @@ drop_entry (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry)
 
 	tcpreasm->waiting--;
 
-	free_entry (entry);
+	free_entry (tcpreasm, entry);
 }
 
 
 static void
-free_entry (struct tcpreasm_ip_entry *entry)
+free_entry (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry)
 {
 	struct tcpreasm_frag_entry *frag = entry->frags, *next;
 	while (frag != NULL) {
@@ -485,10 +591,45 @@ free_entry (struct tcpreasm_ip_entry *entry)
 		frag = next;
 	}
 
+	tcpreasm->bytes -= entry->bytes;
+
+	free (entry->buf);
 	free (entry);
 }
 
 
+static void
+account_tcp (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry)
+{
+	unsigned bytes = entry->size + entry->frag_bytes;
+
+	tcpreasm->bytes += bytes - entry->bytes;
+	entry->bytes = bytes;
+}
+
+
+static void
+enforce_limits_tcp (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *keep)
+{
+	struct tcpreasm_ip_entry *victim;
+
+	while (tcpreasm->bytes > tcpreasm->max_bytes) {
+		victim = tcpreasm->time_first;
+		if (victim == keep)
+			victim = victim->time_next;
+		if (victim == NULL)
+			break;
+
+		if (debug == 2)
+			printf ("TCPREASM: evicting idle stream, SPORT: [%d], DPORT: [%d], BYTES: [%u]\n", victim->id.sport, victim->id.dport, victim->bytes);
+
+		tcpreasm->evicted++;
+		tcpreasm->dropped_frags += victim->frag_count;
+		drop_entry (tcpreasm, victim);
+	}
+}
+
+
 unsigned
 tcpreasm_ip_waiting (const struct tcpreasm_ip *tcpreasm)
 {
@@ -517,6 +658,28 @@ tcpreasm_ip_dropped_frags (const struct tcpreasm_ip *tcpreasm)
 }
 
 
+unsigned
+tcpreasm_ip_evicted (const struct tcpreasm_ip *tcpreasm)
+{
+	return tcpreasm->evicted;
+}
+
+
+unsigned
+tcpreasm_ip_bytes (const struct tcpreasm_ip *tcpreasm)
+{
+	return tcpreasm->bytes;
+}
+
+
+void
+tcpreasm_ip_set_limits (struct tcpreasm_ip *tcpreasm, unsigned max_flow_bytes, unsigned max_bytes)
+{
+	tcpreasm->max_flow_bytes = max_flow_bytes;
+	tcpreasm->max_bytes = max_bytes;
+}
+
+
 bool
 tcpreasm_ip_set_timeout (struct tcpreasm_ip *tcpreasm, tcpreasm_time_t timeout)
 {
@@ -538,106 +701,13 @@ process_timeouts (struct tcpreasm_ip *tcpreasm, tcpreasm_time_t now)
 }
 
 
-#if USE_IPv6
-static struct tcpreasm_frag_entry *
-frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag)
-{
-	struct ip6_hdr *ip6_header = (struct ip6_hdr *) packet;
-	unsigned offset = 40; /* IPv6 header size */
-	uint8_t nxt = ip6_header->ip6_nxt;
-	unsigned total_len = 40 + ntohs (ip6_header->ip6_plen);
-	unsigned last_nxt = offsetof (struct ip6_hdr, ip6_nxt);
-
-	/*
-	 * IPv6 extension headers from RFC 2460:
-	 *   0 Hop-by-Hop Options
-	 *  43 Routing
-	 *  44 Fragment
-	 *  60 Destination Options
-	 *
-	 * We look out for the Fragment header; the other 3 header
-	 * types listed above are recognized and considered safe to
-	 * skip over if they occur before the Fragment header.
-	 * Any unrecognized header will cause processing to stop and
-	 * a subsequent Fragment header to stay unrecognized.
-	 */
-	while (nxt == IPPROTO_HOPOPTS || nxt == IPPROTO_ROUTING || nxt == IPPROTO_DSTOPTS) {
-		if (offset + 2 > total_len)
-			return NULL;  /* header extends past end of packet */
-
-		unsigned exthdr_len = 8 + 8 * packet[offset + 1];
-		if (offset + exthdr_len > total_len)
-			return NULL;  /* header extends past end of packet */
-
-		nxt = packet[offset];
-		last_nxt = offset;
-		offset += exthdr_len;
-	}
-
-	if (nxt != IPPROTO_FRAGMENT)
-		return NULL;
-
-	if (offset + 8 > total_len)
-		return NULL;  /* Fragment header extends past end of packet */
-
-	struct tcpreasm_frag_entry *frag = malloc (sizeof (*frag));
-	if (frag == NULL)
-		return NULL;
-
-	struct ip6_frag *frag_header = (struct ip6_frag *) (packet + offset);
-	offset += 8;
-
-	/*
-	 * The Fragment header will be removed on reassembly, so we have to
-	 * replace the Next Header field of the previous header (which is
-	 * currently IPPROTO_FRAGMENT), with the Next Header field of the
-	 * Fragment header.
-	 *
-	 * XXX We really shouldn't manipulate the input packet in-place.
-	 */
-	packet[last_nxt] = frag_header->ip6f_nxt;
-
-	*frag = (struct tcpreasm_frag_entry) {
-		.len = total_len - offset,
-		.data_offset = offset,
-		.offset = ntohs (frag_header->ip6f_offlg & IP6F_OFF_MASK),
-		.data = packet,
-	};
-
-	*ip_id = ntohl (frag_header->ip6f_ident);
-	*last_frag = (frag_header->ip6f_offlg & IP6F_MORE_FRAG) == 0;
-
-	return frag;
-}
-#endif /* USE_IPv6 */
-
-
 static bool
-tcpreasm_id_equal_tcp (enum tcpreasm_proto proto, const union tcpreasm_id *left, const union tcpreasm_id *right)
+tcpreasm_id_equal_tcp (const struct tcpreasm_id *left, const struct tcpreasm_id *right)
 {
-	switch (proto) {
-		case PROTO_IPV4:
-			return memcmp (left->ipv4.ip_src, right->ipv4.ip_src, 4) == 0
-				&& memcmp (left->ipv4.ip_dst, right->ipv4.ip_dst, 4) == 0
-				&& left->ipv4.ip_id == right->ipv4.ip_id
-				&& left->ipv4.sport == right->ipv4.sport
-				&& left->ipv4.dport == right->ipv4.dport
-				&& left->ipv4.ip_proto == right->ipv4.ip_proto;
-#if USE_IPv6
-		case PROTO_IPV6:
-			return memcmp (left->ipv6.ip_src, right->ipv6.ip_src, 16) == 0
-				&& memcmp (left->ipv6.ip_dst, right->ipv6.ip_dst, 16) == 0
-				&& left->ipv6.sport == right->ipv6.sport
-				&& left->ipv6.dport == right->ipv6.dport
-				&& left->ipv6.ip_id == right->ipv6.ip_id;
-#endif /* USE_IPv6 */
-		default:
-			return memcmp (left->ipv4.ip_src, right->ipv4.ip_src, 4) == 0
-				&& memcmp (left->ipv4.ip_dst, right->ipv4.ip_dst, 4) == 0
-				&& left->ipv4.ip_id == right->ipv4.ip_id
-				&& left->ipv4.sport == right->ipv4.sport
-				&& left->ipv4.dport == right->ipv4.dport
-				&& left->ipv4.ip_proto == right->ipv4.ip_proto;
-	}
+	return left->sport == right->sport
+		&& left->dport == right->dport
+		&& left->ip_ver == right->ip_ver
+		&& memcmp (left->ip_src, right->ip_src, sizeof (left->ip_src)) == 0
+		&& memcmp (left->ip_dst, right->ip_dst, sizeof (left->ip_dst)) == 0;
 }
 
@@ -23,23 +23,26 @@ struct tcpreasm_ip *tcpreasm_ip_new (void);
 void tcpreasm_ip_free (struct tcpreasm_ip *tcpreasm);
 
 /*
- * This is the main packet processing function. It inputs one packet,
- * and MAY output one packet in turn. If the input was not a fragment,
- * it is passed unmodified. If the input was a fragment that completed
- * reassembly of a packet, the reassembled packet is output.
- * If more fragments are required for reassembly, or the input packet
- * is invalid for some reason, a NULL pointer is returned.
+ * This is the main packet processing function. It inputs one TCP
+ * segment payload with its sequence number and flags, and MAY output
+ * a buffer in turn. Segments of each direction of a connection are put
+ * in sequence order; retransmitted bytes are dropped and segments that
+ * arrive early wait for the hole in front of them. The output holds one
+ * or more complete SIP messages, framed by Content-Length, as soon as
+ * they are complete, whatever PSH says. Anything in front of a SIP
+ * start line, as after joining a connection mid-message or skipping a
+ * hole, is dropped. If no message is complete yet, a NULL pointer is
+ * returned. SYN starts a
+ * stream over, RST drops it, and after FIN whatever is left is output.
  *
- * The input must be a pointer allocated by malloc(). The output will
- * be a pointer allocated by malloc().
+ * The connection is given by the IP version, 4 or 6, the source and
+ * destination addresses in network byte order, and the ports.
  *
- * Note that in the case of an IPv6 fragment, the input buffer will be
- * modified in-place. This is considered a bug and should be fixed in
- * the future.
+ * The input must be a pointer allocated by malloc(), it is owned by
+ * tcpreasm afterwards. The output will be a pointer allocated by
+ * malloc().
  */
-unsigned char *tcpreasm_ip_next (struct tcpreasm_ip *tcpreasm, unsigned char *packet, unsigned len, tcpreasm_time_t timestamp, unsigned *output_len);
-
-unsigned char *tcpreasm_ip_next_tcp (struct tcpreasm_ip *tcpreasm, unsigned char *packet, unsigned len, tcpreasm_time_t timestamp, unsigned *output_len, struct in_addr *ip_src, struct in_addr *ip_dst, uint16_t sport, uint16_t dport, uint8_t psh);
+unsigned char *tcpreasm_ip_next_tcp (struct tcpreasm_ip *tcpreasm, unsigned char *packet, unsigned len, tcpreasm_time_t timestamp, unsigned *output_len, uint8_t ip_ver, const void *ip_src, const void *ip_dst, uint16_t sport, uint16_t dport, uint32_t seq, uint8_t flags);
 
 
 /*
@@ -48,6 +51,14 @@ unsigned char *tcpreasm_ip_next_tcp (struct tcpreasm_ip *tcpreasm, unsigned char
  */
 bool tcpreasm_ip_set_timeout (struct tcpreasm_ip *tcpreasm, tcpreasm_time_t timeout);
 
+/*
+ * Limit the bytes one direction of a connection may buffer, and the
+ * bytes all of them may buffer together. A connection over its own
+ * limit gives up on the hole it waits for; when the total is over
+ * budget, the connections idle longest are evicted.
+ */
+void tcpreasm_ip_set_limits (struct tcpreasm_ip *tcpreasm, unsigned max_flow_bytes, unsigned max_bytes);
+
 /*
  * Query certain information about the current state.
  */
@@ -55,6 +66,8 @@ unsigned tcpreasm_ip_waiting (const struct tcpreasm_ip *tcpreasm);
 unsigned tcpreasm_ip_max_waiting (const struct tcpreasm_ip *tcpreasm);
 unsigned tcpreasm_ip_timed_out (const struct tcpreasm_ip *tcpreasm);
 unsigned tcpreasm_ip_dropped_frags (const struct tcpreasm_ip *tcpreasm);
+unsigned tcpreasm_ip_evicted (const struct tcpreasm_ip *tcpreasm);
+unsigned tcpreasm_ip_bytes (const struct tcpreasm_ip *tcpreasm);
 
 
 #endif /* _TCPIPREASM_H */
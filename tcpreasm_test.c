@@ -0,0 +1,313 @@
+/*
+ * tcpreasm_test -- feed tcpreasm segments out of order, again and
+ * overlapping, and check that the messages come out byte for byte.
+ *
+ * Run by make check; prints what failed and exits 1, or exits 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tcpreasm.h"
+
+
+uint8_t debug = 0;
+
+static int failures = 0;
+
+
+/* what one direction of a connection has output so far */
+struct flow {
+	const char *name;
+	uint8_t ip_ver;
+	uint8_t src[16], dst[16];
+	uint16_t sport, dport;
+	uint32_t isn;
+	char out[16384];
+	unsigned out_len;
+};
+
+
+static const char msg_invite[] =
+	"INVITE sip:bob@example.com SIP/2.0\r\n"
+	"Via: SIP/2.0/TCP 10.0.0.1:5060;branch=z9hG4bK1\r\n"
+	"Call-ID: a1@example.com\r\n"
+	"CSeq: 1 INVITE\r\n"
+	"Content-Type: application/sdp\r\n"
+	"Content-Length: 23\r\n"
+	"\r\n"
+	"v=0\r\no=- 1 1 IN IP4 x\r\n";
+
+static const char msg_ok[] =
+	"SIP/2.0 200 OK\r\n"
+	"Via: SIP/2.0/TCP 10.0.0.1:5060;branch=z9hG4bK1\r\n"
+	"Call-ID: a1@example.com\r\n"
+	"CSeq: 1 INVITE\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+static const char msg_options[] =
+	"OPTIONS sip:carol@example.com SIP/2.0\r\n"
+	"Via: SIP/2.0/TCP [a00:1::]:5060;branch=z9hG4bK6\r\n"
+	"Call-ID: b6@example.com\r\n"
+	"CSeq: 7 OPTIONS\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+static const char msg_bye[] =
+	"BYE sip:carol@example.com SIP/2.0\r\n"
+	"Via: SIP/2.0/TCP [a00:1::]:5060;branch=z9hG4bK7\r\n"
+	"Call-ID: b6@example.com\r\n"
+	"CSeq: 8 BYE\r\n"
+	"Content-Length: 5\r\n"
+	"\r\n"
+	"bye\r\n";
+
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf ("FAIL %s:%d: ", __FILE__, __LINE__); printf (__VA_ARGS__); printf ("\n"); } } while (0)
+
+
+/*
+ * One segment of flow, bytes [off, off + len) of stream, at sequence
+ * number isn + 1 + off; what comes out is added to the flow's output.
+ */
+static void
+segment (struct tcpreasm_ip *t, struct flow *f, tcpreasm_time_t now, const char *stream, unsigned off, unsigned len, uint8_t flags)
+{
+	unsigned char *p, *r;
+	unsigned out_len = 0;
+
+	if ((p = malloc (len ? len : 1)) == NULL) {
+		perror ("malloc");
+		exit (2);
+	}
+	memcpy (p, stream + off, len);
+
+	r = tcpreasm_ip_next_tcp (t, p, len, now, &out_len, f->ip_ver, f->src, f->dst, f->sport, f->dport, f->isn + 1 + off, flags | TH_ACK);
+	if (r == NULL)
+		return;
+
+	if (f->out_len + out_len <= sizeof (f->out)) {
+		memcpy (f->out + f->out_len, r, out_len);
+		f->out_len += out_len;
+	}
+	else
+		CHECK (0, "%s: more output than could be", f->name);
+	free (r);
+}
+
+
+static void
+syn (struct tcpreasm_ip *t, struct flow *f, tcpreasm_time_t now)
+{
+	unsigned out_len;
+
+	tcpreasm_ip_next_tcp (t, malloc (1), 0, now, &out_len, f->ip_ver, f->src, f->dst, f->sport, f->dport, f->isn, TH_SYN);
+}
+
+
+static void
+expect (const struct flow *f, const char *want, unsigned want_len)
+{
+	unsigned i;
+
+	if (f->out_len == want_len && !memcmp (f->out, want, want_len))
+		return;
+
+	for (i = 0; i < f->out_len && i < want_len && f->out[i] == want[i]; i++)
+		;
+	CHECK (0, "%s: %u bytes out, %u expected, first difference at %u", f->name, f->out_len, want_len, i);
+}
+
+
+/* as sipgrep sets it up, times in microseconds */
+static struct tcpreasm_ip *
+reasm_new (void)
+{
+	struct tcpreasm_ip *t = tcpreasm_ip_new ();
+
+	if (t == NULL) {
+		perror ("tcpreasm_ip_new");
+		exit (2);
+	}
+	tcpreasm_ip_set_timeout (t, 30000000);
+	return t;
+}
+
+
+static void
+init_flows (struct flow *v4, struct flow *v6)
+{
+	memset (v4, 0, sizeof (*v4));
+	memset (v6, 0, sizeof (*v6));
+
+	/* 10.0.0.1 -> 10.0.0.2, and a00:1:: -> a00:2::, the same first four bytes */
+	v4->name = "ipv4";
+	v4->ip_ver = 4;
+	memcpy (v4->src, "\x0a\x00\x00\x01", 4);
+	memcpy (v4->dst, "\x0a\x00\x00\x02", 4);
+	v4->sport = v6->sport = 5060;
+	v4->dport = v6->dport = 5070;
+	v4->isn = 0xfffffc00;	/* wraps within the stream */
+
+	v6->name = "ipv6";
+	v6->ip_ver = 6;
+	memcpy (v6->src, v4->src, 4);
+	memcpy (v6->dst, v4->dst, 4);
+	v6->isn = 4000;
+}
+
+
+/*
+ * Two connections that differ in nothing but the IP version, their
+ * segments interleaved, reordered, sent again and overlapping.
+ */
+static void
+test_reorder (void)
+{
+	struct tcpreasm_ip *t = reasm_new ();
+	struct flow v4, v6;
+	char s4[1024], s6[1024];
+	unsigned l4, l6;
+
+	init_flows (&v4, &v6);
+	l4 = snprintf (s4, sizeof (s4), "%s%s", msg_invite, msg_ok);
+	l6 = snprintf (s6, sizeof (s6), "%s%s", msg_options, msg_bye);
+
+	syn (t, &v4, 1);
+	syn (t, &v6, 1);
+
+	/* the second segment ahead of the first */
+	segment (t, &v4, 2, s4, 60, 80, 0);
+	segment (t, &v6, 2, s6, 0, 50, 0);
+	segment (t, &v4, 3, s4, 0, 60, 0);
+	/* the first again, whole, then a piece of it */
+	segment (t, &v4, 4, s4, 0, 60, 0);
+	segment (t, &v4, 4, s4, 10, 20, 0);
+	/* overlapping what is in, and what waits beyond a hole */
+	segment (t, &v6, 5, s6, 100, 60, 0);
+	segment (t, &v6, 5, s6, 40, 80, 0);
+	segment (t, &v4, 6, s4, 200, l4 - 200, 0);
+	segment (t, &v4, 6, s4, 120, 100, 0);
+	segment (t, &v6, 7, s6, 150, l6 - 150, 0);
+	/* the whole stream once more, nothing new in it */
+	segment (t, &v6, 8, s6, 0, l6, 0);
+
+	expect (&v4, s4, l4);
+#if USE_IPv6
+	expect (&v6, s6, l6);
+#else
+	/* not built with IPv6, it must not have ended up in the IPv4 stream */
+	CHECK (v6.out_len == 0, "ipv6: output without IPv6 support");
+#endif
+
+	tcpreasm_ip_free (t);
+}
+
+
+/*
+ * FIN outputs what is left once the stream is complete, RST throws
+ * away what was buffered; either way the connection is gone.
+ */
+static void
+test_fin_rst (void)
+{
+	struct tcpreasm_ip *t = reasm_new ();
+	struct flow f, other;
+	const char *tail = "INVITE sip:x SIP/2.0\r\nCall-ID: c\r\n";	/* cut short */
+	char s[1024];
+	unsigned l;
+
+	init_flows (&f, &other);
+	l = snprintf (s, sizeof (s), "%s%s", msg_ok, tail);
+
+	syn (t, &f, 1);
+	/* FIN with the last bytes, before the hole in front of them is filled */
+	segment (t, &f, 2, s, 30, l - 30, TH_FIN);
+	CHECK (f.out_len == 0, "fin: output before the hole is filled");
+	segment (t, &f, 3, s, 0, 30, 0);
+	expect (&f, s, l);
+	CHECK (tcpreasm_ip_waiting (t) == 0, "fin: %u connections still waiting", tcpreasm_ip_waiting (t));
+
+	/* half a message, then RST; what follows without a SYN joins mid-stream */
+	f.out_len = 0;
+	syn (t, &f, 4);
+	segment (t, &f, 5, msg_invite, 0, 70, 0);
+	segment (t, &f, 6, msg_invite, 0, 0, TH_RST);
+	CHECK (tcpreasm_ip_waiting (t) == 0, "rst: %u connections still waiting", tcpreasm_ip_waiting (t));
+	CHECK (tcpreasm_ip_bytes (t) == 0, "rst: %u bytes still held", tcpreasm_ip_bytes (t));
+
+	l = snprintf (s, sizeof (s), "%s%s", msg_invite, msg_ok);
+	segment (t, &f, 7, s, 70, l - 70, 0);
+	expect (&f, msg_ok, strlen (msg_ok));
+
+	tcpreasm_ip_free (t);
+}
+
+
+/*
+ * A connection that waits on a hole for more than it may hold gives
+ * up on it and goes on with the messages after it.
+ */
+static void
+test_flow_cap (void)
+{
+	struct tcpreasm_ip *t = reasm_new ();
+	struct flow f, other;
+	char s[16384], want[16384];
+	unsigned l, hole, i, n, want_len = 0;
+
+	init_flows (&f, &other);
+	tcpreasm_ip_set_limits (t, 4096, 1024 * 1024);
+
+	/* a message cut by the hole, then whole ones */
+	l = snprintf (s, sizeof (s), "%s", msg_invite);
+	hole = 40;
+	for (i = 0; i < 40; i++)
+		l += snprintf (s + l, sizeof (s) - l, "%s", msg_ok);
+
+	syn (t, &f, 1);
+	segment (t, &f, 2, s, 0, hole, 0);
+
+	/* from the message after the one cut, a segment each */
+	for (i = strlen (msg_invite), n = 0; i < l; i += strlen (msg_ok), n++) {
+		segment (t, &f, 3, s, i, strlen (msg_ok), 0);
+		/* the cap, and the stream buffer at its smallest */
+		CHECK (tcpreasm_ip_bytes (t) <= 4096 + 2048, "cap: %u bytes held", tcpreasm_ip_bytes (t));
+	}
+
+	/* all the whole messages, once the hole is given up on */
+	for (i = 0; i < n; i++)
+		want_len += snprintf (want + want_len, sizeof (want) - want_len, "%s", msg_ok);
+	expect (&f, want, want_len);
+	CHECK (tcpreasm_ip_dropped_frags (t) == 1, "cap: %u holes given up, 1 expected", tcpreasm_ip_dropped_frags (t));
+
+	tcpreasm_ip_free (t);
+}
+
+
+int
+main (void)
+{
+	test_reorder ();
+	test_fin_rst ();
+	test_flow_cap ();
+
+	if (failures) {
+		printf ("tcpreasm: %d checks failed\n", failures);
+		return 1;
+	}
+
+	printf ("tcpreasm: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,358 @@
+/*
+ * transact -- SIP transactions, by Via branch and method.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "transact.h"
+#include "sipparse.h"
+
+
+#define TRANSACT_INITIAL 4096
+#define TRANSACT_REPLIES 4
+
+const unsigned transact_bucket_ms[TRANSACT_BUCKETS] = {
+	1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, ~0u
+};
+
+/*
+ * Linked by index, 0 being none, so that the array can grow without
+ * anything pointing into it.
+ */
+struct entry {
+	uint64_t key;		/* hash of the branch and the method */
+	uint64_t request_us;	/* when the request was first seen */
+	uint32_t next;		/* in the hash chain, or the free list */
+	uint32_t wheel_next;	/* in the wheel slot */
+	uint32_t expires;	/* 0 when free */
+	uint32_t replies[TRANSACT_REPLIES];	/* seen, the latest few, by reply_of() */
+	uint16_t final;		/* final reply, 0 until there is one */
+	uint8_t nreplies;
+};
+
+struct transact_table {
+	struct entry *entries;	/* [0] unused */
+	uint32_t size, used, free;
+	uint32_t *hash;		/* size heads */
+	uint32_t wheel[TRANSACT_WHEEL];
+	unsigned now;		/* second the wheel is at */
+	struct transact_stats stats;
+};
+
+
+static uint64_t key_of (const char *branch, int branch_len, const char *method);
+static uint32_t reply_of (unsigned code, const char *to, int to_len);
+static struct entry *find (struct transact_table *t, uint64_t key);
+static struct entry *add (struct transact_table *t, uint64_t key);
+static int grow (struct transact_table *t);
+static void unlink_hash (struct transact_table *t, uint32_t i);
+static void count_latency (unsigned long long *buckets, unsigned long long *sum, uint64_t us);
+
+
+struct transact_table *
+transact_new (void)
+{
+	struct transact_table *t;
+
+	if ((t = calloc (1, sizeof (*t))) == NULL)
+		return NULL;
+
+	if (grow (t)) {
+		transact_free (t);
+		return NULL;
+	}
+
+	return t;
+}
+
+
+void
+transact_free (struct transact_table *t)
+{
+	if (t == NULL)
+		return;
+
+	free (t->entries);
+	free (t->hash);
+	free (t);
+}
+
+
+void
+transact_request (struct transact_table *t, const char *branch, int branch_len, const char *method,
+		  const struct timeval *ts, struct transact_info *info)
+{
+	struct transact_info none;
+	struct entry *e;
+	uint64_t key;
+
+	if (info == NULL)
+		info = &none;
+	info->found = info->retransmission = 0;
+	info->latency_us = -1;
+
+	if (branch_len <= 0 || !strcmp (method, "ACK"))
+		return;
+
+	key = key_of (branch, branch_len, method);
+
+	if ((e = find (t, key)) != NULL) {
+		t->stats.request_retrans++;
+		info->found = info->retransmission = 1;
+		e->expires = ts->tv_sec + TRANSACT_TIMEOUT;
+		return;
+	}
+
+	if ((e = add (t, key)) == NULL) {
+		t->stats.untracked++;
+		return;
+	}
+
+	t->stats.started++;
+	info->found = 1;
+	e->request_us = (uint64_t) ts->tv_sec * 1000000 + ts->tv_usec;
+	e->expires = ts->tv_sec + TRANSACT_TIMEOUT;
+	e->wheel_next = t->wheel[e->expires % TRANSACT_WHEEL];
+	t->wheel[e->expires % TRANSACT_WHEEL] = e - t->entries;
+}
+
+
+void
+transact_reply (struct transact_table *t, const char *branch, int branch_len, const char *method, unsigned code,
+		const char *to, int to_len, const struct timeval *ts, struct transact_info *info)
+{
+	struct transact_info none;
+	struct entry *e;
+	uint64_t us;
+	uint32_t reply;
+	int i;
+
+	if (info == NULL)
+		info = &none;
+	info->found = info->retransmission = 0;
+	info->latency_us = -1;
+
+	if (branch_len <= 0)
+		return;
+
+	if ((e = find (t, key_of (branch, branch_len, method))) == NULL) {
+		t->stats.orphan_replies++;
+		return;
+	}
+
+	us = (uint64_t) ts->tv_sec * 1000000 + ts->tv_usec;
+	info->found = 1;
+	info->latency_us = us > e->request_us ? us - e->request_us : 0;
+	e->expires = ts->tv_sec + TRANSACT_TIMEOUT;
+
+	reply = reply_of (code, to, to_len);
+	for (i = 0; i < e->nreplies && i < TRANSACT_REPLIES; i++)
+		if (e->replies[i] == reply) {
+			t->stats.reply_retrans++;
+			info->retransmission = 1;
+			return;
+		}
+
+	if (e->nreplies == 0)
+		count_latency (t->stats.first_reply, &t->stats.first_reply_us, info->latency_us);
+
+	/* once all are used, over the oldest; nreplies goes round REPLIES..2*REPLIES-1 */
+	e->replies[e->nreplies++ % TRANSACT_REPLIES] = reply;
+	if (e->nreplies == 2 * TRANSACT_REPLIES)
+		e->nreplies = TRANSACT_REPLIES;
+
+	if (code >= 200 && !e->final) {
+		e->final = code;
+		t->stats.completed++;
+		count_latency (t->stats.final_reply, &t->stats.final_reply_us, info->latency_us);
+	}
+}
+
+
+void
+transact_expire (struct transact_table *t, unsigned now)
+{
+	struct entry *e;
+	uint32_t i, next, *slot;
+
+	if (t->now == 0 || now < t->now) {
+		if (t->now == 0)
+			t->now = now;
+		return;
+	}
+
+	/* a gap longer than the wheel, each slot once is enough */
+	if (now - t->now > TRANSACT_WHEEL)
+		t->now = now - TRANSACT_WHEEL;
+
+	while (t->now < now) {
+		t->now++;
+		slot = &t->wheel[t->now % TRANSACT_WHEEL];
+
+		for (i = *slot, *slot = 0; i != 0; i = next) {
+			e = &t->entries[i];
+			next = e->wheel_next;
+
+			/* heard of since it was put here */
+			if (e->expires > t->now) {
+				e->wheel_next = t->wheel[e->expires % TRANSACT_WHEEL];
+				t->wheel[e->expires % TRANSACT_WHEEL] = i;
+				continue;
+			}
+
+			if (!e->final)
+				t->stats.timed_out++;
+
+			unlink_hash (t, i);
+			e->expires = 0;
+			e->next = t->free;
+			t->free = i;
+			t->used--;
+		}
+	}
+}
+
+
+unsigned
+transact_count (const struct transact_table *t)
+{
+	return t->used;
+}
+
+
+const struct transact_stats *
+transact_stats (const struct transact_table *t)
+{
+	return &t->stats;
+}
+
+
+/* FNV-1a, 64 bits make a clash between live transactions unlikely enough */
+static uint64_t
+key_of (const char *branch, int branch_len, const char *method)
+{
+	uint64_t h = fnv1a_64 (FNV1A_64_INIT, branch, branch_len);
+
+	h = fnv1a_64 (h, " ", 1);
+	return fnv1a_64 (h, method, strlen (method));
+}
+
+
+/*
+ * A reply by its code and To, whose tag tells the forks of a request
+ * apart; a copy sent again has both the same.
+ */
+static uint32_t
+reply_of (unsigned code, const char *to, int to_len)
+{
+	uint32_t h = fnv1a_32 (FNV1A_32_INIT, to, to_len);
+
+	return fnv1a_32 (h, &code, sizeof (code));
+}
+
+
+static struct entry *
+find (struct transact_table *t, uint64_t key)
+{
+	uint32_t i;
+
+	for (i = t->hash[key & (t->size - 1)]; i != 0; i = t->entries[i].next)
+		if (t->entries[i].key == key)
+			return &t->entries[i];
+
+	return NULL;
+}
+
+
+static struct entry *
+add (struct transact_table *t, uint64_t key)
+{
+	struct entry *e;
+	uint32_t i, *head;
+
+	if (t->free == 0 && grow (t))
+		return NULL;
+
+	i = t->free;
+	e = &t->entries[i];
+	t->free = e->next;
+	t->used++;
+
+	memset (e, 0, sizeof (*e));
+	e->key = key;
+	head = &t->hash[key & (t->size - 1)];
+	e->next = *head;
+	*head = i;
+
+	return e;
+}
+
+
+/*
+ * Double the entries and the hash, up to TRANSACT_MAX, and link the new
+ * entries into the free list.
+ */
+static int
+grow (struct transact_table *t)
+{
+	struct entry *entries;
+	uint32_t *hash, size, i, *head;
+
+	size = t->size ? t->size * 2 : TRANSACT_INITIAL;
+	if (size > TRANSACT_MAX)
+		return -1;
+
+	if ((entries = realloc (t->entries, (size + 1) * sizeof (*entries))) == NULL)
+		return -1;
+	t->entries = entries;
+
+	if ((hash = calloc (size, sizeof (*hash))) == NULL)
+		return -1;
+
+	/* the live ones into the new hash */
+	for (i = 1; i <= t->size; i++)
+		if (entries[i].expires) {
+			head = &hash[entries[i].key & (size - 1)];
+			entries[i].next = *head;
+			*head = i;
+		}
+
+	for (i = size; i > t->size; i--) {
+		entries[i].expires = 0;
+		entries[i].next = t->free;
+		t->free = i;
+	}
+
+	free (t->hash);
+	t->hash = hash;
+	t->size = size;
+
+	return 0;
+}
+
+
+static void
+unlink_hash (struct transact_table *t, uint32_t i)
+{
+	uint32_t *p = &t->hash[t->entries[i].key & (t->size - 1)];
+
+	for (; *p != 0; p = &t->entries[*p].next)
+		if (*p == i) {
+			*p = t->entries[i].next;
+			return;
+		}
+}
+
+
+static void
+count_latency (unsigned long long *buckets, unsigned long long *sum, uint64_t us)
+{
+	int i;
+
+	for (i = 0; i < TRANSACT_BUCKETS - 1 && us > transact_bucket_ms[i] * 1000ULL; i++)
+		;
+
+	buckets[i]++;
+	*sum += us;
+}
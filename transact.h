@@ -0,0 +1,73 @@
+#ifndef _TRANSACT_H
+#define _TRANSACT_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+
+/*
+ * SIP transactions, known by the branch of the top Via and the CSeq
+ * method, so that a CANCEL is not taken for the INVITE it cancels. For
+ * each, the time from the request to the first reply and to the final
+ * one, and how often the request and its replies were sent again.
+ *
+ * Entries are kept in a hash of indexes into one array, and expire on
+ * a timer wheel of one second slots, TRANSACT_TIMEOUT seconds after the
+ * last message of the transaction. Times are the packets' own.
+ */
+
+#define TRANSACT_TIMEOUT 32	/* 64*T1, Timer B and F */
+#define TRANSACT_WHEEL 64	/* slots, more than the timeout */
+#define TRANSACT_MAX (1 << 20)	/* transactions followed at most */
+
+/* upper bounds of the latency buckets, in ms, the last is the rest */
+#define TRANSACT_BUCKETS 13
+extern const unsigned transact_bucket_ms[TRANSACT_BUCKETS];
+
+struct transact_stats {
+	unsigned long long started;	/* requests that began one */
+	unsigned long long completed;	/* that got a final reply */
+	unsigned long long timed_out;	/* that did not */
+	unsigned long long untracked;	/* not followed, the table being full */
+	unsigned long long request_retrans, reply_retrans;
+	unsigned long long orphan_replies;	/* to a request not seen */
+
+	/* latency to the first reply, and to the final one */
+	unsigned long long first_reply[TRANSACT_BUCKETS], final_reply[TRANSACT_BUCKETS];
+	unsigned long long first_reply_us, final_reply_us;	/* summed */
+};
+
+/* what a message was to its transaction */
+struct transact_info {
+	int found;		/* of a transaction being followed */
+	int retransmission;	/* a copy of a message seen before */
+	long long latency_us;	/* of a reply, since the request; -1 if none */
+};
+
+struct transact_table;
+
+struct transact_table *transact_new (void);
+void transact_free (struct transact_table *t);
+
+/*
+ * A request, or a reply with its status code, method being the CSeq
+ * method, and to the To of a reply, which tells the forks of a request
+ * apart. ACK is not followed: for a final reply it is part of the
+ * INVITE's transaction, for a 2xx it gets no reply. info may be NULL.
+ */
+void transact_request (struct transact_table *t, const char *branch, int branch_len, const char *method,
+		       const struct timeval *ts, struct transact_info *info);
+void transact_reply (struct transact_table *t, const char *branch, int branch_len, const char *method, unsigned code,
+		     const char *to, int to_len, const struct timeval *ts, struct transact_info *info);
+
+/*
+ * Expire what has timed out by now, in seconds of packet time. Called
+ * for every packet.
+ */
+void transact_expire (struct transact_table *t, unsigned now);
+
+unsigned transact_count (const struct transact_table *t);
+const struct transact_stats *transact_stats (const struct transact_table *t);
+
+
+#endif /* _TRANSACT_H */